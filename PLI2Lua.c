@@ -43,6 +43,24 @@
   * На Lua можно создать wawe-форму и скормить её verilog- модели. И наоборот...
   * \n
   * Исходный файл тестировался с Icarus verilog-10.3 и Modelsim
+  * \n
+  * Сообщения и print() из Lua выводятся фоновым потоком (сборка с -lpthread), а всё, что осталось в буфере, - в начале
+  * следующего шага времени (cbNextSimTime), до его событий: относительно $display/vpi_printf в stdout сообщения
+  * упорядочены с точностью до шага времени, внутри одного шага порядок не гарантируется.
+  * Уровень задаётся plusarg +lua_log_level=0..4 (по умолчанию 3), +lua_log_sync отключает фоновый поток.
+  * \n
+  * +lua_cache[=DIR] - скрипт и модули require() загружаются из кэша байткода (по умолчанию каталог .lua_cache).
+  * \n
+  * +lua_threaded[=N] - каждая Lua - машина выполняется в своём потоке. exchange_M вызывается с опережением до N транзакций,
+  * пока они не являются чтением; STATUS_I при этом приходит в Lua с запаздыванием до N вызовов. play_event, watch(),
+  * $lua_call и $lua_capture выполняются только в потоке симулятора: такой экземпляр с +lua_threaded - ошибка, симуляция
+  * останавливается (vpiFinish).
+  * \n
+  * +lua_parallel[=N] - независимые экземпляры вычисляются параллельно на N потоках (по умолчанию - число процессоров).
+  * Входы читаются в момент вызова $lua_exchange_M/$lua_exchange_S (или фронта $lua_attach), модели всех обменов шага времени
+  * выполняются в cbReadWriteSynch, а выходы и rr записываются в порядке вызовов - результат тот же при любом числе потоков.
+  * Выходы появляются в конце активной области шага, а не сразу после вызова: читать их надо не раньше следующего фронта или #1.
+  * Широкая шина, воспроизведение трассы и экземпляры +lua_threaded выполняются сразу, как без +lua_parallel.
   *
   * ~~~~~~~~~~~~~~~{.lua}
   * function init_env()
@@ -51,6 +69,9 @@
   * end
   * ~~~~~~~~~~~~~~~
   *
+  * Точки входа скрипта (init_env, exchange_M, exchange_S и необязательные irq, deinit_env)
+  * ищутся один раз при $lua_init. Отсутствие init_env или сразу обеих exchange_M/exchange_S - ошибка инициализации.
+  *
   * ~~~~~~~~~~~~~~~{.lua}
   * function exchange_M(DAT_I, STATUS_I)
   *   print('<------- exchange_M ------>')
@@ -61,10 +82,53 @@
   * end
   * ~~~~~~~~~~~~~~~
   *
+  * Режим сопрограмм: если в скрипте есть main() и нет exchange_M, main() выполняется как сопрограмма,
+  * а каждый $lua_exchange_M возобновляет её до следующего шинного примитива. По фронту бита IRQ_MASK (по умолчанию 1)
+  * в STATUS_I main() вытесняется сопрограммой irq().
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function main()
+  *   write32(0x100, 0xA5)
+  *   while read32(0x104) & 1 == 0 do wait_ns(100) end
+  * end
+  *
+  * function irq()
+  *   write32(0x108, read32(0x10C))
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Сборка с LuaJIT: -DUSE_LUAJIT и luajit-2.1 вместо Lua 5.3/5.4. Функции exchange_M_ffi()/exchange_S_ffi() без аргументов
+  * и результатов читают и пишут структуру обмена EX (pli_exchange_t) напрямую через FFI:
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function exchange_M_ffi()
+  *   EX.time_ns, EX.CMD, EX.ADR, EX.DAT_O = 10, 2, 0x100, EX.DAT_I + 1
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Descriptor - 32-битный дескриптор экземпляра (индекс и поколение в таблице экземпляров). Неверный или уже
+  * освобождённый дескриптор даёт rr < 0 вместо обращения по случайному адресу. Прежняя форма с парой
+  * Descriptor[31:0], Descriptor[63:32] во всех задачах тоже принимается.
+  *
+  * Шина данных шире 32 бит: если DAT_I или DAT_O места вызова шире 32 бит, данные передаются через vpiVectorVal
+  * и попадают в Lua строкой (младший байт первым); маска битов X/Z передаётся дополнительным аргументом
+  * (строка той же длины или nil): exchange_M(DAT_I, STATUS_I, DAT_I_XZ), exchange_S(time_ns, CMD_I, ADR_I, DAT_I, DAT_I_XZ).
+  * DAT_O возвращается строкой или целым.
+  *
+  * Пакетный режим: exchange_M может вернуть сразу несколько транзакций, они выдаются без входа в Lua.
+  * Данные всех чтений пакета приходят третьим аргументом при следующем вызове.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function exchange_M(DAT_I, STATUS_I, reads)
+  *   -- {time_ns, CMD, ADR, DAT, ...} или string.pack("<i4i4i4i4", ...) для каждой транзакции
+  *   return { 10, 2, 0x100, 0xA5, 10, 2, 0x104, 0x5A, 10, 1, 0x108, 0 }
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
   *
   *
   * ~~~~~~~~~~~~~~~{.v}
-  * reg [63:0] Descriptor;
+  * reg [31:0] Descriptor;
   * reg [31:0] cmd, rr, cnt;
   *
   * reg [31:0] A;
@@ -72,7 +136,7 @@
   * reg [31:0] Dr;
   * 
   * initial begin
-  *   $lua_init(lua_script_name, Descriptor[63:32], Descriptor[31:0]);
+  *   $lua_init(Descriptor, lua_script_name);
   *   if(Descriptor == 0)
   *     begin
   *       $display("ERROR : init lua script");
@@ -98,7 +162,7 @@
   *          #1
   *          UP = 1'b1;
   *          prev_time_ns = time_ns;
-  *          $lua_exchange_M(Descriptor[63:32], Descriptor[31:0], 
+  *          $lua_exchange_M(Descriptor,
   *             time_ns, cmd, A, Dw, Dr, {31'h0, IRQ}, rr);
   *          $display("time_ns = %d", time_ns);
   *         end
@@ -110,6 +174,160 @@
   *     end
   * 
   * ~~~~~~~~~~~~~~~
+  *
+  * Простой: idle_until(T) (в сопрограмме - как wait_ns, в exchange_M - return idle_until(T)) останавливает вызовы модели
+  * до момента T в нс. До T Verilog получает ACTION__IDLE, а в time_ns - оставшееся время; при $lua_attach вместо вызова
+  * на каждом фронте регистрируется один cbAfterDelay. sim_time_ns() возвращает 64-битное время симуляции в нс.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function main()
+  *   write32(0x100, 1)
+  *   idle_until(sim_time_ns() + 5000000000)   -- 5 с без вызовов Lua
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Память модели: глобальная MEM - разреженная память экземпляра в C (страницы по 4 КиБ выделяются при первой записи,
+  * байтовый адрес, слова младшим байтом вперёд). Обращения exchange_S (ACTION__READ/ACTION__WRITE) к диапазонам MEM:map()
+  * обслуживаются без входа в Lua; exchange_S вызывается только для остальных адресов.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function init_env()
+  *   MEM:map(0x00000000, 0x10000)             -- ОЗУ 64 КиБ
+  *   MEM:write(0x0, io.open('fw.bin', 'rb'):read('a'))
+  *   return 1
+  * end
+  * -- MEM:peek8/peek32(adr), MEM:poke8/poke32(adr, v), MEM:read(adr, len), MEM:fill(adr, len, v), MEM:copy(dst, src, len), MEM:pages()
+  * ~~~~~~~~~~~~~~~
+  *
+  * Карта адресов: map_region(base, size, handler [, arg]) в init_env объявляет диапазон [base, base + size) с обработчиком -
+  * функцией Lua handler(offset, CMD_I, DAT_I, time_ns) -> DAT_O, STATUS_O, "ram" (то же, что MEM:map), "const" (arg - читаемое
+  * значение) или "fifo" (arg - глубина; переполнение и чтение пустой очереди - STATUS_O = 1). Адрес декодируется в C двоичным
+  * поиском; "ram", "const" и "fifo" обслуживаются без входа в Lua, exchange_S получает только адреса вне карты.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function uart(offset, CMD_I, DAT_I, time_ns)
+  *   if offset == 0 and CMD_I == 2 then io.write(string.char(DAT_I & 0xFF)) end
+  *   return 0, 0
+  * end
+  *
+  * function init_env()
+  *   map_region(0x00000000, 0x10000, "ram")
+  *   map_region(0x40000000, 4, "const", 0x00010203)   -- ID
+  *   map_region(0x40000004, 4, "fifo", 64)            -- fifo_push(0x40000004, v), fifo_pop(), fifo_count()
+  *   map_region(0x40001000, 0x100, uart)
+  *   return 1
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Трассы: +lua_record[=DIR] записывает все обмены exchange_M/exchange_S каждого экземпляра в DIR/<иерархическое имя>.trc
+  * (второй и следующие $lua_init того же модуля - <иерархическое имя>.1.trc, .2.trc ... в порядке вызова; по умолчанию DIR = .lua_trace; +lua_record_delta - приращения полей в varint, обычно в 5 - 10 раз компактнее).
+  * +lua_replay[=DIR] обслуживает обмены из отображённой в память трассы, не создавая Lua - машину. Если DAT_I/STATUS_I (M)
+  * или CMD_I/ADR_I/DAT_I (S) отличаются от записанных, симуляция останавливается, а с +lua_replay_diverge=lua скрипт загружается,
+  * совпавшая часть трассы прогоняется через него и дальше работает Lua. Широкая шина данных не записывается.
+  *
+  * Память Lua - машин выделяется собственным распределителем экземпляра (списки свободных блоков по классам размера,
+  * без общей кучи и блокировок). +lua_mem_limit=N[K|M|G] ограничивает память каждого экземпляра: при превышении
+  * Lua получает ошибку "not enough memory", а exchange - rr < 0. Занятая память, максимум и число отказов - в stats().
+  *
+  * Сборка мусора: +lua_gc=manual останавливает автоматическую сборку; шаги выполняются в конце шага симуляции
+  * (cbNextSimTime -> cbReadOnlySynch), а в режиме +lua_threaded - когда рабочему потоку нечего делать, не дольше
+  * +lua_gc_budget мкс за раз. Новый цикл начинается после удвоения памяти. +lua_gc=gen - поколенческий режим Lua 5.4.
+  * +lua_gc_full=N[K|M|G] - полная сборка в точке простоя, если память Lua - машины больше N.
+  *
+  * Счётчики: stats() возвращает счётчики экземпляра - обмены M/S, ошибки, транзакции по CMD, байты, память Lua - машины
+  * (текущая и максимум), суммарное время и гистограммы (по степеням двойки, нс) фаз VPI и модели. С +lua_stats[=FILE]
+  * замеряются задержки, а счётчики выводятся в FILE (JSON Lines, по умолчанию lua_stats.json) при $lua_deinit
+  * или в конце симуляции.
+  *
+  * Произвольный интерфейс: $lua_call(Descriptor, "func", входы... [, "->", выходы...]) вызывает func(входы...) экземпляра
+  * и записывает её результаты по порядку в выходы (сразу, vpiNoDelay; nil оставляет выход как есть). Типы аргументов
+  * разбираются один раз в compiletf: до 32 бит - целые (со знаком для signed), шире - строки байт (младший первым),
+  * real - числа, строковые константы - строки, память reg [31:0] m [0:N-1] - таблица из N целых. Функция разрешается
+  * в ссылку реестра при первом вызове, поэтому calltf только выполняет план. Вызовы не записываются в трассу +lua_record
+  * и с +lua_threaded останавливают симуляцию.
+  *
+  * ~~~~~~~~~~~~~~~{.verilog}
+  * always @(posedge CLK) $lua_call(Descriptor, "crc32", crc, DATA, "->", crc);
+  * ~~~~~~~~~~~~~~~
+  *
+  * Воспроизведение воздействий: $lua_play(Descriptor, fname, сигналы...) отображает файл fname в память и выставляет
+  * сигналы (vpi_put_value) в их моменты времени от момента вызова, планируя себя через cbAfterDelay - без Lua на каждом такте.
+  * Формат (little-endian): "PLISTM1\0", uint32 число сигналов, uint32 ширина каждого; затем записи - байт кода и поля varint:
+  * 1 dt (следующие записи через dt нс), 2 sig и (ширина + 7) / 8 байт значения, 3 - то же с таким же числом байт маски X/Z,
+  * 4 id (событие), 0 или конец файла - конец. Descriptor = 0 - без Lua; иначе событие вызывает play_event(id, time_ns)
+  * экземпляра, false из play_event останавливает воспроизведение. VCD переводится в этот формат заранее.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * local f = io.open('stim.bin', 'wb')
+  * f:write('PLISTM1\0', string.pack('<I4I4I4', 2, 8, 32))           -- два сигнала: [7:0] и [31:0]
+  * for i = 0, 999 do
+  *   f:write(string.pack('<BBB BBI4', 2, 0, i & 0xFF, 2, 1, i * 4))  -- значения
+  *   if i % 100 == 0 then f:write(string.pack('<BB', 4, i // 100)) end
+  *   f:write(string.pack('<BB', 1, 10))                              -- +10 нс
+  * end
+  * f:close()
+  * ~~~~~~~~~~~~~~~
+  *
+  * Запись сигналов: $lua_capture(Descriptor, handler, "posedge" | "negedge" | "change", TRIG, сигналы...) по каждому
+  * срабатыванию TRIG записывает время и значения до 32 сигналов в столбцы в памяти C, а функция handler(buf) скрипта
+  * вызывается один раз на +lua_capture_depth выборок (по умолчанию 4096), остаток - при $lua_deinit и в конце симуляции.
+  * buf:column(k) - столбец сигнала k (1..N, 0 - время в нс): #col и col[i] без копирования; значения до 32 бит - целые,
+  * шире - строки байт (младший первым). buf:get(k, i), buf:time(i), buf:xz(k, i) (были ли X/Z), #buf, buf:signals().
+  * buf:ptr(k) - адрес столбца и слов на выборку для ffi LuaJIT. Буфер и столбцы действительны только внутри handler.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * local sum = 0
+  * function on_samples(buf)                -- $lua_capture(Descriptor, "on_samples", "posedge", CLK, ADR, DAT)
+  *   local dat = buf:column(2)
+  *   for i = 1, #dat do sum = sum + dat[i] end
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Наблюдение за сигналами: id = watch(net, "posedge" | "negedge" | "eq" | "change", handler [, mask [, value]]) ставит
+  * cbValueChange на сигнал до 32 бит (полное имя или имя относительно модуля $lua_init). Фильтр проверяется в C:
+  * posedge/negedge - фронт любого бита mask, eq - значение под mask стало равно value, change - изменился бит mask
+  * (mask по умолчанию - все биты). handler(value, prev, time_ns, id) вызывается только при совпадении, поэтому линии
+  * прерываний не нужно опрашивать через STATUS_I на каждом обмене. unwatch(id) снимает наблюдение; все наблюдения
+  * снимаются при $lua_deinit. Наблюдения из скрипта и init_env ставятся после выдачи дескриптора; с +lua_threaded
+  * наблюдения - ошибка $lua_init.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * function init_env()
+  *   watch('IRQ', 'posedge', function(v, prev, time_ns) pending = pending | (v & ~prev) end)
+  *   watch('tb.dut.state', 'eq', on_done, 0xF, 3)
+  *   return 1
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Мост к внешнему эмулятору (QEMU и т.п.): bridge_open(name [, quantum_ns [, depth]]) при загрузке скрипта создаёт сегмент
+  * POSIX shm name с кольцами запросов и ответов (раскладка и функции стороны эмулятора - lua_bridge.h, сборка с -lrt).
+  * Тогда $lua_exchange_M выдаёт на шину транзакции эмулятора (lb_write/lb_read) в их моменты времени без входа в Lua,
+  * а $lua_exchange_S передаёт обращения Verilog эмулятору (lb_poll). Обмен идёт через разделяемую память без системных
+  * вызовов; futex - только если одна из сторон ждёт. Эмулятор опережает симулятор не больше чем на quantum_ns
+  * (по умолчанию 1000): lb_sync(T) отмечает, что до T запросов не будет, и симулятор идёт до T, не дожидаясь эмулятора.
+  *
+  * ~~~~~~~~~~~~~~~{.lua}
+  * bridge_open("/cpu0", 10000)   -- квант 10 мкс
+  *
+  * function init_env()
+  *   return 1
+  * end
+  * ~~~~~~~~~~~~~~~
+  *
+  * Тактирование из C: $lua_attach подписывается (cbValueChange) на передний фронт CLK и сам вызывает модель.
+  * Порты перечисляются в том же порядке, что и в $lua_exchange_M/$lua_exchange_S; входы читаются в момент фронта,
+  * выходы выставляются с инерционной задержкой #1. Необязательный последний аргумент EN - модель вызывается
+  * только при EN == 1. Подключения снимаются при $lua_deinit.
+  *
+  * ~~~~~~~~~~~~~~~{.v}
+  * wire [31:0] STATUS = {31'h0, IRQ};
+  * wire        EN = (Phase == ST__EXCHANGE);
+  *
+  * initial begin
+  *   $lua_init(Descriptor, lua_script_name);
+  *   $lua_attach(Descriptor, CLK_I, "M", time_ns, cmd, A, Dw, Dr, STATUS, rr, EN);
+  * end
+  * ~~~~~~~~~~~~~~~
   */
 
 #include <stdlib.h>
@@ -117,17 +335,70 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 
 #include "veriuser.h"
 #include "vpi_user.h"
 #include "acc_user.h"
 
+#include "lua_bridge.h"
+
 
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
 
+#ifdef USE_LUAJIT
+  #include "luajit.h"
+#endif
+
+
+/* Совместимость с API Lua 5.1 (LuaJIT): целочисленная семантика 32-битных значений шины та же, что в 5.3/5.4 */
+#if LUA_VERSION_NUM < 503
+
+#ifndef LUA_OK
+  #define LUA_OK  0
+#endif
+
+#define lua_rawlen  lua_objlen
+
+static int lua_isinteger(lua_State *L, int idx)
+{
+  lua_Number n;
+
+  if( lua_type(L, idx) != LUA_TNUMBER )
+    return 0;
+
+  n = lua_tonumber(L, idx);
+  return (n == (lua_Number)(int64_t)n);
+}
+
+static int lua_absindex(lua_State *L, int idx)
+{
+  return ((idx > 0) || (idx <= LUA_REGISTRYINDEX)) ? idx : lua_gettop(L) + idx + 1;
+}
+
+static const char *luaL_tolstring(lua_State *L, int idx, size_t *len)
+{
+  idx = lua_absindex(L, idx);
+  lua_getglobal(L, "tostring");
+  lua_pushvalue(L, idx);
+  lua_call(L, 1, 1);
+  return lua_tolstring(L, -1, len);
+}
+
+#endif
+
 
 #define DEBUG
 #define PFX  __FILE__
@@ -140,750 +411,8183 @@ enum
 {
   ACTION__IDLE   = 0,
   ACTION__READ   = 1,
-  ACTION__WRITE  = 2
+  ACTION__WRITE  = 2,
+  ACTION__SLEEP  = 3    /* Только между Lua и C: простой до момента (ADR | DAT << 32) нс, Verilog получает ACTION__IDLE */
 } typedef action_t;
 
 
+/**
+  * @brief Транзакция на шине: то, что exchange_M возвращает за один вызов.
+  */
 struct {
-  lua_State *L;
+  int32_t time_ns;
+  int32_t CMD;
+  int32_t ADR;
+  int32_t DAT;
+} typedef bus_trans_t;
 
-} typedef mb_lua_t;
+
+#define BUS_TRANS_PACKED  16   /* Размер записи упакованного пакета, string.pack("<i4i4i4i4", ...) */
+#define BUS_FIFO_INIT     64
 
 
 /**
-  * @brief Инициализация Lua - машины.
-  * @param  fname: Ссылка на строку с именем файла Lua - программы.
-  * @retval void* Указатель на объект lua_State, приведённый к void*. В случае неудачи возвращает NULL.
+  * @brief FIFO пакета транзакций exchange_M и данные, прочитанные во время его выдачи.
   */
-static uint64_t init_lua(mb_lua_t **master_, const char *fname)
-{
-  int       err;
-  lua_Integer ret;
-  mb_lua_t *master;
-
-  master = (mb_lua_t *)malloc(sizeof(mb_lua_t));
-
-  if (master == NULL) {
-    REPORT(MSG_ERROR, "if (master == NULL)");
-    return -1;
-  }
+struct {
+  bus_trans_t *buf;
+  size_t       size;       /* Ёмкость buf */
+  size_t       head;       /* Следующая выдаваемая транзакция */
+  size_t       count;      /* Количество транзакций в пакете */
 
-  master->L = NULL;
-  master->L = luaL_newstate();
+  int32_t     *rd;         /* Данные транзакций ACTION__READ */
+  size_t       rd_size;
+  size_t       rd_count;
 
-  if( master->L == NULL )
-  {
-    REPORT(MSG_ERROR, "if( master->L == NULL )");
-    free(master);
-    *master_ = NULL;
-    return -2;
-  }
+  int32_t      last_cmd;   /* CMD последней выданной транзакции */
+  int          active;     /* Пакет выдаётся, результаты ещё не переданы в Lua */
+} typedef bus_fifo_t;
 
-  luaL_openlibs( master->L );
 
-  err = luaL_loadfile( master->L, fname );
-  if ( err != LUA_OK )
-  {
-    REPORT(MSG_ERROR, "if ( err != LUA_OK )  '%s' filename = '%s'", lua_tostring(master->L, -1), fname);
-    lua_close( master->L );
-    free(master);
-    *master_ = NULL;
-    return -3;
-  }
+/**
+  * @brief Кольцевой буфер "один писатель - один читатель" с элементами фиксированного размера.
+  *        head и tail - монотонные счётчики, ёмкость - степень двойки.
+  */
+struct {
+  uint8_t       *buf;
+  size_t         elem_size;
+  size_t         mask;
+  atomic_size_t  head;   /* Пишет только производитель */
+  atomic_size_t  tail;   /* Пишет только потребитель */
+} typedef spsc_ring_t;
 
-  if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )
-  {
-    REPORT(MSG_ERROR, "if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
-    lua_close( master->L );
-    free(master);
-    *master_ = NULL;
-    return -4;
-  }
 
-  lua_getglobal(master->L, "init_env");
+enum
+{
+  WORKER__EXCHANGE_M = 0,
+  WORKER__EXCHANGE_S = 1
+} typedef worker_kind_t;
 
-  if( lua_pcall(master->L, 0, 1, 0) != LUA_OK )
-  {
-    REPORT(MSG_ERROR, "if( lua_pcall(master->L, 0, 1, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
-    lua_close( master->L );
-    free(master);
-    *master_ = NULL;
-    return -5;
-  }
 
-  if(! lua_isinteger(master->L, -1))
-  {
-    REPORT(MSG_ERROR, "if(! lua_isinteger(master->L, -1))  '%s'", lua_tostring(master->L, -1));
-    lua_close( master->L );
-    free(master);
-    *master_ = NULL;
-    return -6;
-  }
+/**
+  * @brief Сообщение между потоком симулятора и рабочим потоком Lua - машины.
+  *        Запрос M:  v = {DAT_I, STATUS_I}.               Ответ M:  v = {time_ns, CMD_O, ADR_O, DAT_O}.
+  *        Запрос S:  v = {time_ns, CMD_I, ADR_I, DAT_I}.  Ответ S:  v = {DAT_O, STATUS_O}.
+  */
+struct {
+  int32_t kind;
+  int32_t result;
+  int32_t v[4];
+} typedef worker_msg_t;
 
-  ret = lua_tointeger(master->L, -1);
-  lua_pop(master->L, 1);
 
-  if( ret < 0 )
-  {
-    REPORT(MSG_ERROR, "if( ret < 0 )");
-    lua_close( master->L );
-    free(master);
-    *master_ = NULL;
-    return 0;
-  }
+/**
+  * @brief Рабочий поток, владеющий lua_State экземпляра (режим +lua_threaded).
+  */
+struct {
+  pthread_t       thread;
+  spsc_ring_t     req;             /* Симулятор -> рабочий поток */
+  spsc_ring_t     resp_M;          /* Рабочий поток -> симулятор, глубина = глубина опережения */
+  spsc_ring_t     resp_S;
 
-  REPORT(MSG_INFO, "Descriptor = 0x%llX", (uint64_t)master );
-  *master_ = master;
-  return 0;
-}
+  atomic_int      stop;
+  atomic_int      status_latest;   /* Последний STATUS_I, переданный симулятором */
+  atomic_int      waiters;
+  pthread_mutex_t mtx;
+  pthread_cond_t  cond;
 
+  int             m_ready;         /* Только рабочий поток: есть входные данные для следующего exchange_M */
+  int             m_need_data;     /* Только поток симулятора: рабочий поток ждёт DAT_I последнего чтения */
+} typedef worker_t;
 
-static void deinit_lua(mb_lua_t *master)
-{
-  REPORT(MSG_INFO, "Descriptor = 0x%llX", (uint64_t)master );
-  if( master == NULL)
-  {
-    REPORT(MSG_INFO, "if( master == NULL)");
-    return;
-  }
 
-  lua_close( master->L );
-  free(master);
-}
+#define BRIDGE_QUANTUM_NS  1000   /* Квант синхронизации с эмулятором по умолчанию */
+#define BRIDGE_DEPTH       256
 
 
 /**
-  * @brief Обмен данными, приспособленный под интерфейс системной шины процессора.
-  * @param  desc:  Указатель на Lua - машину.
-  * @param  CMD_O: Возвращает код команды (ожидание, запись, чтение). Эта команда используется автоматом состояний, написанном на Verilog для отработки соответствующей временной диаграмы на шине данных.
-  * @param  ADR_O: Возвращает адрес (32 бита) для формирования на шине адреса.
-  * @param  DAT_O: Возвращает данные (32 бита) для формирования на шине данных.
-  * @param  DAT_I: Считывает данные (32 бита), принимаемые по шине данных.
-  * @param  STATUS_I: Считывает состояния сигналов сброса и прерываний (32 бита, рекомендуется в 31 бит помещать состояние сигнала сброса.)
-  * @retval int32_t Возвращает 0 в случае успеха, отрицательные величины в случае неудачи.
+  * @brief Сторона симулятора моста к внешнему эмулятору (bridge_open(), lua_bridge.h).
   */
-static int lua_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
-{
-  printf("<----------------- lua_exchange_M ---------------->\n");
+struct {
+  lb_shm_t *shm;
+  size_t    size;
+  char      name[NAME_MAX];
+  int64_t   horizon_ns;   /* Последний LB_CMD_SYNC: до этого момента эмулятор запросов не пришлёт */
+  int64_t   next_pub_ns;  /* Граница кванта, на которой sim_ns публикуется следующий раз */
+  lb_msg_t  req;          /* Запрос LB__M_REQ, ждущий своего времени */
+  int       have_req;
+  int       rd_pending;   /* Выдано чтение: DAT_I придёт следующим вызовом $lua_exchange_M */
+  int       put_ring;     /* Кольцо, в котором ждём места (bridge_put()) */
+  int       warned;
+} typedef bridge_t;
 
-  if(master == NULL)
-  {
-    REPORT(MSG_ERROR, "if(master == NULL)");
-    return -1;
-  }
 
-  lua_getglobal(master->L, "exchange_M");
+#ifdef USE_LUAJIT
 
-  lua_pushinteger(master->L, *DAT_I);
-  lua_pushinteger(master->L, *STATUS_I);
+#define PLI_STR(...)   #__VA_ARGS__
+#define PLI_XSTR(...)  PLI_STR(__VA_ARGS__)
 
-  if( lua_pcall(master->L, 2, 4, 0) != LUA_OK )
-  {
-    REPORT(MSG_ERROR, "if( lua_pcall(master->L, 2, 4, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
-    return -2;
-  }
+/* Поля структуры обмена: одно описание для C и для ffi.cdef */
+#define PLI_EXCHANGE_FIELDS  int32_t time_ns; int32_t CMD; int32_t ADR; int32_t DAT_O; int32_t DAT_I; int32_t STATUS_I; int32_t STATUS_O;
 
-#ifdef DEBUG
-  if(! lua_isinteger(master->L, -4))
-  {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(master->L, -4))  '%s'", lua_tostring(master->L, -1));
-     return -3;
-  }
-#endif
-  *time_ns = (uint32_t)lua_tointeger(master->L, -4);
 
-#ifdef DEBUG
-  if(! lua_isinteger(master->L, -3))
-  {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(master->L, -3))  '%s'", lua_tostring(master->L, -1));
-     return -4;
-  }
-#endif
-  *CMD_O = (uint32_t)lua_tointeger(master->L, -3);
+/**
+  * @brief Структура обмена, разделяемая с Lua через FFI (глобальная EX в скрипте).
+  *        exchange_M_ffi(): читает EX.DAT_I, EX.STATUS_I, заполняет EX.time_ns, EX.CMD, EX.ADR, EX.DAT_O.
+  *        exchange_S_ffi(): читает EX.time_ns, EX.CMD, EX.ADR, EX.DAT_I, заполняет EX.DAT_O, EX.STATUS_O.
+  *        Значения хранятся как int32_t, т.е. по модулю 2^32, как и в пути через стек Lua.
+  */
+struct {
+  PLI_EXCHANGE_FIELDS
+} typedef pli_exchange_t;
 
-#ifdef DEBUG
-  if(! lua_isinteger(master->L, -2))
-  {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(L, -2))  '%s'", lua_tostring(master->L, -1));
-     return -5;
-  }
-#endif
-  *ADR_O = (uint32_t)lua_tointeger(master->L, -2);
 
-#ifdef DEBUG
-  if(! lua_isinteger(master->L, -1))
-  {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(L, -1))  '%s'", lua_tostring(master->L, -1));
-     return -6;
-  }
+static const char lua_ffi_prelude[] =
+  "local ffi = require('ffi')\n"
+  "ffi.cdef[[ typedef struct { " PLI_XSTR(PLI_EXCHANGE_FIELDS) " } pli_exchange_t; ]]\n"
+  "EX = ffi.cast('pli_exchange_t *', ...)\n";
+
 #endif
-  *DAT_O = (uint32_t)lua_tointeger(master->L, -1);
 
-  lua_pop(master->L, 4);
-  return 0;
-}
 
+/**
+  * @brief Разреженная память экземпляра: двухуровневая таблица страниц по 4 КиБ, страница выделяется при первой записи.
+  *        Адрес - байтовый, 32 бита; 32-битные слова хранятся младшим байтом вперёд.
+  */
+#define MEM_PAGE_BITS   12
+#define MEM_PAGE_SIZE   (1u << MEM_PAGE_BITS)
+#define MEM_TBL_BITS    10
+#define MEM_TBL_SIZE    (1u << MEM_TBL_BITS)
+#define MEM_DIR_SIZE    (1u << (32 - MEM_PAGE_BITS - MEM_TBL_BITS))
+#define MEM_SPACE       ((lua_Integer)1 << 32)   /* Размер адресного пространства: adr + len не выходит за него */
+#define MEM_MT          "PLI2Lua.mem"
 
-static int lua_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
-{
-  printf("<----------------- lua_exchange_S ---------------->\n");
 
-  if(slave == NULL)
-  {
+struct {
+  uint8_t   **dir[MEM_DIR_SIZE];   /* NULL - ни одной страницы в этой части адресного пространства */
+  size_t      pages;               /* Выделено страниц */
+} typedef mem_t;
+
+
+/**
+  * @brief Карта адресов exchange_S: непересекающиеся диапазоны [lo, hi], отсортированные по lo.
+  *        Обращения к AMAP__RAM, AMAP__CONST и AMAP__FIFO обслуживаются в C, к AMAP__LUA - вызовом обработчика диапазона.
+  */
+#define AMAP_INIT        8
+#define AMAP_FIFO_DEPTH  16
+
+
+enum
+{
+  AMAP__LUA    = 0,   /* handler(offset, CMD_I, DAT_I, time_ns) -> DAT_O, STATUS_O */
+  AMAP__RAM,          /* Память модели MEM по абсолютному адресу */
+  AMAP__CONST,        /* Чтение - константа, запись игнорируется */
+  AMAP__FIFO          /* Запись - в очередь, чтение - из очереди */
+} typedef amap_kind_t;
+
+
+struct {
+  int32_t  *buf;
+  uint32_t  mask;      /* Ёмкость буфера - 1, ёмкость - степень двойки (только для индексов) */
+  uint32_t  depth;     /* Заданная глубина: очередь полна при count == depth */
+  uint32_t  head;
+  uint32_t  count;
+} typedef amap_fifo_t;
+
+
+struct {
+  uint32_t     lo;
+  uint32_t     hi;
+  int          kind;
+  int          ref;     /* AMAP__LUA: обработчик в реестре Lua */
+  int32_t      value;   /* AMAP__CONST */
+  amap_fifo_t *fifo;    /* AMAP__FIFO */
+} typedef amap_entry_t;
+
+
+struct {
+  amap_entry_t *e;
+  size_t        count;
+  size_t        size;
+} typedef amap_t;
+
+
+/**
+  * @brief Двоичная трасса обменов: заголовок trace_hdr_t и записи trace_rec_t подряд
+  *        (или, с TRACE_F_DELTA, приращения полей к предыдущей записи в zigzag - varint).
+  */
+#define TRACE_MAGIC    "PLITRC1"
+#define TRACE_VERSION  1
+#define TRACE_F_DELTA  1u
+#define TRACE_IOBUF    (1 << 20)
+#define TRACE_V        6
+#define TRACE_FIELDS   (TRACE_V + 2)
+#define TRACE_DIR      ".lua_trace"
+
+
+enum
+{
+  TRACE__M = 0,   /* v = {DAT_I, STATUS_I, time_ns, CMD_O, ADR_O, DAT_O} */
+  TRACE__S = 1    /* v = {time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O} */
+} typedef trace_kind_t;
+
+
+struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t flags;
+} typedef trace_hdr_t;
+
+
+struct {
+  int32_t kind;
+  int32_t result;
+  int32_t v[TRACE_V];
+} typedef trace_rec_t;
+
+
+/**
+  * @brief Запись (f != NULL) или воспроизведение (map != NULL) трассы экземпляра.
+  */
+struct {
+  FILE          *f;
+  char          *iobuf;
+
+  const uint8_t *map;
+  size_t         map_len;
+  size_t         pos;
+
+  int            delta;
+  trace_rec_t    prev;
+  uint64_t       count;    /* Записано или совпало при воспроизведении обменов */
+  char          *fname;    /* Скрипт для перехода на Lua при расхождении */
+} typedef trace_t;
+
+
+/**
+  * @brief Распределитель памяти Lua - машины экземпляра: блоки до ARENA_SMALL_MAX байт нарезаются из пластин
+  *        по ARENA_SLAB байт и возвращаются в списки свободных блоков своего класса (кратного ARENA_STEP),
+  *        большие блоки - через malloc(). Размер блока Lua передаёт сама (osize), поэтому заголовков у блоков нет.
+  *        Используется только потоком, владеющим Lua - машиной, блокировок нет.
+  */
+#define ARENA_STEP       16
+#define ARENA_CLASSES    16
+#define ARENA_SMALL_MAX  (ARENA_STEP * ARENA_CLASSES)
+#define ARENA_SLAB       (64 * 1024)
+
+
+struct arena_slab_s {
+  struct arena_slab_s *next;
+  size_t               pad;     /* Выравнивание блоков на ARENA_STEP */
+};
+
+
+struct {
+  void                *free[ARENA_CLASSES];
+  struct arena_slab_s *slabs;
+  char                *bump;         /* Ещё не нарезанная часть последней пластины */
+  size_t               bump_left;
+
+  size_t               used;         /* Байт выделено Lua */
+  size_t               hwm;
+  size_t               limit;        /* 0 - без ограничения */
+  uint64_t             fails;        /* Отказов из-за limit или нехватки памяти */
+} typedef arena_t;
+
+
+/**
+  * @brief Счётчики производительности экземпляра. Гистограммы задержек - по степеням двойки:
+  *        hist[phase][i] - число обменов с длительностью фазы в [2^i, 2^(i+1)) нс.
+  */
+#define STATS_BUCKETS  40
+#define STATS_CMD      3      /* ACTION__IDLE, ACTION__READ, ACTION__WRITE */
+
+
+enum
+{
+  STATS__MARSHAL = 0,   /* VPI: чтение аргументов и запись результатов */
+  STATS__LUA,           /* Модель: Lua, рабочий поток, карта адресов или трасса */
+  STATS__GC,            /* Шаги сборки мусора в точках простоя (+lua_gc) */
+  STATS__PHASES
+} typedef stats_phase_t;
+
+
+struct {
+  uint64_t calls_M;
+  uint64_t calls_S;
+  uint64_t errors;
+  uint64_t cmd[STATS_CMD];
+  uint64_t bytes_rd;
+  uint64_t bytes_wr;
+
+  uint64_t phase_ns[STATS__PHASES];
+  uint64_t hist[STATS__PHASES][STATS_BUCKETS];
+
+  uint64_t gc_steps;
+  uint64_t gc_full;
+
+  size_t   mem;        /* Память Lua - машины при последнем замере, байт */
+  size_t   mem_hwm;    /* Максимум памяти Lua - машины, байт */
+} typedef stats_t;
+
+
+/**
+  * @brief Lua - машина и ссылки в реестре Lua на точки входа скрипта.
+  *        Ссылки разрешаются один раз в init_lua(), LUA_NOREF - функция в скрипте отсутствует.
+  */
+#define LUA_PREFIX_MAX  64
+
+
+struct {
+  lua_State *L;
+  uint32_t   handle;                   /* Дескриптор экземпляра в Verilog, см. handle_alloc() */
+  char       prefix[LUA_PREFIX_MAX];   /* Префикс сообщений экземпляра (иерархическое имя места вызова $lua_init) */
+
+  int ref_init_env;
+  int ref_exchange_M;
+  int ref_exchange_S;
+  int ref_irq;
+  int ref_deinit_env;
+  int ref_main;
+  int ref_play_event;
+
+#ifdef USE_LUAJIT
+  pli_exchange_t *ex;
+  int ref_exchange_M_ffi;
+  int ref_exchange_S_ffi;
+#endif
+
+  bus_fifo_t fifo;
+  mem_t      mem;      /* Память модели (глобальная MEM в Lua) */
+  amap_t     amap;     /* Карта адресов exchange_S (map_region(), MEM:map()) */
+
+  lua_State *co_main;          /* Сопрограмма main(), NULL - режим exchange_M */
+  int        ref_co_main;
+  int        co_main_state;    /* 0 - выполняется, 1 - завершилась, < 0 - код ошибки */
+  lua_State *co_irq;           /* Выполняющийся обработчик irq(), NULL - прерывания нет */
+  int        ref_co_irq;
+  int32_t    irq_mask;         /* Биты прерываний в STATUS_I (глобальная IRQ_MASK скрипта, по умолчанию 1) */
+  int32_t    status_prev;
+  int32_t    saved_DAT_I;      /* DAT_I для main(), вытесненной прерыванием */
+
+  worker_t  *worker;   /* NULL - Lua выполняется в потоке симулятора */
+  trace_t   *trace;    /* NULL - без записи и воспроизведения трассы */
+  bridge_t  *bridge;   /* NULL - обмены обслуживает скрипт, иначе внешний эмулятор */
+  stats_t    stats;
+  arena_t    arena;    /* Память Lua - машины (кроме сборки с LuaJIT) */
+  char       warn[LUA_PREFIX_MAX + 256];   /* Собираемое сообщение warn() (Lua 5.4) */
+  size_t     warn_len;
+  int        warn_on;    /* warn("@on"), по умолчанию выключено, как в luaL_newstate() */
+  int        warn_cont;  /* Ожидается продолжение сообщения */
+  size_t     gc_base;  /* Память после последнего цикла сборки (+lua_gc=manual) */
+  int        gc_cycle; /* Цикл сборки начат и не завершён */
+
+  int64_t          idle_until_ns;   /* Модель простаивает до этого момента (нс), 0 - активна */
+  _Atomic int64_t  now_ns;          /* Время симуляции последнего обмена (нс), для рабочего потока */
+
+  uint32_t   par_batch;   /* Пакет +lua_parallel, в котором у экземпляра есть обмены */
+  int        par_last;    /* Последний обмен экземпляра в этом пакете */
+  int        pooled;      /* Модель выполняется в пуле +lua_parallel: VPI недоступен */
+
+  struct attach_s *attach;   /* Подключения к тактовым сигналам ($lua_attach) */
+  struct play_s   *play;     /* Воспроизведения с событиями play_event() ($lua_play) */
+  struct capture_s *capture; /* Записи сигналов ($lua_capture) */
+  struct watch_s   *watch;   /* Наблюдения за сигналами (watch()) */
+  int              watch_id; /* Последний выданный id watch() */
+} typedef mb_lua_t;
+
+
+/* Глубина опережения рабочего потока (+lua_threaded=N), 0 - без рабочих потоков */
+static int opt_worker_depth = 0;
+
+
+/* Потоков, вычисляющих модели одного шага времени (+lua_parallel[=N], вместе с потоком симулятора), 0 - последовательно */
+static int opt_par_threads = 0;
+
+
+/* Каталог кэша байткода (+lua_cache[=DIR]), NULL - кэш отключён */
+static const char *opt_cache_dir = NULL;
+
+
+/* Точность времени симулятора (показатель степени 10 секунды), 1 - ещё не запрошена */
+static int sim_precision = 1;
+
+
+/* +lua_mem_limit=N[K|M|G]: ограничение памяти Lua - машины каждого экземпляра, 0 - без ограничения */
+static size_t opt_mem_limit = 0;
+
+
+/**
+  * @brief Управление сборкой мусора (+lua_gc=manual|gen).
+  */
+enum
+{
+  GC__AUTO = 0,   /* Автоматическая сборка Lua */
+  GC__MANUAL,     /* Автоматическая сборка остановлена, шаги - в точках простоя симулятора */
+  GC__GEN         /* Поколенческий режим Lua 5.4 */
+} typedef gc_mode_t;
+
+
+static int      opt_gc_mode      = GC__AUTO;
+static uint64_t opt_gc_budget_ns = 200000;   /* +lua_gc_budget=мкс, время на шаги сборки в одной точке простоя */
+static size_t   opt_gc_full      = 0;        /* +lua_gc_full=N[K|M|G], порог полной сборки, 0 - не выполняется */
+
+
+/* +lua_stats[=FILE]: замер задержек и вывод счётчиков в JSON, NULL - только счётчики */
+static const char *opt_stats_file = NULL;
+
+
+/* +lua_record[=DIR], +lua_record_delta, +lua_replay[=DIR], +lua_replay_diverge=stop|lua */
+static const char *opt_record_dir = NULL;
+static int         opt_record_delta = 0;
+static const char *opt_replay_dir = NULL;
+static int         opt_replay_fallback = 0;
+
+
+static int  worker_start(mb_lua_t *master, int depth);
+static void worker_stop(mb_lua_t *master);
+static void attach_remove_all(mb_lua_t *lua);
+static void play_remove_all(mb_lua_t *lua);
+static void capture_remove_all(mb_lua_t *lua);
+static void watch_arm_all(mb_lua_t *lua);
+static void watch_remove_all(mb_lua_t *lua);
+static int  lua_watch(lua_State *L);
+static int  lua_unwatch(lua_State *L);
+static void par_flush(void);
+static void log_arm(void);
+static int  lua_bridge_open(lua_State *L);
+static void bridge_close(mb_lua_t *lua);
+
+
+/**
+  * Количество ячеек стека, необходимое для вызова любой точки входа (функция + аргументы + результаты).
+  */
+#define LUA_EXCHANGE_STACK  8
+
+
+/**
+  * @brief Закрепление глобальной функции скрипта в реестре Lua.
+  * @param  L:    Lua - машина.
+  * @param  name: Имя глобальной функции.
+  * @retval int Ссылка в LUA_REGISTRYINDEX или LUA_NOREF, если такой функции нет.
+  */
+static int lua_ref_function(lua_State *L, const char *name)
+{
+  lua_getglobal(L, name);
+
+  if( lua_type(L, -1) != LUA_TFUNCTION )
+  {
+    lua_pop(L, 1);
+    return LUA_NOREF;
+  }
+
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+/**
+  * @brief Замена print() в Lua: строка собирается целиком и уходит в общий буферизированный вывод
+  *        с префиксом экземпляра, без системного вызова на каждую строку.
+  */
+static int lua_print(lua_State *L)
+{
+  mb_lua_t   *master = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  luaL_Buffer b;
+  const char *s;
+  size_t      len;
+  int         n = lua_gettop(L);
+  int         i;
+
+  if( MSG_INFO > DebugLogLevel )
+    return 0;
+
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, master->prefix);
+  luaL_addstring(&b, ": ");
+
+  for(i = 1; i <= n; i++)
+  {
+    if(i > 1)
+      luaL_addstring(&b, "\t");
+    luaL_tolstring(L, i, NULL);
+    luaL_addvalue(&b);
+  }
+
+  luaL_addstring(&b, TENDSTR);
+  luaL_pushresult(&b);
+
+  s = lua_tolstring(L, -1, &len);
+  DebugLogWrite(_FD_, s, len);
+  return 0;
+}
+
+
+#define CACHE_MAGIC  "PLI2LUAC"
+
+
+/**
+  * @brief Заголовок файла кэша. За ним следуют путь к исходнику (path_len байт) и байткод lua_dump().
+  */
+struct {
+  char     magic[8];
+  uint32_t lua_version;
+  uint32_t path_len;
+  int64_t  mtime;
+  uint64_t size;
+  uint64_t hash;     /* FNV-1a 64 содержимого исходника */
+} typedef cache_hdr_t;
+
+
+/**
+  * @brief Накопитель для lua_dump().
+  */
+struct {
+  char   *buf;
+  size_t  len;
+  size_t  size;
+} typedef cache_buf_t;
+
+
+static uint64_t fnv1a64(const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t       h = 0xcbf29ce484222325ULL;
+
+  while(len--)
+  {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+
+/**
+  * @brief Чтение файла целиком. Возвращает буфер (free()) или NULL.
+  */
+static char *file_read(const char *fname, size_t *len)
+{
+  FILE *f;
+  char *buf;
+  long  size;
+
+  f = fopen(fname, "rb");
+  if(f == NULL)
+    return NULL;
+
+  if( (fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) != 0) )
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  buf = (char *)malloc((size_t)size + 1);
+  if(buf == NULL)
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  if( fread(buf, 1, (size_t)size, f) != (size_t)size )
+  {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+
+  fclose(f);
+  *len = (size_t)size;
+  return buf;
+}
+
+
+static int cache_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  cache_buf_t *b = (cache_buf_t *)ud;
+  char        *buf;
+  size_t       size;
+
+  if(b->len + sz > b->size)
+  {
+    size = b->size ? b->size : 4096;
+    while(size < b->len + sz)
+      size *= 2;
+
+    buf = (char *)realloc(b->buf, size);
+    if(buf == NULL)
+      return 1;
+
+    b->buf = buf;
+    b->size = size;
+  }
+
+  memcpy(b->buf + b->len, p, sz);
+  b->len += sz;
+  return 0;
+}
+
+
+/**
+  * @brief Сохранение скомпилированного чанка (на вершине стека) в кэш: запись во временный файл и rename().
+  */
+static void cache_store(lua_State *L, const char *cname, const char *path, const cache_hdr_t *hdr)
+{
+  cache_buf_t b = { NULL, 0, 0 };
+  char        tmp[PATH_MAX + 32];   /* cname, '.', pid и ".tmp" */
+  FILE       *f;
+  int         err;
+
+#if LUA_VERSION_NUM >= 503
+  err = lua_dump(L, cache_writer, &b, 0);
+#else
+  err = lua_dump(L, cache_writer, &b);
+#endif
+
+  if(err != 0)
+  {
+    free(b.buf);
+    return;
+  }
+
+  if( snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", cname, (long)getpid()) >= (int)sizeof(tmp) )
+  {
+    free(b.buf);   /* Усечённое имя могло бы совпасть с чужим файлом: без кэша */
+    return;
+  }
+
+  f = fopen(tmp, "wb");
+  if(f == NULL)
+  {
+    free(b.buf);
+    return;
+  }
+
+  err = (fwrite(hdr, sizeof(*hdr), 1, f) != 1) ||
+        (fwrite(path, 1, hdr->path_len, f) != hdr->path_len) ||
+        (fwrite(b.buf, 1, b.len, f) != b.len);
+  err |= (fclose(f) != 0);
+  free(b.buf);
+
+  if( err || (rename(tmp, cname) != 0) )
+    remove(tmp);
+}
+
+
+/**
+  * @brief Аналог luaL_loadfile() с кэшем байткода в opt_cache_dir.
+  *        Ключ - путь к файлу, mtime и хэш содержимого; устаревший кэш перестраивается.
+  * @retval int Код luaL_loadfile(): LUA_OK и чанк на стеке или код ошибки и сообщение на стеке.
+  */
+static int cache_loadfile(lua_State *L, const char *fname)
+{
+  char        path[PATH_MAX];
+  char        cname[PATH_MAX];
+  char        chunkname[PATH_MAX + 1];
+  struct stat st;
+  cache_hdr_t hdr;
+  cache_hdr_t *chdr;
+  char       *src;
+  char       *cached;
+  size_t      src_len;
+  size_t      cached_len;
+  int         err;
+
+  if( opt_cache_dir == NULL )
+    return luaL_loadfile(L, fname);
+
+  if( (realpath(fname, path) == NULL) || (stat(path, &st) != 0) )
+    return luaL_loadfile(L, fname);
+
+  src = file_read(path, &src_len);
+  if(src == NULL)
+    return luaL_loadfile(L, fname);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.lua_version = LUA_VERSION_NUM;
+  hdr.path_len    = (uint32_t)strlen(path);
+  hdr.mtime       = (int64_t)st.st_mtime;
+  hdr.size        = (uint64_t)src_len;
+  hdr.hash        = fnv1a64(src, src_len);
+
+  snprintf(cname, sizeof(cname), "%s/%016llx.luac", opt_cache_dir, (unsigned long long)fnv1a64(path, hdr.path_len));
+  snprintf(chunkname, sizeof(chunkname), "@%s", fname);
+
+  cached = file_read(cname, &cached_len);
+
+  if( cached != NULL )
+  {
+    chdr = (cache_hdr_t *)cached;
+
+    if( (cached_len > sizeof(hdr) + hdr.path_len) &&
+        (memcmp(chdr, &hdr, sizeof(hdr)) == 0) &&
+        (memcmp(cached + sizeof(hdr), path, hdr.path_len) == 0) )
+    {
+      err = luaL_loadbufferx(L, cached + sizeof(hdr) + hdr.path_len, cached_len - sizeof(hdr) - hdr.path_len, chunkname, "b");
+      free(cached);
+
+      if(err == LUA_OK)
+      {
+        free(src);
+        return LUA_OK;
+      }
+
+      lua_pop(L, 1);
+    }
+    else
+    {
+      free(cached);
+    }
+  }
+
+  err = luaL_loadbufferx(L, src, src_len, chunkname, "t");
+  free(src);
+
+  if(err == LUA_OK)
+  {
+    mkdir(opt_cache_dir, 0777);
+    cache_store(L, cname, path, &hdr);
+  }
+
+  return err;
+}
+
+
+/**
+  * @brief Поисковик require() для Lua - модулей: ищет файл по package.path и загружает его через кэш.
+  */
+static int lua_cache_searcher(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const char *tpl;
+  const char *end;
+  char        mod[PATH_MAX];
+  char        fname[PATH_MAX];
+  size_t      i;
+  size_t      n;
+  FILE       *f;
+
+  for(i = 0; (name[i] != '\0') && (i < sizeof(mod) - 1); i++)
+    mod[i] = (name[i] == '.') ? '/' : name[i];
+  mod[i] = '\0';
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  tpl = lua_tostring(L, -1);
+
+  while( (tpl != NULL) && (*tpl != '\0') )
+  {
+    end = strchr(tpl, ';');
+    if(end == NULL)
+      end = tpl + strlen(tpl);
+
+    for(n = 0; (tpl < end) && (n < sizeof(fname) - 1); tpl++)
+    {
+      if(*tpl == '?')
+      {
+        i = strlen(mod);
+        if(n + i >= sizeof(fname))
+          break;
+        memcpy(fname + n, mod, i);
+        n += i;
+      }
+      else
+      {
+        fname[n++] = *tpl;
+      }
+    }
+    fname[n] = '\0';
+    tpl = (*end == ';') ? end + 1 : end;
+
+    f = fopen(fname, "r");
+    if(f == NULL)
+      continue;
+    fclose(f);
+
+    if( cache_loadfile(L, fname) != LUA_OK )
+      return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, fname, lua_tostring(L, -1));
+
+    lua_pushstring(L, fname);
+    return 2;
+  }
+
+  lua_pushfstring(L, "\n\tno cached module '%s' in package.path", name);
+  return 1;
+}
+
+
+/**
+  * @brief Замена стандартного поисковика Lua - файлов (второй элемент package.searchers) на кэширующий.
+  */
+static void cache_install_searcher(lua_State *L)
+{
+  lua_getglobal(L, "package");
+
+#if LUA_VERSION_NUM >= 502
+  lua_getfield(L, -1, "searchers");
+#else
+  lua_getfield(L, -1, "loaders");
+#endif
+
+  if( lua_istable(L, -1) )
+  {
+    lua_pushcfunction(L, lua_cache_searcher);
+    lua_rawseti(L, -2, 2);
+  }
+
+  lua_pop(L, 2);
+}
+
+
+/**
+  * @brief Шинные примитивы для сопрограмм main() и irq(). Каждый уступает управление с транзакцией
+  *        (time_ns, CMD, ADR, DAT), которую получит Verilog; при возобновлении возвращают DAT_I, STATUS_I.
+  *        read32(ADR [, time_ns]), write32(ADR, DAT [, time_ns]), wait_ns(time_ns).
+  */
+static int lua_read32(lua_State *L)
+{
+  lua_Integer ADR = luaL_checkinteger(L, 1);
+  lua_Integer t   = luaL_optinteger(L, 2, 0);
+
+  lua_settop(L, 0);
+  lua_pushinteger(L, t);
+  lua_pushinteger(L, ACTION__READ);
+  lua_pushinteger(L, ADR);
+  lua_pushinteger(L, 0);
+  return lua_yield(L, 4);
+}
+
+
+static int lua_write32(lua_State *L)
+{
+  lua_Integer ADR = luaL_checkinteger(L, 1);
+  lua_Integer DAT = luaL_checkinteger(L, 2);
+  lua_Integer t   = luaL_optinteger(L, 3, 0);
+
+  lua_settop(L, 0);
+  lua_pushinteger(L, t);
+  lua_pushinteger(L, ACTION__WRITE);
+  lua_pushinteger(L, ADR);
+  lua_pushinteger(L, DAT);
+  return lua_yield(L, 4);
+}
+
+
+static int lua_wait_ns(lua_State *L)
+{
+  lua_Integer t = luaL_checkinteger(L, 1);
+
+  lua_settop(L, 0);
+  lua_pushinteger(L, t);
+  lua_pushinteger(L, ACTION__IDLE);
+  lua_pushinteger(L, 0);
+  lua_pushinteger(L, 0);
+  return lua_yield(L, 4);
+}
+
+
+/**
+  * @brief idle_until(T) - простой модели до момента T (нс, 64 бита). В сопрограмме уступает управление,
+  *        в exchange_M возвращает транзакцию: return idle_until(T). До T модель не вызывается, Verilog получает ACTION__IDLE.
+  */
+static int lua_idle_until(lua_State *L)
+{
+  lua_Integer T = luaL_checkinteger(L, 1);
+  int         main_thread;
+
+  lua_settop(L, 0);
+  main_thread = lua_pushthread(L);
+  lua_pop(L, 1);
+
+  lua_pushinteger(L, 0);
+  lua_pushinteger(L, ACTION__SLEEP);
+  lua_pushinteger(L, (lua_Integer)((uint64_t)T & 0xFFFFFFFFu));
+  lua_pushinteger(L, (lua_Integer)(((uint64_t)T >> 32) & 0xFFFFFFFFu));
+
+  if(main_thread)
+    return 4;
+
+  return lua_yield(L, 4);
+}
+
+
+/**
+  * @brief Показатель степени 10 единицы времени симулятора (например, -12 для 1 пс).
+  */
+static int sim_precision_get(void)
+{
+  if(sim_precision > 0)
+    sim_precision = vpi_get(vpiTimePrecision, NULL);
+
+  return sim_precision;
+}
+
+
+static uint64_t sim_pow10(int n)
+{
+  uint64_t p = 1;
+
+  while(n-- > 0)
+    p *= 10;
+
+  return p;
+}
+
+
+/**
+  * @brief Текущее время симуляции в единицах симулятора.
+  */
+static uint64_t sim_time_ticks(void)
+{
+  s_vpi_time t;
+
+  t.type = vpiSimTime;
+  vpi_get_time(NULL, &t);
+  return ((uint64_t)t.high << 32) | t.low;
+}
+
+
+/**
+  * @brief Текущее время симуляции в нс (64 бита, без переполнения 32-битного time_ns).
+  */
+static int64_t sim_time_ns(void)
+{
+  uint64_t ticks = sim_time_ticks();
+  int      prec = sim_precision_get();
+
+  if(prec >= -9)
+    return (int64_t)(ticks * sim_pow10(prec + 9));
+
+  return (int64_t)(ticks / sim_pow10(-9 - prec));
+}
+
+
+/**
+  * @brief Интервал в нс -> единицы времени симулятора (с округлением вверх).
+  */
+static uint64_t sim_ns_to_ticks(int64_t ns)
+{
+  uint64_t div;
+  int      prec = sim_precision_get();
+
+  if(prec <= -9)
+    return (uint64_t)ns * sim_pow10(-9 - prec);
+
+  div = sim_pow10(prec + 9);
+  return ((uint64_t)ns + div - 1) / div;
+}
+
+
+/**
+  * @brief sim_time_ns() из Lua. В рабочем потоке и в пуле +lua_parallel VPI недоступен - возвращается время последнего обмена.
+  */
+static int lua_sim_time_ns(lua_State *L)
+{
+  mb_lua_t *master = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+
+  if( (master->worker != NULL) || master->pooled )
+    lua_pushinteger(L, (lua_Integer)atomic_load(&master->now_ns));
+  else
+    lua_pushinteger(L, (lua_Integer)sim_time_ns());
+
+  return 1;
+}
+
+
+/**
+  * @brief lua_resume() в форме Lua 5.4 для 5.3.
+  */
+static int co_resume_raw(lua_State *co, lua_State *from, int nargs, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+  return lua_resume(co, from, nargs, nres);
+#elif LUA_VERSION_NUM < 502
+  int status = lua_resume(co, nargs);
+  *nres = lua_gettop(co);
+  return status;
+#else
+  int status = lua_resume(co, from, nargs);
+  *nres = lua_gettop(co);
+  return status;
+#endif
+}
+
+
+/**
+  * @brief Создание сопрограммы для функции из реестра. Сопрограмма закрепляется в реестре.
+  */
+static lua_State *co_create(lua_State *L, int ref_func, int *ref_co)
+{
+  lua_State *co;
+
+  co = lua_newthread(L);
+  *ref_co = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref_func);
+  lua_xmove(L, co, 1);
+  return co;
+}
+
+
+/**
+  * @brief Режим сопрограмм включается, если в скрипте есть main() и нет exchange_M. Вызывается после init_env.
+  */
+static int co_init(mb_lua_t *master)
+{
+  master->ref_co_main = LUA_NOREF;
+  master->ref_co_irq  = LUA_NOREF;
+  master->irq_mask    = 1;
+
+  if( (master->ref_main == LUA_NOREF) || (master->ref_exchange_M != LUA_NOREF) )
+    return 0;
+
+  lua_getglobal(master->L, "IRQ_MASK");
+  if( lua_type(master->L, -1) == LUA_TNUMBER )
+    master->irq_mask = (int32_t)lua_tointeger(master->L, -1);
+  lua_pop(master->L, 1);
+
+  master->co_main = co_create(master->L, master->ref_main, &master->ref_co_main);
+  return (master->co_main != NULL) ? 0 : -1;
+}
+
+
+/**
+  * @brief Страница, содержащая адрес. create == 0 - NULL для ещё не записанной страницы (читается как нули).
+  */
+static uint8_t *mem_page(mem_t *mem, uint32_t adr, int create)
+{
+  uint8_t **tbl = mem->dir[adr >> (MEM_PAGE_BITS + MEM_TBL_BITS)];
+  uint8_t **pg;
+
+  if(tbl == NULL)
+  {
+    if( ! create )
+      return NULL;
+
+    tbl = (uint8_t **)calloc(MEM_TBL_SIZE, sizeof(uint8_t *));
+    if(tbl == NULL)
+      return NULL;
+
+    mem->dir[adr >> (MEM_PAGE_BITS + MEM_TBL_BITS)] = tbl;
+  }
+
+  pg = &tbl[(adr >> MEM_PAGE_BITS) & (MEM_TBL_SIZE - 1)];
+
+  if( (*pg == NULL) && create )
+  {
+    *pg = (uint8_t *)calloc(1, MEM_PAGE_SIZE);
+    if(*pg != NULL)
+      mem->pages++;
+  }
+
+  return *pg;
+}
+
+
+/**
+  * @brief Копирование из памяти модели (адреса переходят через 0xFFFFFFFF в 0).
+  */
+static void mem_read(mem_t *mem, uint32_t adr, uint8_t *dst, size_t len)
+{
+  const uint8_t *pg;
+  size_t off;
+  size_t n;
+
+  while(len > 0)
+  {
+    off = adr & (MEM_PAGE_SIZE - 1);
+    n = MEM_PAGE_SIZE - off;
+    if(n > len)
+      n = len;
+
+    pg = mem_page(mem, adr, 0);
+    if(pg != NULL)
+      memcpy(dst, pg + off, n);
+    else
+      memset(dst, 0, n);
+
+    adr += (uint32_t)n;
+    dst += n;
+    len -= n;
+  }
+}
+
+
+/**
+  * @brief Копирование в память модели. src == NULL - заполнение байтом fill.
+  * @retval 0 - успешно, -1 - не удалось выделить страницу.
+  */
+static int mem_write(mem_t *mem, uint32_t adr, const uint8_t *src, int fill, size_t len)
+{
+  uint8_t *pg;
+  size_t off;
+  size_t n;
+
+  while(len > 0)
+  {
+    off = adr & (MEM_PAGE_SIZE - 1);
+    n = MEM_PAGE_SIZE - off;
+    if(n > len)
+      n = len;
+
+    pg = mem_page(mem, adr, 1);
+    if(pg == NULL)
+      return -1;
+
+    if(src != NULL)
+    {
+      memcpy(pg + off, src, n);
+      src += n;
+    }
+    else
+      memset(pg + off, fill, n);
+
+    adr += (uint32_t)n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+static uint32_t mem_read32(mem_t *mem, uint32_t adr)
+{
+  uint8_t b[4];
+
+  mem_read(mem, adr, b, 4);
+  return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+
+static int mem_write32(mem_t *mem, uint32_t adr, uint32_t v)
+{
+  uint8_t b[4];
+
+  b[0] = (uint8_t)v;
+  b[1] = (uint8_t)(v >> 8);
+  b[2] = (uint8_t)(v >> 16);
+  b[3] = (uint8_t)(v >> 24);
+  return mem_write(mem, adr, b, 0, 4);
+}
+
+
+static void mem_free(mem_t *mem)
+{
+  size_t i;
+  size_t j;
+
+  for(i = 0; i < MEM_DIR_SIZE; i++)
+  {
+    if(mem->dir[i] == NULL)
+      continue;
+
+    for(j = 0; j < MEM_TBL_SIZE; j++)
+      free(mem->dir[i][j]);
+
+    free(mem->dir[i]);
+    mem->dir[i] = NULL;
+  }
+
+  mem->pages = 0;
+}
+
+
+/**
+  * @brief Диапазон карты адресов, содержащий адрес, или NULL (двоичный поиск).
+  */
+static amap_entry_t *amap_find(amap_t *amap, uint32_t adr)
+{
+  size_t lo = 0;
+  size_t hi = amap->count;
+  size_t mid;
+
+  while(lo < hi)
+  {
+    mid = (lo + hi) / 2;
+
+    if(adr < amap->e[mid].lo)
+      hi = mid;
+    else if(adr > amap->e[mid].hi)
+      lo = mid + 1;
+    else
+      return &amap->e[mid];
+  }
+
+  return NULL;
+}
+
+
+/**
+  * @brief Добавление диапазона с сохранением порядка.
+  * @retval 0 - успешно, -1 - пересечение с существующим диапазоном, -2 - нехватка памяти.
+  */
+static int amap_add(amap_t *amap, const amap_entry_t *entry)
+{
+  amap_entry_t *e;
+  size_t        i;
+
+  for(i = 0; (i < amap->count) && (amap->e[i].lo < entry->lo); i++)
+    ;
+
+  if( (i > 0) && (amap->e[i - 1].hi >= entry->lo) )
+    return -1;
+
+  if( (i < amap->count) && (amap->e[i].lo <= entry->hi) )
+    return -1;
+
+  if(amap->count == amap->size)
+  {
+    e = (amap_entry_t *)realloc(amap->e, sizeof(amap_entry_t) * (amap->size ? amap->size * 2 : AMAP_INIT));
+    if(e == NULL)
+      return -2;
+
+    amap->e = e;
+    amap->size = amap->size ? amap->size * 2 : AMAP_INIT;
+  }
+
+  memmove(&amap->e[i + 1], &amap->e[i], sizeof(amap_entry_t) * (amap->count - i));
+  amap->e[i] = *entry;
+  amap->count++;
+  return 0;
+}
+
+
+static void amap_free(amap_t *amap)
+{
+  size_t i;
+
+  for(i = 0; i < amap->count; i++)
+  {
+    if(amap->e[i].fifo != NULL)
+    {
+      free(amap->e[i].fifo->buf);
+      free(amap->e[i].fifo);
+    }
+  }
+
+  free(amap->e);
+  amap->e = NULL;
+  amap->count = 0;
+  amap->size = 0;
+}
+
+
+/**
+  * @brief Обслуживание обращения exchange_S в C (AMAP__RAM, AMAP__CONST, AMAP__FIFO) без входа в Lua.
+  *        Переполнение или пустая очередь FIFO - STATUS_O = 1. Вызывается в потоке, владеющем lua_State:
+  *        карта, fifo и MEM изменяются и из Lua (+lua_threaded - рабочий поток).
+  * @retval 1 - обращение выполнено, 0 - передаётся в lua_exchange_S().
+  */
+static int amap_serve(mb_lua_t *slave, int32_t CMD_I, int32_t ADR_I, int32_t DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  amap_entry_t *e;
+  amap_fifo_t  *f;
+
+  if( (CMD_I != ACTION__READ) && (CMD_I != ACTION__WRITE) )
+    return 0;
+
+  e = amap_find(&slave->amap, (uint32_t)ADR_I);
+
+  if( (e == NULL) || (e->kind == AMAP__LUA) )
+    return 0;
+
+  *DAT_O = 0;
+  *STATUS_O = 0;
+
+  switch(e->kind)
+  {
+    case AMAP__RAM:
+      if(CMD_I == ACTION__READ)
+        *DAT_O = (int32_t)mem_read32(&slave->mem, (uint32_t)ADR_I);
+      else if(mem_write32(&slave->mem, (uint32_t)ADR_I, (uint32_t)DAT_I) != 0)
+        *STATUS_O = -1;
+      break;
+
+    case AMAP__CONST:
+      if(CMD_I == ACTION__READ)
+        *DAT_O = e->value;
+      break;
+
+    case AMAP__FIFO:
+      f = e->fifo;
+      if(CMD_I == ACTION__READ)
+      {
+        if(f->count == 0)
+          *STATUS_O = 1;
+        else
+        {
+          *DAT_O = f->buf[f->head];
+          f->head = (f->head + 1) & f->mask;
+          f->count--;
+        }
+      }
+      else
+      {
+        if(f->count >= f->depth)
+          *STATUS_O = 1;
+        else
+        {
+          f->buf[(f->head + f->count) & f->mask] = DAT_I;
+          f->count++;
+        }
+      }
+      break;
+  }
+
+  return 1;
+}
+
+
+/**
+  * @brief Добавление диапазона из Lua; ошибки - luaL_error(), ресурсы диапазона при этом освобождаются.
+  */
+static int amap_add_lua(lua_State *L, amap_t *amap, amap_entry_t *entry)
+{
+  int err = amap_add(amap, entry);
+
+  if( (err != 0) && (entry->fifo != NULL) )
+  {
+    free(entry->fifo->buf);
+    free(entry->fifo);
+  }
+
+  if( (err != 0) && (entry->ref != LUA_NOREF) )
+    luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+
+  if(err == -1)
+    return luaL_error(L, "address range 0x%08X..0x%08X overlaps an existing region", (unsigned)entry->lo, (unsigned)entry->hi);
+
+  if(err != 0)
+    return luaL_error(L, "address map: out of memory");
+
+  return 0;
+}
+
+
+/**
+  * @brief Границы диапазона [base, base + size) из аргументов base_idx, base_idx + 1.
+  */
+static void amap_range_lua(lua_State *L, int base_idx, amap_entry_t *entry)
+{
+  uint32_t    base = (uint32_t)luaL_checkinteger(L, base_idx);
+  lua_Integer size = luaL_checkinteger(L, base_idx + 1);
+
+  luaL_argcheck(L, (size > 0) && ((uint64_t)base + (uint64_t)size <= 0x100000000ull), base_idx + 1, "range outside 32-bit address space");
+
+  memset(entry, 0, sizeof(*entry));
+  entry->lo  = base;
+  entry->hi  = (uint32_t)((uint64_t)base + (uint64_t)size - 1);
+  entry->ref = LUA_NOREF;
+}
+
+
+/**
+  * @brief map_region(base, size, handler [, arg]) - объявление диапазона карты адресов (в init_env).
+  *        handler: функция Lua, "ram", "const" (arg - значение) или "fifo" (arg - глубина, по умолчанию AMAP_FIFO_DEPTH).
+  */
+static int lua_map_region(lua_State *L)
+{
+  mb_lua_t    *slave = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  amap_entry_t entry;
+  const char  *kind;
+  lua_Integer  depth;
+  uint32_t     cap;
+
+  amap_range_lua(L, 1, &entry);
+
+  if(lua_type(L, 3) == LUA_TFUNCTION)
+  {
+    entry.kind = AMAP__LUA;
+    lua_pushvalue(L, 3);
+    entry.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return amap_add_lua(L, &slave->amap, &entry);
+  }
+
+  kind = luaL_checkstring(L, 3);
+
+  if(strcmp(kind, "ram") == 0)
+    entry.kind = AMAP__RAM;
+  else if(strcmp(kind, "const") == 0)
+  {
+    entry.kind  = AMAP__CONST;
+    entry.value = (int32_t)luaL_optinteger(L, 4, 0);
+  }
+  else if(strcmp(kind, "fifo") == 0)
+  {
+    depth = luaL_optinteger(L, 4, AMAP_FIFO_DEPTH);
+    luaL_argcheck(L, (depth > 0) && (depth <= 0x1000000), 4, "fifo depth out of range");
+
+    for(cap = 1; cap < (uint32_t)depth; cap <<= 1)
+      ;
+
+    entry.kind = AMAP__FIFO;
+    entry.fifo = (amap_fifo_t *)calloc(1, sizeof(amap_fifo_t));
+    if(entry.fifo != NULL)
+      entry.fifo->buf = (int32_t *)calloc(cap, sizeof(int32_t));
+
+    if( (entry.fifo == NULL) || (entry.fifo->buf == NULL) )
+    {
+      free(entry.fifo);
+      return luaL_error(L, "address map: out of memory");
+    }
+
+    entry.fifo->mask  = cap - 1;
+    entry.fifo->depth = (uint32_t)depth;
+  }
+  else
+    return luaL_argerror(L, 3, "expected function, 'ram', 'const' or 'fifo'");
+
+  return amap_add_lua(L, &slave->amap, &entry);
+}
+
+
+/**
+  * @brief Очередь диапазона "fifo", содержащего адрес из аргумента 1.
+  */
+static amap_fifo_t *fifo_check(lua_State *L)
+{
+  mb_lua_t     *slave = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  amap_entry_t *e = amap_find(&slave->amap, (uint32_t)luaL_checkinteger(L, 1));
+
+  if( (e == NULL) || (e->kind != AMAP__FIFO) )
+    luaL_argerror(L, 1, "address is not in a 'fifo' region");
+
+  return e->fifo;
+}
+
+
+/**
+  * @brief fifo_push(adr, v) -> true | false (очередь полна).
+  */
+static int lua_fifo_push(lua_State *L)
+{
+  amap_fifo_t *f = fifo_check(L);
+  lua_Integer  v = luaL_checkinteger(L, 2);
+
+  if(f->count >= f->depth)
+  {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  f->buf[(f->head + f->count) & f->mask] = (int32_t)v;
+  f->count++;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/**
+  * @brief fifo_pop(adr) -> v | nil (очередь пуста).
+  */
+static int lua_fifo_pop(lua_State *L)
+{
+  amap_fifo_t *f = fifo_check(L);
+
+  if(f->count == 0)
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_pushinteger(L, (lua_Integer)(uint32_t)f->buf[f->head]);
+  f->head = (f->head + 1) & f->mask;
+  f->count--;
+  return 1;
+}
+
+
+static int lua_fifo_count(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer)fifo_check(L)->count);
+  return 1;
+}
+
+
+static mem_t *mem_check(lua_State *L)
+{
+  return &(*(mb_lua_t **)luaL_checkudata(L, 1, MEM_MT))->mem;
+}
+
+
+/**
+  * @brief MEM:peek8(adr), MEM:peek32(adr) -> число.
+  */
+static int lua_mem_peek8(lua_State *L)
+{
+  mem_t  *mem = mem_check(L);
+  uint8_t b;
+
+  mem_read(mem, (uint32_t)luaL_checkinteger(L, 2), &b, 1);
+  lua_pushinteger(L, b);
+  return 1;
+}
+
+
+static int lua_mem_peek32(lua_State *L)
+{
+  mem_t *mem = mem_check(L);
+
+  lua_pushinteger(L, mem_read32(mem, (uint32_t)luaL_checkinteger(L, 2)));
+  return 1;
+}
+
+
+/**
+  * @brief MEM:poke8(adr, v), MEM:poke32(adr, v).
+  */
+static int lua_mem_poke8(lua_State *L)
+{
+  mem_t  *mem = mem_check(L);
+  uint8_t b = (uint8_t)luaL_checkinteger(L, 3);
+
+  if(mem_write(mem, (uint32_t)luaL_checkinteger(L, 2), &b, 0, 1) != 0)
+    return luaL_error(L, "MEM: out of memory");
+
+  return 0;
+}
+
+
+static int lua_mem_poke32(lua_State *L)
+{
+  mem_t *mem = mem_check(L);
+
+  if(mem_write32(mem, (uint32_t)luaL_checkinteger(L, 2), (uint32_t)luaL_checkinteger(L, 3)) != 0)
+    return luaL_error(L, "MEM: out of memory");
+
+  return 0;
+}
+
+
+/**
+  * @brief MEM:read(adr, len) -> строка байтов.
+  */
+static int lua_mem_read(lua_State *L)
+{
+  mem_t      *mem = mem_check(L);
+  uint32_t    adr = (uint32_t)luaL_checkinteger(L, 2);
+  lua_Integer len = luaL_checkinteger(L, 3);
+  luaL_Buffer b;
+  size_t      n;
+
+  luaL_argcheck(L, len >= 0, 3, "negative length");
+  luaL_argcheck(L, len <= MEM_SPACE - adr, 3, "range beyond the 32-bit address space");
+
+  luaL_buffinit(L, &b);
+  while(len > 0)
+  {
+    n = ((size_t)len < LUAL_BUFFERSIZE) ? (size_t)len : LUAL_BUFFERSIZE;
+    mem_read(mem, adr, (uint8_t *)luaL_prepbuffer(&b), n);
+    luaL_addsize(&b, n);
+
+    adr += (uint32_t)n;
+    len -= (lua_Integer)n;
+  }
+
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/**
+  * @brief MEM:write(adr, str) - запись строки байтов.
+  */
+static int lua_mem_write(lua_State *L)
+{
+  mem_t      *mem = mem_check(L);
+  uint32_t    adr = (uint32_t)luaL_checkinteger(L, 2);
+  size_t      len;
+  const char *str = luaL_checklstring(L, 3, &len);
+
+  if(mem_write(mem, adr, (const uint8_t *)str, 0, len) != 0)
+    return luaL_error(L, "MEM: out of memory");
+
+  return 0;
+}
+
+
+/**
+  * @brief MEM:fill(adr, len, byte).
+  */
+static int lua_mem_fill(lua_State *L)
+{
+  mem_t      *mem = mem_check(L);
+  uint32_t    adr = (uint32_t)luaL_checkinteger(L, 2);
+  lua_Integer len = luaL_checkinteger(L, 3);
+  int         v   = (int)luaL_optinteger(L, 4, 0);
+
+  luaL_argcheck(L, len >= 0, 3, "negative length");
+  luaL_argcheck(L, len <= MEM_SPACE - adr, 3, "range beyond the 32-bit address space");
+
+  if(mem_write(mem, adr, NULL, v & 0xFF, (size_t)len) != 0)
+    return luaL_error(L, "MEM: out of memory");
+
+  return 0;
+}
+
+
+/**
+  * @brief MEM:copy(dst, src, len) - копирование внутри памяти модели (через буфер, перекрытие допустимо).
+  */
+static int lua_mem_copy(lua_State *L)
+{
+  mem_t      *mem = mem_check(L);
+  uint32_t    dst = (uint32_t)luaL_checkinteger(L, 2);
+  uint32_t    src = (uint32_t)luaL_checkinteger(L, 3);
+  lua_Integer len = luaL_checkinteger(L, 4);
+  uint8_t    *tmp;
+
+  luaL_argcheck(L, len >= 0, 4, "negative length");
+  luaL_argcheck(L, (len <= MEM_SPACE - dst) && (len <= MEM_SPACE - src), 4, "range beyond the 32-bit address space");
+
+  tmp = (uint8_t *)malloc((size_t)len + 1);
+  if(tmp == NULL)
+    return luaL_error(L, "MEM: out of memory");
+
+  mem_read(mem, src, tmp, (size_t)len);
+
+  if(mem_write(mem, dst, tmp, 0, (size_t)len) != 0)
+  {
+    free(tmp);
+    return luaL_error(L, "MEM: out of memory");
+  }
+
+  free(tmp);
+  return 0;
+}
+
+
+/**
+  * @brief MEM:map(base, size) - то же, что map_region(base, size, "ram").
+  */
+static int lua_mem_map(lua_State *L)
+{
+  mb_lua_t    *slave = *(mb_lua_t **)luaL_checkudata(L, 1, MEM_MT);
+  amap_entry_t entry;
+
+  amap_range_lua(L, 2, &entry);
+  entry.kind = AMAP__RAM;
+  return amap_add_lua(L, &slave->amap, &entry);
+}
+
+
+/**
+  * @brief MEM:pages() -> количество выделенных страниц.
+  */
+static int lua_mem_pages(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer)mem_check(L)->pages);
+  return 1;
+}
+
+
+static const luaL_Reg lua_mem_methods[] =
+{
+  { "peek8",  lua_mem_peek8  },
+  { "peek32", lua_mem_peek32 },
+  { "poke8",  lua_mem_poke8  },
+  { "poke32", lua_mem_poke32 },
+  { "read",   lua_mem_read   },
+  { "write",  lua_mem_write  },
+  { "fill",   lua_mem_fill   },
+  { "copy",   lua_mem_copy   },
+  { "map",    lua_mem_map    },
+  { "pages",  lua_mem_pages  },
+  { NULL,     NULL           }
+};
+
+
+/**
+  * @brief Глобальная MEM - userdata с указателем на экземпляр (память принадлежит mb_lua_t),
+  *        функции карты адресов map_region() и fifo_push/fifo_pop/fifo_count().
+  */
+static void mem_install(lua_State *L, mb_lua_t *master)
+{
+  const luaL_Reg *r;
+
+  lua_pushlightuserdata(L, master);
+  lua_pushcclosure(L, lua_map_region, 1);
+  lua_setglobal(L, "map_region");
+
+  lua_pushlightuserdata(L, master);
+  lua_pushcclosure(L, lua_fifo_push, 1);
+  lua_setglobal(L, "fifo_push");
+
+  lua_pushlightuserdata(L, master);
+  lua_pushcclosure(L, lua_fifo_pop, 1);
+  lua_setglobal(L, "fifo_pop");
+
+  lua_pushlightuserdata(L, master);
+  lua_pushcclosure(L, lua_fifo_count, 1);
+  lua_setglobal(L, "fifo_count");
+
+  *(mb_lua_t **)lua_newuserdata(L, sizeof(mb_lua_t *)) = master;
+
+  luaL_newmetatable(L, MEM_MT);
+  lua_newtable(L);
+  for(r = lua_mem_methods; r->name != NULL; r++)
+  {
+    lua_pushcfunction(L, r->func);
+    lua_setfield(L, -2, r->name);
+  }
+  lua_setfield(L, -2, "__index");
+  lua_setmetatable(L, -2);
+
+  lua_setglobal(L, "MEM");
+}
+
+
+#ifndef USE_LUAJIT
+
+/**
+  * @brief Ячейка класса size без выделения новой пластины (список свободных или остаток текущей), иначе NULL.
+  */
+static void *arena_take(arena_t *a, size_t size)
+{
+  size_t cls = (size - 1) / ARENA_STEP;
+  void  *p = a->free[cls];
+
+  if(p != NULL)
+  {
+    a->free[cls] = *(void **)p;
+    return p;
+  }
+
+  size = (cls + 1) * ARENA_STEP;
+  if(a->bump_left < size)
+    return NULL;
+
+  p = a->bump;
+  a->bump += size;
+  a->bump_left -= size;
+  return p;
+}
+
+
+static void *arena_get(arena_t *a, size_t size)
+{
+  struct arena_slab_s *slab;
+  void                *p;
+
+  if(size > ARENA_SMALL_MAX)
+    return malloc(size);
+
+  p = arena_take(a, size);
+  if(p != NULL)
+    return p;
+
+  slab = (struct arena_slab_s *)malloc(ARENA_SLAB);
+  if(slab == NULL)
+    return NULL;
+
+  slab->next = a->slabs;
+  a->slabs = slab;
+  a->bump = (char *)slab + ((sizeof(*slab) + ARENA_STEP - 1) / ARENA_STEP) * ARENA_STEP;
+  a->bump_left = ARENA_SLAB - (size_t)(a->bump - (char *)slab);
+  return arena_take(a, size);
+}
+
+
+static void arena_put(arena_t *a, void *p, size_t size)
+{
+  size_t cls;
+
+  if(size > ARENA_SMALL_MAX)
+  {
+    free(p);
+    return;
+  }
+
+  cls = (size - 1) / ARENA_STEP;
+  *(void **)p = a->free[cls];
+  a->free[cls] = p;
+}
+
+
+/**
+  * @brief lua_Alloc экземпляра. Рост сверх limit отклоняется (Lua сообщит "not enough memory"), уменьшение не отказывает.
+  */
+static void *arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  arena_t *a = (arena_t *)ud;
+  void    *p;
+
+  if(ptr == NULL)
+    osize = 0;   /* osize - тип создаваемого объекта */
+
+  if(nsize == 0)
+  {
+    if(ptr != NULL)
+    {
+      arena_put(a, ptr, osize);
+      a->used -= osize;
+    }
+    return NULL;
+  }
+
+  if( (nsize > osize) && (a->limit != 0) && (a->used - osize + nsize > a->limit) )
+  {
+    a->fails++;
+    return NULL;
+  }
+
+  if( (ptr != NULL) && (nsize <= osize) )
+  {
+    /* Уменьшение (Lua 5.3 считает его отказ фатальным): блок переносится, только если место уже есть */
+    if(nsize > ARENA_SMALL_MAX)
+    {
+      p = realloc(ptr, nsize);
+      if(p == NULL)
+        p = ptr;
+    }
+    else if( (osize <= ARENA_SMALL_MAX) && ((osize - 1) / ARENA_STEP == (nsize - 1) / ARENA_STEP) )
+      p = ptr;
+    else
+    {
+      p = arena_take(a, nsize);
+
+      /* Блок malloc, ставший мелким, освобождался бы в список класса мимо free(): переносится и ценой новой пластины */
+      if( (p == NULL) && (osize > ARENA_SMALL_MAX) )
+        p = arena_get(a, nsize);
+
+      if(p == NULL)
+        p = ptr;   /* Ячейка мелкого класса остаётся на месте; блок malloc - только при нехватке памяти */
+      else
+      {
+        memcpy(p, ptr, nsize);
+        arena_put(a, ptr, osize);
+      }
+    }
+  }
+  else if( (ptr != NULL) && (osize <= ARENA_SMALL_MAX) && (nsize <= ARENA_SMALL_MAX) && ((osize - 1) / ARENA_STEP == (nsize - 1) / ARENA_STEP) )
+    p = ptr;
+  else if( (ptr != NULL) && (osize > ARENA_SMALL_MAX) && (nsize > ARENA_SMALL_MAX) )
+  {
+    p = realloc(ptr, nsize);
+    if(p == NULL)
+    {
+      a->fails++;
+      return NULL;
+    }
+  }
+  else
+  {
+    p = arena_get(a, nsize);
+    if(p == NULL)
+    {
+      a->fails++;
+      return NULL;
+    }
+
+    if(ptr != NULL)
+    {
+      memcpy(p, ptr, (osize < nsize) ? osize : nsize);
+      arena_put(a, ptr, osize);
+    }
+  }
+
+  a->used = a->used - osize + nsize;
+  if(a->used > a->hwm)
+    a->hwm = a->used;
+
+  return p;
+}
+
+
+#endif
+
+
+/**
+  * @brief Освобождение пластин после lua_close().
+  */
+static void arena_free(arena_t *a)
+{
+  struct arena_slab_s *slab;
+
+  while(a->slabs != NULL)
+  {
+    slab = a->slabs;
+    a->slabs = slab->next;
+    free(slab);
+  }
+
+  memset(a, 0, sizeof(*a));
+}
+
+
+#ifndef USE_LUAJIT
+/**
+  * @brief Ошибка вне lua_pcall() (как в luaL_newstate()).
+  */
+static int lua_panic(lua_State *L)
+{
+  REPORT(MSG_ERROR, "PANIC: unprotected error in call to Lua API (%s)", lua_tostring(L, -1));
+  return 0;
+}
+
+
+#if LUA_VERSION_NUM >= 504
+/**
+  * @brief Функция предупреждений warn() (как в luaL_newstate(): "@on"/"@off", части сообщения с tocont).
+  *        Сообщение собирается целиком и уходит в общий вывод с префиксом экземпляра, как print().
+  */
+static void lua_warnf(void *ud, const char *msg, int tocont)
+{
+  mb_lua_t *master = (mb_lua_t *)ud;
+  size_t    cap = sizeof(master->warn) - sizeof(TENDSTR);   /* Место под TENDSTR остаётся всегда */
+  size_t    n;
+
+  if( (! master->warn_cont) && (! tocont) && (msg[0] == '@') )
+  {
+    if( strcmp(msg, "@on") == 0 )
+      master->warn_on = 1;
+    else if( strcmp(msg, "@off") == 0 )
+      master->warn_on = 0;
+    return;
+  }
+
+  if(! master->warn_cont)
+  {
+    n = (size_t)snprintf(master->warn, sizeof(master->warn), "%s: Lua warning: ", master->prefix);
+    master->warn_len = (n < cap) ? n : cap;
+  }
+
+  n = strlen(msg);
+  if(n > cap - master->warn_len)
+    n = cap - master->warn_len;   /* Длинное сообщение усекается */
+
+  memcpy(master->warn + master->warn_len, msg, n);
+  master->warn_len += n;
+
+  master->warn_cont = tocont;
+  if(tocont)
+    return;
+
+  memcpy(master->warn + master->warn_len, TENDSTR, sizeof(TENDSTR) - 1);
+  master->warn_len += sizeof(TENDSTR) - 1;
+
+  if( master->warn_on && (MSG_WARNING <= DebugLogLevel) )
+    DebugLogWrite(_FD_, master->warn, master->warn_len);
+}
+#endif
+#endif
+
+
+static uint64_t mono_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+  * @brief Монотонное время в нс (0, если замер задержек выключен).
+  */
+static uint64_t stats_now(void)
+{
+  if(opt_stats_file == NULL)
+    return 0;
+
+  return mono_ns();
+}
+
+
+static void stats_hist(stats_t *st, int phase, uint64_t ns)
+{
+  int b = 0;
+
+  st->phase_ns[phase] += ns;
+
+  while( (ns >>= 1) != 0 )
+    b++;
+
+  st->hist[phase][(b < STATS_BUCKETS) ? b : (STATS_BUCKETS - 1)]++;
+}
+
+
+/**
+  * @brief Замер памяти Lua - машины. Вызывается в потоке, владеющем Lua - машиной.
+  */
+static void stats_mem(mb_lua_t *lua)
+{
+  if(lua->L == NULL)
+    return;
+
+#ifdef USE_LUAJIT
+  lua->stats.mem = ((size_t)lua_gc(lua->L, LUA_GCCOUNT, 0) << 10) + (size_t)lua_gc(lua->L, LUA_GCCOUNTB, 0);
+
+  if(lua->stats.mem > lua->stats.mem_hwm)
+    lua->stats.mem_hwm = lua->stats.mem;
+#else
+  lua->stats.mem     = lua->arena.used;
+  lua->stats.mem_hwm = lua->arena.hwm;
+#endif
+}
+
+
+/**
+  * @brief Память Lua - машины, байт.
+  */
+static size_t lua_mem_used(mb_lua_t *lua)
+{
+#ifdef USE_LUAJIT
+  return ((size_t)lua_gc(lua->L, LUA_GCCOUNT, 0) << 10) + (size_t)lua_gc(lua->L, LUA_GCCOUNTB, 0);
+#else
+  return lua->arena.used;
+#endif
+}
+
+
+/**
+  * @brief Режим сборки мусора после init_env.
+  */
+static void gc_setup(mb_lua_t *lua)
+{
+  if(opt_gc_mode == GC__MANUAL)
+    lua_gc(lua->L, LUA_GCSTOP, 0);
+#if LUA_VERSION_NUM >= 504
+  else if(opt_gc_mode == GC__GEN)
+    lua_gc(lua->L, LUA_GCGEN, 0, 0);
+#endif
+}
+
+
+/**
+  * @brief Точка простоя: полная сборка при превышении +lua_gc_full, иначе (manual) шаги сборки в пределах +lua_gc_budget.
+  *        Вызывается в потоке, владеющем Lua - машиной.
+  */
+static void gc_idle(mb_lua_t *lua)
+{
+  uint64_t t0;
+  uint64_t t;
+
+  if( (opt_gc_mode == GC__AUTO) || (lua->L == NULL) )
+    return;
+
+  t0 = mono_ns();
+  t = t0;
+
+  if( (opt_gc_full != 0) && (lua_mem_used(lua) > opt_gc_full) )
+  {
+    lua_gc(lua->L, LUA_GCCOLLECT, 0);
+    lua->stats.gc_full++;
+    lua->gc_cycle = 0;
+    lua->gc_base = lua_mem_used(lua);
+    t = mono_ns();
+  }
+  else if( (opt_gc_mode == GC__MANUAL) && (lua->gc_cycle || (lua_mem_used(lua) >= 2 * lua->gc_base)) )
+  {
+    lua->gc_cycle = 1;   /* Как пауза Lua по умолчанию: новый цикл - после удвоения памяти */
+
+    do
+    {
+      lua->stats.gc_steps++;
+      if( lua_gc(lua->L, LUA_GCSTEP, 0) )
+      {
+        lua->gc_cycle = 0;
+        lua->gc_base = lua_mem_used(lua);
+        break;
+      }
+
+      t = mono_ns();
+    } while(t - t0 < opt_gc_budget_ns);
+
+    t = mono_ns();
+  }
+  else
+    return;
+
+  stats_hist(&lua->stats, STATS__GC, t - t0);
+  stats_mem(lua);
+}
+
+
+/**
+  * @brief Учёт одного обмена: счётчики и (с +lua_stats) фазы по меткам времени t0 - вход, t1/t2 - вызов модели, t3 - выход.
+  */
+static void stats_exchange(mb_lua_t *lua, int kind_S, int32_t CMD, int result, int width, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3)
+{
+  stats_t *st = &lua->stats;
+
+  if(kind_S)
+    st->calls_S++;
+  else
+    st->calls_M++;
+
+  if(result < 0)
+    st->errors++;
+  else if( (CMD >= 0) && (CMD < STATS_CMD) )
+  {
+    st->cmd[CMD]++;
+
+    if(CMD == ACTION__READ)
+      st->bytes_rd += (uint64_t)((width + 7) / 8);
+    else if(CMD == ACTION__WRITE)
+      st->bytes_wr += (uint64_t)((width + 7) / 8);
+  }
+
+  if(opt_stats_file != NULL)
+  {
+    stats_hist(st, STATS__MARSHAL, (t1 - t0) + (t3 - t2));
+    stats_hist(st, STATS__LUA, t2 - t1);
+  }
+}
+
+
+static void stats_json_hist(FILE *f, const char *name, const stats_t *st, int phase)
+{
+  int last = STATS_BUCKETS - 1;
+  int i;
+
+  while( (last > 0) && (st->hist[phase][last] == 0) )
+    last--;
+
+  fprintf(f, "\"%s\":{\"total_ns\":%llu,\"log2_buckets\":[", name, (unsigned long long)st->phase_ns[phase]);
+  for(i = 0; i <= last; i++)
+    fprintf(f, "%s%llu", (i != 0) ? "," : "", (unsigned long long)st->hist[phase][i]);
+  fprintf(f, "]}");
+}
+
+
+/**
+  * @brief Счётчики экземпляра одной строкой JSON (JSON Lines: по объекту на экземпляр).
+  */
+static void stats_json(FILE *f, const mb_lua_t *lua)
+{
+  const stats_t *st = &lua->stats;
+  const char    *p;
+
+  fprintf(f, "{\"instance\":\"");
+  for(p = lua->prefix; *p != '\0'; p++)
+  {
+    if( (*p == '"') || (*p == '\\') )
+      fputc('\\', f);
+    fputc(*p, f);
+  }
+
+  fprintf(f, "\",\"descriptor\":%u,\"calls_M\":%llu,\"calls_S\":%llu,\"errors\":%llu,"
+             "\"cmd\":{\"idle\":%llu,\"read\":%llu,\"write\":%llu},"
+             "\"bytes\":{\"read\":%llu,\"write\":%llu},"
+             "\"lua_mem\":%llu,\"lua_mem_hwm\":%llu,\"lua_mem_limit\":%llu,\"alloc_failures\":%llu,\"latency\":{",
+    (unsigned)lua->handle, (unsigned long long)st->calls_M, (unsigned long long)st->calls_S, (unsigned long long)st->errors,
+    (unsigned long long)st->cmd[ACTION__IDLE], (unsigned long long)st->cmd[ACTION__READ], (unsigned long long)st->cmd[ACTION__WRITE],
+    (unsigned long long)st->bytes_rd, (unsigned long long)st->bytes_wr,
+    (unsigned long long)st->mem, (unsigned long long)st->mem_hwm,
+    (unsigned long long)lua->arena.limit, (unsigned long long)lua->arena.fails);
+
+  stats_json_hist(f, "marshal", st, STATS__MARSHAL);
+  fputc(',', f);
+  stats_json_hist(f, "lua", st, STATS__LUA);
+  fputc(',', f);
+  stats_json_hist(f, "gc", st, STATS__GC);
+  fprintf(f, "},\"gc_steps\":%llu,\"gc_full\":%llu}\n", (unsigned long long)st->gc_steps, (unsigned long long)st->gc_full);
+}
+
+
+/**
+  * @brief Дописывание счётчиков экземпляра в файл +lua_stats.
+  */
+static void stats_dump(const mb_lua_t *lua)
+{
+  FILE *f;
+
+  if(opt_stats_file == NULL)
+    return;
+
+  f = fopen(opt_stats_file, "a");
+  if(f == NULL)
+  {
+    REPORT_PFX(lua->prefix, MSG_WARNING, "if(f == NULL)  cannot open '%s'", opt_stats_file);
+    return;
+  }
+
+  stats_json(f, lua);
+  fclose(f);
+}
+
+
+static void lua_stats_hist(lua_State *L, const stats_t *st, int phase, const char *name)
+{
+  int i;
+
+  lua_newtable(L);
+  for(i = 0; i < STATS_BUCKETS; i++)
+  {
+    lua_pushinteger(L, (lua_Integer)st->hist[phase][i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, name);
+}
+
+
+/**
+  * @brief stats() -> таблица счётчиков экземпляра (поля как в JSON; гистограммы - массивы marshal_hist, lua_hist).
+  */
+static int lua_stats(lua_State *L)
+{
+  mb_lua_t      *lua = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  const stats_t *st = &lua->stats;
+
+  stats_mem(lua);
+
+  lua_newtable(L);
+  lua_pushinteger(L, (lua_Integer)st->calls_M);                lua_setfield(L, -2, "calls_M");
+  lua_pushinteger(L, (lua_Integer)st->calls_S);                lua_setfield(L, -2, "calls_S");
+  lua_pushinteger(L, (lua_Integer)st->errors);                 lua_setfield(L, -2, "errors");
+  lua_pushinteger(L, (lua_Integer)st->cmd[ACTION__IDLE]);      lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, (lua_Integer)st->cmd[ACTION__READ]);      lua_setfield(L, -2, "read");
+  lua_pushinteger(L, (lua_Integer)st->cmd[ACTION__WRITE]);     lua_setfield(L, -2, "write");
+  lua_pushinteger(L, (lua_Integer)st->bytes_rd);               lua_setfield(L, -2, "bytes_read");
+  lua_pushinteger(L, (lua_Integer)st->bytes_wr);               lua_setfield(L, -2, "bytes_write");
+  lua_pushinteger(L, (lua_Integer)st->mem);                    lua_setfield(L, -2, "lua_mem");
+  lua_pushinteger(L, (lua_Integer)st->mem_hwm);                lua_setfield(L, -2, "lua_mem_hwm");
+  lua_pushinteger(L, (lua_Integer)lua->arena.limit);           lua_setfield(L, -2, "lua_mem_limit");
+  lua_pushinteger(L, (lua_Integer)lua->arena.fails);           lua_setfield(L, -2, "alloc_failures");
+  lua_pushinteger(L, (lua_Integer)st->phase_ns[STATS__MARSHAL]); lua_setfield(L, -2, "marshal_ns");
+  lua_pushinteger(L, (lua_Integer)st->phase_ns[STATS__LUA]);   lua_setfield(L, -2, "lua_ns");
+  lua_pushinteger(L, (lua_Integer)st->phase_ns[STATS__GC]);    lua_setfield(L, -2, "gc_ns");
+  lua_pushinteger(L, (lua_Integer)st->gc_steps);               lua_setfield(L, -2, "gc_steps");
+  lua_pushinteger(L, (lua_Integer)st->gc_full);                lua_setfield(L, -2, "gc_full");
+
+  lua_stats_hist(L, st, STATS__MARSHAL, "marshal_hist");
+  lua_stats_hist(L, st, STATS__LUA, "lua_hist");
+  lua_stats_hist(L, st, STATS__GC, "gc_hist");
+  return 1;
+}
+
+
+/* Иерархические имена, для которых в этом запуске уже выдан файл трассы */
+static char   **trace_names = NULL;
+static size_t   trace_names_count = 0;
+
+
+/**
+  * @brief Имя файла трассы экземпляра: DIR/<иерархическое имя>.trc, для N-го повторного $lua_init
+  *        того же модуля - DIR/<иерархическое имя>.N.trc. Порядок вызовов при записи и воспроизведении один и тот же.
+  */
+static void trace_path(char *buf, size_t size, const char *dir, const char *prefix)
+{
+  char   **names;
+  char    *p;
+  unsigned n = 0;
+  size_t   i;
+
+  for(i = 0; i < trace_names_count; i++)
+  {
+    if( strcmp(trace_names[i], prefix) == 0 )
+      n++;
+  }
+
+  names = (char **)realloc(trace_names, sizeof(char *) * (trace_names_count + 1));
+  if(names != NULL)
+  {
+    trace_names = names;
+    trace_names[trace_names_count] = strdup(prefix);
+    if(trace_names[trace_names_count] != NULL)
+      trace_names_count++;
+  }
+
+  if(n == 0)
+    snprintf(buf, size, "%s/%s.trc", dir, prefix);
+  else
+    snprintf(buf, size, "%s/%s.%u.trc", dir, prefix, n);
+
+  for(p = buf + strlen(dir) + 1; *p != '\0'; p++)
+  {
+    if( (*p == '/') || (*p == '\\') || (*p == ' ') )
+      *p = '_';
+  }
+}
+
+
+static void trace_close(trace_t *tr)
+{
+  if(tr == NULL)
+    return;
+
+  if(tr->f != NULL)
+    fclose(tr->f);
+
+  if(tr->map != NULL)
+    munmap((void *)tr->map, tr->map_len);
+
+  free(tr->iobuf);
+  free(tr->fname);
+  free(tr);
+}
+
+
+/**
+  * @brief Открытие трассы на запись (+lua_record). NULL - запись для экземпляра не ведётся.
+  */
+static trace_t *trace_open_record(const char *prefix)
+{
+  char        path[PATH_MAX];
+  trace_hdr_t hdr;
+  trace_t    *tr;
+
+  mkdir(opt_record_dir, 0777);
+  trace_path(path, sizeof(path), opt_record_dir, prefix);
+
+  tr = (trace_t *)calloc(1, sizeof(trace_t));
+  if(tr == NULL)
+    return NULL;
+
+  tr->f = fopen(path, "wb");
+  if(tr->f == NULL)
+  {
+    REPORT_PFX(prefix, MSG_WARNING, "if(tr->f == NULL)  cannot create trace '%s'", path);
+    free(tr);
+    return NULL;
+  }
+
+  tr->iobuf = (char *)malloc(TRACE_IOBUF);
+  if(tr->iobuf != NULL)
+    setvbuf(tr->f, tr->iobuf, _IOFBF, TRACE_IOBUF);
+
+  tr->delta = opt_record_delta;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  hdr.version = TRACE_VERSION;
+  hdr.flags   = tr->delta ? TRACE_F_DELTA : 0;
+  fwrite(&hdr, sizeof(hdr), 1, tr->f);
+
+  REPORT_PFX(prefix, MSG_INFO, "recording trace '%s'", path);
+  return tr;
+}
+
+
+static void trace_unpack(const trace_rec_t *rec, int32_t *w)
+{
+  w[0] = rec->kind;
+  w[1] = rec->result;
+  memcpy(&w[2], rec->v, sizeof(rec->v));
+}
+
+
+static void trace_pack(trace_rec_t *rec, const int32_t *w)
+{
+  rec->kind   = w[0];
+  rec->result = w[1];
+  memcpy(rec->v, &w[2], sizeof(rec->v));
+}
+
+
+/**
+  * @brief Запись обмена в трассу.
+  */
+static void trace_put(trace_t *tr, const trace_rec_t *rec)
+{
+  int32_t  w[TRACE_FIELDS];
+  int32_t  p[TRACE_FIELDS];
+  uint8_t  buf[TRACE_FIELDS * 5];
+  uint32_t z;
+  size_t   n = 0;
+  int      i;
+
+  if( ! tr->delta )
+  {
+    fwrite(rec, sizeof(*rec), 1, tr->f);
+    tr->count++;
+    return;
+  }
+
+  trace_unpack(rec, w);
+  trace_unpack(&tr->prev, p);
+
+  for(i = 0; i < TRACE_FIELDS; i++)
+  {
+    z = (uint32_t)w[i] - (uint32_t)p[i];
+    z = (z << 1) ^ (uint32_t)(-(int32_t)(z >> 31));
+
+    while(z >= 0x80)
+    {
+      buf[n++] = (uint8_t)(z | 0x80);
+      z >>= 7;
+    }
+    buf[n++] = (uint8_t)z;
+  }
+
+  fwrite(buf, 1, n, tr->f);
+  tr->prev = *rec;
+  tr->count++;
+}
+
+
+/**
+  * @brief Следующая запись воспроизводимой трассы.
+  * @retval 0 - успешно, -1 - конец или повреждение трассы.
+  */
+static int trace_next(trace_t *tr, trace_rec_t *rec)
+{
+  int32_t  w[TRACE_FIELDS];
+  uint32_t z;
+  int      shift;
+  int      i;
+
+  if( ! tr->delta )
+  {
+    if(tr->map_len - tr->pos < sizeof(*rec))
+      return -1;
+
+    memcpy(rec, tr->map + tr->pos, sizeof(*rec));
+    tr->pos += sizeof(*rec);
+    return 0;
+  }
+
+  trace_unpack(&tr->prev, w);
+
+  for(i = 0; i < TRACE_FIELDS; i++)
+  {
+    z = 0;
+    for(shift = 0; ; shift += 7)
+    {
+      if( (tr->pos >= tr->map_len) || (shift > 28) )
+        return -1;
+
+      z |= (uint32_t)(tr->map[tr->pos] & 0x7F) << shift;
+      if( (tr->map[tr->pos++] & 0x80) == 0 )
+        break;
+    }
+
+    w[i] = (int32_t)((uint32_t)w[i] + ((z >> 1) ^ (uint32_t)(-(int32_t)(z & 1))));
+  }
+
+  trace_pack(rec, w);
+  tr->prev = *rec;
+  return 0;
+}
+
+
+/**
+  * @brief Возврат воспроизведения в начало трассы.
+  */
+static void trace_rewind(trace_t *tr)
+{
+  tr->pos = sizeof(trace_hdr_t);
+  memset(&tr->prev, 0, sizeof(tr->prev));
+}
+
+
+/**
+  * @brief Экземпляр без Lua - машины, обслуживающий обмены из трассы (+lua_replay).
+  * @retval mb_lua_t* Экземпляр или NULL, если трассы нет или она повреждена (тогда используется Lua).
+  */
+static mb_lua_t *trace_open_replay(const char *fname, const char *prefix)
+{
+  char               path[PATH_MAX];
+  const trace_hdr_t *hdr;
+  struct stat        st;
+  mb_lua_t          *shell;
+  trace_t           *tr;
+  void              *map;
+  int                fd;
+
+  trace_path(path, sizeof(path), opt_replay_dir, prefix);
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    REPORT_PFX(prefix, MSG_WARNING, "if(fd < 0)  no trace '%s', running Lua", path);
+    return NULL;
+  }
+
+  if( (fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(trace_hdr_t)) )
+  {
+    REPORT_PFX(prefix, MSG_WARNING, "if( (fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(trace_hdr_t)) )  '%s'", path);
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+  {
+    REPORT_PFX(prefix, MSG_WARNING, "if(map == MAP_FAILED)  '%s'", path);
+    return NULL;
+  }
+
+  hdr = (const trace_hdr_t *)map;
+
+  if( (memcmp(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) || (hdr->version != TRACE_VERSION) )
+  {
+    REPORT_PFX(prefix, MSG_WARNING, "if( (memcmp(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) || (hdr->version != TRACE_VERSION) )  '%s'", path);
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+
+  shell = (mb_lua_t *)calloc(1, sizeof(mb_lua_t));
+  tr = (trace_t *)calloc(1, sizeof(trace_t));
+
+  if( (shell == NULL) || (tr == NULL) || ((tr->fname = strdup(fname)) == NULL) )
+  {
+    REPORT_PFX(prefix, MSG_ERROR, "if( (shell == NULL) || (tr == NULL) || ((tr->fname = strdup(fname)) == NULL) )");
+    munmap(map, (size_t)st.st_size);
+    free(tr);
+    free(shell);
+    return NULL;
+  }
+
+  tr->map     = (const uint8_t *)map;
+  tr->map_len = (size_t)st.st_size;
+  tr->delta   = (hdr->flags & TRACE_F_DELTA) != 0;
+  trace_rewind(tr);
+
+  snprintf(shell->prefix, sizeof(shell->prefix), "%s", prefix);
+  shell->trace          = tr;
+  shell->ref_init_env   = LUA_NOREF;
+  shell->ref_exchange_M = LUA_NOREF;
+  shell->ref_exchange_S = LUA_NOREF;
+  shell->ref_irq        = LUA_NOREF;
+  shell->ref_deinit_env = LUA_NOREF;
+  shell->ref_main       = LUA_NOREF;
+  shell->ref_play_event = LUA_NOREF;
+  shell->ref_co_main    = LUA_NOREF;
+  shell->ref_co_irq     = LUA_NOREF;
+#ifdef USE_LUAJIT
+  shell->ref_exchange_M_ffi = LUA_NOREF;
+  shell->ref_exchange_S_ffi = LUA_NOREF;
+#endif
+
+  REPORT_PFX(prefix, MSG_INFO, "replaying trace '%s' without Lua", path);
+  return shell;
+}
+
+
+/**
+  * @brief Инициализация Lua - машины.
+  * @param  fname: Ссылка на строку с именем файла Lua - программы.
+  * @retval void* Указатель на объект lua_State, приведённый к void*. В случае неудачи возвращает NULL.
+  */
+static uint64_t init_lua(mb_lua_t **master_, const char *fname, const char *prefix)
+{
+  int       err;
+  lua_Integer ret;
+  mb_lua_t *master;
+
+  master = (mb_lua_t *)calloc(1, sizeof(mb_lua_t));
+
+  if (master == NULL) {
+    REPORT(MSG_ERROR, "if (master == NULL)");
+    return -1;
+  }
+
+  snprintf(master->prefix, sizeof(master->prefix), "%s", prefix);
+
+  master->L = NULL;
+#ifdef USE_LUAJIT
+  master->L = luaL_newstate();   /* LuaJIT на x64 не поддерживает собственный lua_Alloc */
+#else
+  master->arena.limit = opt_mem_limit;
+  master->L = lua_newstate(arena_alloc, &master->arena);
+
+  if( master->L != NULL )
+  {
+    lua_atpanic(master->L, lua_panic);
+#if LUA_VERSION_NUM >= 504
+    lua_setwarnf(master->L, lua_warnf, master);
+#endif
+  }
+#endif
+
+  if( master->L == NULL )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( master->L == NULL )");
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -2;
+  }
+
+  luaL_openlibs( master->L );
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_print, 1);
+  lua_setglobal(master->L, "print");
+
+  lua_register(master->L, "read32",  lua_read32);
+  lua_register(master->L, "write32", lua_write32);
+  lua_register(master->L, "wait_ns", lua_wait_ns);
+  lua_register(master->L, "idle_until", lua_idle_until);
+
+  mem_install(master->L, master);
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_stats, 1);
+  lua_setglobal(master->L, "stats");
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_sim_time_ns, 1);
+  lua_setglobal(master->L, "sim_time_ns");
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_bridge_open, 1);
+  lua_setglobal(master->L, "bridge_open");
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_watch, 1);
+  lua_setglobal(master->L, "watch");
+
+  lua_pushlightuserdata(master->L, master);
+  lua_pushcclosure(master->L, lua_unwatch, 1);
+  lua_setglobal(master->L, "unwatch");
+
+#ifdef USE_LUAJIT
+  master->ex = (pli_exchange_t *)calloc(1, sizeof(pli_exchange_t));
+
+  if( (master->ex == NULL) ||
+      (luaL_loadbuffer(master->L, lua_ffi_prelude, sizeof(lua_ffi_prelude) - 1, "=ffi_prelude") != LUA_OK) ||
+      (lua_pushlightuserdata(master->L, master->ex), lua_pcall(master->L, 1, 0, 0) != LUA_OK) )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "ffi prelude failed  '%s'", (master->ex != NULL) ? lua_tostring(master->L, -1) : "no memory");
+    lua_close( master->L );
+    free(master->ex);
+    free(master);
+    *master_ = NULL;
+    return -11;
+  }
+#endif
+
+  if( opt_cache_dir != NULL )
+    cache_install_searcher(master->L);
+
+  err = cache_loadfile( master->L, fname );
+  if ( err != LUA_OK )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if ( err != LUA_OK )  '%s' filename = '%s'", lua_tostring(master->L, -1), fname);
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -3;
+  }
+
+  if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -4;
+  }
+
+  master->ref_init_env   = lua_ref_function(master->L, "init_env");
+  master->ref_exchange_M = lua_ref_function(master->L, "exchange_M");
+  master->ref_exchange_S = lua_ref_function(master->L, "exchange_S");
+  master->ref_irq        = lua_ref_function(master->L, "irq");
+  master->ref_deinit_env = lua_ref_function(master->L, "deinit_env");
+  master->ref_main       = lua_ref_function(master->L, "main");
+  master->ref_play_event = lua_ref_function(master->L, "play_event");
+#ifdef USE_LUAJIT
+  master->ref_exchange_M_ffi = lua_ref_function(master->L, "exchange_M_ffi");
+  master->ref_exchange_S_ffi = lua_ref_function(master->L, "exchange_S_ffi");
+
+  if( master->ref_exchange_M_ffi != LUA_NOREF )
+    master->ref_exchange_M = master->ref_exchange_M_ffi;
+
+  if( master->ref_exchange_S_ffi != LUA_NOREF )
+    master->ref_exchange_S = master->ref_exchange_S_ffi;
+#endif
+
+  if( master->ref_init_env == LUA_NOREF )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( master->ref_init_env == LUA_NOREF )  function 'init_env' not found in '%s'", fname);
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -7;
+  }
+
+  /* Функции $lua_call, $lua_capture и watch() называются не в скрипте, поэтому скрипт без точек входа - не ошибка */
+  if( (master->ref_exchange_M == LUA_NOREF) && (master->ref_exchange_S == LUA_NOREF) && (master->ref_main == LUA_NOREF) &&
+      (master->ref_play_event == LUA_NOREF) && (master->bridge == NULL) )
+  {
+    REPORT_PFX(master->prefix, MSG_INFO, "no 'exchange_M', 'exchange_S', 'main' or 'play_event' found in '%s', only $lua_call, $lua_capture and watch() handlers can be used", fname);
+  }
+  else
+  {
+    if( (master->ref_exchange_M == LUA_NOREF) && (master->ref_main == LUA_NOREF) && (master->ref_play_event == LUA_NOREF) && (master->bridge == NULL) )
+      REPORT_PFX(master->prefix, MSG_INFO, "function 'exchange_M' not found in '%s', $lua_exchange_M will fail", fname);
+
+    if( (master->ref_exchange_S == LUA_NOREF) && (master->ref_play_event == LUA_NOREF) && (master->bridge == NULL) )
+      REPORT_PFX(master->prefix, MSG_INFO, "function 'exchange_S' not found in '%s', $lua_exchange_S will fail", fname);
+  }
+
+  if( ! lua_checkstack(master->L, LUA_EXCHANGE_STACK) )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( ! lua_checkstack(master->L, LUA_EXCHANGE_STACK) )");
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -9;
+  }
+
+  lua_rawgeti(master->L, LUA_REGISTRYINDEX, master->ref_init_env);
+
+  if( lua_pcall(master->L, 0, 1, 0) != LUA_OK )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, 0, 1, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -5;
+  }
+
+  if(! lua_isinteger(master->L, -1))
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if(! lua_isinteger(master->L, -1))  '%s'", lua_tostring(master->L, -1));
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -6;
+  }
+
+  ret = lua_tointeger(master->L, -1);
+  lua_pop(master->L, 1);
+
+  if( ret < 0 )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( ret < 0 )");
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return 0;
+  }
+
+  if( co_init(master) != 0 )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( co_init(master) != 0 )");
+    lua_close( master->L );
+    mem_free(&master->mem);
+    amap_free(&master->amap);
+    bridge_close(master);
+    arena_free(&master->arena);
+    free(master);
+    *master_ = NULL;
+    return -10;
+  }
+
+  gc_setup(master);
+
+  if( (opt_worker_depth > 0) && (master->bridge == NULL) &&
+      ((master->ref_play_event != LUA_NOREF) || (master->watch != NULL)) )
+  {
+    /* Обработчики вызываются из колбэков симулятора: рабочий поток не запускается, симуляция останавливается */
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( (master->ref_play_event != LUA_NOREF) || (master->watch != NULL) )  play_event() and watch() are not available with +lua_threaded");
+    vpi_control(vpiFinish, 1);
+  }
+  else if( (opt_worker_depth > 0) && (master->bridge == NULL) && (worker_start(master, opt_worker_depth) != 0) )
+    REPORT_PFX(master->prefix, MSG_WARNING, "if( worker_start(master, opt_worker_depth) != 0 )  running on the simulator thread");
+
+  if( (opt_record_dir != NULL) && (opt_replay_dir == NULL) )
+    master->trace = trace_open_record(master->prefix);
+
+  *master_ = master;
+  return 0;
+}
+
+
+static void deinit_lua(mb_lua_t *master)
+{
+  if( master == NULL)
+  {
+    REPORT(MSG_INFO, "if( master == NULL)");
+    return;
+  }
+
+  REPORT_PFX(master->prefix, MSG_INFO, "Descriptor = 0x%08X", master->handle);
+
+  worker_stop(master);
+
+  if( master->trace != NULL )
+    REPORT_PFX(master->prefix, MSG_INFO, "trace: %llu exchanges %s", (unsigned long long)master->trace->count, (master->trace->f != NULL) ? "recorded" : "replayed");
+
+  trace_close(master->trace);
+  bridge_close(master);
+
+  if( master->ref_deinit_env != LUA_NOREF )
+  {
+    lua_rawgeti(master->L, LUA_REGISTRYINDEX, master->ref_deinit_env);
+
+    if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )
+    {
+      REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+      lua_pop(master->L, 1);
+    }
+  }
+
+  if( master->L != NULL )
+    lua_close( master->L );
+#ifdef USE_LUAJIT
+  free(master->ex);
+#endif
+  free(master->fifo.buf);
+  free(master->fifo.rd);
+  mem_free(&master->mem);
+  amap_free(&master->amap);
+  arena_free(&master->arena);
+  free(master);
+}
+
+
+/**
+  * @brief Выдача очередной транзакции из пакета.
+  */
+static void bus_fifo_issue(bus_fifo_t *fifo, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O)
+{
+  const bus_trans_t *t = &fifo->buf[fifo->head++];
+
+  *time_ns = t->time_ns;
+  *CMD_O   = t->CMD;
+  *ADR_O   = t->ADR;
+  *DAT_O   = t->DAT;
+
+  fifo->last_cmd = t->CMD;
+}
+
+
+/**
+  * @brief Запоминание данных, прочитанных последней выданной транзакцией ACTION__READ.
+  */
+static int bus_fifo_collect(bus_fifo_t *fifo, int32_t DAT_I)
+{
+  int32_t *rd;
+
+  if(fifo->last_cmd != ACTION__READ)
+    return 0;
+
+  fifo->last_cmd = ACTION__IDLE;
+
+  if(fifo->rd_count == fifo->rd_size)
+  {
+    rd = (int32_t *)realloc(fifo->rd, sizeof(int32_t) * (fifo->rd_size ? fifo->rd_size * 2 : BUS_FIFO_INIT));
+    if(rd == NULL)
+      return -1;
+
+    fifo->rd = rd;
+    fifo->rd_size = fifo->rd_size ? fifo->rd_size * 2 : BUS_FIFO_INIT;
+  }
+
+  fifo->rd[fifo->rd_count++] = DAT_I;
+  return 0;
+}
+
+
+/**
+  * @brief Загрузка пакета транзакций, возвращённого exchange_M, в FIFO.
+  *        Пакет - плоская таблица {time_ns, CMD, ADR, DAT, time_ns, CMD, ...}
+  *        или строка из записей string.pack("<i4i4i4i4", time_ns, CMD, ADR, DAT).
+  * @param  idx: Индекс пакета на стеке Lua.
+  * @retval int Возвращает 0 в случае успеха, отрицательные величины в случае неудачи.
+  */
+static int bus_fifo_load(bus_fifo_t *fifo, lua_State *L, int idx)
+{
+  size_t       count;
+  size_t       len;
+  size_t       i;
+  int          k;
+  int          isnum;
+  int32_t      v[4];
+  bus_trans_t *buf;
+  const uint8_t *p = NULL;
+
+  if(lua_type(L, idx) == LUA_TSTRING)
+  {
+    p = (const uint8_t *)lua_tolstring(L, idx, &len);
+
+    if((len % BUS_TRANS_PACKED) != 0)
+      return -1;
+
+    count = len / BUS_TRANS_PACKED;
+  }
+  else
+  {
+    len = (size_t)lua_rawlen(L, idx);
+
+    if((len % 4) != 0)
+      return -1;
+
+    count = len / 4;
+  }
+
+  if(count > fifo->size)
+  {
+    buf = (bus_trans_t *)realloc(fifo->buf, sizeof(bus_trans_t) * count);
+    if(buf == NULL)
+      return -2;
+
+    fifo->buf = buf;
+    fifo->size = count;
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    for(k = 0; k < 4; k++)
+    {
+      if(p != NULL)
+      {
+        v[k] = (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        p += 4;
+      }
+      else
+      {
+        lua_rawgeti(L, idx, (lua_Integer)(i * 4 + k + 1));
+        v[k] = (int32_t)(uint32_t)lua_tointegerx(L, -1, &isnum);
+        lua_pop(L, 1);
+
+        if(! isnum)
+          return -3;
+      }
+    }
+
+    fifo->buf[i].time_ns = v[0];
+    fifo->buf[i].CMD     = v[1];
+    fifo->buf[i].ADR     = v[2];
+    fifo->buf[i].DAT     = v[3];
+  }
+
+  fifo->head     = 0;
+  fifo->count    = count;
+  fifo->rd_count = 0;
+  fifo->last_cmd = ACTION__IDLE;
+  fifo->active   = 1;
+  return 0;
+}
+
+
+/**
+  * @brief Возобновление сопрограммы с результатом предыдущей транзакции.
+  * @retval int 1 - сопрограмма выдала транзакцию t, 0 - сопрограмма завершилась, отрицательные величины - ошибка.
+  */
+static int co_step(mb_lua_t *master, lua_State *co, int32_t DAT_I, int32_t STATUS_I, bus_trans_t *t)
+{
+  int     status;
+  int     nres = 0;
+  int     isnum;
+  int     k;
+  int32_t v[4];
+
+  lua_pushinteger(co, DAT_I);
+  lua_pushinteger(co, STATUS_I);
+
+  status = co_resume_raw(co, master->L, 2, &nres);
+
+  if(status == LUA_OK)
+  {
+    lua_settop(co, 0);
+    return 0;
+  }
+
+  if(status != LUA_YIELD)
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if(status != LUA_YIELD)  '%s'", lua_tostring(co, -1));
+    lua_settop(co, 0);
+    return -2;
+  }
+
+  if(nres != 4)
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if(nres != 4)  coroutine must yield (time_ns, CMD, ADR, DAT), use read32/write32/wait_ns");
+    lua_settop(co, 0);
+    return -3;
+  }
+
+  for(k = 0; k < 4; k++)
+  {
+    v[k] = (int32_t)(uint32_t)lua_tointegerx(co, k - 4, &isnum);
+
+    if(! isnum)
+    {
+      REPORT_PFX(master->prefix, MSG_ERROR, "if(! isnum)  yielded value %d is not an integer", k + 1);
+      lua_settop(co, 0);
+      return -3;
+    }
+  }
+
+  lua_settop(co, 0);
+
+  t->time_ns = v[0];
+  t->CMD     = v[1];
+  t->ADR     = v[2];
+  t->DAT     = v[3];
+  return 1;
+}
+
+
+/**
+  * @brief exchange_M в режиме сопрограмм. По фронту бита irq_mask в STATUS_I main() вытесняется сопрограммой irq()
+  *        до её завершения; вложенные прерывания не обслуживаются.
+  */
+static int lua_exchange_M_co(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  bus_trans_t t;
+  int32_t     DAT = *DAT_I;
+  int         ret;
+
+  if( (master->co_irq == NULL) && (master->ref_irq != LUA_NOREF) &&
+      ((*STATUS_I & master->irq_mask) != 0) && ((master->status_prev & master->irq_mask) == 0) )
+  {
+    master->co_irq = co_create(master->L, master->ref_irq, &master->ref_co_irq);
+    master->saved_DAT_I = *DAT_I;
+  }
+
+  master->status_prev = *STATUS_I;
+
+  for(;;)
+  {
+    if(master->co_irq != NULL)
+    {
+      ret = co_step(master, master->co_irq, DAT, *STATUS_I, &t);
+
+      if(ret <= 0)
+      {
+        luaL_unref(master->L, LUA_REGISTRYINDEX, master->ref_co_irq);
+        master->ref_co_irq = LUA_NOREF;
+        master->co_irq = NULL;
+
+        if(ret < 0)
+          return ret;
+
+        DAT = master->saved_DAT_I;
+        continue;
+      }
+    }
+    else
+    {
+      if(master->co_main_state != 0)
+      {
+        *time_ns = 0;
+        *CMD_O   = ACTION__IDLE;
+        *ADR_O   = 0;
+        *DAT_O   = 0;
+        return (master->co_main_state < 0) ? master->co_main_state : 0;
+      }
+
+      ret = co_step(master, master->co_main, DAT, *STATUS_I, &t);
+
+      if(ret <= 0)
+      {
+        master->co_main_state = (ret == 0) ? 1 : ret;
+        if(ret == 0)
+          REPORT_PFX(master->prefix, MSG_INFO, "main() finished");
+        continue;
+      }
+    }
+
+    *time_ns = t.time_ns;
+    *CMD_O   = t.CMD;
+    *ADR_O   = t.ADR;
+    *DAT_O   = t.DAT;
+    return 0;
+  }
+}
+
+
+/**
+  * @brief Обмен данными, приспособленный под интерфейс системной шины процессора.
+  *        Если exchange_M вернула пакет транзакций (таблицу или строку, см. bus_fifo_load()), последующие вызовы
+  *        выдают транзакции из FIFO без входа в Lua. Когда FIFO опустеет, exchange_M вызывается с третьим аргументом -
+  *        таблицей данных, прочитанных транзакциями ACTION__READ пакета (в порядке их выдачи).
+  * @param  desc:  Указатель на Lua - машину.
+  * @param  CMD_O: Возвращает код команды (ожидание, запись, чтение). Эта команда используется автоматом состояний, написанном на Verilog для отработки соответствующей временной диаграмы на шине данных.
+  * @param  ADR_O: Возвращает адрес (32 бита) для формирования на шине адреса.
+  * @param  DAT_O: Возвращает данные (32 бита) для формирования на шине данных.
+  * @param  DAT_I: Считывает данные (32 бита), принимаемые по шине данных.
+  * @param  STATUS_I: Считывает состояния сигналов сброса и прерываний (32 бита, рекомендуется в 31 бит помещать состояние сигнала сброса.)
+  * @retval int32_t Возвращает 0 в случае успеха, отрицательные величины в случае неудачи.
+  */
+static int lua_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  bus_fifo_t *fifo;
+  int         nargs = 2;
+  size_t      i;
+
+  if(master == NULL)
+  {
+    REPORT(MSG_ERROR, "if(master == NULL)");
+    return -1;
+  }
+
+  if(master->co_main != NULL)
+    return lua_exchange_M_co(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+
+  fifo = &master->fifo;
+
+  if(fifo->active)
+  {
+    if( bus_fifo_collect(fifo, *DAT_I) != 0 )
+    {
+      REPORT_PFX(master->prefix, MSG_ERROR, "if( bus_fifo_collect(fifo, *DAT_I) != 0 )");
+      fifo->active = 0;
+      return -8;
+    }
+
+    if(fifo->head < fifo->count)
+    {
+      bus_fifo_issue(fifo, time_ns, CMD_O, ADR_O, DAT_O);
+      return 0;
+    }
+  }
+
+  REPORT_PFX(master->prefix, MSG_DEBUG, "<----------------- lua_exchange_M ---------------->");
+
+  if(master->ref_exchange_M == LUA_NOREF)
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if(master->ref_exchange_M == LUA_NOREF)");
+    return -7;
+  }
+
+#ifdef USE_LUAJIT
+  if(master->ref_exchange_M_ffi != LUA_NOREF)
+  {
+    master->ex->DAT_I    = *DAT_I;
+    master->ex->STATUS_I = *STATUS_I;
+
+    lua_rawgeti(master->L, LUA_REGISTRYINDEX, master->ref_exchange_M_ffi);
+
+    if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )
+    {
+      REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, 0, 0, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+      lua_settop(master->L, 0);
+      return -2;
+    }
+
+    *time_ns = master->ex->time_ns;
+    *CMD_O   = master->ex->CMD;
+    *ADR_O   = master->ex->ADR;
+    *DAT_O   = master->ex->DAT_O;
+    return 0;
+  }
+#endif
+
+  /* Стек пуст на входе: [exchange_M, DAT_I, STATUS_I (, reads)] -> [time_ns, CMD_O, ADR_O, DAT_O] или [batch, nil, nil, nil] */
+  lua_rawgeti(master->L, LUA_REGISTRYINDEX, master->ref_exchange_M);
+
+  lua_pushinteger(master->L, *DAT_I);
+  lua_pushinteger(master->L, *STATUS_I);
+
+  if(fifo->active)
+  {
+    lua_createtable(master->L, (int)fifo->rd_count, 0);
+    for(i = 0; i < fifo->rd_count; i++)
+    {
+      lua_pushinteger(master->L, fifo->rd[i]);
+      lua_rawseti(master->L, -2, (lua_Integer)(i + 1));
+    }
+
+    fifo->active = 0;
+    nargs = 3;
+  }
+
+  if( lua_pcall(master->L, nargs, 4, 0) != LUA_OK )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, nargs, 4, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+    lua_settop(master->L, 0);
+    return -2;
+  }
+
+  if( (lua_type(master->L, -4) == LUA_TTABLE) || (lua_type(master->L, -4) == LUA_TSTRING) )
+  {
+    if( bus_fifo_load(fifo, master->L, lua_absindex(master->L, -4)) != 0 )
+    {
+      REPORT_PFX(master->prefix, MSG_ERROR, "if( bus_fifo_load(fifo, master->L, -4) != 0 )  malformed transaction batch");
+      lua_settop(master->L, 0);
+      return -9;
+    }
+
+    lua_pop(master->L, 4);
+
+    if(fifo->count == 0)
+    {
+      /* Пустой пакет: один такт ожидания, затем снова exchange_M */
+      *time_ns = 0;
+      *CMD_O   = ACTION__IDLE;
+      *ADR_O   = 0;
+      *DAT_O   = 0;
+      return 0;
+    }
+
+    bus_fifo_issue(fifo, time_ns, CMD_O, ADR_O, DAT_O);
+    return 0;
+  }
+
+#ifdef DEBUG
+  if(! lua_isinteger(master->L, -4))
+  {
+     REPORT_PFX(master->prefix, MSG_ERROR, "if(! lua_isinteger(master->L, -4))  '%s'", lua_tostring(master->L, -1));
+     lua_settop(master->L, 0);
+     return -3;
+  }
+#endif
+  *time_ns = (uint32_t)lua_tointeger(master->L, -4);
+
+#ifdef DEBUG
+  if(! lua_isinteger(master->L, -3))
+  {
+     REPORT_PFX(master->prefix, MSG_ERROR, "if(! lua_isinteger(master->L, -3))  '%s'", lua_tostring(master->L, -1));
+     lua_settop(master->L, 0);
+     return -4;
+  }
+#endif
+  *CMD_O = (uint32_t)lua_tointeger(master->L, -3);
+
+#ifdef DEBUG
+  if(! lua_isinteger(master->L, -2))
+  {
+     REPORT_PFX(master->prefix, MSG_ERROR, "if(! lua_isinteger(L, -2))  '%s'", lua_tostring(master->L, -1));
+     lua_settop(master->L, 0);
+     return -5;
+  }
+#endif
+  *ADR_O = (uint32_t)lua_tointeger(master->L, -2);
+
+#ifdef DEBUG
+  if(! lua_isinteger(master->L, -1))
+  {
+     REPORT_PFX(master->prefix, MSG_ERROR, "if(! lua_isinteger(L, -1))  '%s'", lua_tostring(master->L, -1));
+     lua_settop(master->L, 0);
+     return -6;
+  }
+#endif
+  *DAT_O = (uint32_t)lua_tointeger(master->L, -1);
+
+  lua_pop(master->L, 4);
+  return 0;
+}
+
+
+static int lua_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  amap_entry_t *e = NULL;
+
+  if(slave == NULL)
+  {
+    REPORT(MSG_ERROR, "if(slave == NULL)");
+    return -1;
+  }
+
+  REPORT_PFX(slave->prefix, MSG_DEBUG, "<----------------- lua_exchange_S ---------------->");
+
+  if( (slave->amap.count != 0) && ((*CMD_I == ACTION__READ) || (*CMD_I == ACTION__WRITE)) )
+    e = amap_find(&slave->amap, (uint32_t)*ADR_I);
+
+  if( (e != NULL) && (e->kind == AMAP__LUA) )
+  {
+    /* [handler, offset, CMD_I, DAT_I, time_ns] -> [DAT_O, STATUS_O] */
+    lua_rawgeti(slave->L, LUA_REGISTRYINDEX, e->ref);
+
+    lua_pushinteger(slave->L, (lua_Integer)((uint32_t)*ADR_I - e->lo));
+    lua_pushinteger(slave->L, *CMD_I);
+    lua_pushinteger(slave->L, *DAT_I);
+    lua_pushinteger(slave->L, *time_ns);
+  }
+  else if(slave->ref_exchange_S == LUA_NOREF)
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "if(slave->ref_exchange_S == LUA_NOREF)");
+    return -5;
+  }
+#ifdef USE_LUAJIT
+  else if(slave->ref_exchange_S_ffi != LUA_NOREF)
+  {
+    slave->ex->time_ns = *time_ns;
+    slave->ex->CMD     = *CMD_I;
+    slave->ex->ADR     = *ADR_I;
+    slave->ex->DAT_I   = *DAT_I;
+
+    lua_rawgeti(slave->L, LUA_REGISTRYINDEX, slave->ref_exchange_S_ffi);
+
+    if( lua_pcall(slave->L, 0, 0, 0) != LUA_OK )
+    {
+      REPORT_PFX(slave->prefix, MSG_ERROR, "if( lua_pcall(slave->L, 0, 0, 0) != LUA_OK )  '%s'", lua_tostring(slave->L, -1));
+      lua_settop(slave->L, 0);
+      return -2;
+    }
+
+    *DAT_O    = slave->ex->DAT_O;
+    *STATUS_O = slave->ex->STATUS_O;
+    return 0;
+  }
+#endif
+  else
+  {
+    /* Стек пуст на входе: [exchange_S, time_ns, CMD_I, ADR_I, DAT_I] -> [DAT_O, STATUS_O] */
+    lua_rawgeti(slave->L, LUA_REGISTRYINDEX, slave->ref_exchange_S);
+
+    lua_pushinteger(slave->L, *time_ns);
+    lua_pushinteger(slave->L, *CMD_I);
+    lua_pushinteger(slave->L, *ADR_I);
+    lua_pushinteger(slave->L, *DAT_I);
+  }
+
+  if( lua_pcall(slave->L, 4, 2, 0) != LUA_OK )
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "if( lua_pcall(slave->L, 4, 2, 0) != LUA_OK )  '%s'", lua_tostring(slave->L, -1));
+    lua_settop(slave->L, 0);
+    return -2;
+  }
+
+#ifdef DEBUG
+  if(! lua_isinteger(slave->L, -2))
+  {
+     REPORT_PFX(slave->prefix, MSG_ERROR, "if(! lua_isinteger(slave->L, -2))  '%s'", lua_tostring(slave->L, -1));
+     lua_settop(slave->L, 0);
+     return -3;
+  }
+#endif
+  *DAT_O = (uint32_t)lua_tointeger(slave->L, -2);
+
+#ifdef DEBUG
+  if(! lua_isinteger(slave->L, -1))
+  {
+     REPORT_PFX(slave->prefix, MSG_ERROR, "if(! lua_isinteger(master->L, -1))  '%s'", lua_tostring(slave->L, -1));
+     lua_settop(slave->L, 0);
+     return -4;
+  }
+#endif
+  *STATUS_O = (uint32_t)lua_tointeger(slave->L, -1);
+
+  lua_pop(slave->L, 2);
+  return 0;
+}
+
+
+/**
+  * @brief Число 32-битных слов s_vpi_vecval для вектора шириной width бит.
+  */
+#define VEC_WORDS(width)  (((width) > 0) ? (((width) + 31) / 32) : 1)
+
+
+/**
+  * @brief Помещение вектора на стек Lua строкой ceil(width/8) байт, младший байт первым.
+  * @param  xz: 0 - значения битов (aval), 1 - маска X/Z (bval).
+  */
+static void vec_push(lua_State *L, const s_vpi_vecval *v, int width, int xz)
+{
+  luaL_Buffer b;
+  uint32_t    word;
+  int         bytes = (width + 7) / 8;
+  int         i;
+
+  luaL_buffinit(L, &b);
+
+  for(i = 0; i < bytes; i++)
+  {
+    word = (uint32_t)(xz ? v[i / 4].bval : v[i / 4].aval);
+    luaL_addchar(&b, (char)(word >> (8 * (i % 4))));
+  }
+
+  luaL_pushresult(&b);
+}
+
+
+/**
+  * @brief Есть ли в векторе биты X/Z.
+  */
+static int vec_has_xz(const s_vpi_vecval *v, int width)
+{
+  int i;
+
+  for(i = 0; i < VEC_WORDS(width); i++)
+  {
+    if(v[i].bval != 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+  * @brief Чтение вектора из Lua: строка (младший байт первым, недостающие байты - 0) или целое (расширяется нулями).
+  * @retval int 0 в случае успеха, -1 если значение не строка и не целое.
+  */
+static int vec_from_lua(lua_State *L, int idx, s_vpi_vecval *v, int width)
+{
+  const uint8_t *p;
+  size_t         len;
+  size_t         i;
+  int            words = VEC_WORDS(width);
+  int            k;
+  lua_Integer    n;
+
+  for(k = 0; k < words; k++)
+  {
+    v[k].aval = 0;
+    v[k].bval = 0;
+  }
+
+  if( lua_type(L, idx) == LUA_TSTRING )
+  {
+    p = (const uint8_t *)lua_tolstring(L, idx, &len);
+
+    if(len > (size_t)words * 4)
+      len = (size_t)words * 4;
+
+    for(i = 0; i < len; i++)
+      v[i / 4].aval |= (PLI_INT32)((uint32_t)p[i] << (8 * (i % 4)));
+
+    return 0;
+  }
+
+  if(! lua_isinteger(L, idx))
+    return -1;
+
+  n = lua_tointeger(L, idx);
+  v[0].aval = (PLI_INT32)(uint32_t)n;
+  if(words > 1)
+    v[1].aval = (PLI_INT32)(uint32_t)((uint64_t)n >> 32);
+
+  return 0;
+}
+
+
+/**
+  * @brief exchange_M для шины данных шире 32 бит.
+  *        Lua: exchange_M(DAT_I, STATUS_I, DAT_I_XZ) -> time_ns, CMD_O, ADR_O, DAT_O, где DAT_I - строка
+  *        (см. vec_push()), DAT_I_XZ - маска X/Z той же длины или nil, DAT_O - строка или целое.
+  *        Пакетный режим, сопрограммы и рабочий поток для широкой шины не поддерживаются.
+  */
+static int lua_exchange_M_wide(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O,
+  s_vpi_vecval *DAT_O, int DAT_O_width, const s_vpi_vecval *DAT_I, int DAT_I_width, const int32_t *STATUS_I)
+{
+  if(master == NULL)
+  {
+    REPORT(MSG_ERROR, "if(master == NULL)");
+    return -1;
+  }
+
+  if( (master->ref_exchange_M == LUA_NOREF) || (master->co_main != NULL) || (master->worker != NULL) )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "wide data bus needs plain exchange_M on the simulator thread");
+    return -10;
+  }
+
+  /* Стек пуст на входе: [exchange_M, DAT_I, STATUS_I, DAT_I_XZ] -> [time_ns, CMD_O, ADR_O, DAT_O] */
+  lua_rawgeti(master->L, LUA_REGISTRYINDEX, master->ref_exchange_M);
+
+  vec_push(master->L, DAT_I, DAT_I_width, 0);
+  lua_pushinteger(master->L, *STATUS_I);
+
+  if( vec_has_xz(DAT_I, DAT_I_width) )
+    vec_push(master->L, DAT_I, DAT_I_width, 1);
+  else
+    lua_pushnil(master->L);
+
+  if( lua_pcall(master->L, 3, 4, 0) != LUA_OK )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( lua_pcall(master->L, 3, 4, 0) != LUA_OK )  '%s'", lua_tostring(master->L, -1));
+    lua_settop(master->L, 0);
+    return -2;
+  }
+
+  if( (! lua_isinteger(master->L, -4)) || (! lua_isinteger(master->L, -3)) || (! lua_isinteger(master->L, -2)) )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "exchange_M must return integer time_ns, CMD_O, ADR_O");
+    lua_settop(master->L, 0);
+    return -3;
+  }
+
+  *time_ns = (uint32_t)lua_tointeger(master->L, -4);
+  *CMD_O   = (uint32_t)lua_tointeger(master->L, -3);
+  *ADR_O   = (uint32_t)lua_tointeger(master->L, -2);
+
+  if( vec_from_lua(master->L, -1, DAT_O, DAT_O_width) != 0 )
+  {
+    REPORT_PFX(master->prefix, MSG_ERROR, "if( vec_from_lua(master->L, -1, DAT_O, DAT_O_width) != 0 )  '%s'", lua_tostring(master->L, -1));
+    lua_settop(master->L, 0);
+    return -6;
+  }
+
+  lua_pop(master->L, 4);
+  return 0;
+}
+
+
+/**
+  * @brief exchange_S для шины данных шире 32 бит.
+  *        Lua: exchange_S(time_ns, CMD_I, ADR_I, DAT_I, DAT_I_XZ) -> DAT_O, STATUS_O (см. lua_exchange_M_wide()).
+  */
+static int lua_exchange_S_wide(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I,
+  const s_vpi_vecval *DAT_I, int DAT_I_width, s_vpi_vecval *DAT_O, int DAT_O_width, int32_t *STATUS_O)
+{
+  if(slave == NULL)
+  {
     REPORT(MSG_ERROR, "if(slave == NULL)");
     return -1;
   }
 
-  lua_getglobal(slave->L, "exchange_S");
+  if( (slave->ref_exchange_S == LUA_NOREF) || (slave->worker != NULL) )
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "wide data bus needs plain exchange_S on the simulator thread");
+    return -10;
+  }
+
+  /* Стек пуст на входе: [exchange_S, time_ns, CMD_I, ADR_I, DAT_I, DAT_I_XZ] -> [DAT_O, STATUS_O] */
+  lua_rawgeti(slave->L, LUA_REGISTRYINDEX, slave->ref_exchange_S);
+
+  lua_pushinteger(slave->L, *time_ns);
+  lua_pushinteger(slave->L, *CMD_I);
+  lua_pushinteger(slave->L, *ADR_I);
+  vec_push(slave->L, DAT_I, DAT_I_width, 0);
+
+  if( vec_has_xz(DAT_I, DAT_I_width) )
+    vec_push(slave->L, DAT_I, DAT_I_width, 1);
+  else
+    lua_pushnil(slave->L);
+
+  if( lua_pcall(slave->L, 5, 2, 0) != LUA_OK )
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "if( lua_pcall(slave->L, 5, 2, 0) != LUA_OK )  '%s'", lua_tostring(slave->L, -1));
+    lua_settop(slave->L, 0);
+    return -2;
+  }
+
+  if( vec_from_lua(slave->L, -2, DAT_O, DAT_O_width) != 0 )
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "if( vec_from_lua(slave->L, -2, DAT_O, DAT_O_width) != 0 )  '%s'", lua_tostring(slave->L, -1));
+    lua_settop(slave->L, 0);
+    return -3;
+  }
+
+  if(! lua_isinteger(slave->L, -1))
+  {
+    REPORT_PFX(slave->prefix, MSG_ERROR, "if(! lua_isinteger(slave->L, -1))  '%s'", lua_tostring(slave->L, -1));
+    lua_settop(slave->L, 0);
+    return -4;
+  }
+
+  *STATUS_O = (uint32_t)lua_tointeger(slave->L, -1);
+
+  lua_pop(slave->L, 2);
+  return 0;
+}
+
+
+/**
+  * @brief Создание кольцевого буфера ёмкостью не меньше depth элементов.
+  */
+static int spsc_init(spsc_ring_t *r, size_t elem_size, size_t depth)
+{
+  size_t size = 1;
+
+  while(size < depth)
+    size <<= 1;
+
+  r->buf = (uint8_t *)malloc(elem_size * size);
+  if(r->buf == NULL)
+    return -1;
+
+  r->elem_size = elem_size;
+  r->mask = size - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return 0;
+}
+
+
+static int spsc_empty(spsc_ring_t *r)
+{
+  return atomic_load_explicit(&r->head, memory_order_acquire) == atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+static int spsc_full(spsc_ring_t *r)
+{
+  return (atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire)) > r->mask;
+}
+
+
+static int spsc_push(spsc_ring_t *r, const void *elem)
+{
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+  if( (head - atomic_load_explicit(&r->tail, memory_order_acquire)) > r->mask )
+    return -1;
+
+  memcpy(r->buf + (head & r->mask) * r->elem_size, elem, r->elem_size);
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return 0;
+}
+
+
+static int spsc_pop(spsc_ring_t *r, void *elem)
+{
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  if( atomic_load_explicit(&r->head, memory_order_acquire) == tail )
+    return -1;
+
+  memcpy(elem, r->buf + (tail & r->mask) * r->elem_size, r->elem_size);
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+
+#define WORKER_SPIN  2000   /* Холостых проверок перед засыпанием на условной переменной */
+
+
+/**
+  * @brief Пробуждение ожидающей стороны. Без ожидающих стоит одну атомарную загрузку.
+  */
+static void worker_notify(worker_t *w)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if( atomic_load(&w->waiters) > 0 )
+  {
+    pthread_mutex_lock(&w->mtx);
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mtx);
+  }
+}
+
+
+/**
+  * @brief Ожидание выполнения условия ready(): сначала активное, затем на условной переменной.
+  */
+static void worker_wait(worker_t *w, int (*ready)(worker_t *w, spsc_ring_t *r), spsc_ring_t *r)
+{
+  int i;
+
+  for(i = 0; i < WORKER_SPIN; i++)
+  {
+    if( ready(w, r) )
+      return;
+  }
+
+  pthread_mutex_lock(&w->mtx);
+  atomic_fetch_add(&w->waiters, 1);
+
+  while( ! ready(w, r) )
+    pthread_cond_wait(&w->cond, &w->mtx);
+
+  atomic_fetch_sub(&w->waiters, 1);
+  pthread_mutex_unlock(&w->mtx);
+}
+
+
+static int worker_can_pop(worker_t *w, spsc_ring_t *r)
+{
+  return (! spsc_empty(r)) || atomic_load(&w->stop);
+}
+
+
+static int worker_can_push(worker_t *w, spsc_ring_t *r)
+{
+  return (! spsc_full(r)) || atomic_load(&w->stop);
+}
+
+
+static int worker_has_work(worker_t *w, spsc_ring_t *r)
+{
+  return (! spsc_empty(&w->req)) || (w->m_ready && ! spsc_full(&w->resp_M)) || atomic_load(&w->stop);
+}
+
+
+static void worker_put(worker_t *w, spsc_ring_t *r, const worker_msg_t *msg)
+{
+  while( spsc_push(r, msg) != 0 )
+  {
+    if( atomic_load(&w->stop) )
+      return;
+    worker_wait(w, worker_can_push, r);
+  }
+
+  worker_notify(w);
+}
+
+
+static void worker_get(worker_t *w, spsc_ring_t *r, worker_msg_t *msg)
+{
+  while( spsc_pop(r, msg) != 0 )
+    worker_wait(w, worker_can_pop, r);
+
+  worker_notify(w);
+}
+
+
+/**
+  * @brief Рабочий поток. exchange_M вызывается с опережением, пока очередная транзакция не является чтением:
+  *        для записи и ожидания DAT_I не нужен, а STATUS_I берётся последний известный.
+  *        После ACTION__READ (или ошибки) поток ждёт от симулятора фактических DAT_I и STATUS_I.
+  */
+static void *worker_main(void *arg)
+{
+  mb_lua_t     *master = (mb_lua_t *)arg;
+  worker_t     *w = master->worker;
+  worker_msg_t  msg;
+  int32_t       DAT_I = 0;
+  int32_t       STATUS_I = 0;
+
+  while( ! atomic_load(&w->stop) )
+  {
+    if( spsc_pop(&w->req, &msg) == 0 )
+    {
+      worker_notify(w);
+
+      if(msg.kind == WORKER__EXCHANGE_S)
+      {
+        int32_t DAT_O = 0;
+        int32_t STATUS_O = 0;
+
+        if( (master->amap.count != 0) && amap_serve(master, msg.v[1], msg.v[2], msg.v[3], &DAT_O, &STATUS_O) )
+          msg.result = 0;
+        else
+        {
+          msg.result = lua_exchange_S(master, &msg.v[0], &msg.v[1], &msg.v[2], &msg.v[3], &DAT_O, &STATUS_O);
+          stats_mem(master);
+        }
+        msg.v[0] = DAT_O;
+        msg.v[1] = STATUS_O;
+        worker_put(w, &w->resp_S, &msg);
+      }
+      else
+      {
+        DAT_I = msg.v[0];
+        STATUS_I = msg.v[1];
+        w->m_ready = 1;
+      }
+      continue;
+    }
+
+    if( w->m_ready && ! spsc_full(&w->resp_M) )
+    {
+      STATUS_I = atomic_load_explicit(&w->status_latest, memory_order_relaxed);
+
+      msg.kind = WORKER__EXCHANGE_M;
+      msg.result = lua_exchange_M(master, &msg.v[0], &msg.v[1], &msg.v[2], &msg.v[3], &DAT_I, &STATUS_I);
+      stats_mem(master);
+      worker_put(w, &w->resp_M, &msg);
+
+      if( (msg.v[1] == ACTION__READ) || (msg.result < 0) )
+        w->m_ready = 0;
+      continue;
+    }
+
+    gc_idle(master);
+    worker_wait(w, worker_has_work, NULL);
+  }
+
+  return NULL;
+}
+
+
+/**
+  * @brief Перевод экземпляра в режим рабочего потока. Вызывается после init_env.
+  * @param  depth: На сколько транзакций exchange_M может опережать симулятор.
+  */
+static int worker_start(mb_lua_t *master, int depth)
+{
+  worker_t *w;
+
+  w = (worker_t *)calloc(1, sizeof(worker_t));
+  if(w == NULL)
+    return -1;
+
+  if( (spsc_init(&w->req, sizeof(worker_msg_t), 4) != 0) ||
+      (spsc_init(&w->resp_M, sizeof(worker_msg_t), (size_t)depth) != 0) ||
+      (spsc_init(&w->resp_S, sizeof(worker_msg_t), 4) != 0) )
+  {
+    free(w->req.buf);
+    free(w->resp_M.buf);
+    free(w->resp_S.buf);
+    free(w);
+    return -2;
+  }
+
+  atomic_init(&w->stop, 0);
+  atomic_init(&w->status_latest, 0);
+  atomic_init(&w->waiters, 0);
+  pthread_mutex_init(&w->mtx, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->m_ready = 0;
+  w->m_need_data = 1;
+
+  master->worker = w;
+
+  if( pthread_create(&w->thread, NULL, worker_main, master) != 0 )
+  {
+    master->worker = NULL;
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mtx);
+    free(w->req.buf);
+    free(w->resp_M.buf);
+    free(w->resp_S.buf);
+    free(w);
+    return -3;
+  }
+
+  return 0;
+}
+
+
+/**
+  * @brief Остановка рабочего потока. Недоставленные опережающие транзакции отбрасываются.
+  */
+static void worker_stop(mb_lua_t *master)
+{
+  worker_t *w = master->worker;
+
+  if(w == NULL)
+    return;
+
+  atomic_store(&w->stop, 1);
+  pthread_mutex_lock(&w->mtx);
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mtx);
+
+  pthread_join(w->thread, NULL);
+
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->mtx);
+  free(w->req.buf);
+  free(w->resp_M.buf);
+  free(w->resp_S.buf);
+  free(w);
+
+  master->worker = NULL;
+  lua_settop(master->L, 0);
+}
+
+
+/**
+  * @brief exchange_M через рабочий поток (сторона симулятора).
+  */
+static int worker_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  worker_t     *w = master->worker;
+  worker_msg_t  msg;
+
+  atomic_store_explicit(&w->status_latest, *STATUS_I, memory_order_relaxed);
+
+  if(w->m_need_data)
+  {
+    msg.kind = WORKER__EXCHANGE_M;
+    msg.result = 0;
+    msg.v[0] = *DAT_I;
+    msg.v[1] = *STATUS_I;
+    worker_put(w, &w->req, &msg);
+  }
+
+  worker_get(w, &w->resp_M, &msg);
+
+  *time_ns = msg.v[0];
+  *CMD_O   = msg.v[1];
+  *ADR_O   = msg.v[2];
+  *DAT_O   = msg.v[3];
+
+  w->m_need_data = (msg.v[1] == ACTION__READ) || (msg.result < 0);
+  log_arm();   /* Сообщения рабочего потока выводятся до следующего шага времени */
+  return msg.result;
+}
+
+
+/**
+  * @brief exchange_S через рабочий поток (сторона симулятора). Ответ зависит от входов, поэтому ожидается сразу.
+  */
+static int worker_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  worker_t     *w = slave->worker;
+  worker_msg_t  msg;
+
+  msg.kind = WORKER__EXCHANGE_S;
+  msg.result = 0;
+  msg.v[0] = *time_ns;
+  msg.v[1] = *CMD_I;
+  msg.v[2] = *ADR_I;
+  msg.v[3] = *DAT_I;
+  worker_put(w, &w->req, &msg);
+
+  worker_get(w, &w->resp_S, &msg);
+
+  *DAT_O    = msg.v[0];
+  *STATUS_O = msg.v[1];
+  log_arm();
+  return msg.result;
+}
+
+
+/**
+  * @brief bridge_open(name [, quantum_ns [, depth]]) - мост к внешнему эмулятору через сегмент POSIX shm name ("/cpu0").
+  *        Вызывается при загрузке скрипта (не в init_env): exchange_M/exchange_S скрипта тогда не нужны.
+  */
+static int lua_bridge_open(lua_State *L)
+{
+  mb_lua_t    *lua = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  const char  *name = luaL_checkstring(L, 1);
+  lua_Integer  quantum = luaL_optinteger(L, 2, BRIDGE_QUANTUM_NS);
+  lua_Integer  depth = luaL_optinteger(L, 3, BRIDGE_DEPTH);
+  bridge_t    *br;
+  lb_shm_t    *shm;
+  uint32_t     cap;
+  size_t       size;
+  int          fd;
+
+  luaL_argcheck(L, (name[0] == '/') && (strchr(name + 1, '/') == NULL) && (strlen(name) < NAME_MAX), 1, "expected '/name'");
+  luaL_argcheck(L, quantum > 0, 2, "quantum must be positive");
+  luaL_argcheck(L, (depth > 0) && (depth <= LB_DEPTH_MAX), 3, "depth out of range");
+
+  if(lua->bridge != NULL)
+    return luaL_error(L, "bridge '%s' is already open", lua->bridge->name);
+
+  for(cap = 1; cap < (uint32_t)depth; cap <<= 1)
+    ;
+
+  size = lb_shm_size(cap);
+
+  shm_unlink(name);   /* Сегмент от прерванного прогона */
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if(fd < 0)
+    return luaL_error(L, "bridge '%s': shm_open: %s", name, strerror(errno));
+
+  if( ftruncate(fd, (off_t)size) != 0 )
+  {
+    close(fd);
+    shm_unlink(name);
+    return luaL_error(L, "bridge '%s': ftruncate: %s", name, strerror(errno));
+  }
+
+  shm = (lb_shm_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  br = (bridge_t *)calloc(1, sizeof(bridge_t));
+
+  if( (shm == MAP_FAILED) || (br == NULL) )
+  {
+    if(shm != MAP_FAILED)
+      munmap(shm, size);
+    free(br);
+    shm_unlink(name);
+    return luaL_error(L, "bridge '%s': out of memory", name);
+  }
+
+  shm->version    = LB_VERSION;
+  shm->depth      = cap;
+  shm->quantum_ns = (int64_t)quantum;
+  atomic_thread_fence(memory_order_release);
+  memcpy(shm->magic, LB_MAGIC, sizeof(LB_MAGIC));
+
+  br->shm  = shm;
+  br->size = size;
+  snprintf(br->name, sizeof(br->name), "%s", name);
+  lua->bridge = br;
+
+  REPORT_PFX(lua->prefix, MSG_INFO, "bridge '%s': quantum %lld ns, depth %u", name, (long long)quantum, cap);
+  return 0;
+}
+
+
+static void bridge_close(mb_lua_t *lua)
+{
+  bridge_t *br = lua->bridge;
+
+  if(br == NULL)
+    return;
+
+  atomic_fetch_or(&br->shm->closed, LB_CLOSED_SIM);
+  lb_ring(&br->shm->emu);
+
+  munmap(br->shm, br->size);
+  shm_unlink(br->name);
+  free(br);
+  lua->bridge = NULL;
+}
+
+
+/**
+  * @brief Публикация времени симуляции для lb_sync() эмулятора; следующая - на границе кванта.
+  */
+static void bridge_publish(bridge_t *br, int64_t now)
+{
+  atomic_store(&br->shm->sim_ns, now);
+  br->next_pub_ns = (now / br->shm->quantum_ns + 1) * br->shm->quantum_ns;
+  lb_ring(&br->shm->emu);
+}
+
+
+static int bridge_emu_gone(bridge_t *br)
+{
+  return (atomic_load(&br->shm->closed) & LB_CLOSED_EMU) != 0;
+}
+
+
+static int bridge_ready_req(void *arg)
+{
+  bridge_t *br = (bridge_t *)arg;
+
+  return (! lb_empty(br->shm, LB__M_REQ)) || bridge_emu_gone(br);
+}
+
+
+static int bridge_ready_push(void *arg)
+{
+  bridge_t *br = (bridge_t *)arg;
+
+  return (! lb_full(br->shm, br->put_ring)) || bridge_emu_gone(br);
+}
+
+
+static int bridge_ready_rsp(void *arg)
+{
+  bridge_t *br = (bridge_t *)arg;
+
+  return (! lb_empty(br->shm, LB__S_RSP)) || bridge_emu_gone(br);
+}
+
+
+/**
+  * @brief Ожидание эмулятора; о первом долгом ожидании сообщается один раз.
+  */
+static void bridge_wait(mb_lua_t *lua, int (*ready)(void *arg))
+{
+  bridge_t *br = lua->bridge;
+
+  if( (! lb_wait(&br->shm->sim, ready, br)) && (! br->warned) )
+  {
+    REPORT_PFX(lua->prefix, MSG_WARNING, "bridge '%s': waiting for the emulator%s", br->name,
+      atomic_load(&br->shm->attached) ? "" : " to attach");
+    br->warned = 1;
+  }
+}
+
+
+/**
+  * @brief Постановка сообщения в кольцо к эмулятору с ожиданием места.
+  * @retval int 0 - в очереди, -1 - эмулятор отключился.
+  */
+static int bridge_put(mb_lua_t *lua, int ring, const lb_msg_t *msg)
+{
+  bridge_t *br = lua->bridge;
+
+  while( lb_push(br->shm, ring, msg) != 0 )
+  {
+    if( bridge_emu_gone(br) )
+      return -1;
+
+    br->put_ring = ring;
+    bridge_wait(lua, bridge_ready_push);
+  }
+
+  lb_ring(&br->shm->emu);
+  return 0;
+}
+
+
+/**
+  * @brief exchange_M экземпляра с мостом: транзакции эмулятора (LB__M_REQ) выдаются на шину в свои моменты времени,
+  *        DAT_I чтения уходит в LB__M_RSP следующим вызовом. Между запросами Verilog получает ACTION__IDLE с временем
+  *        до следующего запроса, LB_CMD_SYNC или границы кванта. Поток симулятора ждёт эмулятор, только когда
+  *        время дошло до последнего LB_CMD_SYNC, а новых запросов нет.
+  */
+static int bridge_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  bridge_t *br = master->bridge;
+  int64_t   now = atomic_load(&master->now_ns);
+  int64_t   until;
+  lb_msg_t  rsp;
+
+  atomic_store_explicit(&br->shm->status, *STATUS_I, memory_order_relaxed);
+
+  if(br->rd_pending)
+  {
+    br->rd_pending = 0;
+
+    rsp.time_ns = now;
+    rsp.CMD     = ACTION__READ;
+    rsp.ADR     = 0;
+    rsp.DAT     = *DAT_I;
+    rsp.STATUS  = *STATUS_I;
+    bridge_put(master, LB__M_RSP, &rsp);
+  }
+
+  if(now >= br->next_pub_ns)
+    bridge_publish(br, now);
+
+  *time_ns = 0;
+  *CMD_O   = ACTION__IDLE;
+  *ADR_O   = 0;
+  *DAT_O   = 0;
+
+  for(;;)
+  {
+    if( (! br->have_req) && (lb_pop(br->shm, LB__M_REQ, &br->req) == 0) )
+    {
+      if(br->req.CMD != LB_CMD_SYNC)
+        br->have_req = 1;
+      else if(br->req.time_ns > br->horizon_ns)
+        br->horizon_ns = br->req.time_ns;
+      continue;
+    }
+
+    if(br->have_req)
+      until = br->req.time_ns;
+    else if(now < br->horizon_ns)
+      until = br->horizon_ns;
+    else if( bridge_emu_gone(br) )
+      return 0;
+    else
+    {
+      bridge_publish(br, now);
+      bridge_wait(master, bridge_ready_req);
+      continue;
+    }
+
+    if(until > now)
+    {
+      if(until > br->next_pub_ns)
+        until = br->next_pub_ns;
+
+      *time_ns = ((until - now) > INT32_MAX) ? INT32_MAX : (int32_t)(until - now);
+      return 0;
+    }
+
+    br->have_req   = 0;
+    br->rd_pending = (br->req.CMD == ACTION__READ);
+
+    *CMD_O = br->req.CMD;
+    *ADR_O = br->req.ADR;
+    *DAT_O = br->req.DAT;
+    return 0;
+  }
+}
+
+
+/**
+  * @brief exchange_S экземпляра с мостом: обращение Verilog передаётся эмулятору (LB__S_REQ), ответ ждётся в LB__S_RSP.
+  * @retval int 0 - ответ получен, -1 - эмулятор отключился (STATUS_O = 1).
+  */
+static int bridge_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  bridge_t *br = slave->bridge;
+  int64_t   now = atomic_load(&slave->now_ns);
+  lb_msg_t  msg;
+
+  *DAT_O    = 0;
+  *STATUS_O = 1;
+
+  if(now >= br->next_pub_ns)
+    bridge_publish(br, now);
+
+  msg.time_ns = now;
+  msg.CMD     = *CMD_I;
+  msg.ADR     = *ADR_I;
+  msg.DAT     = *DAT_I;
+  msg.STATUS  = 0;
+
+  if( bridge_put(slave, LB__S_REQ, &msg) != 0 )
+    return -1;
+
+  while( lb_pop(br->shm, LB__S_RSP, &msg) != 0 )
+  {
+    if( bridge_emu_gone(br) )
+      return -1;
+    bridge_wait(slave, bridge_ready_rsp);
+  }
+
+  *DAT_O    = msg.DAT;
+  *STATUS_O = msg.STATUS;
+  return 0;
+}
+
+
+/**
+  * @brief Простой модели: до idle_until_ns Verilog получает ACTION__IDLE с оставшимся временем в time_ns.
+  * @retval 1 - модель простаивает и не вызывается.
+  */
+static int idle_pending(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O)
+{
+  int64_t left;
+
+  if(master->idle_until_ns == 0)
+    return 0;
+
+  left = master->idle_until_ns - atomic_load(&master->now_ns);
+
+  if(left <= 0)
+  {
+    master->idle_until_ns = 0;
+    return 0;
+  }
+
+  *time_ns = (left > INT32_MAX) ? INT32_MAX : (int32_t)left;
+  *CMD_O   = ACTION__IDLE;
+  *ADR_O   = 0;
+  return 1;
+}
+
+
+/**
+  * @brief Транзакция ACTION__SLEEP от модели: запоминание момента пробуждения и замена на ACTION__IDLE.
+  */
+static void idle_enter(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t DAT_hi)
+{
+  master->idle_until_ns = (int64_t)(((uint64_t)(uint32_t)DAT_hi << 32) | (uint32_t)*ADR_O);
+
+  if(idle_pending(master, time_ns, CMD_O, ADR_O) == 0)
+  {
+    *time_ns = 0;
+    *CMD_O   = ACTION__IDLE;
+    *ADR_O   = 0;
+  }
+}
+
+
+/**
+  * @brief Вызов модели в потоке симулятора или через рабочий поток экземпляра.
+  */
+static int run_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  int result;
+
+  if(master->bridge != NULL)
+    return bridge_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+
+  if(master->worker != NULL)
+    return worker_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+
+  result = lua_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+  stats_mem(master);
+  return result;
+}
+
+
+static int run_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  int result;
+
+  if(slave->bridge != NULL)
+  {
+    if(! slave->pooled)
+      atomic_store(&slave->now_ns, sim_time_ns());
+    return bridge_exchange_S(slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+  }
+
+  if(slave->worker != NULL)
+  {
+    atomic_store(&slave->now_ns, sim_time_ns());
+    return worker_exchange_S(slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+  }
+
+  result = lua_exchange_S(slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+  stats_mem(slave);
+  return result;
+}
+
+
+static mb_lua_t *trace_fallback(mb_lua_t *shell);
+
+
+/**
+  * @brief Расхождение с трассой: остановка симуляции или (+lua_replay_diverge=lua) переход на Lua.
+  * @retval mb_lua_t* Экземпляр с Lua - машиной, NULL - продолжать нельзя.
+  */
+static mb_lua_t *trace_diverged(mb_lua_t *shell)
+{
+  REPORT_PFX(shell->prefix, MSG_ERROR, "trace diverged at exchange %llu", (unsigned long long)shell->trace->count);
+
+  if( ! opt_replay_fallback )
+  {
+    vpi_control(vpiFinish, 1);
+    return NULL;
+  }
+
+  return trace_fallback(shell);
+}
+
+
+/**
+  * @brief Обмен exchange_M из трассы: DAT_I и STATUS_I сверяются с записанными, выходы берутся из записи.
+  */
+static int trace_replay_M(mb_lua_t **master_, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  trace_t    *tr = (*master_)->trace;
+  trace_rec_t rec;
+
+  if( (trace_next(tr, &rec) != 0) || (rec.kind != TRACE__M) || (rec.v[0] != *DAT_I) || (rec.v[1] != *STATUS_I) )
+  {
+    *master_ = trace_diverged(*master_);
+    if(*master_ == NULL)
+      return -1;
+
+    return run_exchange_M(*master_, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+  }
+
+  tr->count++;
+  *time_ns = rec.v[2];
+  *CMD_O   = rec.v[3];
+  *ADR_O   = rec.v[4];
+  *DAT_O   = rec.v[5];
+  return rec.result;
+}
+
+
+/**
+  * @brief Обмен exchange_S из трассы: CMD_I, ADR_I и DAT_I сверяются с записанными.
+  */
+static int trace_replay_S(mb_lua_t **slave_, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  trace_t    *tr = (*slave_)->trace;
+  trace_rec_t rec;
+
+  if( (trace_next(tr, &rec) != 0) || (rec.kind != TRACE__S) || (rec.v[1] != *CMD_I) || (rec.v[2] != *ADR_I) || (rec.v[3] != *DAT_I) )
+  {
+    *slave_ = trace_diverged(*slave_);
+    if(*slave_ == NULL)
+      return -1;
+
+    return run_exchange_S(*slave_, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+  }
+
+  tr->count++;
+  *DAT_O    = rec.v[4];
+  *STATUS_O = rec.v[5];
+  return rec.result;
+}
+
+
+/**
+  * @brief exchange_M экземпляра при уже известном now_ns: простой, трасса, модель. Без обращений к VPI,
+  *        кроме расхождения с трассой, поэтому выполняется и в пуле +lua_parallel.
+  */
+static int model_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  trace_rec_t rec;
+  int         result;
+
+  if(idle_pending(master, time_ns, CMD_O, ADR_O))
+  {
+    *DAT_O = 0;
+    return 0;
+  }
+
+  if( (master->trace != NULL) && (master->trace->map != NULL) )
+  {
+    result = trace_replay_M(&master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+    if(master == NULL)
+      return result;
+  }
+  else
+    result = run_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+
+  if( (master->trace != NULL) && (master->trace->f != NULL) )
+  {
+    rec.kind   = TRACE__M;
+    rec.result = result;
+    rec.v[0]   = *DAT_I;
+    rec.v[1]   = *STATUS_I;
+    rec.v[2]   = *time_ns;
+    rec.v[3]   = *CMD_O;
+    rec.v[4]   = *ADR_O;
+    rec.v[5]   = *DAT_O;
+    trace_put(master->trace, &rec);
+  }
+
+  if( (result == 0) && (*CMD_O == ACTION__SLEEP) )
+  {
+    idle_enter(master, time_ns, CMD_O, ADR_O, *DAT_O);
+    *DAT_O = 0;
+  }
+
+  return result;
+}
+
+
+/**
+  * @brief Вызов exchange_M в потоке симулятора или через рабочий поток экземпляра.
+  */
+static int call_exchange_M(mb_lua_t *master, int32_t *time_ns, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+{
+  if(master == NULL)
+    return lua_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+
+  atomic_store(&master->now_ns, sim_time_ns());
+  return model_exchange_M(master, time_ns, CMD_O, ADR_O, DAT_O, DAT_I, STATUS_I);
+}
+
+
+static int call_exchange_S(mb_lua_t *slave, const int32_t *time_ns, const int32_t *CMD_I, const int32_t *ADR_I, const int32_t *DAT_I, int32_t *DAT_O, int32_t *STATUS_O)
+{
+  trace_rec_t rec;
+  int         result;
+
+  if(slave == NULL)
+    return lua_exchange_S(slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+
+  if( (slave->trace != NULL) && (slave->trace->map != NULL) )
+  {
+    result = trace_replay_S(&slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+    if(slave == NULL)
+      return result;
+  }
+  else if( (slave->amap.count != 0) && (slave->worker == NULL) && amap_serve(slave, *CMD_I, *ADR_I, *DAT_I, DAT_O, STATUS_O) )
+    result = 0;   /* С рабочим потоком карта обслуживается в нём: fifo и MEM изменяются и из exchange_M */
+  else
+    result = run_exchange_S(slave, time_ns, CMD_I, ADR_I, DAT_I, DAT_O, STATUS_O);
+
+  if( (slave->trace != NULL) && (slave->trace->f != NULL) )
+  {
+    rec.kind   = TRACE__S;
+    rec.result = result;
+    rec.v[0]   = *time_ns;
+    rec.v[1]   = *CMD_I;
+    rec.v[2]   = *ADR_I;
+    rec.v[3]   = *DAT_I;
+    rec.v[4]   = *DAT_O;
+    rec.v[5]   = *STATUS_O;
+    trace_put(slave->trace, &rec);
+  }
+
+  return result;
+}
+
+
+#define HANDLE_INDEX_BITS  16
+#define HANDLE_INDEX_MASK  ((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_MASK    0xFFFFu
+#define HANDLE_NONE        0xFFFFFFFFu
+
+
+/**
+  * @brief Ячейка таблицы экземпляров. Дескриптор в Verilog = (gen << 16) | index, никогда не равен 0.
+  */
+struct {
+  mb_lua_t *lua;
+  uint32_t  gen;         /* Поколение ячейки, 1..0xFFFF, меняется при освобождении */
+  uint32_t  next_free;
+} typedef handle_slot_t;
+
+
+static handle_slot_t *handle_tab   = NULL;
+static uint32_t       handle_count = 0;
+static uint32_t       handle_size  = 0;
+static uint32_t       handle_free  = HANDLE_NONE;
+
+
+/**
+  * @brief Регистрация экземпляра в таблице.
+  * @retval uint32_t Дескриптор экземпляра или 0, если таблица переполнена.
+  */
+static uint32_t handle_alloc(mb_lua_t *lua)
+{
+  handle_slot_t *tab;
+  uint32_t       idx;
+  uint32_t       size;
+
+  if(handle_free != HANDLE_NONE)
+  {
+    idx = handle_free;
+    handle_free = handle_tab[idx].next_free;
+  }
+  else
+  {
+    if(handle_count > HANDLE_INDEX_MASK)
+      return 0;
+
+    if(handle_count == handle_size)
+    {
+      size = handle_size ? handle_size * 2 : 64;
+      tab = (handle_slot_t *)realloc(handle_tab, sizeof(handle_slot_t) * size);
+      if(tab == NULL)
+        return 0;
+
+      handle_tab = tab;
+      handle_size = size;
+    }
+
+    idx = handle_count++;
+    handle_tab[idx].gen = 1;
+  }
+
+  handle_tab[idx].lua = lua;
+  handle_tab[idx].next_free = HANDLE_NONE;
+  return (handle_tab[idx].gen << HANDLE_INDEX_BITS) | idx;
+}
+
+
+/**
+  * @brief Поиск экземпляра по дескриптору за O(1).
+  * @retval mb_lua_t* Экземпляр или NULL для неверного, устаревшего или неинициализированного дескриптора.
+  */
+static mb_lua_t *handle_get(uint32_t handle)
+{
+  uint32_t idx = handle & HANDLE_INDEX_MASK;
+
+  if( (idx >= handle_count) || (handle_tab[idx].gen != (handle >> HANDLE_INDEX_BITS)) )
+    return NULL;
+
+  return handle_tab[idx].lua;
+}
+
+
+/**
+  * @brief Освобождение дескриптора. Повторное освобождение и устаревшие дескрипторы возвращают NULL.
+  */
+static mb_lua_t *handle_release(uint32_t handle)
+{
+  uint32_t  idx = handle & HANDLE_INDEX_MASK;
+  mb_lua_t *lua = handle_get(handle);
+
+  if(lua == NULL)
+    return NULL;
+
+  handle_tab[idx].lua = NULL;
+  handle_tab[idx].gen = (handle_tab[idx].gen % HANDLE_GEN_MASK) + 1;
+  handle_tab[idx].next_free = handle_free;
+  handle_free = idx;
+  return lua;
+}
+
+
+/**
+  * @brief Переход воспроизводимого экземпляра на Lua: скрипт загружается, совпавшая часть трассы
+  *        прогоняется через модель (результаты отбрасываются), затем дескриптор переключается на новый экземпляр.
+  * @retval mb_lua_t* Экземпляр с Lua - машиной или NULL.
+  */
+static mb_lua_t *trace_fallback(mb_lua_t *shell)
+{
+  trace_t    *tr = shell->trace;
+  mb_lua_t   *live = NULL;
+  trace_rec_t rec;
+  uint64_t    i;
+  int32_t     v[4];
+  int         ret;
+
+  ret = init_lua(&live, tr->fname, shell->prefix);
+
+  if( (ret < 0) || (live == NULL) )
+  {
+    REPORT_PFX(shell->prefix, MSG_ERROR, "if( (ret < 0) || (live == NULL) )");
+    vpi_control(vpiFinish, 1);
+    return NULL;
+  }
+
+  REPORT_PFX(shell->prefix, MSG_WARNING, "falling back to Lua, catching up %llu exchanges", (unsigned long long)tr->count);
+
+  trace_rewind(tr);
+  for(i = 0; (i < tr->count) && (trace_next(tr, &rec) == 0); i++)
+  {
+    if(rec.kind == TRACE__M)
+      run_exchange_M(live, &v[0], &v[1], &v[2], &v[3], &rec.v[0], &rec.v[1]);
+    else
+      run_exchange_S(live, &rec.v[0], &rec.v[1], &rec.v[2], &rec.v[3], &v[0], &v[1]);
+  }
+
+  live->handle        = shell->handle;
+  live->attach        = shell->attach;
+  live->idle_until_ns = shell->idle_until_ns;
+  atomic_store(&live->now_ns, atomic_load(&shell->now_ns));
+  shell->attach = NULL;
+
+  handle_tab[shell->handle & HANDLE_INDEX_MASK].lua = live;
+  watch_arm_all(live);
+  deinit_lua(shell);
+  return live;
+}
+
+
+/**
+  * @brief Индексы аргументов $lua_init в контексте места вызова.
+  *        Дескриптор - один 32-битный аргумент; прежняя форма с парой Descriptor[63:32], Descriptor[31:0]
+  *        тоже принимается, старшая половина при этом всегда 0 (ARG_*__HANDLE_HI).
+  */
+enum
+{
+  ARG_INIT__HANDLE = 0,
+  ARG_INIT__HANDLE_HI,
+  ARG_INIT__FNAME,
+  ARG_INIT__NUM
+} typedef arg_init_t;
+
+
+/**
+  * @brief Индексы аргументов $lua_deinit в контексте места вызова.
+  */
+enum
+{
+  ARG_DEINIT__HANDLE = 0,
+  ARG_DEINIT__HANDLE_HI,
+  ARG_DEINIT__NUM
+} typedef arg_deinit_t;
+
+
+/**
+  * @brief Индексы аргументов $lua_exchange_M в контексте места вызова.
+  */
+enum
+{
+  ARG_M__HANDLE = 0,
+  ARG_M__HANDLE_HI,
+  ARG_M__TIME_NS,
+  ARG_M__CMD_O,
+  ARG_M__ADR_O,
+  ARG_M__DAT_O,
+  ARG_M__DAT_I,
+  ARG_M__STATUS_I,
+  ARG_M__RESULT,
+  ARG_M__NUM
+} typedef arg_m_t;
+
+
+/**
+  * @brief Индексы аргументов $lua_exchange_S в контексте места вызова.
+  */
+enum
+{
+  ARG_S__HANDLE = 0,
+  ARG_S__HANDLE_HI,
+  ARG_S__TIME_NS,
+  ARG_S__CMD_I,
+  ARG_S__ADR_I,
+  ARG_S__DAT_I,
+  ARG_S__DAT_O,
+  ARG_S__STATUS_O,
+  ARG_S__RESULT,
+  ARG_S__NUM
+} typedef arg_s_t;
+
+
+#define TF_CTX_ARGS_MAX  9
+
+
+/**
+  * @brief Контекст места вызова системной задачи. Создаётся один раз (compiletf) и
+  *        хранится в user data хэндла vpiSysTfCall, чтобы calltf не перебирал аргументы на каждом такте.
+  */
+struct {
+  int           args_num;
+  vpiHandle     arg[TF_CTX_ARGS_MAX];
+  PLI_INT32     size[TF_CTX_ARGS_MAX];
+  s_vpi_vecval *vec[TF_CTX_ARGS_MAX];   /* Буферы vpiVectorVal аргументов шире 32 бит, NULL для остальных */
+} typedef tf_ctx_t;
+
+
+/**
+  * @brief Разбор списка аргументов места вызова и создание контекста.
+  *        Принимается полная форма (args_num аргументов, дескриптор парой) и краткая (args_num - 1, один дескриптор);
+  *        в краткой форме arg[1] (HANDLE_HI) равен NULL, остальные индексы совпадают.
+  * @param  inst_h:   Хэндл vpiSysTfCall.
+  * @param  args_num: Количество аргументов в полной форме.
+  * @retval tf_ctx_t* Контекст места вызова. В случае неудачи возвращает NULL.
+  */
+static tf_ctx_t *tf_ctx_create(vpiHandle inst_h, int args_num)
+{
+  vpiHandle arg_iter;
+  vpiHandle arg_hdl;
+  tf_ctx_t *ctx;
+  int       n;
+  int       i;
+
+  if(inst_h == NULL)
+  {
+    REPORT(MSG_ERROR, "if(inst_h == NULL)");
+    return NULL;
+  }
+
+  arg_iter = vpi_iterate(vpiArgument, inst_h);
+
+  if(arg_iter == NULL)
+  {
+    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
+    return NULL;
+  }
+
+  ctx = (tf_ctx_t *)calloc(1, sizeof(tf_ctx_t));
+
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    vpi_free_object(arg_iter);
+    return NULL;
+  }
+
+  /* Итератор освобождается симулятором после того, как vpi_scan() вернул NULL */
+  for(n = 0; (arg_hdl = vpi_scan(arg_iter)) != NULL; n++)
+  {
+    if(n >= args_num)
+    {
+      REPORT(MSG_ERROR, "if(n >= args_num)  '%s' expects %d or %d arguments",
+        vpi_get_str(vpiName, inst_h), args_num - 1, args_num);
+      vpi_free_object(arg_hdl);
+      vpi_free_object(arg_iter);
+      free(ctx);
+      return NULL;
+    }
+
+    ctx->arg[n] = arg_hdl;
+    ctx->size[n] = vpi_get(vpiSize, arg_hdl);
+  }
+
+  if(n == args_num - 1)
+  {
+    for(i = args_num - 1; i > 1; i--)
+    {
+      ctx->arg[i]  = ctx->arg[i - 1];
+      ctx->size[i] = ctx->size[i - 1];
+    }
+
+    ctx->arg[1]  = NULL;
+    ctx->size[1] = 0;
+  }
+  else if(n != args_num)
+  {
+    REPORT(MSG_ERROR, "if(n != args_num)  '%s' expects %d or %d arguments, got %d",
+      vpi_get_str(vpiName, inst_h), args_num - 1, args_num, n);
+    free(ctx);
+    return NULL;
+  }
+
+  for(i = 0; i < args_num; i++)
+  {
+    if( (ctx->arg[i] == NULL) || (ctx->size[i] <= 32) )
+      continue;
+
+    ctx->vec[i] = (s_vpi_vecval *)calloc(VEC_WORDS(ctx->size[i]), sizeof(s_vpi_vecval));
+
+    if(ctx->vec[i] == NULL)
+    {
+      REPORT(MSG_ERROR, "if(ctx->vec[%d] == NULL)", i);
+      while(i-- > 0)
+        free(ctx->vec[i]);
+      free(ctx);
+      return NULL;
+    }
+  }
+
+  ctx->args_num = args_num;
+  return ctx;
+}
+
+
+/**
+  * @brief Получение контекста места вызова в calltf. Если симулятор не вызывал compiletf,
+  *        контекст создаётся при первом вызове.
+  */
+static tf_ctx_t *tf_ctx_get(int args_num)
+{
+  vpiHandle inst_h;
+  tf_ctx_t *ctx;
+
+  inst_h = vpi_handle(vpiSysTfCall, NULL);
+  ctx = (tf_ctx_t *)vpi_get_userdata(inst_h);
+
+  if(ctx == NULL)
+  {
+    ctx = tf_ctx_create(inst_h, args_num);
+
+    if(ctx != NULL)
+      vpi_put_userdata(inst_h, ctx);
+  }
+
+  return ctx;
+}
+
+
+/**
+  * @brief Общий compiletf системных задач. Количество аргументов полной формы передаётся через user_data.
+  */
+static PLI_INT32 compiletf_lua(PLI_BYTE8 *user_data)
+{
+  vpiHandle inst_h;
+  tf_ctx_t *ctx;
+
+  inst_h = vpi_handle(vpiSysTfCall, NULL);
+  ctx = tf_ctx_create(inst_h, (int)(intptr_t)user_data);
+
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    vpi_control(vpiFinish, 1);
+    return 0;
+  }
+
+  vpi_put_userdata(inst_h, ctx);
+  return 0;
+}
+
+
+/**
+  * @brief Запись дескриптора в аргументы места вызова (в полной форме старшая половина - 0).
+  */
+static void tf_put_handle(tf_ctx_t *ctx, uint32_t handle)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiIntVal;
+  value_s.value.integer = (PLI_INT32)handle;
+  vpi_put_value(ctx->arg[0], &value_s, NULL, vpiNoDelay);
+
+  if(ctx->arg[1] != NULL)
+  {
+    value_s.value.integer = 0;
+    vpi_put_value(ctx->arg[1], &value_s, NULL, vpiNoDelay);
+  }
+}
+
+
+/**
+  * @brief PLI - обёртка для функции init_lua(const char *fname)
+  */
+static PLI_INT32 calltf_lua_init(PLI_BYTE8 *user_data)
+{
+  const char *fname;
+  const char *prefix;
+  vpiHandle inst_h;
+  vpiHandle scope_hdl;
+  tf_ctx_t *ctx;
+  s_vpi_value value_s;
+  uint32_t handle;
+  int ret;
+  mb_lua_t *master = NULL;
+
+  ctx = tf_ctx_get(ARG_INIT__NUM);
+
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    return 0;
+  }
+
+  tf_put_handle(ctx, 0);
+
+  value_s.format = vpiStringVal;
+  vpi_get_value(ctx->arg[ARG_INIT__FNAME], &value_s);
+  fname = value_s.value.str;
+
+  if(fname == NULL)
+  {
+    REPORT(MSG_ERROR, "if(fname == NULL)");
+    return 0;
+  }
+
+  inst_h = vpi_handle(vpiSysTfCall, NULL);
+  scope_hdl = vpi_handle(vpiScope, inst_h);
+  prefix = (scope_hdl != NULL) ? vpi_get_str(vpiFullName, scope_hdl) : NULL;
+
+  if(opt_replay_dir != NULL)
+    master = trace_open_replay(fname, (prefix != NULL) ? prefix : fname);
+
+  if(master == NULL)
+  {
+    ret = init_lua(&master, fname, (prefix != NULL) ? prefix : fname);
+    if( ret < 0 )
+    {
+      REPORT(MSG_ERROR, "if( ret < 0 )");
+      return 0;
+    }
+  }
+
+  if(master == NULL)
+  {
+    REPORT(MSG_ERROR, "if(master == NULL)");
+    return 0;
+  }
+
+  handle = handle_alloc(master);
+
+  if(handle == 0)
+  {
+    REPORT(MSG_ERROR, "if(handle == 0)  instance table is full");
+    deinit_lua(master);
+    return 0;
+  }
+
+  master->handle = handle;
+  REPORT_PFX(master->prefix, MSG_INFO, "Descriptor = 0x%08X", handle);
+
+  watch_arm_all(master);
+
+  tf_put_handle(ctx, handle);
+  return 0;
+}
+
+
+/**
+  * @brief PLI - обёртка для функции void deinit_lua(mb_lua_t *master)
+  */
+static PLI_INT32 calltf_lua_deinit(PLI_BYTE8 *user_data)
+{
+  tf_ctx_t *ctx;
+  s_vpi_value value_s;
+  mb_lua_t *master;
+
+  ctx = tf_ctx_get(ARG_DEINIT__NUM);
+
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    return 0;
+  }
+
+  par_flush();   /* Обмены экземпляра, отложенные в этом шаге, выполняются до его освобождения */
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(ctx->arg[ARG_DEINIT__HANDLE], &value_s);
+  master = handle_release((uint32_t)value_s.value.integer);
+
+  if(master == NULL)
+  {
+    REPORT(MSG_ERROR, "if(master == NULL)  invalid or stale descriptor 0x%08X", (uint32_t)value_s.value.integer);
+    return 0;
+  }
+
+  attach_remove_all(master);
+  play_remove_all(master);
+  capture_remove_all(master);
+  watch_remove_all(master);
+  stats_dump(master);
+  deinit_lua(master);
+  DebugLogFlush();
+  return 0;
+}
+
+
+/**
+  * @brief Чтение аргумента как вектора в буфер места вызова (узкий аргумент - во временное слово).
+  */
+static const s_vpi_vecval *tf_get_vec(tf_ctx_t *ctx, int idx, s_vpi_vecval *narrow)
+{
+  s_vpi_value   value_s;
+  s_vpi_vecval *dst = (ctx->vec[idx] != NULL) ? ctx->vec[idx] : narrow;
+
+  value_s.format = vpiVectorVal;
+  vpi_get_value(ctx->arg[idx], &value_s);
+  memcpy(dst, value_s.value.vector, sizeof(s_vpi_vecval) * VEC_WORDS(ctx->size[idx]));
+  return dst;
+}
+
+
+static int32_t tf_get_int(tf_ctx_t *ctx, int idx)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(ctx->arg[idx], &value_s);
+  return value_s.value.integer;
+}
+
+
+/**
+  * @brief Запись результата. delay == NULL - немедленно (vpiNoDelay), иначе с инерционной задержкой.
+  */
+static void tf_put_int(tf_ctx_t *ctx, int idx, int32_t value, p_vpi_time delay)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiIntVal;
+  value_s.value.integer = value;
+  vpi_put_value(ctx->arg[idx], &value_s, delay, (delay != NULL) ? vpiInertialDelay : vpiNoDelay);
+}
+
+
+static void tf_put_vec(tf_ctx_t *ctx, int idx, s_vpi_vecval *v, p_vpi_time delay)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiVectorVal;
+  value_s.value.vector = v;
+  vpi_put_value(ctx->arg[idx], &value_s, delay, (delay != NULL) ? vpiInertialDelay : vpiNoDelay);
+}
+
+
+/**
+  * @brief Обмен exchange_M с шиной данных шире 32 бит (vpiVectorVal).
+  */
+static void tf_exchange_M_wide(tf_ctx_t *ctx, mb_lua_t *master, p_vpi_time delay)
+{
+  s_vpi_vecval        DAT_I_narrow;
+  s_vpi_vecval        DAT_O_narrow;
+  s_vpi_vecval       *DAT_O;
+  const s_vpi_vecval *DAT_I;
+  int32_t time_ns = 0;
+  int32_t CMD_O = 0;
+  int32_t ADR_O = 0;
+  int32_t STATUS_I;
+  int32_t result;
+  int     idle = 0;
+  uint64_t t0 = stats_now();
+  uint64_t t1;
+  uint64_t t2;
+
+  DAT_I = tf_get_vec(ctx, ARG_M__DAT_I, &DAT_I_narrow);
+  DAT_O = (ctx->vec[ARG_M__DAT_O] != NULL) ? ctx->vec[ARG_M__DAT_O] : &DAT_O_narrow;
+  STATUS_I = tf_get_int(ctx, ARG_M__STATUS_I);
+
+  if(master != NULL)
+    atomic_store(&master->now_ns, sim_time_ns());
+
+  t1 = stats_now();
+
+  if( (master != NULL) && idle_pending(master, &time_ns, &CMD_O, &ADR_O) )
+  {
+    idle = 1;
+    result = 0;
+  }
+  else
+  {
+    result = lua_exchange_M_wide(master, &time_ns, &CMD_O, &ADR_O,
+      DAT_O, ctx->size[ARG_M__DAT_O], DAT_I, ctx->size[ARG_M__DAT_I], &STATUS_I);
+
+    if(master != NULL)
+      stats_mem(master);
+
+    if( (result == 0) && (CMD_O == ACTION__SLEEP) )
+    {
+      idle_enter(master, &time_ns, &CMD_O, &ADR_O, (int32_t)DAT_O[0].aval);
+      idle = 1;
+    }
+  }
+
+  t2 = stats_now();
+
+  tf_put_int(ctx, ARG_M__TIME_NS, time_ns, delay);
+  tf_put_int(ctx, ARG_M__CMD_O, CMD_O, delay);
+  tf_put_int(ctx, ARG_M__ADR_O, ADR_O, delay);
+
+  if( (result == 0) && (idle == 0) )   /* Во время простоя DAT_O не изменяется */
+    tf_put_vec(ctx, ARG_M__DAT_O, DAT_O, delay);
+
+  tf_put_int(ctx, ARG_M__RESULT, result, delay);
+
+  if(master != NULL)
+    stats_exchange(master, 0, CMD_O, result, ctx->size[ARG_M__DAT_O], t0, t1, t2, stats_now());
+}
+
+
+/**
+  * @brief Обмен exchange_S с шиной данных шире 32 бит (vpiVectorVal).
+  */
+static void tf_exchange_S_wide(tf_ctx_t *ctx, mb_lua_t *slave, p_vpi_time delay)
+{
+  s_vpi_vecval        DAT_I_narrow;
+  s_vpi_vecval        DAT_O_narrow;
+  s_vpi_vecval       *DAT_O;
+  const s_vpi_vecval *DAT_I;
+  int32_t time_ns;
+  int32_t CMD_I;
+  int32_t ADR_I;
+  int32_t STATUS_O = 0;
+  int32_t result;
+  uint64_t t0 = stats_now();
+  uint64_t t1;
+  uint64_t t2;
+
+  time_ns = tf_get_int(ctx, ARG_S__TIME_NS);
+  CMD_I   = tf_get_int(ctx, ARG_S__CMD_I);
+  ADR_I   = tf_get_int(ctx, ARG_S__ADR_I);
+
+  DAT_I = tf_get_vec(ctx, ARG_S__DAT_I, &DAT_I_narrow);
+  DAT_O = (ctx->vec[ARG_S__DAT_O] != NULL) ? ctx->vec[ARG_S__DAT_O] : &DAT_O_narrow;
+
+  t1 = stats_now();
+  result = lua_exchange_S_wide(slave, &time_ns, &CMD_I, &ADR_I,
+    DAT_I, ctx->size[ARG_S__DAT_I], DAT_O, ctx->size[ARG_S__DAT_O], &STATUS_O);
+
+  if(slave != NULL)
+    stats_mem(slave);
+  t2 = stats_now();
+
+  if(result == 0)
+    tf_put_vec(ctx, ARG_S__DAT_O, DAT_O, delay);
+
+  tf_put_int(ctx, ARG_S__STATUS_O, STATUS_O, delay);
+  tf_put_int(ctx, ARG_S__RESULT, result, delay);
+
+  if(slave != NULL)
+    stats_exchange(slave, 1, CMD_I, result, ctx->size[ARG_S__DAT_I], t0, t1, t2, stats_now());
+}
+
+
+/**
+  * @brief Один обмен exchange_M по портам контекста: чтение входов, вызов модели, запись выходов.
+  */
+static void tf_exchange_M(tf_ctx_t *ctx, mb_lua_t *master, p_vpi_time delay)
+{
+  int32_t time_ns = 0;
+  int32_t CMD_O = 0;
+  int32_t ADR_O = 0;
+  int32_t DAT_O = 0;
+  int32_t DAT_I;
+  int32_t STATUS_I;
+  int32_t result;
+  uint32_t handle = (master != NULL) ? master->handle : 0;
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t t2;
+
+  if( (ctx->size[ARG_M__DAT_I] > 32) || (ctx->size[ARG_M__DAT_O] > 32) )
+  {
+    tf_exchange_M_wide(ctx, master, delay);
+    return;
+  }
+
+  t0 = stats_now();
+  DAT_I    = tf_get_int(ctx, ARG_M__DAT_I);
+  STATUS_I = tf_get_int(ctx, ARG_M__STATUS_I);
+
+  t1 = stats_now();
+  result = call_exchange_M(master, &time_ns, &CMD_O, &ADR_O, &DAT_O, &DAT_I, &STATUS_I);
+  t2 = stats_now();
+
+  tf_put_int(ctx, ARG_M__TIME_NS, time_ns, delay);
+  tf_put_int(ctx, ARG_M__CMD_O, CMD_O, delay);
+  tf_put_int(ctx, ARG_M__ADR_O, ADR_O, delay);
+  tf_put_int(ctx, ARG_M__DAT_O, DAT_O, delay);
+  tf_put_int(ctx, ARG_M__RESULT, result, delay);
+
+  master = handle_get(handle);   /* При расхождении с трассой экземпляр заменяется */
+  if(master != NULL)
+    stats_exchange(master, 0, CMD_O, result, 32, t0, t1, t2, stats_now());
+}
+
+
+/**
+  * @brief Один обмен exchange_S по портам контекста.
+  */
+static void tf_exchange_S(tf_ctx_t *ctx, mb_lua_t *slave, p_vpi_time delay)
+{
+  int32_t time_ns;
+  int32_t CMD_I;
+  int32_t ADR_I;
+  int32_t DAT_I;
+  int32_t DAT_O = 0;
+  int32_t STATUS_O = 0;
+  int32_t result;
+  uint32_t handle = (slave != NULL) ? slave->handle : 0;
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t t2;
+
+  if( (ctx->size[ARG_S__DAT_I] > 32) || (ctx->size[ARG_S__DAT_O] > 32) )
+  {
+    tf_exchange_S_wide(ctx, slave, delay);
+    return;
+  }
+
+  t0 = stats_now();
+  time_ns = tf_get_int(ctx, ARG_S__TIME_NS);
+  CMD_I   = tf_get_int(ctx, ARG_S__CMD_I);
+  ADR_I   = tf_get_int(ctx, ARG_S__ADR_I);
+  DAT_I   = tf_get_int(ctx, ARG_S__DAT_I);
+
+  t1 = stats_now();
+  result = call_exchange_S(slave, &time_ns, &CMD_I, &ADR_I, &DAT_I, &DAT_O, &STATUS_O);
+  t2 = stats_now();
+
+  tf_put_int(ctx, ARG_S__DAT_O, DAT_O, delay);
+  tf_put_int(ctx, ARG_S__STATUS_O, STATUS_O, delay);
+  tf_put_int(ctx, ARG_S__RESULT, result, delay);
+
+  slave = handle_get(handle);
+  if(slave != NULL)
+    stats_exchange(slave, 1, CMD_I, result, 32, t0, t1, t2, stats_now());
+}
+
+
+/**
+  * @brief Параллельный режим (+lua_parallel[=N]). Обмены $lua_exchange_M/$lua_exchange_S и $lua_attach одного шага времени
+  *        не выполняются сразу: входы читаются в calltf, обмен ставится в пакет, а в cbReadWriteSynch пакет раздаётся
+  *        пулу потоков. Обмены одного экземпляра образуют группу и выполняются одним потоком в порядке вызова, поэтому
+  *        каждая Lua - машина в каждый момент принадлежит одному потоку. Результаты записываются в Verilog в порядке
+  *        вызовов, как при последовательном выполнении.
+  */
+struct {
+  mb_lua_t        *lua;
+  tf_ctx_t        *ctx;
+  struct attach_s *at;       /* Обмен от $lua_attach: после записи результатов - проверка простоя */
+  p_vpi_time       delay;
+  int              kind;     /* WORKER__EXCHANGE_M или WORKER__EXCHANGE_S */
+  int              next;     /* Следующий обмен того же экземпляра в пакете, -1 - последний */
+  int32_t          in[4];    /* M: DAT_I, STATUS_I.                S: time_ns, CMD_I, ADR_I, DAT_I */
+  int32_t          out[4];   /* M: time_ns, CMD_O, ADR_O, DAT_O.   S: DAT_O, STATUS_O */
+  int32_t          result;
+  uint64_t         t0;
+  uint64_t         t1;
+  uint64_t         lua_ns;
+} typedef par_job_t;
+
+
+struct {
+  pthread_t        *thread;
+  int               threads;         /* Потоков пула (без потока симулятора) */
+  int               started;         /* 0 - не запускался, 1 - работает, -1 - запустить не удалось */
+
+  par_job_t        *job;
+  size_t            job_count;
+  size_t            job_size;
+  int              *group;           /* Первый обмен каждой группы */
+  size_t            group_count;
+  size_t            group_size;
+  uint32_t          batch;           /* Номер текущего пакета (mb_lua_t.par_batch) */
+  int               armed;           /* cbReadWriteSynch зарегистрирован */
+
+  _Atomic uint64_t  cursor;          /* (число групп << 32) | следующая группа пакета */
+  atomic_size_t     done;            /* Выполнено групп */
+  atomic_int        stop;
+  atomic_int        waiters;
+  pthread_mutex_t   mtx;
+  pthread_cond_t    cond;
+} typedef par_pool_t;
+
+
+static par_pool_t par = { .batch = 1 };
+
+
+static void attach_sleep(struct attach_s *at, mb_lua_t *lua);
+
+
+static void par_notify(void)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if( atomic_load(&par.waiters) > 0 )
+  {
+    pthread_mutex_lock(&par.mtx);
+    pthread_cond_broadcast(&par.cond);
+    pthread_mutex_unlock(&par.mtx);
+  }
+}
+
+
+static void par_wait(int (*ready)(void))
+{
+  int i;
+
+  for(i = 0; i < WORKER_SPIN; i++)
+  {
+    if( ready() )
+      return;
+  }
+
+  pthread_mutex_lock(&par.mtx);
+  atomic_fetch_add(&par.waiters, 1);
+
+  while( ! ready() )
+    pthread_cond_wait(&par.cond, &par.mtx);
+
+  atomic_fetch_sub(&par.waiters, 1);
+  pthread_mutex_unlock(&par.mtx);
+}
+
+
+static int par_has_work(void)
+{
+  uint64_t v = atomic_load_explicit(&par.cursor, memory_order_acquire);
+
+  return ((uint32_t)v < (uint32_t)(v >> 32)) || atomic_load(&par.stop);
+}
+
+
+static int par_all_done(void)
+{
+  return atomic_load_explicit(&par.done, memory_order_acquire) == (size_t)(atomic_load(&par.cursor) >> 32);
+}
+
+
+/**
+  * @brief Все обмены одного экземпляра в пакете.
+  */
+static void par_run_group(int first)
+{
+  mb_lua_t  *lua = par.job[first].lua;
+  par_job_t *job;
+  uint64_t   t;
+  int        i;
+
+  lua->pooled = 1;
+
+  for(i = first; i >= 0; i = job->next)
+  {
+    job = &par.job[i];
+    t = stats_now();
+
+    if(job->kind == WORKER__EXCHANGE_M)
+      job->result = model_exchange_M(lua, &job->out[0], &job->out[1], &job->out[2], &job->out[3], &job->in[0], &job->in[1]);
+    else
+      job->result = call_exchange_S(lua, &job->in[0], &job->in[1], &job->in[2], &job->in[3], &job->out[0], &job->out[1]);
+
+    job->lua_ns = stats_now() - t;
+  }
+
+  lua->pooled = 0;
+}
+
+
+/**
+  * @brief Выбор и выполнение групп текущего пакета, пока они есть. Номер группы забирается CAS по cursor;
+  *        число групп хранится в том же слове, поэтому устаревший cursor прошлого пакета не даст лишней группы.
+  */
+static void par_drain(void)
+{
+  uint64_t v = atomic_load_explicit(&par.cursor, memory_order_acquire);
+  uint32_t n;
+
+  while( (uint32_t)v < (n = (uint32_t)(v >> 32)) )
+  {
+    if( ! atomic_compare_exchange_weak_explicit(&par.cursor, &v, v + 1, memory_order_acq_rel, memory_order_acquire) )
+      continue;
+
+    par_run_group(par.group[(uint32_t)v]);
+
+    if( atomic_fetch_add_explicit(&par.done, 1, memory_order_acq_rel) + 1 == n )
+      par_notify();
+
+    v = atomic_load_explicit(&par.cursor, memory_order_acquire);
+  }
+}
+
+
+static void *par_main(void *arg)
+{
+  while(1)
+  {
+    par_wait(par_has_work);
+
+    if( atomic_load(&par.stop) )
+      break;
+
+    par_drain();
+  }
+
+  return NULL;
+}
+
+
+/**
+  * @brief Запуск пула при первом отложенном обмене.
+  */
+static int par_start(void)
+{
+  int i;
+
+  if(par.started != 0)
+    return (par.started > 0) ? 0 : -1;
+
+  par.started = -1;
+  par.threads = opt_par_threads - 1;
+  par.thread = (pthread_t *)calloc((size_t)par.threads, sizeof(pthread_t));
+
+  if(par.thread == NULL)
+    return -1;
+
+  atomic_init(&par.cursor, 0);
+  atomic_init(&par.done, 0);
+  atomic_init(&par.stop, 0);
+  atomic_init(&par.waiters, 0);
+  pthread_mutex_init(&par.mtx, NULL);
+  pthread_cond_init(&par.cond, NULL);
+
+  for(i = 0; i < par.threads; i++)
+  {
+    if( pthread_create(&par.thread[i], NULL, par_main, NULL) != 0 )
+      break;
+  }
+
+  par.threads = i;
+  par.started = 1;
+  REPORT(MSG_INFO, "+lua_parallel: %d threads", par.threads + 1);
+  return 0;
+}
+
+
+/**
+  * @brief Остановка пула (конец симуляции).
+  */
+static void par_stop(void)
+{
+  int i;
+
+  if(par.started <= 0)
+    return;
+
+  atomic_store(&par.stop, 1);
+  pthread_mutex_lock(&par.mtx);
+  pthread_cond_broadcast(&par.cond);
+  pthread_mutex_unlock(&par.mtx);
+
+  for(i = 0; i < par.threads; i++)
+    pthread_join(par.thread[i], NULL);
+
+  pthread_cond_destroy(&par.cond);
+  pthread_mutex_destroy(&par.mtx);
+  free(par.thread);
+  free(par.job);
+  free(par.group);
+  par.thread = NULL;
+  par.job = NULL;
+  par.group = NULL;
+  par.started = 0;
+}
+
+
+/**
+  * @brief Выполнение накопленного пакета и запись результатов в порядке вызовов.
+  */
+static void par_flush(void)
+{
+  par_job_t *job;
+  uint64_t   t2;
+  uint64_t   t3;
+  size_t     i;
+
+  if(par.job_count == 0)
+    return;
+
+  atomic_store_explicit(&par.done, 0, memory_order_relaxed);
+  atomic_store_explicit(&par.cursor, (uint64_t)par.group_count << 32, memory_order_release);
+  par_notify();
+
+  par_drain();
+  par_wait(par_all_done);
+
+  for(i = 0; i < par.job_count; i++)
+  {
+    job = &par.job[i];
+    t2 = stats_now();
+
+    if(job->kind == WORKER__EXCHANGE_M)
+    {
+      tf_put_int(job->ctx, ARG_M__TIME_NS, job->out[0], job->delay);
+      tf_put_int(job->ctx, ARG_M__CMD_O, job->out[1], job->delay);
+      tf_put_int(job->ctx, ARG_M__ADR_O, job->out[2], job->delay);
+      tf_put_int(job->ctx, ARG_M__DAT_O, job->out[3], job->delay);
+      tf_put_int(job->ctx, ARG_M__RESULT, job->result, job->delay);
+    }
+    else
+    {
+      tf_put_int(job->ctx, ARG_S__DAT_O, job->out[0], job->delay);
+      tf_put_int(job->ctx, ARG_S__STATUS_O, job->out[1], job->delay);
+      tf_put_int(job->ctx, ARG_S__RESULT, job->result, job->delay);
+    }
+
+    t3 = stats_now();
+    stats_exchange(job->lua, job->kind == WORKER__EXCHANGE_S, (job->kind == WORKER__EXCHANGE_M) ? job->out[1] : job->in[1],
+      job->result, 32, job->t0, job->t1, job->t1 + job->lua_ns, job->t1 + job->lua_ns + (t3 - t2));
+
+    if( (job->at != NULL) && (job->lua->idle_until_ns != 0) )
+      attach_sleep(job->at, job->lua);
+  }
+
+  par.job_count = 0;
+  par.group_count = 0;
+  par.batch++;
+  log_arm();   /* Сообщения и print() потоков пула выводятся до следующего шага времени */
+}
+
+
+/**
+  * @brief Конец активной области шага времени: выполнение пакета.
+  */
+static PLI_INT32 cb_par_rw_synch(p_cb_data cb_data)
+{
+  par.armed = 0;
+  par_flush();
+  return 0;
+}
+
+
+static int par_arm(void)
+{
+  static s_vpi_time time_s;
+  s_cb_data         cb_data;
+  vpiHandle         cb_hdl;
+
+  time_s.type = vpiSimTime;
+  time_s.high = 0;
+  time_s.low  = 0;
+
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason = cbReadWriteSynch;
+  cb_data.cb_rtn = cb_par_rw_synch;
+  cb_data.time   = &time_s;
+
+  cb_hdl = vpi_register_cb(&cb_data);
+
+  if(cb_hdl == NULL)
+    return -1;
+
+  vpi_free_object(cb_hdl);
+  par.armed = 1;
+  return 0;
+}
+
+
+/**
+  * @brief Постановка обмена в пакет шага времени вместо немедленного выполнения.
+  *        Широкая шина, трасса воспроизведения и экземпляры +lua_threaded выполняются как обычно;
+  *        если у экземпляра уже есть обмены в пакете, пакет сначала выполняется, чтобы не нарушить порядок.
+  * @retval int 1 - обмен поставлен в пакет, 0 - выполнить его сразу.
+  */
+static int par_defer(tf_ctx_t *ctx, mb_lua_t *lua, int kind, p_vpi_time delay, struct attach_s *at)
+{
+  par_job_t *job;
+  void      *p;
+  size_t     size;
+  int        idx;
+
+  if( (opt_par_threads == 0) || (lua == NULL) )
+    return 0;
+
+  if( (lua->worker != NULL) || ((lua->trace != NULL) && (lua->trace->map != NULL)) ||
+      (ctx->size[(kind == WORKER__EXCHANGE_M) ? ARG_M__DAT_I : ARG_S__DAT_I] > 32) ||
+      (ctx->size[(kind == WORKER__EXCHANGE_M) ? ARG_M__DAT_O : ARG_S__DAT_O] > 32) ||
+      (par_start() != 0) )
+  {
+    if(lua->par_batch == par.batch)
+      par_flush();
+    return 0;
+  }
+
+  if(par.job_count == par.job_size)
+  {
+    size = par.job_size ? par.job_size * 2 : 64;
+    p = realloc(par.job, size * sizeof(par_job_t));
+    if(p == NULL)
+    {
+      par_flush();
+      return 0;
+    }
+    par.job = (par_job_t *)p;
+    par.job_size = size;
+  }
+
+  if( (lua->par_batch != par.batch) && (par.group_count == par.group_size) )
+  {
+    size = par.group_size ? par.group_size * 2 : 64;
+    p = realloc(par.group, size * sizeof(int));
+    if(p == NULL)
+    {
+      par_flush();
+      return 0;
+    }
+    par.group = (int *)p;
+    par.group_size = size;
+  }
+
+  idx = (int)par.job_count++;
+  job = &par.job[idx];
+  job->lua   = lua;
+  job->ctx   = ctx;
+  job->at    = at;
+  job->delay = delay;
+  job->kind  = kind;
+  job->next  = -1;
+  job->t0    = stats_now();
+
+  if(kind == WORKER__EXCHANGE_M)
+  {
+    job->in[0] = tf_get_int(ctx, ARG_M__DAT_I);
+    job->in[1] = tf_get_int(ctx, ARG_M__STATUS_I);
+    job->out[0] = job->out[1] = job->out[2] = job->out[3] = 0;
+  }
+  else
+  {
+    job->in[0] = tf_get_int(ctx, ARG_S__TIME_NS);
+    job->in[1] = tf_get_int(ctx, ARG_S__CMD_I);
+    job->in[2] = tf_get_int(ctx, ARG_S__ADR_I);
+    job->in[3] = tf_get_int(ctx, ARG_S__DAT_I);
+    job->out[0] = job->out[1] = 0;
+  }
+
+  atomic_store(&lua->now_ns, sim_time_ns());
+  job->t1 = stats_now();
+
+  if(lua->par_batch == par.batch)
+    par.job[lua->par_last].next = idx;
+  else
+  {
+    par.group[par.group_count++] = idx;
+    lua->par_batch = par.batch;
+  }
+  lua->par_last = idx;
+
+  if( (! par.armed) && (par_arm() != 0) )
+  {
+    REPORT(MSG_WARNING, "if( par_arm() != 0 )  cbReadWriteSynch is not available, running serially");
+    opt_par_threads = 0;
+    par_flush();
+  }
+
+  return 1;
+}
+
+
+/**
+  * @brief PLI - обёртка для функции exchange_CAD(lua_State* L, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+  */
+static PLI_INT32 calltf_lua_exchange_M(PLI_BYTE8 *user_data) //Verilog -> lua
+{
+  tf_ctx_t *ctx;
+  mb_lua_t *master;
+
+  ctx = tf_ctx_get(ARG_M__NUM);
+
+#ifdef DEBUG
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    return 0;
+  }
+#endif
+
+  master = handle_get((uint32_t)tf_get_int(ctx, ARG_M__HANDLE));
+
+  if( par_defer(ctx, master, WORKER__EXCHANGE_M, NULL, NULL) )
+    return 0;
+
+  tf_exchange_M(ctx, master, NULL);
+  return 0;
+}
+
+
+static PLI_INT32 calltf_lua_exchange_S(PLI_BYTE8 *user_data) //Verilog -> lua
+{
+  tf_ctx_t *ctx;
+  mb_lua_t *slave;
+
+  ctx = tf_ctx_get(ARG_S__NUM);
+
+#ifdef DEBUG
+  if(ctx == NULL)
+  {
+    REPORT(MSG_ERROR, "if(ctx == NULL)");
+    return 0;
+  }
+#endif
+
+  slave = handle_get((uint32_t)tf_get_int(ctx, ARG_S__HANDLE));
+
+  if( par_defer(ctx, slave, WORKER__EXCHANGE_S, NULL, NULL) )
+    return 0;
+
+  tf_exchange_S(ctx, slave, NULL);
+  return 0;
+}
+
+
+/*****************************************************************************
+ * $lua_call: вызов произвольной функции Lua по плану места вызова
+ *****************************************************************************/
+
+#define CALL_OUT_MARK  "->"   /* Строка, отделяющая входы от выходов в списке аргументов $lua_call */
+
+
+enum
+{
+  CALL__UINT = 0,   /* До 32 бит без знака: целое Lua */
+  CALL__SINT,       /* До 32 бит со знаком: целое Lua с расширением знака */
+  CALL__WIDE,       /* Шире 32 бит: строка байт, младший первым */
+  CALL__REAL,       /* real: число Lua */
+  CALL__STRING,     /* Строковая константа: читается один раз */
+  CALL__ARRAY       /* Память (reg [w:0] m [0:n]) до 32 бит на слово: таблица целых */
+} typedef call_kind_t;
+
+
+/**
+  * @brief Шаг плана: один аргумент $lua_call. Тип, ширина и направление определяются один раз.
+  */
+struct {
+  vpiHandle     obj;
+  int           kind;
+  int           width;
+  int           words;
+  int           shift;      /* 32 - width: расширение знака CALL__SINT */
+  uint32_t      mask;
+  int           count;      /* CALL__ARRAY: число слов */
+  vpiHandle    *elem;       /* CALL__ARRAY: слова памяти */
+  s_vpi_vecval *vec;        /* CALL__WIDE: буфер значения */
+  char         *str;        /* CALL__STRING: значение; CALL__WIDE: буфер байт */
+} typedef call_arg_t;
+
+
+/**
+  * @brief План места вызова $lua_call (user data vpiSysTfCall). Функция разрешается в ссылку реестра
+  *        экземпляра при первом вызове и заново - только если дескриптор сменился.
+  */
+struct {
+  vpiHandle   desc;
+  char       *func;
+  uint32_t    handle;       /* Экземпляр, которому принадлежит ref */
+  int         ref;
+  int         warned;       /* Ошибка разрешения уже выведена */
+  int         nin;
+  int         nout;
+  call_arg_t  arg[];        /* nin входов, затем nout выходов */
+} typedef call_plan_t;
+
+
+static const char *call_str(vpiHandle obj)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiStringVal;
+  vpi_get_value(obj, &value_s);
+  return (value_s.value.str != NULL) ? value_s.value.str : "";
+}
+
+
+static int call_is_str(vpiHandle obj)
+{
+  return (vpi_get(vpiType, obj) == vpiConstant) && (vpi_get(vpiConstType, obj) == vpiStringConst);
+}
+
+
+/**
+  * @brief Тип, ширина и буферы одного аргумента.
+  * @retval int 0 - успешно, иначе - ошибка.
+  */
+static int call_arg_init(call_arg_t *a, vpiHandle obj, int out)
+{
+  vpiHandle iter;
+  vpiHandle h;
+  int       type = vpi_get(vpiType, obj);
+  int       n;
+
+  a->obj   = obj;
+  a->width = vpi_get(vpiSize, obj);
+
+  if( (type == vpiMemory) || (type == vpiRegArray) )
+  {
+    a->kind  = CALL__ARRAY;
+    a->count = a->width;   /* vpiSize памяти - число слов */
+    a->elem  = (vpiHandle *)calloc((a->count > 0) ? a->count : 1, sizeof(vpiHandle));
+    if(a->elem == NULL)
+      return -1;
+
+    iter = vpi_iterate((type == vpiMemory) ? vpiMemoryWord : vpiReg, obj);
+    for(n = 0; (iter != NULL) && ((h = vpi_scan(iter)) != NULL); n++)
+    {
+      if(n < a->count)
+        a->elem[n] = h;
+    }
+
+    a->count = (n < a->count) ? n : a->count;
+    a->width = (a->count > 0) ? vpi_get(vpiSize, a->elem[0]) : 32;
+    if(a->width > 32)
+    {
+      REPORT(MSG_ERROR, "if(a->width > 32)  $lua_call: array '%s' words are wider than 32 bits", vpi_get_str(vpiName, obj));
+      return -1;
+    }
+  }
+  else if( (type == vpiRealVar) || ((type == vpiConstant) && (vpi_get(vpiConstType, obj) == vpiRealConst)) )
+    a->kind = CALL__REAL;
+  else if( (! out) && call_is_str(obj) )
+  {
+    a->kind = CALL__STRING;
+    a->str  = strdup(call_str(obj));
+    if(a->str == NULL)
+      return -1;
+  }
+  else if(a->width > 32)
+  {
+    a->kind  = CALL__WIDE;
+    a->words = VEC_WORDS(a->width);
+    a->vec   = (s_vpi_vecval *)calloc(a->words, sizeof(s_vpi_vecval));
+    a->str   = (char *)malloc((a->width + 7) / 8);
+    if( (a->vec == NULL) || (a->str == NULL) )
+      return -1;
+  }
+  else
+    a->kind = vpi_get(vpiSigned, obj) ? CALL__SINT : CALL__UINT;
+
+  if(a->width < 1)
+    a->width = 32;
+
+  a->shift = (a->width < 32) ? 32 - a->width : 0;
+  a->mask  = (a->width < 32) ? (1u << a->width) - 1 : 0xFFFFFFFFu;
+  return 0;
+}
+
+
+static void call_plan_free(call_plan_t *plan)
+{
+  int i;
+
+  for(i = 0; i < plan->nin + plan->nout; i++)
+  {
+    free(plan->arg[i].elem);
+    free(plan->arg[i].vec);
+    free(plan->arg[i].str);
+  }
+
+  free(plan->func);
+  free(plan);
+}
+
+
+/**
+  * @brief Разбор аргументов места вызова: $lua_call(Descriptor, "func", входы... [, "->", выходы...]).
+  * @retval call_plan_t* План или NULL.
+  */
+static call_plan_t *call_plan_create(vpiHandle inst_h)
+{
+  vpiHandle    arg_iter;
+  vpiHandle    arg[3 + 2 * 256];
+  call_plan_t *plan;
+  int          n;
+  int          mark = -1;
+  int          i;
+
+  arg_iter = (inst_h != NULL) ? vpi_iterate(vpiArgument, inst_h) : NULL;
+
+  for(n = 0; (arg_iter != NULL) && ((arg[n] = vpi_scan(arg_iter)) != NULL); n++)
+  {
+    if(n == (int)(sizeof(arg) / sizeof(arg[0])) - 1)
+    {
+      vpi_free_object(arg_iter);
+      REPORT(MSG_ERROR, "$lua_call: too many arguments");
+      return NULL;
+    }
+
+    if( (n >= 2) && (mark < 0) && call_is_str(arg[n]) && (strcmp(call_str(arg[n]), CALL_OUT_MARK) == 0) )
+      mark = n;
+  }
+
+  if( (n < 2) || (! call_is_str(arg[1])) )
+  {
+    REPORT(MSG_ERROR, "if( (n < 2) || (! call_is_str(arg[1])) )  $lua_call expects (Descriptor, \"func\", inputs... [, \"%s\", outputs...])", CALL_OUT_MARK);
+    return NULL;
+  }
+
+  if(mark < 0)
+    mark = n;
+
+  plan = (call_plan_t *)calloc(1, sizeof(call_plan_t) + sizeof(call_arg_t) * (n - 2));
+  if(plan == NULL)
+  {
+    REPORT(MSG_ERROR, "if(plan == NULL)");
+    return NULL;
+  }
+
+  plan->desc = arg[0];
+  plan->func = strdup(call_str(arg[1]));
+  plan->ref  = LUA_NOREF;
+  plan->nin  = mark - 2;
+  plan->nout = (mark < n) ? n - mark - 1 : 0;
+
+  for(i = 0; i < plan->nin + plan->nout; i++)
+  {
+    if( call_arg_init(&plan->arg[i], arg[(i < plan->nin) ? 2 + i : 3 + i], i >= plan->nin) != 0 )
+    {
+      REPORT(MSG_ERROR, "if( call_arg_init(&plan->arg[%d], ...) != 0 )  $lua_call '%s'", i, (plan->func != NULL) ? plan->func : "");
+      plan->nin = i + 1;
+      plan->nout = 0;
+      call_plan_free(plan);
+      return NULL;
+    }
+  }
+
+  if(plan->func == NULL)
+  {
+    call_plan_free(plan);
+    return NULL;
+  }
+
+  return plan;
+}
+
+
+static PLI_INT32 compiletf_lua_call(PLI_BYTE8 *user_data)
+{
+  vpiHandle    inst_h = vpi_handle(vpiSysTfCall, NULL);
+  call_plan_t *plan = call_plan_create(inst_h);
+
+  if(plan == NULL)
+  {
+    vpi_control(vpiFinish, 1);
+    return 0;
+  }
+
+  vpi_put_userdata(inst_h, plan);
+  return 0;
+}
+
+
+/**
+  * @brief Значение входа на стек Lua.
+  */
+static void call_push(lua_State *L, call_arg_t *a)
+{
+  s_vpi_value value_s;
+  uint32_t    v;
+  int         i;
+  int         n;
+
+  switch(a->kind)
+  {
+    case CALL__UINT:
+    case CALL__SINT:
+      value_s.format = vpiIntVal;
+      vpi_get_value(a->obj, &value_s);
+      v = (uint32_t)value_s.value.integer;
+      if(a->kind == CALL__SINT)
+        lua_pushinteger(L, (lua_Integer)((int32_t)(v << a->shift) >> a->shift));
+      else
+        lua_pushinteger(L, (lua_Integer)(v & a->mask));
+      break;
+
+    case CALL__WIDE:
+      value_s.format = vpiVectorVal;
+      vpi_get_value(a->obj, &value_s);
+      n = (a->width + 7) / 8;
+      for(i = 0; i < n; i++)
+        a->str[i] = (char)((uint32_t)value_s.value.vector[i / 4].aval >> (8 * (i % 4)));
+      lua_pushlstring(L, a->str, (size_t)n);
+      break;
+
+    case CALL__REAL:
+      value_s.format = vpiRealVal;
+      vpi_get_value(a->obj, &value_s);
+      lua_pushnumber(L, (lua_Number)value_s.value.real);
+      break;
+
+    case CALL__STRING:
+      lua_pushstring(L, a->str);
+      break;
+
+    case CALL__ARRAY:
+      lua_createtable(L, a->count, 0);
+      for(i = 0; i < a->count; i++)
+      {
+        value_s.format = vpiIntVal;
+        vpi_get_value(a->elem[i], &value_s);
+        lua_pushinteger(L, (lua_Integer)((uint32_t)value_s.value.integer & a->mask));
+        lua_rawseti(L, -2, i + 1);
+      }
+      break;
+  }
+}
+
+
+/**
+  * @brief Результат функции (индекс idx на стеке) в выход; nil оставляет выход без изменений.
+  * @retval int 0 - успешно, -1 - значение не подходит к выходу.
+  */
+static int call_put(lua_State *L, int idx, call_arg_t *a)
+{
+  s_vpi_value value_s;
+  const char *s;
+  size_t      len;
+  uint64_t    u;
+  int         i;
+
+  if( lua_isnil(L, idx) )
+    return 0;
+
+  if(a->kind == CALL__REAL)
+  {
+    if( ! lua_isnumber(L, idx) )
+      return -1;
+
+    value_s.format = vpiRealVal;
+    value_s.value.real = (double)lua_tonumber(L, idx);
+    vpi_put_value(a->obj, &value_s, NULL, vpiNoDelay);
+    return 0;
+  }
+
+  if(a->kind == CALL__ARRAY)
+  {
+    if( ! lua_istable(L, idx) )
+      return -1;
+
+    for(i = 0; i < a->count; i++)
+    {
+      lua_rawgeti(L, idx, i + 1);
+      if( lua_isnumber(L, -1) )
+      {
+        value_s.format = vpiIntVal;
+        value_s.value.integer = (PLI_INT32)lua_tointeger(L, -1);
+        vpi_put_value(a->elem[i], &value_s, NULL, vpiNoDelay);
+      }
+      lua_pop(L, 1);
+    }
+    return 0;
+  }
+
+  if( lua_isboolean(L, idx) )
+    u = lua_toboolean(L, idx);
+  else if( lua_isinteger(L, idx) )
+    u = (uint64_t)lua_tointeger(L, idx);
+  else if( lua_type(L, idx) == LUA_TNUMBER )
+    u = (uint64_t)(int64_t)lua_tonumber(L, idx);
+  else if( (a->kind == CALL__WIDE) && (lua_type(L, idx) == LUA_TSTRING) )
+  {
+    s = lua_tolstring(L, idx, &len);
+    memset(a->vec, 0, sizeof(s_vpi_vecval) * a->words);
+    for(i = 0; (i < (int)len) && (i < a->words * 4); i++)
+      a->vec[i / 4].aval |= (PLI_INT32)((uint32_t)(uint8_t)s[i] << (8 * (i % 4)));
+
+    value_s.format = vpiVectorVal;
+    value_s.value.vector = a->vec;
+    vpi_put_value(a->obj, &value_s, NULL, vpiNoDelay);
+    return 0;
+  }
+  else
+    return -1;
+
+  if(a->kind == CALL__WIDE)
+  {
+    memset(a->vec, 0, sizeof(s_vpi_vecval) * a->words);
+    a->vec[0].aval = (PLI_INT32)(uint32_t)u;
+    a->vec[1].aval = (PLI_INT32)(uint32_t)(u >> 32);
+    value_s.format = vpiVectorVal;
+    value_s.value.vector = a->vec;
+  }
+  else
+  {
+    value_s.format = vpiIntVal;
+    value_s.value.integer = (PLI_INT32)(uint32_t)u;
+  }
+
+  vpi_put_value(a->obj, &value_s, NULL, vpiNoDelay);
+  return 0;
+}
+
+
+/**
+  * @brief Ссылка на функцию плана в экземпляре lua; разрешается заново только при смене дескриптора.
+  */
+static int call_bind(call_plan_t *plan, mb_lua_t *lua)
+{
+  mb_lua_t *old;
+
+  if(plan->handle == lua->handle)
+    return plan->ref;
+
+  old = handle_get(plan->handle);
+  if( (old != NULL) && (old->L != NULL) )
+    luaL_unref(old->L, LUA_REGISTRYINDEX, plan->ref);
+
+  plan->handle = lua->handle;
+  plan->ref    = lua_ref_function(lua->L, plan->func);
+  plan->warned = 0;
+
+  if( ! lua_checkstack(lua->L, plan->nin + plan->nout + 1) )
+  {
+    luaL_unref(lua->L, LUA_REGISTRYINDEX, plan->ref);
+    plan->ref = LUA_NOREF;
+  }
+
+  return plan->ref;
+}
+
+
+/**
+  * @brief $lua_call(Descriptor, "func", входы... [, "->", выходы...]): func(входы...) экземпляра,
+  *        результаты по порядку записываются в выходы (vpiNoDelay).
+  */
+static PLI_INT32 calltf_lua_call(PLI_BYTE8 *user_data)
+{
+  vpiHandle    inst_h = vpi_handle(vpiSysTfCall, NULL);
+  call_plan_t *plan = (call_plan_t *)vpi_get_userdata(inst_h);
+  s_vpi_value  value_s;
+  mb_lua_t    *lua;
+  lua_State   *L;
+  int          i;
+
+  if(plan == NULL)
+  {
+    plan = call_plan_create(inst_h);
+    if(plan == NULL)
+      return 0;
+
+    vpi_put_userdata(inst_h, plan);
+  }
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(plan->desc, &value_s);
+  lua = handle_get((uint32_t)value_s.value.integer);
+
+  if( (lua == NULL) || (lua->L == NULL) )
+  {
+    if(! plan->warned)
+      REPORT(MSG_ERROR, "if( (lua == NULL) || (lua->L == NULL) )  $lua_call '%s': invalid descriptor 0x%08X",
+        plan->func, (uint32_t)value_s.value.integer);
+    plan->warned = 1;
+    return 0;
+  }
+
+  if(lua->worker != NULL)
+  {
+    if(! plan->warned)
+    {
+      REPORT_PFX(lua->prefix, MSG_ERROR, "if(lua->worker != NULL)  $lua_call '%s' is not available with +lua_threaded", plan->func);
+      vpi_control(vpiFinish, 1);
+    }
+    plan->warned = 1;
+    return 0;
+  }
+
+  if(lua->par_batch == par.batch)
+    par_flush();   /* Обмены экземпляра, отложенные в этом шаге, выполняются до вызова */
+
+  if( call_bind(plan, lua) == LUA_NOREF )
+  {
+    if(! plan->warned)
+      REPORT_PFX(lua->prefix, MSG_ERROR, "if( call_bind(plan, lua) == LUA_NOREF )  function '%s' not found", plan->func);
+    plan->warned = 1;
+    return 0;
+  }
+
+  L = lua->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, plan->ref);
+
+  for(i = 0; i < plan->nin; i++)
+    call_push(L, &plan->arg[i]);
+
+  if( lua_pcall(L, plan->nin, plan->nout, 0) != LUA_OK )
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( lua_pcall(L, plan->nin, plan->nout, 0) != LUA_OK )  %s: '%s'", plan->func, lua_tostring(L, -1));
+    lua_settop(L, 0);
+    return 0;
+  }
+
+  for(i = 0; i < plan->nout; i++)
+  {
+    if( call_put(L, i - plan->nout, &plan->arg[plan->nin + i]) != 0 )
+      REPORT_PFX(lua->prefix, MSG_ERROR, "if( call_put(...) != 0 )  %s: result %d is %s", plan->func, i + 1, luaL_typename(L, i - plan->nout));
+  }
+
+  lua_settop(L, 0);
+  stats_mem(lua);
+  return 0;
+}
+
+
+/**
+  * @brief Индексы аргументов $lua_attach. За ними следуют порты exchange_M/exchange_S в том же порядке,
+  *        что и в $lua_exchange_M/$lua_exchange_S после дескриптора, и необязательный сигнал разрешения.
+  */
+enum
+{
+  ARG_ATTACH__HANDLE = 0,
+  ARG_ATTACH__CLK,
+  ARG_ATTACH__KIND,
+  ARG_ATTACH__PORTS,
+  ARG_ATTACH__MIN    = ARG_ATTACH__PORTS + (ARG_M__NUM - ARG_M__TIME_NS),
+  ARG_ATTACH__MAX    = ARG_ATTACH__MIN + 1
+} typedef arg_attach_t;
+
+
+/**
+  * @brief Модель, подключённая к тактовому сигналу ($lua_attach).
+  */
+struct attach_s {
+  uint32_t         handle;
+  int              kind;          /* WORKER__EXCHANGE_M или WORKER__EXCHANGE_S */
+  vpiHandle        clk;
+  vpiHandle        enable;        /* NULL - модель вызывается на каждом фронте */
+  vpiHandle        cb;
+  tf_ctx_t         ports;         /* Порты в раскладке ARG_M__* / ARG_S__* */
+  s_vpi_time       cb_time;
+  s_vpi_value      cb_value;
+  s_vpi_time       delay;
+  struct attach_s *next;
+};
+typedef struct attach_s attach_t;
+
+
+static PLI_INT32 cb_attach_clk(p_cb_data cb_data);
+
+
+/**
+  * @brief Подписка на изменения тактового сигнала подключённой модели.
+  */
+static vpiHandle attach_arm_clk(attach_t *at)
+{
+  s_cb_data cb_data;
+
+  at->cb_time.type = vpiSuppressTime;
+  at->cb_value.format = vpiScalarVal;
+
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason    = cbValueChange;
+  cb_data.cb_rtn    = cb_attach_clk;
+  cb_data.obj       = at->clk;
+  cb_data.time      = &at->cb_time;
+  cb_data.value     = &at->cb_value;
+  cb_data.user_data = (PLI_BYTE8 *)at;
+
+  return vpi_register_cb(&cb_data);
+}
+
+
+/**
+  * @brief Конец простоя модели: снова подписываемся на фронты CLK.
+  */
+static PLI_INT32 cb_attach_wake(p_cb_data cb_data)
+{
+  attach_t *at = (attach_t *)cb_data->user_data;
+
+  at->cb = attach_arm_clk(at);
+
+  if(at->cb == NULL)
+    REPORT(MSG_ERROR, "if(at->cb == NULL)");
+
+  return 0;
+}
+
+
+/**
+  * @brief Модель простаивает (idle_until): вместо вызова на каждом фронте CLK - один cbAfterDelay до момента пробуждения.
+  */
+static void attach_sleep(attach_t *at, mb_lua_t *lua)
+{
+  s_cb_data cb_data;
+  uint64_t  ticks;
+  vpiHandle cb;
+
+  ticks = sim_ns_to_ticks(lua->idle_until_ns - atomic_load(&lua->now_ns));
+
+  at->cb_time.type = vpiSimTime;
+  at->cb_time.low  = (PLI_UINT32)ticks;
+  at->cb_time.high = (PLI_UINT32)(ticks >> 32);
+
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason    = cbAfterDelay;
+  cb_data.cb_rtn    = cb_attach_wake;
+  cb_data.time      = &at->cb_time;
+  cb_data.user_data = (PLI_BYTE8 *)at;
+
+  cb = vpi_register_cb(&cb_data);
+
+  if(cb == NULL)
+  {
+    REPORT(MSG_ERROR, "if(cb == NULL)");
+    return;
+  }
+
+  vpi_remove_cb(at->cb);
+  at->cb = cb;
+}
+
+
+/**
+  * @brief Передний фронт тактового сигнала подключённой модели: входы читаются в момент фронта,
+  *        выходы выставляются с инерционной задержкой #1 (в единицах времени модуля портов).
+  */
+static PLI_INT32 cb_attach_clk(p_cb_data cb_data)
+{
+  attach_t   *at = (attach_t *)cb_data->user_data;
+  mb_lua_t   *lua;
+  s_vpi_value value_s;
+
+  if(cb_data->value->value.scalar != vpi1)
+    return 0;
+
+  if(at->enable != NULL)
+  {
+    value_s.format = vpiScalarVal;
+    vpi_get_value(at->enable, &value_s);
+
+    if(value_s.value.scalar != vpi1)
+      return 0;
+  }
+
+  lua = handle_get(at->handle);
+
+  if( par_defer(&at->ports, lua, at->kind, &at->delay, at) )
+    return 0;   /* Простой проверяется при записи результатов пакета */
+
+  if(at->kind == WORKER__EXCHANGE_M)
+    tf_exchange_M(&at->ports, lua, &at->delay);
+  else
+    tf_exchange_S(&at->ports, lua, &at->delay);
+
+  lua = handle_get(at->handle);   /* При расхождении с трассой экземпляр заменяется */
+
+  if( (lua != NULL) && (lua->idle_until_ns != 0) )
+    attach_sleep(at, lua);
+
+  return 0;
+}
+
+
+/**
+  * @brief Отключение всех моделей экземпляра от тактовых сигналов (при $lua_deinit).
+  */
+static void attach_remove_all(mb_lua_t *lua)
+{
+  attach_t *at;
+  int       i;
+
+  while(lua->attach != NULL)
+  {
+    at = lua->attach;
+    lua->attach = at->next;
+
+    if(at->cb != NULL)
+      vpi_remove_cb(at->cb);
+
+    for(i = 0; i < TF_CTX_ARGS_MAX; i++)
+      free(at->ports.vec[i]);
+    free(at);
+  }
+}
+
+
+/**
+  * @brief $lua_attach(Descriptor, CLK, "M" | "S", порты exchange_M/exchange_S..., [EN])
+  *        Регистрирует cbValueChange на CLK: модель вызывается из C на каждом переднем фронте (при EN == 1),
+  *        без always - блока, задержек #1 и автомата фаз в Verilog.
+  */
+static PLI_INT32 calltf_lua_attach(PLI_BYTE8 *user_data)
+{
+  vpiHandle   inst_h;
+  vpiHandle   arg_iter;
+  vpiHandle   arg[ARG_ATTACH__MAX];
+  s_vpi_value value_s;
+  attach_t   *at;
+  mb_lua_t   *lua;
+  int         kind;
+  int         n;
+  int         i;
+
+  inst_h = vpi_handle(vpiSysTfCall, NULL);
+  arg_iter = vpi_iterate(vpiArgument, inst_h);
+
+  if(arg_iter == NULL)
+  {
+    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
+    return 0;
+  }
+
+  for(n = 0; n < ARG_ATTACH__MAX; n++)
+  {
+    arg[n] = vpi_scan(arg_iter);
+    if(arg[n] == NULL)
+      break;
+  }
+
+  if(n == ARG_ATTACH__MAX)
+    vpi_free_object(arg_iter);
+
+  if(n < ARG_ATTACH__MIN)
+  {
+    REPORT(MSG_ERROR, "if(n < ARG_ATTACH__MIN)  $lua_attach expects %d or %d arguments", ARG_ATTACH__MIN, ARG_ATTACH__MAX);
+    return 0;
+  }
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(arg[ARG_ATTACH__HANDLE], &value_s);
+  lua = handle_get((uint32_t)value_s.value.integer);
+
+  if(lua == NULL)
+  {
+    REPORT(MSG_ERROR, "if(lua == NULL)  invalid descriptor 0x%08X", (uint32_t)value_s.value.integer);
+    return 0;
+  }
+
+  value_s.format = vpiStringVal;
+  vpi_get_value(arg[ARG_ATTACH__KIND], &value_s);
+
+  if( (value_s.value.str != NULL) && (strcmp(value_s.value.str, "M") == 0) )
+    kind = WORKER__EXCHANGE_M;
+  else if( (value_s.value.str != NULL) && (strcmp(value_s.value.str, "S") == 0) )
+    kind = WORKER__EXCHANGE_S;
+  else
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( kind != \"M\" && kind != \"S\" )  $lua_attach kind '%s', expected \"M\" or \"S\"",
+      (value_s.value.str != NULL) ? value_s.value.str : "");
+    return 0;
+  }
+
+  at = (attach_t *)calloc(1, sizeof(attach_t));
+
+  if(at == NULL)
+  {
+    REPORT(MSG_ERROR, "if(at == NULL)");
+    return 0;
+  }
+
+  at->handle = lua->handle;
+  at->clk    = arg[ARG_ATTACH__CLK];
+  at->enable = (n == ARG_ATTACH__MAX) ? arg[ARG_ATTACH__MAX - 1] : NULL;
+  at->kind   = kind;
+
+  at->ports.args_num = ARG_M__NUM;
+  for(i = ARG_M__TIME_NS; i < ARG_M__NUM; i++)
+  {
+    at->ports.arg[i]  = arg[ARG_ATTACH__PORTS + i - ARG_M__TIME_NS];
+    at->ports.size[i] = vpi_get(vpiSize, at->ports.arg[i]);
+
+    if(at->ports.size[i] > 32)
+      at->ports.vec[i] = (s_vpi_vecval *)calloc(VEC_WORDS(at->ports.size[i]), sizeof(s_vpi_vecval));
+  }
+
+  at->delay.type = vpiScaledRealTime;
+  at->delay.real = 1.0;
+
+  at->cb = attach_arm_clk(at);
+
+  if(at->cb == NULL)
+  {
+    REPORT(MSG_ERROR, "if(at->cb == NULL)");
+    for(i = 0; i < TF_CTX_ARGS_MAX; i++)
+      free(at->ports.vec[i]);
+    free(at);
+    return 0;
+  }
+
+  at->next = lua->attach;
+  lua->attach = at;
+  return 0;
+}
+
+
+/*****************************************************************************
+ * $lua_play: воспроизведение воздействий из файла
+ *****************************************************************************/
+
+#define PLAY_MAGIC  "PLISTM1"
+#define PLAY_HDR    (sizeof(PLAY_MAGIC) + 4)   /* magic, uint32 nsig; затем uint32 width[nsig] */
+
+
+enum
+{
+  PLAY__END      = 0,   /* Конец воспроизведения (или конец файла) */
+  PLAY__TIME     = 1,   /* varint dt: следующие записи - через dt нс */
+  PLAY__VALUE    = 2,   /* varint sig, (width + 7) / 8 байт значения, младший первым */
+  PLAY__VALUE_XZ = 3,   /* То же и ещё столько же байт маски X/Z (бит 1: 0 -> Z, 1 -> X) */
+  PLAY__EVENT    = 4    /* varint id: play_event(id, time_ns) экземпляра */
+} typedef play_op_t;
+
+
+struct {
+  vpiHandle obj;
+  int       bytes;    /* Байт значения в файле */
+  int       words;    /* Слов s_vpi_vecval сигнала */
+} typedef play_sig_t;
+
+
+/**
+  * @brief Воспроизведение одного файла ($lua_play). Файл отображён в память и читается последовательно.
+  */
+struct play_s {
+  uint32_t        handle;      /* Экземпляр с play_event(), 0 - без событий */
+  char           *fname;
+  const uint8_t  *map;
+  size_t          map_len;
+  size_t          pos;
+  uint64_t        start;       /* Время $lua_play в единицах симулятора */
+  int64_t         t_ns;        /* Время текущих записей от начала воспроизведения */
+  uint64_t        values;
+  int             nsig;
+  play_sig_t     *sig;
+  s_vpi_vecval   *vec;         /* Значение самого широкого сигнала */
+  vpiHandle       cb;
+  s_vpi_time      cb_time;
+  struct play_s  *next;
+};
+typedef struct play_s play_t;
+
+
+/* Воспроизведения с Descriptor = 0: не принадлежат экземпляру, оставшиеся освобождаются в конце симуляции */
+static play_t *play_detached = NULL;
+static int     play_eos_armed = 0;
+
+
+static PLI_INT32 cb_play(p_cb_data cb_data);
+
+
+static void play_free(play_t *pl)
+{
+  if(pl->cb != NULL)
+    vpi_remove_cb(pl->cb);
+
+  munmap((void *)pl->map, pl->map_len);
+  free(pl->fname);
+  free(pl->sig);
+  free(pl->vec);
+  free(pl);
+}
+
+
+/**
+  * @brief Конец файла: воспроизведение снимается с экземпляра (или из play_detached) и освобождается.
+  */
+static void play_finish(play_t *pl)
+{
+  mb_lua_t  *lua = (pl->handle != 0) ? handle_get(pl->handle) : NULL;
+  play_t   **pp;
+
+  REPORT(MSG_INFO, "'%s': %llu values in %lld ns", pl->fname, (unsigned long long)pl->values, (long long)pl->t_ns);
+
+  pp = (pl->handle == 0) ? &play_detached : (lua != NULL) ? &lua->play : NULL;
+
+  for(; (pp != NULL) && (*pp != NULL); pp = &(*pp)->next)
+  {
+    if(*pp == pl)
+    {
+      *pp = pl->next;
+      break;
+    }
+  }
+
+  play_free(pl);
+}
+
+
+/**
+  * @brief Снятие всех воспроизведений экземпляра (при $lua_deinit).
+  */
+static void play_remove_all(mb_lua_t *lua)
+{
+  play_t *pl;
+
+  while(lua->play != NULL)
+  {
+    pl = lua->play;
+    lua->play = pl->next;
+    play_free(pl);
+  }
+}
+
+
+/**
+  * @brief Конец симуляции: незавершённые воспроизведения без экземпляра освобождаются.
+  */
+static PLI_INT32 cb_play_end_of_sim(p_cb_data cb_data)
+{
+  play_t *pl;
+
+  while(play_detached != NULL)
+  {
+    pl = play_detached;
+    play_detached = pl->next;
+    play_free(pl);
+  }
+
+  return 0;
+}
+
+
+static int play_varint(play_t *pl, uint64_t *v)
+{
+  int shift;
+
+  *v = 0;
+  for(shift = 0; shift < 64; shift += 7)
+  {
+    if(pl->pos >= pl->map_len)
+      return -1;
+
+    *v |= (uint64_t)(pl->map[pl->pos] & 0x7F) << shift;
+    if( (pl->map[pl->pos++] & 0x80) == 0 )
+      return 0;
+  }
+
+  return -1;
+}
+
+
+/**
+  * @brief Запись PLAY__VALUE / PLAY__VALUE_XZ: значение выставляется сразу (vpiNoDelay).
+  */
+static int play_value(play_t *pl, int xz)
+{
+  play_sig_t *sig;
+  s_vpi_value value_s;
+  uint64_t    idx;
+  int         i;
+
+  if( (play_varint(pl, &idx) != 0) || (idx >= (uint64_t)pl->nsig) )
+    return -1;
+
+  sig = &pl->sig[idx];
+
+  if( pl->map_len - pl->pos < (size_t)sig->bytes * (xz ? 2 : 1) )
+    return -1;
+
+  memset(pl->vec, 0, sizeof(s_vpi_vecval) * sig->words);
+
+  for(i = 0; i < sig->bytes; i++)
+    pl->vec[i / 4].aval |= (PLI_INT32)((uint32_t)pl->map[pl->pos + i] << (8 * (i % 4)));
+  pl->pos += sig->bytes;
+
+  if(xz)
+  {
+    for(i = 0; i < sig->bytes; i++)
+      pl->vec[i / 4].bval |= (PLI_INT32)((uint32_t)pl->map[pl->pos + i] << (8 * (i % 4)));
+    pl->pos += sig->bytes;
+  }
+
+  value_s.format = vpiVectorVal;
+  value_s.value.vector = pl->vec;
+  vpi_put_value(sig->obj, &value_s, NULL, vpiNoDelay);
+
+  pl->values++;
+  return 0;
+}
+
+
+/**
+  * @brief Запись PLAY__EVENT: play_event(id, time_ns) экземпляра. false из play_event останавливает воспроизведение.
+  * @retval int 0 - продолжать, 1 - остановить.
+  */
+static int play_event(play_t *pl, uint64_t id)
+{
+  mb_lua_t *lua = (pl->handle != 0) ? handle_get(pl->handle) : NULL;
+  int       stop;
+
+  if( (lua == NULL) || (lua->L == NULL) || (lua->ref_play_event == LUA_NOREF) )
+    return 0;
+
+  if(lua->par_batch == par.batch)
+    par_flush();   /* Обмены экземпляра, отложенные в этом шаге, выполняются до события */
+
+  lua_rawgeti(lua->L, LUA_REGISTRYINDEX, lua->ref_play_event);
+  lua_pushinteger(lua->L, (lua_Integer)id);
+  lua_pushinteger(lua->L, (lua_Integer)sim_time_ns());
+
+  if( lua_pcall(lua->L, 2, 1, 0) != LUA_OK )
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( lua_pcall(lua->L, 2, 1, 0) != LUA_OK )  '%s'", lua_tostring(lua->L, -1));
+    lua_settop(lua->L, 0);
+    return 0;
+  }
+
+  stop = lua_isboolean(lua->L, -1) && ! lua_toboolean(lua->L, -1);
+  lua_settop(lua->L, 0);
+  stats_mem(lua);
+  return stop;
+}
+
+
+/**
+  * @brief Разбор записей до следующего момента времени; на нём регистрируется cbAfterDelay.
+  */
+static void play_run(play_t *pl)
+{
+  uint64_t  now = sim_time_ticks();
+  uint64_t  at;
+  uint64_t  v;
+  s_cb_data cb_data;
+
+  while(pl->pos < pl->map_len)
+  {
+    switch(pl->map[pl->pos++])
+    {
+      case PLAY__TIME:
+        if(play_varint(pl, &v) != 0)
+          goto corrupt;
+
+        pl->t_ns += (int64_t)v;
+        at = pl->start + sim_ns_to_ticks(pl->t_ns);
+
+        if(at <= now)
+          break;
+
+        pl->cb_time.type = vpiSimTime;
+        pl->cb_time.low  = (PLI_UINT32)(at - now);
+        pl->cb_time.high = (PLI_UINT32)((at - now) >> 32);
+
+        memset(&cb_data, 0, sizeof(cb_data));
+        cb_data.reason    = cbAfterDelay;
+        cb_data.cb_rtn    = cb_play;
+        cb_data.time      = &pl->cb_time;
+        cb_data.user_data = (PLI_BYTE8 *)pl;
+
+        pl->cb = vpi_register_cb(&cb_data);
+        if(pl->cb == NULL)
+        {
+          REPORT(MSG_ERROR, "if(pl->cb == NULL)  '%s'", pl->fname);
+          play_finish(pl);   /* Остальные записи не выставляются раньше своего времени */
+        }
+        return;
+
+      case PLAY__VALUE:
+      case PLAY__VALUE_XZ:
+        if( play_value(pl, pl->map[pl->pos - 1] == PLAY__VALUE_XZ) != 0 )
+          goto corrupt;
+        break;
+
+      case PLAY__EVENT:
+        if(play_varint(pl, &v) != 0)
+          goto corrupt;
+        if( play_event(pl, v) )
+        {
+          play_finish(pl);
+          return;
+        }
+        break;
+
+      case PLAY__END:
+        play_finish(pl);
+        return;
+
+      default:
+        goto corrupt;
+    }
+  }
+
+  play_finish(pl);
+  return;
+
+corrupt:
+  REPORT(MSG_ERROR, "'%s': bad record at offset %llu", pl->fname, (unsigned long long)(pl->pos - 1));
+  play_finish(pl);
+}
+
+
+static PLI_INT32 cb_play(p_cb_data cb_data)
+{
+  play_t *pl = (play_t *)cb_data->user_data;
+
+  pl->cb = NULL;
+  play_run(pl);
+  return 0;
+}
+
+
+/**
+  * @brief Отображение файла воздействий и проверка заголовка по сигналам места вызова.
+  */
+static play_t *play_open(const char *fname, vpiHandle *arg, int nsig)
+{
+  struct stat st;
+  play_t     *pl;
+  void       *map;
+  uint32_t    width;
+  int         words = 1;
+  int         size;
+  int         fd;
+  int         i;
+
+  fd = open(fname, O_RDONLY);
+  if(fd < 0)
+  {
+    REPORT(MSG_ERROR, "if(fd < 0)  '%s'", fname);
+    return NULL;
+  }
+
+  if( (fstat(fd, &st) != 0) || ((size_t)st.st_size < PLAY_HDR + 4 * (size_t)nsig) )
+  {
+    REPORT(MSG_ERROR, "if( (fstat(fd, &st) != 0) || ((size_t)st.st_size < PLAY_HDR + 4 * (size_t)nsig) )  '%s'", fname);
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+  {
+    REPORT(MSG_ERROR, "if(map == MAP_FAILED)  '%s'", fname);
+    return NULL;
+  }
+
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  pl = (play_t *)calloc(1, sizeof(play_t));
+  if(pl != NULL)
+  {
+    pl->map       = (const uint8_t *)map;
+    pl->map_len   = (size_t)st.st_size;
+    pl->nsig      = nsig;
+    pl->fname     = strdup(fname);
+    pl->sig       = (play_sig_t *)calloc((size_t)nsig, sizeof(play_sig_t));
+  }
+
+  if( (pl == NULL) || (pl->fname == NULL) || (pl->sig == NULL) )
+  {
+    REPORT(MSG_ERROR, "if( (pl == NULL) || (pl->fname == NULL) || (pl->sig == NULL) )");
+    if(pl != NULL)
+      play_free(pl);
+    else
+      munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+
+  memcpy(&width, pl->map + sizeof(PLAY_MAGIC), 4);
+
+  if( (memcmp(pl->map, PLAY_MAGIC, sizeof(PLAY_MAGIC)) != 0) || (width != (uint32_t)nsig) )
+  {
+    REPORT(MSG_ERROR, "'%s': not a stimulus file for %d signals", fname, nsig);
+    play_free(pl);
+    return NULL;
+  }
+
+  for(i = 0; i < nsig; i++)
+  {
+    memcpy(&width, pl->map + PLAY_HDR + 4 * i, 4);
+    size = vpi_get(vpiSize, arg[i]);
+
+    if( (width == 0) || (width > (uint32_t)size) )
+    {
+      REPORT(MSG_ERROR, "'%s': signal %d is %u bits in the file, %d bits wide in Verilog", fname, i, width, size);
+      play_free(pl);
+      return NULL;
+    }
+
+    pl->sig[i].obj   = arg[i];
+    pl->sig[i].bytes = (int)((width + 7) / 8);
+    pl->sig[i].words = VEC_WORDS(size);
+
+    if(pl->sig[i].words > words)
+      words = pl->sig[i].words;
+  }
+
+  pl->vec = (s_vpi_vecval *)calloc((size_t)words, sizeof(s_vpi_vecval));
+  if(pl->vec == NULL)
+  {
+    REPORT(MSG_ERROR, "if(pl->vec == NULL)");
+    play_free(pl);
+    return NULL;
+  }
+
+  pl->pos = PLAY_HDR + 4 * (size_t)nsig;
+  return pl;
+}
+
+
+/**
+  * @brief $lua_play(Descriptor, fname, сигналы...)
+  *        Сигналы выставляются из файла fname по своим моментам времени (от момента вызова) через cbAfterDelay,
+  *        без Lua. Descriptor = 0 - без событий; иначе записи PLAY__EVENT вызывают play_event(id, time_ns) скрипта.
+  */
+static PLI_INT32 calltf_lua_play(PLI_BYTE8 *user_data)
+{
+  vpiHandle   inst_h;
+  vpiHandle   arg_iter;
+  vpiHandle   h;
+  vpiHandle  *arg = NULL;
+  s_vpi_value value_s;
+  s_cb_data   cb_data;
+  mb_lua_t   *lua = NULL;
+  play_t     *pl;
+  uint32_t    handle;
+  int         n = 0;
+  int         size = 0;
+
+  inst_h = vpi_handle(vpiSysTfCall, NULL);
+  arg_iter = vpi_iterate(vpiArgument, inst_h);
+
+  while( (arg_iter != NULL) && ((h = vpi_scan(arg_iter)) != NULL) )
+  {
+    if(n == size)
+    {
+      size = size ? size * 2 : 16;
+      arg = (vpiHandle *)realloc(arg, sizeof(vpiHandle) * (size_t)size);
+      if(arg == NULL)
+      {
+        REPORT(MSG_ERROR, "if(arg == NULL)");
+        vpi_free_object(arg_iter);
+        return 0;
+      }
+    }
+    arg[n++] = h;
+  }
+
+  if(n < 3)
+  {
+    REPORT(MSG_ERROR, "if(n < 3)  $lua_play expects (Descriptor, fname, signals...)");
+    free(arg);
+    return 0;
+  }
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(arg[0], &value_s);
+  handle = (uint32_t)value_s.value.integer;
+
+  if(handle != 0)
+  {
+    lua = handle_get(handle);
+    if(lua == NULL)
+    {
+      REPORT(MSG_ERROR, "if(lua == NULL)  invalid descriptor 0x%08X", handle);
+      free(arg);
+      return 0;
+    }
+  }
+
+  value_s.format = vpiStringVal;
+  vpi_get_value(arg[1], &value_s);
+
+  pl = play_open((value_s.value.str != NULL) ? value_s.value.str : "", arg + 2, n - 2);
+  free(arg);
+
+  if(pl == NULL)
+    return 0;
+
+  if(lua != NULL)
+  {
+    pl->handle = lua->handle;
+    pl->next = lua->play;
+    lua->play = pl;
+  }
+  else
+  {
+    pl->next = play_detached;
+    play_detached = pl;
+
+    if(! play_eos_armed)
+    {
+      memset(&cb_data, 0, sizeof(cb_data));
+      cb_data.reason = cbEndOfSimulation;
+      cb_data.cb_rtn = cb_play_end_of_sim;
+      vpi_free_object(vpi_register_cb(&cb_data));
+      play_eos_armed = 1;
+    }
+  }
+
+  pl->start = sim_time_ticks();
+  play_run(pl);
+  return 0;
+}
+
+
+/*****************************************************************************
+ * $lua_capture: запись сигналов в столбцы и передача в Lua пачками
+ *****************************************************************************/
+
+#define CAPTURE_DEPTH    4096   /* Выборок в буфере по умолчанию (+lua_capture_depth=N) */
+#define CAPTURE_SIG_MAX  32
+#define CAPTURE_MT       "PLI2Lua.capture"
+#define COLUMN_MT        "PLI2Lua.column"
+
+
+enum
+{
+  CAPTURE__POSEDGE = 0,
+  CAPTURE__NEGEDGE,
+  CAPTURE__CHANGE
+} typedef capture_edge_t;
+
+
+/* Выборок в буфере $lua_capture (+lua_capture_depth=N) */
+static uint32_t opt_capture_depth = CAPTURE_DEPTH;
+
+
+struct capture_s;
+
+
+/**
+  * @brief Userdata буфера и представления столбца в Lua: создаются один раз при $lua_capture,
+  *        при освобождении записи cap обнуляется. k = 0 - столбец времени.
+  */
+struct {
+  struct capture_s *cap;
+  int               k;
+} typedef capture_ud_t;
+
+
+/**
+  * @brief Запись сигналов по фронту или изменению ($lua_capture). Столбцы - по сигналу, выборка за выборкой:
+  *        width <= 32 - одно слово на выборку, шире - VEC_WORDS(width) слов (младшее первым).
+  */
+struct capture_s {
+  uint32_t          handle;
+  int               ref_handler;
+  int               ref_views;     /* Таблица {буфер, столбец 1, ...} в реестре Lua */
+  int               edge;
+  vpiHandle         trig;
+  vpiHandle         cb;
+  s_vpi_time        cb_time;
+  s_vpi_value       cb_value;
+  int               nsig;
+  vpiHandle         sig[CAPTURE_SIG_MAX];
+  int               width[CAPTURE_SIG_MAX];
+  int               words[CAPTURE_SIG_MAX];
+  uint32_t         *col[CAPTURE_SIG_MAX];
+  int64_t          *time_ns;
+  uint32_t         *xz;            /* Бит k - в сигнале k были X/Z */
+  capture_ud_t     *view[CAPTURE_SIG_MAX + 2];   /* [0] - буфер, [1 + k] - столбец k */
+  uint32_t          depth;
+  uint32_t          count;
+  int               delivering;    /* Буфер передан обработчику: представления столбцов действительны */
+  uint64_t          samples;
+  char              name[LUA_PREFIX_MAX];
+  struct capture_s *next;
+};
+typedef struct capture_s capture_t;
+
+
+static int capture_eos_armed = 0;
+
+
+/**
+  * @brief Буфер или столбец из аргумента idx; вне обработчика обращение - ошибка Lua.
+  */
+static capture_ud_t *capture_check(lua_State *L, int idx, const char *mt)
+{
+  capture_ud_t *ud = (capture_ud_t *)luaL_checkudata(L, idx, mt);
+
+  if( (ud->cap == NULL) || (! ud->cap->delivering) )
+    luaL_error(L, "capture buffer is only valid inside its handler");
+
+  return ud;
+}
+
+
+static lua_Integer capture_index(lua_State *L, capture_t *cap, int idx)
+{
+  lua_Integer i = luaL_checkinteger(L, idx);
+
+  luaL_argcheck(L, (i >= 1) && (i <= (lua_Integer)cap->count), idx, "sample index out of range");
+  return i - 1;
+}
+
+
+/**
+  * @brief Значение сигнала k выборки i на стек: целое (до 32 бит) или строка, младший байт первым.
+  */
+static void capture_push(lua_State *L, capture_t *cap, int k, lua_Integer i)
+{
+  const uint32_t *w;
+  luaL_Buffer     b;
+  int             n;
+  int             j;
+
+  if(k == 0)
+  {
+    lua_pushinteger(L, (lua_Integer)cap->time_ns[i]);
+    return;
+  }
+
+  k--;
+  if(cap->words[k] == 1)
+  {
+    lua_pushinteger(L, (lua_Integer)cap->col[k][i]);
+    return;
+  }
+
+  w = cap->col[k] + (size_t)i * cap->words[k];
+  n = (cap->width[k] + 7) / 8;
 
-  lua_pushinteger(slave->L, *time_ns);
-  lua_pushinteger(slave->L, *CMD_I);
-  lua_pushinteger(slave->L, *ADR_I);
-  lua_pushinteger(slave->L, *DAT_I);
+  luaL_buffinit(L, &b);
 
-  if( lua_pcall(slave->L, 4, 2, 0) != LUA_OK )
+  for(j = 0; j < n; j++)
+    luaL_addchar(&b, (char)(w[j / 4] >> (8 * (j % 4))));
+
+  luaL_pushresult(&b);
+}
+
+
+static int capture_column_k(lua_State *L, capture_t *cap, int idx)
+{
+  lua_Integer k = luaL_checkinteger(L, idx);
+
+  luaL_argcheck(L, (k >= 0) && (k <= cap->nsig), idx, "column out of range (0 - time, 1..N - signals)");
+  return (int)k;
+}
+
+
+/**
+  * @brief #buf - число выборок; buf:signals() - число сигналов.
+  */
+static int lua_capture_len(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer)capture_check(L, 1, CAPTURE_MT)->cap->count);
+  return 1;
+}
+
+
+static int lua_capture_signals(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer)capture_check(L, 1, CAPTURE_MT)->cap->nsig);
+  return 1;
+}
+
+
+/**
+  * @brief buf:time(i) - время выборки i в нс; buf:get(k, i) - значение сигнала k; buf:xz(k, i) - были ли X/Z.
+  */
+static int lua_capture_time(lua_State *L)
+{
+  capture_t *cap = capture_check(L, 1, CAPTURE_MT)->cap;
+
+  capture_push(L, cap, 0, capture_index(L, cap, 2));
+  return 1;
+}
+
+
+static int lua_capture_get(lua_State *L)
+{
+  capture_t *cap = capture_check(L, 1, CAPTURE_MT)->cap;
+  int        k = capture_column_k(L, cap, 2);
+
+  capture_push(L, cap, k, capture_index(L, cap, 3));
+  return 1;
+}
+
+
+static int lua_capture_xz(lua_State *L)
+{
+  capture_t  *cap = capture_check(L, 1, CAPTURE_MT)->cap;
+  int         k = capture_column_k(L, cap, 2);
+  lua_Integer i = capture_index(L, cap, 3);
+
+  lua_pushboolean(L, (k > 0) && ((cap->xz[i] >> (k - 1)) & 1));
+  return 1;
+}
+
+
+/**
+  * @brief buf:column(k) - представление столбца без копирования (#col, col[i]); действительно до возврата из обработчика.
+  */
+static int lua_capture_column(lua_State *L)
+{
+  capture_t *cap = capture_check(L, 1, CAPTURE_MT)->cap;
+  int        k = capture_column_k(L, cap, 2);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cap->ref_views);
+  lua_rawgeti(L, -1, k + 2);
+  return 1;
+}
+
+
+/**
+  * @brief buf:ptr(k) - адрес столбца (lightuserdata) для ffi.cast: k = 0 - int64_t[], иначе uint32_t[] по words(k) слов на выборку.
+  */
+static int lua_capture_ptr(lua_State *L)
+{
+  capture_t *cap = capture_check(L, 1, CAPTURE_MT)->cap;
+  int        k = capture_column_k(L, cap, 2);
+
+  lua_pushlightuserdata(L, (k == 0) ? (void *)cap->time_ns : (void *)cap->col[k - 1]);
+  lua_pushinteger(L, (k == 0) ? 2 : cap->words[k - 1]);
+  return 2;
+}
+
+
+static int lua_column_len(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer)capture_check(L, 1, COLUMN_MT)->cap->count);
+  return 1;
+}
+
+
+static int lua_column_index(lua_State *L)
+{
+  capture_ud_t *ud = capture_check(L, 1, COLUMN_MT);
+
+  capture_push(L, ud->cap, ud->k, capture_index(L, ud->cap, 2));
+  return 1;
+}
+
+
+static const luaL_Reg lua_capture_methods[] =
+{
+  { "signals", lua_capture_signals },
+  { "time",    lua_capture_time    },
+  { "get",     lua_capture_get     },
+  { "xz",      lua_capture_xz      },
+  { "column",  lua_capture_column  },
+  { "ptr",     lua_capture_ptr     },
+  { NULL,      NULL                }
+};
+
+
+/**
+  * @brief Userdata буфера и столбцов в таблице реестра cap->ref_views.
+  */
+static void capture_views(lua_State *L, capture_t *cap)
+{
+  const luaL_Reg *r;
+  capture_ud_t   *ud;
+  int             k;
+
+  if( luaL_newmetatable(L, CAPTURE_MT) )
   {
-    REPORT(MSG_ERROR, "if( lua_pcall(slave->L, 4, 2, 0) != LUA_OK )  '%s'", lua_tostring(slave->L, -1));
-    return -2;
+    lua_newtable(L);
+    for(r = lua_capture_methods; r->name != NULL; r++)
+    {
+      lua_pushcfunction(L, r->func);
+      lua_setfield(L, -2, r->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_capture_len);
+    lua_setfield(L, -2, "__len");
   }
+  lua_pop(L, 1);
 
-#ifdef DEBUG
-  if(! lua_isinteger(slave->L, -2))
+  if( luaL_newmetatable(L, COLUMN_MT) )
   {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(slave->L, -2))  '%s'", lua_tostring(slave->L, -1));
-     return -3;
+    lua_pushcfunction(L, lua_column_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_column_len);
+    lua_setfield(L, -2, "__len");
   }
-#endif
-  *DAT_O = (uint32_t)lua_tointeger(slave->L, -2);
+  lua_pop(L, 1);
 
-#ifdef DEBUG
-  if(! lua_isinteger(slave->L, -1))
+  /* [1] - буфер, [2 + k] - столбец k (0 - время, 1..N - сигналы) */
+  lua_createtable(L, cap->nsig + 2, 0);
+
+  for(k = -1; k <= cap->nsig; k++)
   {
-     REPORT(MSG_ERROR, "if(! lua_isinteger(master->L, -1))  '%s'", lua_tostring(slave->L, -1));
-     return -4;
+    ud = (capture_ud_t *)lua_newuserdata(L, sizeof(capture_ud_t));
+    ud->cap = cap;
+    ud->k   = k;
+    luaL_getmetatable(L, (k < 0) ? CAPTURE_MT : COLUMN_MT);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, k + 2);
+
+    cap->view[k + 1] = ud;
   }
-#endif
-  *STATUS_O = (uint32_t)lua_tointeger(slave->L, -1);
 
-  lua_pop(slave->L, 2);
-  return 0;
+  cap->ref_views = luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
 
 /**
-  * @brief PLI - обёртка для функции init_lua(const char *fname)
+  * @brief Передача накопленных выборок обработчику handler(buf) экземпляра lua; буфер затем пуст.
   */
-static PLI_INT32 calltf_lua_init(PLI_BYTE8 *user_data)
+static void capture_deliver(capture_t *cap, mb_lua_t *lua)
+{
+  if( (cap->count == 0) || (lua == NULL) || (lua->L == NULL) )
+  {
+    cap->count = 0;
+    return;
+  }
+
+  if(lua->par_batch == par.batch)
+    par_flush();   /* Обмены экземпляра, отложенные в этом шаге, выполняются до обработчика */
+
+  lua_rawgeti(lua->L, LUA_REGISTRYINDEX, cap->ref_handler);
+  lua_rawgeti(lua->L, LUA_REGISTRYINDEX, cap->ref_views);
+  lua_rawgeti(lua->L, -1, 1);
+  lua_remove(lua->L, -2);
+
+  cap->delivering = 1;
+
+  if( lua_pcall(lua->L, 1, 0, 0) != LUA_OK )
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( lua_pcall(lua->L, 1, 0, 0) != LUA_OK )  %s: '%s'", cap->name, lua_tostring(lua->L, -1));
+    lua_settop(lua->L, 0);
+  }
+
+  cap->delivering = 0;
+  cap->count = 0;
+  stats_mem(lua);
+}
+
+
+/**
+  * @brief Выборка всех сигналов в момент срабатывания; полный буфер сразу передаётся в Lua.
+  */
+static void capture_sample(capture_t *cap)
 {
-  const char *fname;
-  vpiHandle inst_h;
-  vpiHandle arg_iter;
-  vpiHandle fname_hdl;
-  vpiHandle descriptor_hdl_LO;
-  vpiHandle descriptor_hdl_HI;
   s_vpi_value value_s;
-  uint64_t descriptor;
-  int ret;
-  mb_lua_t *master = NULL;
+  uint32_t   *dst;
+  uint32_t    xz = 0;
+  uint32_t    i = cap->count;
+  int         k;
+  int         w;
+
+  cap->time_ns[i] = sim_time_ns();
+
+  for(k = 0; k < cap->nsig; k++)
+  {
+    value_s.format = vpiVectorVal;
+    vpi_get_value(cap->sig[k], &value_s);
+
+    dst = cap->col[k] + (size_t)i * cap->words[k];
+    for(w = 0; w < cap->words[k]; w++)
+    {
+      dst[w] = (uint32_t)value_s.value.vector[w].aval;
+      if(value_s.value.vector[w].bval != 0)
+        xz |= 1u << k;
+    }
+  }
+
+  cap->xz[i] = xz;
+  cap->samples++;
+
+  if(++cap->count == cap->depth)
+    capture_deliver(cap, handle_get(cap->handle));
+}
+
+
+static PLI_INT32 cb_capture(p_cb_data cb_data)
+{
+  capture_t *cap = (capture_t *)cb_data->user_data;
+
+  if( (cap->edge == CAPTURE__POSEDGE) && (cb_data->value->value.scalar != vpi1) )
+    return 0;
+
+  if( (cap->edge == CAPTURE__NEGEDGE) && (cb_data->value->value.scalar != vpi0) )
+    return 0;
+
+  capture_sample(cap);
+  return 0;
+}
+
+
+static void capture_free(capture_t *cap, mb_lua_t *lua)
+{
+  int k;
+
+  if(cap->cb != NULL)
+    vpi_remove_cb(cap->cb);
+
+  for(k = 0; k < cap->nsig + 2; k++)
+  {
+    if(cap->view[k] != NULL)
+      cap->view[k]->cap = NULL;
+  }
+
+  if( (lua != NULL) && (lua->L != NULL) )
+  {
+    luaL_unref(lua->L, LUA_REGISTRYINDEX, cap->ref_handler);
+    luaL_unref(lua->L, LUA_REGISTRYINDEX, cap->ref_views);
+  }
+
+  for(k = 0; k < cap->nsig; k++)
+    free(cap->col[k]);
+  free(cap->time_ns);
+  free(cap->xz);
+  free(cap);
+}
+
+
+/**
+  * @brief Остаток выборок - в Lua, затем запись снимается (при $lua_deinit: описатель уже освобождён, до deinit_env).
+  */
+static void capture_remove_all(mb_lua_t *lua)
+{
+  capture_t *cap;
+
+  while(lua->capture != NULL)
+  {
+    cap = lua->capture;
+    capture_deliver(cap, lua);
+    REPORT_PFX(lua->prefix, MSG_INFO, "%s: %llu samples", cap->name, (unsigned long long)cap->samples);
+
+    lua->capture = cap->next;
+    capture_free(cap, lua);
+  }
+}
+
+
+/**
+  * @brief Конец симуляции: остаток выборок экземпляров без $lua_deinit передаётся в Lua.
+  */
+static PLI_INT32 cb_capture_end_of_sim(p_cb_data cb_data)
+{
+  capture_t *cap;
+  uint32_t   i;
+
+  for(i = 0; i < handle_count; i++)
+  {
+    if(handle_tab[i].lua == NULL)
+      continue;
+
+    for(cap = handle_tab[i].lua->capture; cap != NULL; cap = cap->next)
+      capture_deliver(cap, handle_tab[i].lua);
+  }
+
+  return 0;
+}
 
 
+/**
+  * @brief $lua_capture(Descriptor, handler, "posedge" | "negedge" | "change", TRIG, сигналы...)
+  *        По срабатыванию TRIG значения сигналов записываются в столбцы в C; handler(buf) скрипта вызывается,
+  *        когда буфер заполнен (+lua_capture_depth выборок), при $lua_deinit и в конце симуляции.
+  */
+static PLI_INT32 calltf_lua_capture(PLI_BYTE8 *user_data)
+{
+  vpiHandle   inst_h;
+  vpiHandle   arg_iter;
+  vpiHandle   arg[4 + CAPTURE_SIG_MAX + 1];
+  s_vpi_value value_s;
+  s_cb_data   cb_data;
+  capture_t  *cap;
+  mb_lua_t   *lua;
+  const char *edge;
+  int         kind;
+  int         n;
+  int         k;
+
   inst_h = vpi_handle(vpiSysTfCall, NULL);
   arg_iter = vpi_iterate(vpiArgument, inst_h);
 
-  if(arg_iter == NULL)
+  for(n = 0; (arg_iter != NULL) && (n < (int)(sizeof(arg) / sizeof(arg[0]))); n++)
   {
-    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
-    return 0;
+    arg[n] = vpi_scan(arg_iter);
+    if(arg[n] == NULL)
+      break;
   }
 
-  descriptor_hdl_LO = vpi_scan(arg_iter);
+  if(n == (int)(sizeof(arg) / sizeof(arg[0])))
+  {
+    vpi_free_object(arg_iter);
+    REPORT(MSG_ERROR, "$lua_capture: at most %d signals", CAPTURE_SIG_MAX);
+    return 0;
+  }
 
-  if(descriptor_hdl_LO == NULL)
+  if(n < 5)
   {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_LO) == NULL)");
+    REPORT(MSG_ERROR, "if(n < 5)  $lua_capture expects (Descriptor, handler, edge, TRIG, signals...)");
     return 0;
   }
 
-  descriptor_hdl_HI = vpi_scan(arg_iter);
+  value_s.format = vpiIntVal;
+  vpi_get_value(arg[0], &value_s);
+  lua = handle_get((uint32_t)value_s.value.integer);
 
-  if(descriptor_hdl_HI == NULL)
+  if( (lua == NULL) || (lua->L == NULL) )
   {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_HI) == NULL)");
+    REPORT(MSG_ERROR, "if( (lua == NULL) || (lua->L == NULL) )  invalid descriptor 0x%08X", (uint32_t)value_s.value.integer);
     return 0;
   }
 
-  fname_hdl = vpi_scan(arg_iter);
-
-  if(fname_hdl == NULL)
+  if(lua->worker != NULL)
   {
-    REPORT(MSG_ERROR, "if(fname_hdl) == NULL)");
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if(lua->worker != NULL)  $lua_capture is not available with +lua_threaded");
+    vpi_control(vpiFinish, 1);
     return 0;
   }
 
   value_s.format = vpiStringVal;
-  vpi_get_value(fname_hdl, &value_s);
-  fname = value_s.value.str;
+  vpi_get_value(arg[2], &value_s);
+  edge = (value_s.value.str != NULL) ? value_s.value.str : "";
+
+  if( strcmp(edge, "posedge") == 0 )
+    kind = CAPTURE__POSEDGE;
+  else if( strcmp(edge, "negedge") == 0 )
+    kind = CAPTURE__NEGEDGE;
+  else if( strcmp(edge, "change") == 0 )
+    kind = CAPTURE__CHANGE;
+  else
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( edge != \"posedge\" && edge != \"negedge\" && edge != \"change\" )  $lua_capture trigger '%s'", edge);
+    return 0;
+  }
 
-  if(fname == NULL)
+  cap = (capture_t *)calloc(1, sizeof(capture_t));
+  if(cap == NULL)
   {
-    REPORT(MSG_ERROR, "if(fname == NULL)");
+    REPORT(MSG_ERROR, "if(cap == NULL)");
     return 0;
   }
 
-  ret = init_lua(&master, fname);
-  if( ret < 0 )
+  value_s.format = vpiStringVal;
+  vpi_get_value(arg[1], &value_s);
+  snprintf(cap->name, sizeof(cap->name), "%s", (value_s.value.str != NULL) ? value_s.value.str : "");
+
+  cap->edge        = kind;
+  cap->handle      = lua->handle;
+  cap->trig        = arg[3];
+  cap->nsig        = n - 4;
+  cap->depth       = opt_capture_depth;
+  cap->ref_handler = lua_ref_function(lua->L, cap->name);
+  cap->ref_views   = LUA_NOREF;
+
+  if(cap->ref_handler == LUA_NOREF)
   {
-    REPORT(MSG_ERROR, "if( ret < 0 )");
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if(cap->ref_handler == LUA_NOREF)  function '%s' not found", cap->name);
+    capture_free(cap, lua);
     return 0;
   }
 
-  descriptor = (uint64_t)(master);
+  cap->time_ns = (int64_t *)malloc(sizeof(int64_t) * cap->depth);
+  cap->xz      = (uint32_t *)malloc(sizeof(uint32_t) * cap->depth);
+
+  for(k = 0; k < cap->nsig; k++)
+  {
+    cap->sig[k]   = arg[4 + k];
+    cap->width[k] = vpi_get(vpiSize, cap->sig[k]);
+    cap->words[k] = VEC_WORDS(cap->width[k]);
+    cap->col[k]   = (uint32_t *)malloc(sizeof(uint32_t) * cap->depth * (size_t)cap->words[k]);
+
+    if(cap->col[k] == NULL)
+      break;
+  }
 
-  if(descriptor == 0)
+  if( (cap->time_ns == NULL) || (cap->xz == NULL) || (k < cap->nsig) )
   {
-    REPORT(MSG_ERROR, "if(descriptor == NULL)");
+    REPORT(MSG_ERROR, "if( (cap->time_ns == NULL) || (cap->xz == NULL) || (k < cap->nsig) )");
+    capture_free(cap, lua);
     return 0;
   }
 
+  capture_views(lua->L, cap);
 
-  value_s.format = vpiIntVal;
-  value_s.value.integer = (PLI_INT32)descriptor;
-  vpi_put_value(descriptor_hdl_LO, &value_s, NULL, vpiNoDelay);
+  cap->cb_time.type    = vpiSuppressTime;
+  cap->cb_value.format = vpiScalarVal;
 
-  value_s.value.integer = (PLI_INT32)(descriptor >> 32);
-  vpi_put_value(descriptor_hdl_HI, &value_s, NULL, vpiNoDelay);
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason    = cbValueChange;
+  cb_data.cb_rtn    = cb_capture;
+  cb_data.obj       = cap->trig;
+  cb_data.time      = &cap->cb_time;
+  cb_data.value     = &cap->cb_value;
+  cb_data.user_data = (PLI_BYTE8 *)cap;
 
-  vpi_free_object(fname_hdl);
-  vpi_free_object(descriptor_hdl_LO);
-  vpi_free_object(descriptor_hdl_HI);
+  cap->cb = vpi_register_cb(&cb_data);
+  if(cap->cb == NULL)
+  {
+    REPORT(MSG_ERROR, "if(cap->cb == NULL)");
+    capture_free(cap, lua);
+    return 0;
+  }
 
-  vpi_free_object(arg_iter);
-  vpi_free_object(inst_h);
+  if(! capture_eos_armed)
+  {
+    memset(&cb_data, 0, sizeof(cb_data));
+    cb_data.reason = cbEndOfSimulation;
+    cb_data.cb_rtn = cb_capture_end_of_sim;
+    vpi_free_object(vpi_register_cb(&cb_data));
+    capture_eos_armed = 1;
+  }
 
+  cap->next = lua->capture;
+  lua->capture = cap;
   return 0;
 }
 
 
+/*****************************************************************************
+ * watch(): наблюдение за сигналами с фильтром в C
+ *****************************************************************************/
+
+enum
+{
+  WATCH__POSEDGE = 0,   /* Любой бит маски 0 -> 1 */
+  WATCH__NEGEDGE,       /* Любой бит маски 1 -> 0 */
+  WATCH__EQ,            /* Значение под маской стало равно value */
+  WATCH__CHANGE         /* Изменился любой бит маски */
+} typedef watch_filter_t;
+
+
+static const char *const watch_filters[] = { "posedge", "negedge", "eq", "change", NULL };
+
+
 /**
-  * @brief PLI - обёртка для функции void deinit_sockets(mb_master_t *master)
+  * @brief Наблюдение watch(). Запись - userdata Lua - машины экземпляра (освобождается вместе с ней);
+  *        cbValueChange ставится, когда у экземпляра есть дескриптор, и снимается при $lua_deinit.
   */
-static PLI_INT32 calltf_lua_deinit(PLI_BYTE8 *user_data)
+struct watch_s {
+  int             id;
+  int             filter;
+  uint32_t        mask;
+  uint32_t        value;
+  uint32_t        prev;          /* Значение при прошлом изменении (биты X/Z - 0) */
+  int             ref_handler;
+  int             ref_self;      /* Ссылка реестра на саму запись: сборщик её не освобождает */
+  int             running;       /* Выполняется обработчик: unwatch() откладывает освобождение */
+  int             removed;
+  uint64_t        changes;
+  uint64_t        hits;
+  vpiHandle       net;
+  vpiHandle       cb;
+  s_vpi_time      cb_time;
+  s_vpi_value     cb_value;
+  mb_lua_t       *lua;
+  char            name[LUA_PREFIX_MAX];
+  struct watch_s *next;
+};
+typedef struct watch_s watch_t;
+
+
+static int watch_match(const watch_t *w, uint32_t prev, uint32_t v)
 {
-  vpiHandle inst_h;
-  vpiHandle arg_iter;
+  switch(w->filter)
+  {
+    case WATCH__POSEDGE:
+      return (~prev & v & w->mask) != 0;
 
-  vpiHandle descriptor_hdl_LO;
-  vpiHandle descriptor_hdl_HI;
+    case WATCH__NEGEDGE:
+      return (prev & ~v & w->mask) != 0;
 
-  s_vpi_value value_s;
+    case WATCH__EQ:
+      return ((v & w->mask) == w->value) && ((prev & w->mask) != w->value);
 
-  uint64_t descriptor;
+    default:
+      return ((prev ^ v) & w->mask) != 0;
+  }
+}
 
 
-  inst_h = vpi_handle(vpiSysTfCall, NULL);
-  arg_iter = vpi_iterate(vpiArgument, inst_h);
+/**
+  * @brief Изменение наблюдаемого сигнала. Фильтр проверяется в C; Lua вызывается только при совпадении:
+  *        handler(value, prev, time_ns, id).
+  */
+static PLI_INT32 cb_watch(p_cb_data cb_data)
+{
+  watch_t   *w = (watch_t *)cb_data->user_data;
+  mb_lua_t  *lua = w->lua;
+  uint32_t   v = (uint32_t)cb_data->value->value.integer;
+  uint32_t   prev = w->prev;
+  lua_State *L;
 
-#ifdef DEBUG
-  if(arg_iter == NULL)
-  {
-    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
+  w->prev = v;
+  w->changes++;
+
+  if( ! watch_match(w, prev, v) )
     return 0;
+
+  w->hits++;
+
+  if(lua->par_batch == par.batch)
+    par_flush();   /* Обмены экземпляра, отложенные в этом шаге, выполняются до обработчика */
+
+  L = lua->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref_handler);
+  lua_pushinteger(L, (lua_Integer)v);
+  lua_pushinteger(L, (lua_Integer)prev);
+  lua_pushinteger(L, (lua_Integer)sim_time_ns());
+  lua_pushinteger(L, (lua_Integer)w->id);
+
+  w->running = 1;
+
+  if( lua_pcall(L, 4, 0, 0) != LUA_OK )
+  {
+    REPORT_PFX(lua->prefix, MSG_ERROR, "if( lua_pcall(L, 4, 0, 0) != LUA_OK )  watch %d '%s': '%s'", w->id, w->name, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  w->running = 0;
+
+  if(w->removed)   /* unwatch() из собственного обработчика */
+    luaL_unref(L, LUA_REGISTRYINDEX, w->ref_self);
+
+  stats_mem(lua);
+  return 0;
+}
+
+
+static void watch_arm(watch_t *w)
+{
+  s_vpi_value value_s;
+  s_cb_data   cb_data;
+
+  value_s.format = vpiIntVal;
+  vpi_get_value(w->net, &value_s);
+  w->prev = (uint32_t)value_s.value.integer;
+
+  w->cb_time.type    = vpiSuppressTime;
+  w->cb_value.format = vpiIntVal;
+
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason    = cbValueChange;
+  cb_data.cb_rtn    = cb_watch;
+  cb_data.obj       = w->net;
+  cb_data.time      = &w->cb_time;
+  cb_data.value     = &w->cb_value;
+  cb_data.user_data = (PLI_BYTE8 *)w;
+
+  w->cb = vpi_register_cb(&cb_data);
+  if(w->cb == NULL)
+    REPORT_PFX(w->lua->prefix, MSG_ERROR, "if(w->cb == NULL)  watch %d '%s'", w->id, w->name);
+}
+
+
+/**
+  * @brief Постановка наблюдений, созданных при загрузке скрипта и в init_env (у экземпляра появился дескриптор).
+  */
+static void watch_arm_all(mb_lua_t *lua)
+{
+  watch_t *w;
+
+  for(w = lua->watch; w != NULL; w = w->next)
+  {
+    if(w->cb == NULL)
+      watch_arm(w);
   }
-#endif
+}
 
-  descriptor_hdl_LO = vpi_scan(arg_iter);
 
-#ifdef DEBUG
-  if(descriptor_hdl_LO == NULL)
+/**
+  * @brief Снятие наблюдений при $lua_deinit. Записи освобождаются вместе с Lua - машиной.
+  */
+static void watch_remove_all(mb_lua_t *lua)
+{
+  watch_t *w;
+
+  for(w = lua->watch; w != NULL; w = w->next)
   {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_LO) == NULL)");
-    return 0;
+    if(w->cb != NULL)
+      vpi_remove_cb(w->cb);
+    w->cb = NULL;
+
+    REPORT_PFX(lua->prefix, MSG_INFO, "watch %d '%s': %llu of %llu changes matched", w->id, w->name,
+      (unsigned long long)w->hits, (unsigned long long)w->changes);
   }
-#endif
 
-  descriptor_hdl_HI = vpi_scan(arg_iter);
+  lua->watch = NULL;
+}
+
 
-#ifdef DEBUG
-  if(descriptor_hdl_HI == NULL)
+/**
+  * @brief id = watch(net, "posedge" | "negedge" | "eq" | "change", handler [, mask [, value]]).
+  *        net - полное иерархическое имя или имя относительно модуля $lua_init; до 32 бит.
+  *        mask по умолчанию - все биты сигнала; для "eq" value обязательно.
+  */
+static int lua_watch(lua_State *L)
+{
+  mb_lua_t   *lua = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *name = luaL_checkstring(L, 1);
+  int         filter = luaL_checkoption(L, 2, NULL, watch_filters);
+  char        path[LUA_PREFIX_MAX + 256];
+  vpiHandle   net;
+  watch_t    *w;
+  int         width;
+
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  luaL_argcheck(L, (filter != WATCH__EQ) || (! lua_isnoneornil(L, 5)), 5, "'eq' needs a value");
+
+  if( (lua->worker != NULL) || lua->pooled )
+    return luaL_error(L, "watch() is only available on the simulator thread");
+
+  net = vpi_handle_by_name((PLI_BYTE8 *)name, NULL);
+  if(net == NULL)
   {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_HI) == NULL)");
-    return 0;
+    snprintf(path, sizeof(path), "%s.%s", lua->prefix, name);
+    net = vpi_handle_by_name(path, NULL);
   }
-#endif
 
+  if(net == NULL)
+    return luaL_error(L, "watch(): net '%s' not found", name);
 
-  value_s.format = vpiIntVal;
-  vpi_get_value(descriptor_hdl_HI, &value_s);
-  descriptor = (uint64_t)(value_s.value.integer);
-  descriptor = descriptor << 32;
+  width = vpi_get(vpiSize, net);
+  if(width > 32)
+    return luaL_error(L, "watch(): '%s' is %d bits wide, at most 32 are supported", name, width);
 
-  vpi_get_value(descriptor_hdl_LO, &value_s);
-  descriptor |= (0x00000000FFFFFFFF & (uint64_t)(value_s.value.integer));
+  w = (watch_t *)lua_newuserdata(L, sizeof(watch_t));
+  memset(w, 0, sizeof(watch_t));
+  w->ref_self = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  deinit_lua((mb_lua_t *)descriptor);
+  lua_pushvalue(L, 3);
+  w->ref_handler = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  vpi_free_object(descriptor_hdl_HI);
-  vpi_free_object(descriptor_hdl_LO);
+  w->id     = ++lua->watch_id;
+  w->filter = filter;
+  w->mask   = (uint32_t)luaL_optinteger(L, 4, ((width > 0) && (width < 32)) ? (lua_Integer)((1ull << width) - 1) : -1);
+  w->value  = (uint32_t)luaL_optinteger(L, 5, 0) & w->mask;
+  w->net    = net;
+  w->lua    = lua;
+  snprintf(w->name, sizeof(w->name), "%s", name);
 
-  vpi_free_object(arg_iter);
-  vpi_free_object(inst_h);
-  return 0;
+  w->next = lua->watch;
+  lua->watch = w;
+
+  if(lua->handle != 0)   /* Иначе - после выдачи дескриптора, watch_arm_all() */
+    watch_arm(w);
 
+  lua_pushinteger(L, (lua_Integer)w->id);
+  return 1;
 }
 
 
 /**
-  * @brief PLI - обёртка для функции exchange_CAD(lua_State* L, int32_t *CMD_O, int32_t *ADR_O, int32_t *DAT_O, const int32_t *DAT_I, const int32_t *STATUS_I)
+  * @brief unwatch(id): снятие наблюдения. Возвращает false, если такого нет.
   */
-static PLI_INT32 calltf_lua_exchange_M(PLI_BYTE8 *user_data) //Verilog -> lua
+static int lua_unwatch(lua_State *L)
 {
-  vpiHandle inst_h;
-  vpiHandle arg_iter;
-
-  vpiHandle descriptor_hdl_LO;
-  vpiHandle descriptor_hdl_HI;
-  vpiHandle time_ns_hdl;
-  vpiHandle CMD_O_hdl;
-  vpiHandle ADR_O_hdl;
-  vpiHandle DAT_O_hdl;
-  vpiHandle DAT_I_hdl;
-  vpiHandle STATUS_I_hdl;
-  vpiHandle result_hdl;
-
-  s_vpi_value value_s;
+  mb_lua_t    *lua = (mb_lua_t *)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Integer  id = luaL_checkinteger(L, 1);
+  watch_t    **pw;
+  watch_t     *w;
 
-  uint64_t descriptor;
-  int32_t time_ns = 0;
-  int32_t CMD_O = 0;
-  int32_t ADR_O = 0;
-  int32_t DAT_O = 0;
-  int32_t DAT_I;
-  int32_t STATUS_I;
-  int32_t result;
+  if( (lua->worker != NULL) || lua->pooled )
+    return luaL_error(L, "unwatch() is only available on the simulator thread");
 
-  inst_h = vpi_handle(vpiSysTfCall, NULL);
-  arg_iter = vpi_iterate(vpiArgument, inst_h);
+  for(pw = &lua->watch; (*pw != NULL) && ((*pw)->id != id); pw = &(*pw)->next)
+    ;
 
-#ifdef DEBUG
-  if(arg_iter == NULL)
+  w = *pw;
+  if(w == NULL)
   {
-    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
-    return 0;
+    lua_pushboolean(L, 0);
+    return 1;
   }
-#endif
 
-  descriptor_hdl_LO = vpi_scan(arg_iter);
+  *pw = w->next;
 
-#ifdef DEBUG
-  if(descriptor_hdl_LO == NULL)
-  {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_LO) == NULL)");
-    return 0;
-  }
-#endif
+  if(w->cb != NULL)
+    vpi_remove_cb(w->cb);
+  w->cb = NULL;
 
-  descriptor_hdl_HI = vpi_scan(arg_iter);
+  luaL_unref(L, LUA_REGISTRYINDEX, w->ref_handler);
 
-#ifdef DEBUG
-  if(descriptor_hdl_HI == NULL)
-  {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_HI) == NULL)");
-    return 0;
-  }
-#endif
+  if(w->running)
+    w->removed = 1;
+  else
+    luaL_unref(L, LUA_REGISTRYINDEX, w->ref_self);
 
-  time_ns_hdl = vpi_scan(arg_iter);
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-#ifdef DEBUG
-  if(time_ns_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(time_ns_hdl == NULL)");
-    return 0;
-  }
-#endif
 
-  CMD_O_hdl = vpi_scan(arg_iter);
+/**
+  * @brief Поиск plusarg вида +name=value в командной строке симулятора.
+  * @param  name: Имя без '+' и '='.
+  * @retval const char* Значение после '=', "" для +name без значения, NULL если plusarg не задан.
+  */
+static const char *plusarg_value(const char *name)
+{
+  s_vpi_vlog_info info;
+  size_t len = strlen(name);
+  int    i;
+
+  if( ! vpi_get_vlog_info(&info) )
+    return NULL;
 
-#ifdef DEBUG
-  if(CMD_O_hdl == NULL)
+  for(i = 0; i < info.argc; i++)
   {
-    REPORT(MSG_ERROR, "if(CMD_O_hdl) == NULL)");
-    return 0;
-  }
-#endif
+    const char *arg = info.argv[i];
 
-  ADR_O_hdl = vpi_scan(arg_iter);
+    if( (arg == NULL) || (arg[0] != '+') || (strncmp(arg + 1, name, len) != 0) )
+      continue;
 
-#ifdef DEBUG
-  if(ADR_O_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(ADR_O_hdl) == NULL)");
-    return 0;
+    if( arg[len + 1] == '=' )
+      return arg + len + 2;
+
+    if( arg[len + 1] == '\0' )
+      return "";
   }
-#endif
 
-  DAT_O_hdl = vpi_scan(arg_iter);
+  return NULL;
+}
 
-#ifdef DEBUG
-  if(DAT_O_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(DAT_O_hdl) == NULL)");
-    return 0;
-  }
-#endif
 
-  DAT_I_hdl = vpi_scan(arg_iter);
+/**
+  * @brief Завершение моделирования: вывод всего накопленного в буфере сообщений.
+  */
+static PLI_INT32 cb_end_of_sim(p_cb_data cb_data)
+{
+  DebugLogStop();
+  return 0;
+}
+
 
-#ifdef DEBUG
-  if(DAT_I_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(DAT_I_hdl) == NULL)");
-    return 0;
-  }
-#endif
+/**
+  * @brief Конец симуляции: счётчики экземпляров, для которых не был вызван $lua_deinit.
+  */
+static PLI_INT32 cb_stats_end_of_sim(p_cb_data cb_data)
+{
+  uint32_t i;
 
-  STATUS_I_hdl = vpi_scan(arg_iter);
+  /* Порядок колбэков cbEndOfSimulation не задан: последний пакет +lua_parallel и остаток $lua_capture
+     выполняются до вывода, повторный вызов в их собственных колбэках ничего не делает */
+  par_flush();
+  cb_capture_end_of_sim(cb_data);
 
-#ifdef DEBUG
-  if(STATUS_I_hdl == NULL)
+  for(i = 0; i < handle_count; i++)
   {
-    REPORT(MSG_ERROR, "if(STATUS_I_hdl) == NULL)");
-    return 0;
+    if(handle_tab[i].lua != NULL)
+      stats_dump(handle_tab[i].lua);
   }
-#endif
 
-  result_hdl = vpi_scan(arg_iter);
+  return 0;
+}
+
 
-#ifdef DEBUG
-  if(result_hdl == NULL)
+/**
+  * @brief Конец симуляции: остановка пула +lua_parallel.
+  */
+static PLI_INT32 cb_par_end_of_sim(p_cb_data cb_data)
+{
+  par_flush();
+  par_stop();
+  return 0;
+}
+
+
+static void gc_arm(int reason);
+
+
+/**
+  * @brief Конец шага симуляции (cbReadOnlySynch): сборка мусора экземпляров, выполняющихся в потоке симулятора.
+  */
+static PLI_INT32 cb_gc_read_only(p_cb_data cb_data)
+{
+  uint32_t i;
+
+  for(i = 0; i < handle_count; i++)
   {
-    REPORT(MSG_ERROR, "if(result_hdl) == NULL)");
-    return 0;
+    if( (handle_tab[i].lua != NULL) && (handle_tab[i].lua->worker == NULL) )
+      gc_idle(handle_tab[i].lua);
   }
-#endif
-
-  value_s.format = vpiIntVal;
-  vpi_get_value(descriptor_hdl_HI, &value_s);
-  descriptor = (uint64_t)(value_s.value.integer);
-  descriptor = descriptor << 32;
 
-  vpi_get_value(descriptor_hdl_LO, &value_s);
-  descriptor |= (0x00000000FFFFFFFF & (uint64_t)(value_s.value.integer));
+  gc_arm(cbNextSimTime);
+  return 0;
+}
 
 
-  vpi_get_value(DAT_I_hdl, &value_s);
-  DAT_I = value_s.value.integer;
+/**
+  * @brief Начало следующего шага симуляции: точка простоя - его конец.
+  */
+static PLI_INT32 cb_gc_next_time(p_cb_data cb_data)
+{
+  gc_arm(cbReadOnlySynch);
+  return 0;
+}
 
-  vpi_get_value(STATUS_I_hdl, &value_s);
-  STATUS_I = value_s.value.integer;
 
-  result = lua_exchange_M((mb_lua_t *)descriptor, &time_ns, &CMD_O, &ADR_O, &DAT_O, &DAT_I, &STATUS_I);
+static void gc_arm(int reason)
+{
+  static s_vpi_time time_s;
+  s_cb_data         cb_data;
+  vpiHandle         cb_hdl;
 
-  value_s.value.integer = time_ns;
-  vpi_put_value(time_ns_hdl, &value_s, NULL, vpiNoDelay);
+  time_s.type = vpiSimTime;
+  time_s.high = 0;
+  time_s.low  = 0;
 
-  value_s.value.integer = CMD_O;
-  vpi_put_value(CMD_O_hdl, &value_s, NULL, vpiNoDelay);
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason = reason;
+  cb_data.cb_rtn = (reason == cbReadOnlySynch) ? cb_gc_read_only : cb_gc_next_time;
+  cb_data.time   = &time_s;
 
-  value_s.value.integer = ADR_O;
-  vpi_put_value(ADR_O_hdl, &value_s, NULL, vpiNoDelay);
+  cb_hdl = vpi_register_cb(&cb_data);
 
-  value_s.value.integer = DAT_O;
-  vpi_put_value(DAT_O_hdl, &value_s, NULL, vpiNoDelay);
+  if(cb_hdl == NULL)
+    REPORT(MSG_WARNING, "if(cb_hdl == NULL)  GC idle callbacks are not available");
+  else
+    vpi_free_object(cb_hdl);
+}
 
-  value_s.value.integer = result;
-  vpi_put_value(result_hdl, &value_s, NULL, vpiNoDelay);
 
-  vpi_free_object(descriptor_hdl_HI);
-  vpi_free_object(descriptor_hdl_LO);
-  vpi_free_object(time_ns_hdl);
-  vpi_free_object(CMD_O_hdl);
-  vpi_free_object(ADR_O_hdl);
-  vpi_free_object(DAT_O_hdl);
-  vpi_free_object(DAT_I_hdl);
-  vpi_free_object(STATUS_I_hdl);
-  vpi_free_object(result_hdl);
+/* Запланирован вывод накопленных сообщений в начале следующего шага времени */
+static int log_armed = 0;
 
-  vpi_free_object(arg_iter);
-  vpi_free_object(inst_h);
 
+/**
+  * @brief Начало следующего шага времени: сообщения прошлого шага передаются в stdout до его событий,
+  *        поэтому они не окажутся после $display/vpi_printf более поздних моментов.
+  */
+static PLI_INT32 cb_log_next_time(p_cb_data cb_data)
+{
+  log_armed = 0;
+  DebugLogDrain();
   return 0;
 }
 
 
-static PLI_INT32 calltf_lua_exchange_S(PLI_BYTE8 *user_data) //Verilog -> lua
+/**
+  * @brief Планирование cb_log_next_time, если в буфере есть сообщения. Только поток симулятора.
+  *        Без REPORT: вызывается после каждого сообщения (DebugLogSetNotify).
+  */
+static void log_arm(void)
 {
-  vpiHandle inst_h;
-  vpiHandle arg_iter;
-
-  vpiHandle descriptor_hdl_LO;
-  vpiHandle descriptor_hdl_HI;
-  vpiHandle time_ns_hdl;
-  vpiHandle CMD_I_hdl;
-  vpiHandle ADR_I_hdl;
-  vpiHandle DAT_I_hdl;
-  vpiHandle DAT_O_hdl;
-  vpiHandle STATUS_O_hdl;
-  vpiHandle result_hdl;
+  static s_vpi_time time_s;
+  s_cb_data         cb_data;
+  vpiHandle         cb_hdl;
 
-  s_vpi_value value_s;
+  if( log_armed || ! DebugLogPending() )
+    return;
 
-  uint64_t descriptor;
-  int32_t time_ns;
-  int32_t CMD_I;
-  int32_t ADR_I;
-  int32_t DAT_I;
-  int32_t DAT_O = 0;
-  int32_t STATUS_O = 0;
-  int32_t result;
+  time_s.type = vpiSimTime;
+  time_s.high = 0;
+  time_s.low  = 0;
 
-  inst_h = vpi_handle(vpiSysTfCall, NULL);
-  arg_iter = vpi_iterate(vpiArgument, inst_h);
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason = cbNextSimTime;
+  cb_data.cb_rtn = cb_log_next_time;
+  cb_data.time   = &time_s;
 
-#ifdef DEBUG
-  if(arg_iter == NULL)
+  cb_hdl = vpi_register_cb(&cb_data);
+  if(cb_hdl != NULL)
   {
-    REPORT(MSG_ERROR, "if(arg_iter == NULL)");
-    return 0;
+    vpi_free_object(cb_hdl);
+    log_armed = 1;
   }
-#endif
-
-  descriptor_hdl_LO = vpi_scan(arg_iter);
+}
 
-#ifdef DEBUG
-  if(descriptor_hdl_LO == NULL)
-  {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_LO) == NULL)");
-    return 0;
-  }
-#endif
 
-  descriptor_hdl_HI = vpi_scan(arg_iter);
+/**
+  * @brief Настройка вывода сообщений по plusargs:
+  *        +lua_log_level=N (0 - ничего, 1 - ошибки, 2 - предупреждения, 3 - информация и print() из Lua, 4 - отладка),
+  *        +lua_log_sync - вывод без фонового потока.
+  */
+static void log_init(void)
+{
+  const char *level;
+  s_cb_data   cb_data;
+  vpiHandle   cb_hdl;
 
-#ifdef DEBUG
-  if(descriptor_hdl_HI == NULL)
-  {
-    REPORT(MSG_ERROR, "if(descriptor_hdl_HI) == NULL)");
-    return 0;
-  }
-#endif
+  level = plusarg_value("lua_log_level");
+  if( (level != NULL) && (level[0] != '\0') )
+    DebugLogLevel = atoi(level);
 
-  time_ns_hdl = vpi_scan(arg_iter);
+  if( plusarg_value("lua_log_sync") != NULL )
+    return;
 
-#ifdef DEBUG
-  if(time_ns_hdl == NULL)
+  if( DebugLogStart(_FD_) != 0 )
   {
-    REPORT(MSG_ERROR, "if(time_ns_hdl == NULL)");
-    return 0;
+    REPORT(MSG_WARNING, "if( DebugLogStart(_FD_) != 0 )");
+    return;
   }
-#endif
 
-  CMD_I_hdl = vpi_scan(arg_iter);
-
-#ifdef DEBUG
-  if(CMD_I_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(CMD_O_hdl) == NULL)");
-    return 0;
-  }
-#endif
+  DebugLogSetNotify(log_arm);
 
-  ADR_I_hdl = vpi_scan(arg_iter);
+  memset(&cb_data, 0, sizeof(cb_data));
+  cb_data.reason = cbEndOfSimulation;
+  cb_data.cb_rtn = cb_end_of_sim;
+  cb_hdl = vpi_register_cb(&cb_data);
+  vpi_free_object(cb_hdl);
+}
 
-#ifdef DEBUG
-  if(ADR_I_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(ADR_O_hdl) == NULL)");
-    return 0;
-  }
-#endif
 
-  DAT_I_hdl = vpi_scan(arg_iter);
+/**
+  * @brief Размер вида N[K|M|G] в байтах.
+  */
+static size_t parse_size(const char *arg)
+{
+  char  *end;
+  size_t n = (size_t)strtoull(arg, &end, 0);
 
-#ifdef DEBUG
-  if(DAT_I_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(DAT_O_hdl) == NULL)");
-    return 0;
-  }
-#endif
+  if( (*end == 'K') || (*end == 'k') )
+    n <<= 10;
+  else if( (*end == 'M') || (*end == 'm') )
+    n <<= 20;
+  else if( (*end == 'G') || (*end == 'g') )
+    n <<= 30;
 
-  DAT_O_hdl = vpi_scan(arg_iter);
+  return n;
+}
 
-#ifdef DEBUG
-  if(DAT_O_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(DAT_I_hdl) == NULL)");
-    return 0;
-  }
-#endif
 
-  STATUS_O_hdl = vpi_scan(arg_iter);
+/**
+  * @brief Режимы выполнения по plusargs:
+  *        +lua_cache[=DIR]  - кэш байткода скриптов и модулей require() в каталоге DIR (по умолчанию .lua_cache),
+  *        +lua_threaded[=N] - каждая Lua - машина в своём потоке, exchange_M опережает симулятор не более чем на N транзакций (по умолчанию 4),
+  *        +lua_parallel[=N] - обмены шага времени выполняются в cbReadWriteSynch на N потоках (по умолчанию - число процессоров, N < 2 - последовательно),
+  *        +lua_gc=manual|gen, +lua_gc_budget=мкс (по умолчанию 200), +lua_gc_full=N[K|M|G] - управление сборкой мусора,
+  *        +lua_mem_limit=N[K|M|G] - ограничение памяти Lua - машины каждого экземпляра,
+  *        +lua_stats[=FILE] - замер задержек и счётчики экземпляров в JSON Lines (по умолчанию lua_stats.json),
+  *        +lua_record[=DIR] - запись трасс обменов в DIR (по умолчанию .lua_trace), +lua_record_delta - трасса в сжатом виде,
+  *        +lua_replay[=DIR] - воспроизведение трасс без Lua, +lua_replay_diverge=stop|lua - действие при расхождении (по умолчанию stop).
+  */
+static void opts_init(void)
+{
+  const char *arg;
+  s_cb_data   cb_data;
+  vpiHandle   cb_hdl;
+  FILE       *f;
 
-#ifdef DEBUG
-  if(STATUS_O_hdl == NULL)
+  arg = plusarg_value("lua_gc");
+  if(arg != NULL)
   {
-    REPORT(MSG_ERROR, "if(STATUS_I_hdl) == NULL)");
-    return 0;
-  }
+    opt_gc_mode = (strcmp(arg, "gen") == 0) ? GC__GEN : GC__MANUAL;
+#if LUA_VERSION_NUM < 504
+    if(opt_gc_mode == GC__GEN)
+    {
+      REPORT(MSG_WARNING, "+lua_gc=gen needs Lua 5.4, using manual");
+      opt_gc_mode = GC__MANUAL;
+    }
 #endif
+  }
 
-  result_hdl = vpi_scan(arg_iter);
+  arg = plusarg_value("lua_gc_budget");
+  if( (arg != NULL) && (arg[0] != '\0') )
+    opt_gc_budget_ns = (uint64_t)strtoull(arg, NULL, 0) * 1000u;
 
-#ifdef DEBUG
-  if(result_hdl == NULL)
-  {
-    REPORT(MSG_ERROR, "if(result_hdl) == NULL)");
-    return 0;
-  }
-#endif
+  arg = plusarg_value("lua_gc_full");
+  if( (arg != NULL) && (arg[0] != '\0') )
+    opt_gc_full = parse_size(arg);
 
-  value_s.format = vpiIntVal;
-  vpi_get_value(descriptor_hdl_HI, &value_s);
-  descriptor = (uint64_t)(value_s.value.integer);
-  descriptor = descriptor << 32;
+  if(opt_gc_mode != GC__AUTO)
+    gc_arm(cbNextSimTime);
 
-  vpi_get_value(descriptor_hdl_LO, &value_s);
-  descriptor |= (0x00000000FFFFFFFF & (uint64_t)(value_s.value.integer));
+  arg = plusarg_value("lua_mem_limit");
+  if( (arg != NULL) && (arg[0] != '\0') )
+    opt_mem_limit = parse_size(arg);
 
-  vpi_get_value(time_ns_hdl, &value_s);
-  time_ns = value_s.value.integer;
+  arg = plusarg_value("lua_stats");
+  if(arg != NULL)
+  {
+    opt_stats_file = (arg[0] != '\0') ? arg : "lua_stats.json";
 
-  vpi_get_value(CMD_I_hdl, &value_s);
-  CMD_I = value_s.value.integer;
+    f = fopen(opt_stats_file, "w");   /* Новый файл на каждый запуск, экземпляры дописывают в него при $lua_deinit */
+    if(f != NULL)
+      fclose(f);
 
-  vpi_get_value(ADR_I_hdl, &value_s);
-  ADR_I = value_s.value.integer;
+    memset(&cb_data, 0, sizeof(cb_data));
+    cb_data.reason = cbEndOfSimulation;
+    cb_data.cb_rtn = cb_stats_end_of_sim;
+    cb_hdl = vpi_register_cb(&cb_data);
+    vpi_free_object(cb_hdl);
+  }
 
-  vpi_get_value(DAT_I_hdl, &value_s);
-  DAT_I = value_s.value.integer;
+  arg = plusarg_value("lua_record");
+  if(arg != NULL)
+    opt_record_dir = (arg[0] != '\0') ? arg : TRACE_DIR;
 
-  result = lua_exchange_S((mb_lua_t *)descriptor, &time_ns, &CMD_I, &ADR_I, &DAT_I, &DAT_O, &STATUS_O);
+  opt_record_delta = (plusarg_value("lua_record_delta") != NULL);
 
+  arg = plusarg_value("lua_replay");
+  if(arg != NULL)
+    opt_replay_dir = (arg[0] != '\0') ? arg : TRACE_DIR;
 
-  value_s.value.integer = DAT_O;
-  vpi_put_value(DAT_O_hdl, &value_s, NULL, vpiNoDelay);
+  arg = plusarg_value("lua_replay_diverge");
+  opt_replay_fallback = (arg != NULL) && (strcmp(arg, "lua") == 0);
 
-  value_s.value.integer = STATUS_O;
-  vpi_put_value(STATUS_O_hdl, &value_s, NULL, vpiNoDelay);
+  arg = plusarg_value("lua_cache");
+  if(arg != NULL)
+    opt_cache_dir = (arg[0] != '\0') ? arg : ".lua_cache";
 
-  value_s.value.integer = result;
-  vpi_put_value(result_hdl, &value_s, NULL, vpiNoDelay);
+  arg = plusarg_value("lua_threaded");
+  if(arg != NULL)
+  {
+    opt_worker_depth = (arg[0] != '\0') ? atoi(arg) : 4;
+    if(opt_worker_depth < 1)
+      opt_worker_depth = 1;
+  }
 
-  vpi_free_object(descriptor_hdl_HI);
-  vpi_free_object(descriptor_hdl_LO);
-  vpi_free_object(time_ns_hdl);
-  vpi_free_object(CMD_I_hdl);
-  vpi_free_object(ADR_I_hdl);
-  vpi_free_object(DAT_I_hdl);
-  vpi_free_object(DAT_O_hdl);
-  vpi_free_object(STATUS_O_hdl);
-  vpi_free_object(result_hdl);
+  arg = plusarg_value("lua_parallel");
+  if(arg != NULL)
+  {
+    opt_par_threads = (arg[0] != '\0') ? atoi(arg) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(opt_par_threads < 2)
+    {
+      REPORT(MSG_INFO, "+lua_parallel=%d: running serially", opt_par_threads);
+      opt_par_threads = 0;
+    }
+  }
 
-  vpi_free_object(arg_iter);
-  vpi_free_object(inst_h);
+  if(opt_par_threads != 0)
+  {
+    memset(&cb_data, 0, sizeof(cb_data));
+    cb_data.reason = cbEndOfSimulation;
+    cb_data.cb_rtn = cb_par_end_of_sim;
+    cb_hdl = vpi_register_cb(&cb_data);
+    vpi_free_object(cb_hdl);
+  }
 
-  return 0;
+  arg = plusarg_value("lua_capture_depth");
+  if( (arg != NULL) && (arg[0] != '\0') )
+  {
+    opt_capture_depth = (uint32_t)strtoul(arg, NULL, 0);
+    if(opt_capture_depth < 1)
+      opt_capture_depth = 1;
+  }
 }
 
 
@@ -897,6 +8601,9 @@ static int adderSizetf(char* user_data)
   */
 void vpit_RegisterTfs_Lua( void )
 {
+  log_init();
+  opts_init();
+
 #if 1
   s_vpi_systf_data systf_data;
   vpiHandle systf_handle;
@@ -905,9 +8612,9 @@ void vpit_RegisterTfs_Lua( void )
   systf_data.sysfunctype = 0;
   systf_data.tfname = "$lua_init";
   systf_data.calltf = calltf_lua_init;
-  systf_data.compiletf = 0;
+  systf_data.compiletf = compiletf_lua;
   systf_data.sizetf = 0;
-  systf_data.user_data = 0;
+  systf_data.user_data = (PLI_BYTE8 *)(intptr_t)ARG_INIT__NUM;
   systf_handle = vpi_register_systf(&systf_data);
   vpi_free_object(systf_handle);
 
@@ -915,9 +8622,9 @@ void vpit_RegisterTfs_Lua( void )
   systf_data.sysfunctype = 0;
   systf_data.tfname = "$lua_exchange_M";
   systf_data.calltf = calltf_lua_exchange_M;
-  systf_data.compiletf = 0;
+  systf_data.compiletf = compiletf_lua;
   systf_data.sizetf = 0;
-  systf_data.user_data = 0;
+  systf_data.user_data = (PLI_BYTE8 *)(intptr_t)ARG_M__NUM;
   systf_handle = vpi_register_systf(&systf_data);
   vpi_free_object(systf_handle);
 
@@ -925,6 +8632,16 @@ void vpit_RegisterTfs_Lua( void )
   systf_data.sysfunctype = 0;
   systf_data.tfname = "$lua_exchange_S";
   systf_data.calltf = calltf_lua_exchange_S;
+  systf_data.compiletf = compiletf_lua;
+  systf_data.sizetf = 0;
+  systf_data.user_data = (PLI_BYTE8 *)(intptr_t)ARG_S__NUM;
+  systf_handle = vpi_register_systf(&systf_data);
+  vpi_free_object(systf_handle);
+
+  systf_data.type = vpiSysTask;
+  systf_data.sysfunctype = 0;
+  systf_data.tfname = "$lua_attach";
+  systf_data.calltf = calltf_lua_attach;
   systf_data.compiletf = 0;
   systf_data.sizetf = 0;
   systf_data.user_data = 0;
@@ -933,14 +8650,44 @@ void vpit_RegisterTfs_Lua( void )
 
   systf_data.type = vpiSysTask;
   systf_data.sysfunctype = 0;
-  systf_data.tfname = "$lua_deinit";
-  systf_data.calltf = calltf_lua_deinit;
+  systf_data.tfname = "$lua_play";
+  systf_data.calltf = calltf_lua_play;
+  systf_data.compiletf = 0;
+  systf_data.sizetf = 0;
+  systf_data.user_data = 0;
+  systf_handle = vpi_register_systf(&systf_data);
+  vpi_free_object(systf_handle);
+
+  systf_data.type = vpiSysTask;
+  systf_data.sysfunctype = 0;
+  systf_data.tfname = "$lua_call";
+  systf_data.calltf = calltf_lua_call;
+  systf_data.compiletf = compiletf_lua_call;
+  systf_data.sizetf = 0;
+  systf_data.user_data = 0;
+  systf_handle = vpi_register_systf(&systf_data);
+  vpi_free_object(systf_handle);
+
+  systf_data.type = vpiSysTask;
+  systf_data.sysfunctype = 0;
+  systf_data.tfname = "$lua_capture";
+  systf_data.calltf = calltf_lua_capture;
   systf_data.compiletf = 0;
   systf_data.sizetf = 0;
   systf_data.user_data = 0;
   systf_handle = vpi_register_systf(&systf_data);
   vpi_free_object(systf_handle);
 
+  systf_data.type = vpiSysTask;
+  systf_data.sysfunctype = 0;
+  systf_data.tfname = "$lua_deinit";
+  systf_data.calltf = calltf_lua_deinit;
+  systf_data.compiletf = compiletf_lua;
+  systf_data.sizetf = 0;
+  systf_data.user_data = (PLI_BYTE8 *)(intptr_t)ARG_DEINIT__NUM;
+  systf_handle = vpi_register_systf(&systf_data);
+  vpi_free_object(systf_handle);
+
 #else
   //FIXME  ХЗ как лучше: как функцию или как задачу. На функцию ругается, что переменных не возвращает...
   s_vpi_systf_data tf_data;
@@ -0,0 +1,13 @@
+/* encoding UTF-8 */
+
+/**
+  * @file    acc_user.h
+  * @brief   Пустая замена acc_user.h для стенда производительности: PLI2Lua.c использует только VPI (vpi_user.h).
+  */
+
+#ifndef _BENCH_ACC_USER_H_
+#define _BENCH_ACC_USER_H_
+
+#include "vpi_user.h"
+
+#endif
@@ -0,0 +1,674 @@
+/* encoding UTF-8 */
+
+/*
+ * This file is part of the "Verilog Lua" distribution (https://github.com/yrasik/Verilog_Lua).
+ * Copyright (c) 2022 Yuri Stepanenko.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+  ******************************************************************************
+  * @file    bench.c
+  * @brief   Стенд производительности PLI2Lua.c без симулятора: системные задачи вызываются
+  *          через заглушку VPI (vpi_stub.c) с эталонными моделями из bench/models.
+  ******************************************************************************
+  *
+  * Сборка (из корня репозитория, Lua 5.3/5.4, glibc):
+  *
+  * ~~~~~~~~~~~~~~~{.sh}
+  * gcc -O2 -I. -Ibench -I/usr/include/lua5.4 bench/bench.c bench/vpi_stub.c PLI2Lua.c debug.c \
+  *     -llua5.4 -lpthread -lrt -lm -o pli2lua_bench
+  * ~~~~~~~~~~~~~~~
+  *
+  * Запуск: pli2lua_bench [-n N] [-d DIR] [сценарий ...] [+plusarg ...]
+  *   -n N   - число шагов времени в каждом сценарии (по умолчанию 1000000; init/deinit - N / 1000),
+  *   -d DIR - каталог моделей (по умолчанию bench/models),
+  *   сценарии: init, M, M_batch, M_co, S, S_map, attach, M_x16, bridge, play, capture, call, watch (по умолчанию все; M_x16 - 16 экземпляров на шаге,
+  *             для +lua_parallel; bridge - транзакции от эмулятора - заглушки в отдельном потоке через lua_bridge.h;
+  *             play - $lua_play, четыре 32-битных сигнала на шаг и событие Lua каждые BENCH_PLAY_EVENT шагов;
+  *             capture - $lua_capture трёх сигналов по фронту CLK, Lua - раз в +lua_capture_depth шагов;
+  *             call - $lua_call с двумя входами и двумя выходами, та же нагрузка, что у M;
+  *             watch - watch() фронта STATUS[0] на фоне изменений STATUS[15:8] на каждом шаге),
+  *   +plusargs передаются PLI2Lua.c как аргументы симулятора (+lua_threaded, +lua_gc=manual, ...).
+  *
+  * Для каждого сценария выводятся вызовы в секунду, нс на вызов и выделения памяти (malloc/calloc/realloc)
+  * на вызов, включая выделения внутри Lua и рабочих потоков. Перед замером выполняется прогрев.
+  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "vpi_user.h"
+#include "vpi_stub.h"
+#include "lua_bridge.h"
+
+
+#define BENCH_CALLS       1000000
+#define BENCH_INIT_DIV    1000        /* $lua_init/$lua_deinit на порядки дороже обмена */
+#define BENCH_WARMUP_MAX  10000
+#define BENCH_STEP        10000       /* Шаг времени между обменами - 10 нс */
+#define BENCH_RD_XOR      0x5A5A5A5A  /* Ответ стенда на чтение: ADR ^ BENCH_RD_XOR */
+#define BENCH_ARGV_MAX    64
+#define BENCH_INST_MAX    16
+#define BENCH_BRIDGE      "/pli2lua_bench"   /* Имя моста в bench/models/bridge.lua */
+#define BENCH_EMU_STEP    10                 /* Эмулятор - заглушка: одно обращение на 10 нс */
+#define BENCH_EMU_QUANTUM 1000               /* и lb_sync() каждую 1 мкс */
+#define BENCH_PLAY_SIGS   4
+#define BENCH_PLAY_EVENT  1000
+#define BENCH_IRQ_PERIOD  1000        /* watch: фронт STATUS[0] раз в 1000 шагов, STATUS[15:8] меняется на каждом */
+
+
+enum
+{
+  BENCH__INIT = 0,
+  BENCH__M,
+  BENCH__S,
+  BENCH__ATTACH,
+  BENCH__BRIDGE,
+  BENCH__PLAY,
+  BENCH__CAPTURE,
+  BENCH__CALL,
+  BENCH__WATCH
+} typedef bench_kind_t;
+
+
+struct {
+  const char *name;
+  int         kind;
+  const char *script;
+  int         instances;   /* Независимых экземпляров, вызываемых на каждом шаге времени */
+} typedef bench_case_t;
+
+
+static const bench_case_t bench_cases[] = {
+  { "init",    BENCH__INIT,   "master.lua",     1 },
+  { "M",       BENCH__M,      "master.lua",     1 },
+  { "M_batch", BENCH__M,      "batch.lua",      1 },
+  { "M_co",    BENCH__M,      "coroutine.lua",  1 },
+  { "S",       BENCH__S,      "slave.lua",      1 },
+  { "S_map",   BENCH__S,      "ram.lua",        1 },
+  { "attach",  BENCH__ATTACH, "master.lua",     1 },
+  { "M_x16",   BENCH__M,      "peripheral.lua", BENCH_INST_MAX },
+  { "bridge",  BENCH__BRIDGE, "bridge.lua",     1 },
+  { "play",    BENCH__PLAY,   "play.lua",       1 },
+  { "capture", BENCH__CAPTURE, "capture.lua",   1 },
+  { "call",    BENCH__CALL,   "call.lua",       1 },
+  { "watch",   BENCH__WATCH,  "watch.lua",      1 },
+};
+
+#define BENCH_CASES  ((int)(sizeof(bench_cases) / sizeof(bench_cases[0])))
+
+
+/**
+  * @brief Порты места вызова: те же переменные, что в тестбенче Verilog.
+  */
+struct {
+  vpiHandle Descriptor;
+  vpiHandle fname;
+  vpiHandle kind;
+  vpiHandle CLK;
+  vpiHandle time_ns;
+  vpiHandle CMD;
+  vpiHandle ADR;
+  vpiHandle DAT_O;      /* M: данные записи модели,  S: данные чтения модели */
+  vpiHandle DAT_I;      /* M: ответ стенда на чтение, S: данные записи стенда */
+  vpiHandle STATUS;
+  vpiHandle rr;
+  vpiHandle scope;
+} typedef bench_ports_t;
+
+
+/*****************************************************************************
+ * Счёт выделений памяти: замена malloc/calloc/realloc поверх glibc
+ *****************************************************************************/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static atomic_ullong alloc_calls;
+static atomic_ullong alloc_bytes;
+
+
+void *malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, nmemb * size, memory_order_relaxed);
+  return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+
+static uint64_t bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+/*****************************************************************************
+ * Сценарии
+ *****************************************************************************/
+
+static char bench_dir[1024] = "bench/models";
+
+
+static int ports_create(bench_ports_t *p, const bench_case_t *bc, int inst)
+{
+  char path[1280];
+  char scope[64];
+  char name[96];
+
+  snprintf(path, sizeof(path), "%s/%s", bench_dir, bc->script);
+
+  if(bc->instances > 1)
+    snprintf(scope, sizeof(scope), "bench.%s.u%d", bc->name, inst);
+  else
+    snprintf(scope, sizeof(scope), "bench.%s", bc->name);
+
+  p->Descriptor = stub_reg("Descriptor", 32);
+  p->fname      = stub_str(strdup(path));
+  p->kind       = stub_str( (bc->kind == BENCH__S) ? "S" : "M" );
+  p->CLK        = stub_reg("CLK", 1);
+  p->time_ns    = stub_reg("time_ns", 32);
+  p->CMD        = stub_reg("CMD", 32);
+  p->ADR        = stub_reg("ADR", 32);
+  p->DAT_O      = stub_reg("DAT_O", 32);
+  p->DAT_I      = stub_reg("DAT_I", 32);
+  p->STATUS     = stub_reg("STATUS", 32);
+  p->rr         = stub_reg("rr", 32);
+  p->scope      = stub_scope(strdup(scope));
+
+  snprintf(name, sizeof(name), "%s.STATUS", scope);   /* Для watch("STATUS", ...) */
+  if(p->STATUS != NULL)
+    stub_name(p->STATUS, strdup(name));
+
+  return ( (p->Descriptor == NULL) || (p->fname == NULL) || (p->kind == NULL) || (p->CLK == NULL) ||
+           (p->time_ns == NULL) || (p->CMD == NULL) || (p->ADR == NULL) || (p->DAT_O == NULL) ||
+           (p->DAT_I == NULL) || (p->STATUS == NULL) || (p->rr == NULL) || (p->scope == NULL) ) ? -1 : 0;
+}
+
+
+/**
+  * @brief Ответ стенда на транзакцию ведущего: данные чтения приходят в DAT_I следующего обмена.
+  *        Выполняется после шага времени: с +lua_parallel выходы записываются в cbReadWriteSynch.
+  */
+static void bench_respond_M(bench_ports_t *p)
+{
+  if(stub_get_int(p->CMD) == 1)
+    stub_put_int(p->DAT_I, stub_get_int(p->ADR) ^ BENCH_RD_XOR);
+}
+
+
+/**
+  * @brief Транзакция стенда к ведомому: запись и чтение по очереди.
+  */
+static void bench_drive_S(bench_ports_t *p, uint64_t i)
+{
+  stub_put_int(p->time_ns, (int32_t)(i * 10));
+  stub_put_int(p->CMD, (i & 1) ? 1 : 2);
+  stub_put_int(p->ADR, (int32_t)((i << 1) & 0xFFFC));
+  stub_put_int(p->DAT_I, (int32_t)i);
+}
+
+
+/**
+  * @brief Эмулятор - заглушка: через мост семь записей и чтение последнего адреса, проверка прочитанного (ответ стенда ADR ^ BENCH_RD_XOR).
+  */
+static atomic_int emu_stop;
+static int        emu_errors;
+
+
+static void *bench_emu_main(void *arg)
+{
+  lb_client_t c;
+  int64_t     t = 0;
+  int32_t     adr = 0;
+  int32_t     dat;
+  uint32_t    n = 0;
+
+  while( lb_attach(&c, BENCH_BRIDGE, NULL, NULL) != 0 )
+  {
+    if( atomic_load(&emu_stop) )
+      return NULL;
+    sched_yield();
+  }
+
+  for(;;)
+  {
+    for(t += BENCH_EMU_STEP; t % BENCH_EMU_QUANTUM != 0; t += BENCH_EMU_STEP)
+    {
+      if(++n & 7)
+      {
+        adr = (adr + 4) & 0xFFFC;
+        if( lb_write(&c, t, adr, (int32_t)n) != 0 )
+          goto done;
+      }
+      else
+      {
+        if( lb_read(&c, t, adr, &dat, NULL) != 0 )
+          goto done;
+        if( dat != (adr ^ BENCH_RD_XOR) )
+          emu_errors++;
+      }
+    }
+
+    if( lb_sync(&c, t) != 0 )
+      break;
+  }
+
+done:
+  lb_detach(&c);
+  return NULL;
+}
+
+
+/**
+  * @brief Файл воздействий для $lua_play (формат - в PLI2Lua.c): на шаге s сигнал k получает s * (k + 1).
+  */
+static char bench_play_path[64];
+
+
+static void bench_put_varint(FILE *f, uint64_t v)
+{
+  while(v >= 0x80)
+  {
+    fputc((int)(v & 0x7F) | 0x80, f);
+    v >>= 7;
+  }
+  fputc((int)v, f);
+}
+
+
+static int bench_play_file(uint64_t steps)
+{
+  static const char magic[8] = "PLISTM1";
+  uint32_t w[1 + BENCH_PLAY_SIGS] = { BENCH_PLAY_SIGS };
+  uint32_t v;
+  uint64_t s;
+  FILE    *f;
+  int      k;
+
+  snprintf(bench_play_path, sizeof(bench_play_path), "/tmp/pli2lua_bench.%ld.stim", (long)getpid());
+
+  f = fopen(bench_play_path, "wb");
+  if(f == NULL)
+    return -1;
+
+  for(k = 0; k < BENCH_PLAY_SIGS; k++)
+    w[1 + k] = 32;
+
+  fwrite(magic, 1, sizeof(magic), f);
+  fwrite(w, sizeof(uint32_t), 1 + BENCH_PLAY_SIGS, f);   /* Стенд - только little-endian */
+
+  for(s = 0; s < steps; s++)
+  {
+    if(s != 0)
+    {
+      fputc(1, f);                        /* PLAY__TIME */
+      bench_put_varint(f, BENCH_STEP / 1000);
+    }
+
+    for(k = 0; k < BENCH_PLAY_SIGS; k++)
+    {
+      v = (uint32_t)(s * (uint64_t)(k + 1));
+      fputc(2, f);                        /* PLAY__VALUE */
+      bench_put_varint(f, (uint64_t)k);
+      fwrite(&v, 4, 1, f);
+    }
+
+    if( (s % BENCH_PLAY_EVENT) == 0 )
+    {
+      fputc(4, f);                        /* PLAY__EVENT */
+      bench_put_varint(f, s / BENCH_PLAY_EVENT);
+    }
+  }
+
+  return (fclose(f) == 0) ? 0 : -1;
+}
+
+
+/**
+  * @brief Места вызова одного экземпляра: $lua_init и $lua_deinit, а для обменов - $lua_init выполняется сразу.
+  * @retval vpiHandle Место вызова обмена ($lua_init для сценария init), NULL - ошибка.
+  */
+static vpiHandle bench_setup(const bench_case_t *bc, bench_ports_t *p, vpiHandle *deinit)
+{
+  vpiHandle init;
+  vpiHandle call;
+  vpiHandle args[10];
+
+  args[0] = p->Descriptor;
+  args[1] = p->fname;
+  init = stub_call("$lua_init", p->scope, 2, args);
+  *deinit = stub_call("$lua_deinit", p->scope, 1, args);
+
+  if( (init == NULL) || (*deinit == NULL) )
+    return NULL;
+
+  if(bc->kind == BENCH__INIT)
+    return init;
+
+  stub_calltf(init);
+
+  if(stub_get_int(p->Descriptor) == 0)
+  {
+    fprintf(stderr, "%s: $lua_init('%s/%s') failed\n", bc->name, bench_dir, bc->script);
+    return NULL;
+  }
+
+  if(bc->kind == BENCH__ATTACH)
+  {
+    args[1] = p->CLK;
+    args[2] = p->kind;
+    args[3] = p->time_ns; args[4] = p->CMD; args[5] = p->ADR; args[6] = p->DAT_O; args[7] = p->DAT_I; args[8] = p->STATUS; args[9] = p->rr;
+    call = stub_call("$lua_attach", p->scope, 10, args);
+    if(call != NULL)
+      stub_calltf(call);
+  }
+  else if(bc->kind == BENCH__PLAY)
+  {
+    args[1] = stub_str(bench_play_path);
+    args[2] = p->CMD; args[3] = p->ADR; args[4] = p->DAT_O; args[5] = p->DAT_I;
+    call = stub_call("$lua_play", p->scope, 2 + BENCH_PLAY_SIGS, args);
+    if(call != NULL)
+      stub_calltf(call);
+  }
+  else if(bc->kind == BENCH__CAPTURE)
+  {
+    args[1] = stub_str("on_samples");
+    args[2] = stub_str("posedge");
+    args[3] = p->CLK; args[4] = p->CMD; args[5] = p->ADR; args[6] = p->DAT_O;
+    call = stub_call("$lua_capture", p->scope, 7, args);
+    if(call != NULL)
+      stub_calltf(call);
+  }
+  else if(bc->kind == BENCH__CALL)
+  {
+    args[1] = stub_str("step");
+    args[2] = p->ADR; args[3] = p->DAT_O; args[4] = stub_str("->"); args[5] = p->DAT_I; args[6] = p->STATUS;
+    call = stub_call("$lua_call", p->scope, 7, args);
+  }
+  else if( (bc->kind == BENCH__M) || (bc->kind == BENCH__BRIDGE) )
+  {
+    args[1] = p->time_ns; args[2] = p->CMD; args[3] = p->ADR; args[4] = p->DAT_O; args[5] = p->DAT_I; args[6] = p->STATUS; args[7] = p->rr;
+    call = stub_call("$lua_exchange_M", p->scope, 8, args);
+  }
+  else
+  {
+    args[1] = p->time_ns; args[2] = p->CMD; args[3] = p->ADR; args[4] = p->DAT_I; args[5] = p->DAT_O; args[6] = p->STATUS; args[7] = p->rr;
+    call = stub_call("$lua_exchange_S", p->scope, 8, args);
+  }
+
+  return call;
+}
+
+
+/**
+  * @brief Один сценарий: прогрев, затем n шагов времени под замером. На каждом шаге каждый экземпляр делает один вызов.
+  * @retval int Количество вызовов с rr != 0, -1 если сценарий не удалось запустить.
+  */
+static int bench_run(const bench_case_t *bc, uint64_t n)
+{
+  bench_ports_t p[BENCH_INST_MAX];
+  vpiHandle     call[BENCH_INST_MAX];
+  vpiHandle     deinit[BENCH_INST_MAX];
+  uint64_t      warmup = (n / 10 < BENCH_WARMUP_MAX) ? n / 10 : BENCH_WARMUP_MAX;
+  uint64_t      calls;
+  uint64_t      i;
+  uint64_t      t0;
+  uint64_t      t1;
+  unsigned long long a0;
+  unsigned long long b0;
+  unsigned long long a1;
+  unsigned long long b1;
+  int           errors = 0;
+  int           k;
+  pthread_t     emu;
+
+  if( (bc->kind == BENCH__PLAY) && (bench_play_file(warmup + n + 1) != 0) )
+    return -1;
+
+  for(k = 0; k < bc->instances; k++)
+  {
+    if( ports_create(&p[k], bc, k) != 0 )
+      return -1;
+
+    call[k] = bench_setup(bc, &p[k], &deinit[k]);
+    if(call[k] == NULL)
+      return -1;
+  }
+
+  if(bc->kind == BENCH__BRIDGE)
+  {
+    atomic_store(&emu_stop, 0);
+    emu_errors = 0;
+    if( pthread_create(&emu, NULL, bench_emu_main, NULL) != 0 )
+      return -1;
+  }
+
+  if(bc->kind == BENCH__INIT)
+    warmup = (warmup < 10) ? warmup : 10;
+
+  a0 = b0 = 0;
+  t0 = 0;
+
+  for(i = 0; i < warmup + n; i++)
+  {
+    if(i == warmup)
+    {
+      a0 = atomic_load(&alloc_calls);
+      b0 = atomic_load(&alloc_bytes);
+      t0 = bench_ns();
+    }
+
+    for(k = 0; k < bc->instances; k++)
+    {
+      switch(bc->kind)
+      {
+        case BENCH__INIT:
+          stub_calltf(call[k]);
+          if(stub_get_int(p[k].Descriptor) == 0)
+            errors++;
+          stub_calltf(deinit[k]);
+          break;
+
+        case BENCH__M:
+        case BENCH__BRIDGE:
+          stub_calltf(call[k]);
+          break;
+
+        case BENCH__S:
+          bench_drive_S(&p[k], i);
+          stub_calltf(call[k]);
+          break;
+
+        case BENCH__ATTACH:
+          stub_put_int(p[k].CLK, 1);
+          stub_put_int(p[k].CLK, 0);
+          break;
+
+        case BENCH__PLAY:   /* Сигналы выставляет cbAfterDelay $lua_play */
+          break;
+
+        case BENCH__CALL:
+          stub_put_int(p[k].ADR, (int32_t)i);
+          stub_put_int(p[k].DAT_O, (int32_t)(i * 3));
+          stub_calltf(call[k]);
+          break;
+
+        case BENCH__WATCH:   /* Lua вызывается только на фронте STATUS[0] */
+          stub_put_int(p[k].STATUS, (int32_t)(((i & 0xFF) << 8) | ((i % BENCH_IRQ_PERIOD) < BENCH_IRQ_PERIOD / 2)));
+          break;
+
+        case BENCH__CAPTURE:   /* Lua вызывается раз в +lua_capture_depth фронтов */
+          stub_put_int(p[k].CMD, (int32_t)i);
+          stub_put_int(p[k].ADR, (int32_t)(i * 2));
+          stub_put_int(p[k].DAT_O, (int32_t)(i * 3));
+          stub_put_int(p[k].CLK, 1);
+          stub_put_int(p[k].CLK, 0);
+          break;
+      }
+    }
+
+    stub_step(BENCH_STEP);
+
+    if(bc->kind == BENCH__INIT)
+      continue;
+
+    for(k = 0; k < bc->instances; k++)
+    {
+      if( (bc->kind == BENCH__PLAY) && ((uint32_t)stub_get_int(p[k].DAT_I) != (uint32_t)((i + 1) * BENCH_PLAY_SIGS)) )
+        errors++;
+
+      if( (bc->kind == BENCH__CALL) && (((uint32_t)stub_get_int(p[k].DAT_I) != (uint32_t)(i * 4)) || ((uint32_t)stub_get_int(p[k].STATUS) != (uint32_t)(i ^ (i * 3)))) )
+        errors++;
+
+      if( (bc->kind != BENCH__S) && (bc->kind != BENCH__PLAY) && (bc->kind != BENCH__CAPTURE) && (bc->kind != BENCH__CALL) &&
+          (bc->kind != BENCH__WATCH) )
+        bench_respond_M(&p[k]);
+
+      if(stub_get_int(p[k].rr) != 0)
+        errors++;
+    }
+  }
+
+  t1 = bench_ns();
+  a1 = atomic_load(&alloc_calls);
+  b1 = atomic_load(&alloc_bytes);
+
+  if(bc->kind != BENCH__INIT)
+  {
+    for(k = 0; k < bc->instances; k++)
+      stub_calltf(deinit[k]);
+  }
+
+  if(bc->kind == BENCH__PLAY)
+    remove(bench_play_path);
+
+  if(bc->kind == BENCH__BRIDGE)
+  {
+    atomic_store(&emu_stop, 1);
+    pthread_join(emu, NULL);
+    errors += emu_errors;
+  }
+
+  calls = (n != 0) ? n * (uint64_t)bc->instances : 1;
+
+  printf("%-8s %10llu calls %8.3f s %12.0f calls/s %9.1f ns/call %9.3f allocs/call %10.1f B/call\n",
+    bc->name, (unsigned long long)calls, (double)(t1 - t0) * 1e-9,
+    (double)calls * 1e9 / (double)((t1 > t0) ? t1 - t0 : 1),
+    (double)(t1 - t0) / (double)calls,
+    (double)(a1 - a0) / (double)calls,
+    (double)(b1 - b0) / (double)calls);
+
+  return errors;
+}
+
+
+int main(int argc, char *argv[])
+{
+  static char *vlog_argv[BENCH_ARGV_MAX];
+  const char  *select[BENCH_CASES];
+  uint64_t     n = BENCH_CALLS;
+  int          vlog_argc = 0;
+  int          nselect = 0;
+  int          log_level = 0;
+  int          failed = 0;
+  int          errors;
+  int          i;
+  int          k;
+
+  vlog_argv[vlog_argc++] = argv[0];
+
+  for(i = 1; i < argc; i++)
+  {
+    if( (strcmp(argv[i], "-n") == 0) && (i + 1 < argc) )
+      n = strtoull(argv[++i], NULL, 0);
+    else if( (strcmp(argv[i], "-d") == 0) && (i + 1 < argc) )
+      snprintf(bench_dir, sizeof(bench_dir), "%s", argv[++i]);
+    else if( (argv[i][0] == '+') && (vlog_argc < BENCH_ARGV_MAX - 2) )
+    {
+      log_level |= (strncmp(argv[i], "+lua_log_level", 14) == 0);
+      vlog_argv[vlog_argc++] = argv[i];
+    }
+    else if( (argv[i][0] != '-') && (nselect < BENCH_CASES) )
+      select[nselect++] = argv[i];
+    else
+    {
+      fprintf(stderr, "usage: %s [-n N] [-d DIR] [init|M|M_batch|M_co|S|S_map|attach|M_x16|bridge|play ...] [+plusarg ...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if(! log_level)   /* Сообщение о каждом $lua_init заслонило бы результаты */
+    vlog_argv[vlog_argc++] = "+lua_log_level=1";
+
+  stub_start(vlog_argc, vlog_argv);
+
+  for(k = 0; k < BENCH_CASES; k++)
+  {
+    for(i = 0; i < nselect; i++)
+    {
+      if(strcmp(select[i], bench_cases[k].name) == 0)
+        break;
+    }
+
+    if( (nselect != 0) && (i == nselect) )
+      continue;
+
+    errors = bench_run(&bench_cases[k], (bench_cases[k].kind == BENCH__INIT) ? n / BENCH_INIT_DIV : n);
+
+    if(errors != 0)
+    {
+      fprintf(stderr, "%s: %s\n", bench_cases[k].name, (errors < 0) ? "not started" : "calls with rr != 0");
+      failed = 1;
+    }
+
+    fflush(stdout);
+  }
+
+  stub_finish();
+  return failed;
+}
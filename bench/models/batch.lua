@@ -0,0 +1,23 @@
+-- Эталонная модель ведущего для стенда: пакет из 16 транзакций (8 записей, 8 чтений) на вызов
+
+local ACTION__READ  = 1
+local ACTION__WRITE = 2
+
+local base = 0
+local tr   = {}
+
+function init_env()
+  return 1
+end
+
+function exchange_M(DAT_I, STATUS_I, reads)
+  base = (base + 0x40) & 0xFFC0
+
+  for i = 0, 7 do
+    local k = i * 8
+    tr[k + 1], tr[k + 2], tr[k + 3], tr[k + 4] = 10, ACTION__WRITE, base + i * 4, i
+    tr[k + 5], tr[k + 6], tr[k + 7], tr[k + 8] = 10, ACTION__READ,  base + i * 4, 0
+  end
+
+  return tr
+end
@@ -0,0 +1,7 @@
+-- Модель - мост для стенда: транзакции $lua_exchange_M приходят от эмулятора - заглушки (поток стенда, lua_bridge.h)
+
+bridge_open("/pli2lua_bench", 1000, 256)   -- квант 1 мкс, до 256 запросов в очереди
+
+function init_env()
+  return 1
+end
@@ -0,0 +1,9 @@
+-- Функция для $lua_call стенда: два входа, два выхода
+
+function init_env()
+  return 1
+end
+
+function step(adr, dat)
+  return adr + dat, adr ~ dat
+end
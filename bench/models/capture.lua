@@ -0,0 +1,29 @@
+-- Обработчик $lua_capture для стенда: столбцы CMD, ADR, DAT_O записаны в C по фронту CLK
+
+local samples = 0
+local chunks  = 0
+local errors  = 0
+
+function init_env()
+  return 1
+end
+
+function on_samples(buf)
+  local cmd = buf:column(1)
+  local adr = buf:column(2)
+  local dat = buf:column(3)
+
+  for i = 1, #cmd do
+    local c = cmd[i]
+    if (c ~= samples + i - 1) or (adr[i] ~= (c * 2) & 0xFFFFFFFF) or (dat[i] ~= (c * 3) & 0xFFFFFFFF) then
+      errors = errors + 1
+    end
+  end
+
+  samples = samples + #cmd
+  chunks  = chunks + 1
+end
+
+function deinit_env()
+  if errors ~= 0 then print('capture.lua: sample errors ' .. errors) end
+end
@@ -0,0 +1,15 @@
+-- Эталонная модель ведущего для стенда: main() как сопрограмма с шинными примитивами
+
+function init_env()
+  return 1
+end
+
+function main()
+  local adr = 0
+
+  while true do
+    adr = (adr + 4) & 0xFFFC
+    write32(adr, adr, 10)
+    read32(adr, 10)
+  end
+end
@@ -0,0 +1,31 @@
+-- Эталонная модель ведущего для стенда: запись и чтение по очереди, по одной транзакции на вызов
+
+local ACTION__READ  = 1
+local ACTION__WRITE = 2
+
+local n      = 0
+local adr    = 0
+local errors = 0
+
+function init_env()
+  return 1
+end
+
+function exchange_M(DAT_I, STATUS_I)
+  n = n + 1
+
+  if n % 2 == 0 then
+    return 10, ACTION__READ, adr, 0
+  end
+
+  if n > 1 and DAT_I ~= (adr ~ 0x5A5A5A5A) then   -- стенд отвечает на чтение ADR ^ 0x5A5A5A5A
+    errors = errors + 1
+  end
+
+  adr = (adr + 4) & 0xFFFC
+  return 10, ACTION__WRITE, adr, n
+end
+
+function deinit_env()
+  if errors ~= 0 then print('master.lua: read errors ' .. errors) end
+end
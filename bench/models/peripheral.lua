@@ -0,0 +1,36 @@
+-- Эталонная модель периферийного блока для стенда: ведущий с заметной работой на каждый обмен
+-- (CRC-32 по 4 словам), чтобы 16 независимых экземпляров можно было сравнить с +lua_parallel и без
+
+local ACTION__READ  = 1
+local ACTION__WRITE = 2
+
+local n   = 0
+local crc = 0xFFFFFFFF
+
+local function crc32_word(c, w)
+  for _ = 1, 32 do
+    local b = (c ~ w) & 1
+    c = c >> 1
+    if b ~= 0 then c = c ~ 0xEDB88320 end
+    w = w >> 1
+  end
+  return c
+end
+
+function init_env()
+  return 1
+end
+
+function exchange_M(DAT_I, STATUS_I)
+  n = n + 1
+
+  for i = 1, 4 do
+    crc = crc32_word(crc, (DAT_I + i) & 0xFFFFFFFF)
+  end
+
+  if n % 2 == 0 then
+    return 10, ACTION__READ, (n * 4) & 0xFFFC, 0
+  end
+
+  return 10, ACTION__WRITE, (n * 4) & 0xFFFC, crc
+end
@@ -0,0 +1,22 @@
+-- События воспроизведения для стенда: $lua_play выставляет сигналы сам, Lua вызывается только на записях PLAY__EVENT
+
+local events = 0
+local last   = -1
+local errors = 0
+
+function init_env()
+  return 1
+end
+
+function play_event(id, time_ns)
+  if id ~= last + 1 then
+    errors = errors + 1
+  end
+
+  last   = id
+  events = events + 1
+end
+
+function deinit_env()
+  if errors ~= 0 then print('play.lua: event order errors ' .. errors) end
+end
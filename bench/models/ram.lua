@@ -0,0 +1,10 @@
+-- Эталонная модель ведомого для стенда: ОЗУ в карте адресов, обмены обслуживаются в C
+
+function init_env()
+  map_region(0x00000000, 0x10000, "ram")
+  return 1
+end
+
+function exchange_S(time_ns, CMD_I, ADR_I, DAT_I)
+  return 0, 1   -- адрес вне карты
+end
@@ -0,0 +1,23 @@
+-- Эталонная модель ведомого для стенда: ОЗУ в таблице Lua, обслуживание каждого обмена в Lua
+
+local ACTION__READ  = 1
+local ACTION__WRITE = 2
+
+local mem = {}
+
+function init_env()
+  return 1
+end
+
+function exchange_S(time_ns, CMD_I, ADR_I, DAT_I)
+  if CMD_I == ACTION__WRITE then
+    mem[ADR_I] = DAT_I
+    return 0, 0
+  end
+
+  if CMD_I == ACTION__READ then
+    return mem[ADR_I] or 0, 0
+  end
+
+  return 0, 0
+end
@@ -0,0 +1,22 @@
+-- Прерывание для стенда: watch() на фронт STATUS[0], изменения остальных битов отсекаются в C
+
+local irqs   = 0
+local last   = nil
+local errors = 0
+
+function on_irq(value, prev, time_ns, id)
+  if (value & 1) ~= 1 or (prev & 1) ~= 0 then errors = errors + 1 end
+  if last ~= nil and time_ns - last ~= 10000 then errors = errors + 1 end
+
+  last = time_ns
+  irqs = irqs + 1
+end
+
+function init_env()
+  watch('STATUS', 'posedge', on_irq, 1)
+  return 1
+end
+
+function deinit_env()
+  if errors ~= 0 then print('watch.lua: irq errors ' .. errors) end
+end
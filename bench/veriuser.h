@@ -0,0 +1,13 @@
+/* encoding UTF-8 */
+
+/**
+  * @file    veriuser.h
+  * @brief   Пустая замена veriuser.h для стенда производительности: PLI2Lua.c использует только VPI (vpi_user.h).
+  */
+
+#ifndef _BENCH_VERIUSER_H_
+#define _BENCH_VERIUSER_H_
+
+#include "vpi_user.h"
+
+#endif
@@ -0,0 +1,755 @@
+/* encoding UTF-8 */
+
+/*
+ * This file is part of the "Verilog Lua" distribution (https://github.com/yrasik/Verilog_Lua).
+ * Copyright (c) 2022 Yuri Stepanenko.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+  ******************************************************************************
+  * @file    vpi_stub.c
+  * @brief   Реализация VPI для стенда производительности PLI2Lua.c (без симулятора).
+  *          Итераторы и обратные вызовы берутся из пула, поэтому после прогрева заглушка
+  *          сама не выделяет память и не искажает счёт выделений на вызов.
+  ******************************************************************************
+  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "vpi_user.h"
+#include "vpi_stub.h"
+
+
+#define STUB_TF_MAX       16
+#define STUB_POOL_CHUNK   64
+#define VEC_WORDS(width)  (((width) > 0) ? (((width) + 31) / 32) : 1)
+
+
+/**
+  * @brief Объект заглушки. Поля используются в зависимости от type.
+  */
+struct vpi_obj_s {
+  PLI_INT32          type;
+  const char        *name;
+  const char        *full_name;
+
+  /* vpiReg, vpiConstant */
+  int                width;
+  s_vpi_vecval      *vec;
+  char              *str;          /* Значение в формате vpiStringVal */
+  int                watched;      /* Количество cbValueChange на объекте */
+
+  struct vpi_obj_s  *next_named;   /* Список stub_name() */
+
+  /* vpiSysTfCall */
+  s_vpi_systf_data  *tf;
+  vpiHandle          scope;
+  int                argc;
+  vpiHandle         *argv;
+  void              *userdata;
+
+  /* vpiIterator */
+  int                pos;
+
+  /* vpiCallback */
+  s_cb_data          cb;
+  s_vpi_time         cb_time;
+  s_vpi_value        cb_value;
+  uint64_t           due;
+  int                active;
+
+  struct vpi_obj_s  *next_free;
+};
+
+
+static s_vpi_systf_data  tf_tab[STUB_TF_MAX];
+static struct vpi_obj_s  tf_obj[STUB_TF_MAX];
+static int               tf_count = 0;
+
+static vpiHandle         pool_free = NULL;   /* Свободные объекты итераторов и обратных вызовов */
+
+static vpiHandle        *cb_tab = NULL;      /* Зарегистрированные обратные вызовы в порядке регистрации */
+static int               cb_count = 0;
+static int               cb_size = 0;
+static int               cb_depth = 0;       /* Вложенность обхода cb_tab; удалённые убираются на внешнем уровне */
+
+static vpiHandle         named = NULL;       /* Переменные с полным именем (stub_name), последняя - первой */
+static vpiHandle         cur_call = NULL;
+static uint64_t          sim_now = 0;
+static int               sim_finish = 0;
+static int               vlog_argc = 0;
+static char            **vlog_argv = NULL;
+
+
+extern void (*vlog_startup_routines[])();
+
+
+static vpiHandle pool_get(PLI_INT32 type)
+{
+  vpiHandle h;
+  int       i;
+
+  if(pool_free == NULL)
+  {
+    h = (vpiHandle)calloc(STUB_POOL_CHUNK, sizeof(struct vpi_obj_s));
+    if(h == NULL)
+      return NULL;
+
+    for(i = 0; i < STUB_POOL_CHUNK; i++)
+    {
+      h[i].next_free = pool_free;
+      pool_free = &h[i];
+    }
+  }
+
+  h = pool_free;
+  pool_free = h->next_free;
+  memset(h, 0, sizeof(*h));
+  h->type = type;
+  return h;
+}
+
+
+static void pool_put(vpiHandle h)
+{
+  h->type = 0;
+  h->next_free = pool_free;
+  pool_free = h;
+}
+
+
+/**
+  * @brief Удаление сработавших и снятых обратных вызовов из cb_tab (только вне обхода).
+  */
+static void cb_compact(void)
+{
+  int i;
+  int n = 0;
+
+  if(cb_depth != 0)
+    return;
+
+  for(i = 0; i < cb_count; i++)
+  {
+    if(cb_tab[i]->active)
+      cb_tab[n++] = cb_tab[i];
+    else
+      pool_put(cb_tab[i]);
+  }
+
+  cb_count = n;
+}
+
+
+/**
+  * @brief Вызов обратных вызовов reason, зарегистрированных до начала обхода.
+  *        Все причины, кроме cbValueChange, однократные.
+  */
+static void cb_fire(PLI_INT32 reason, vpiHandle obj)
+{
+  vpiHandle h;
+  int       n = cb_count;
+  int       i;
+
+  cb_depth++;
+
+  for(i = 0; i < n; i++)
+  {
+    h = cb_tab[i];
+
+    if( (! h->active) || (h->cb.reason != reason) )
+      continue;
+
+    if(reason == cbValueChange)
+    {
+      if(h->cb.obj != obj)
+        continue;
+
+      if(h->cb.value != NULL)
+        vpi_get_value(obj, h->cb.value);
+
+      if( (h->cb.time != NULL) && (h->cb.time->type != vpiSuppressTime) )
+        vpi_get_time(NULL, h->cb.time);
+    }
+    else
+    {
+      if( (reason == cbAfterDelay) && (h->due > sim_now) )
+        continue;
+
+      h->active = 0;
+    }
+
+    h->cb.cb_rtn(&h->cb);
+  }
+
+  cb_depth--;
+  cb_compact();
+}
+
+
+static uint64_t time_ticks(const s_vpi_time *t)
+{
+  if(t == NULL)
+    return 0;
+
+  if(t->type == vpiScaledRealTime)
+    return (uint64_t)(t->real * 1000.0);   /* Единица времени модуля - 1 нс */
+
+  return ((uint64_t)t->high << 32) | t->low;
+}
+
+
+static int vec_store(vpiHandle obj, const s_vpi_vecval *v, int words)
+{
+  int changed = 0;
+  int all = VEC_WORDS(obj->width);
+  int i;
+  s_vpi_vecval w;
+
+  for(i = 0; i < all; i++)
+  {
+    w.aval = (i < words) ? v[i].aval : 0;
+    w.bval = (i < words) ? v[i].bval : 0;
+
+    if( (i == all - 1) && ((obj->width & 31) != 0) )
+    {
+      w.aval &= (PLI_INT32)((1u << (obj->width & 31)) - 1);
+      w.bval &= (PLI_INT32)((1u << (obj->width & 31)) - 1);
+    }
+
+    if( (w.aval != obj->vec[i].aval) || (w.bval != obj->vec[i].bval) )
+      changed = 1;
+
+    obj->vec[i] = w;
+  }
+
+  return changed;
+}
+
+
+static vpiHandle var_create(PLI_INT32 type, const char *name, int width)
+{
+  vpiHandle h = (vpiHandle)calloc(1, sizeof(struct vpi_obj_s));
+
+  if(h == NULL)
+    return NULL;
+
+  h->type  = type;
+  h->name  = name;
+  h->width = width;
+  h->vec   = (s_vpi_vecval *)calloc(VEC_WORDS(width), sizeof(s_vpi_vecval));
+  h->str   = (char *)calloc(width / 8 + 2, 1);
+
+  if( (h->vec == NULL) || (h->str == NULL) )
+  {
+    free(h->vec);
+    free(h->str);
+    free(h);
+    return NULL;
+  }
+
+  return h;
+}
+
+
+/*****************************************************************************
+ * API стенда
+ *****************************************************************************/
+
+void stub_start(int argc, char **argv)
+{
+  int i;
+
+  vlog_argc = argc;
+  vlog_argv = argv;
+
+  for(i = 0; vlog_startup_routines[i] != NULL; i++)
+    vlog_startup_routines[i]();
+}
+
+
+void stub_finish(void)
+{
+  cb_fire(cbEndOfSimulation, NULL);
+}
+
+
+vpiHandle stub_reg(const char *name, int width)
+{
+  return var_create(vpiReg, name, width);
+}
+
+
+vpiHandle stub_str(const char *s)
+{
+  size_t    len = strlen(s);
+  vpiHandle h = var_create(vpiConstant, s, (int)len * 8);
+  size_t    i;
+
+  if(h == NULL)
+    return NULL;
+
+  memcpy(h->str, s, len);
+
+  for(i = 0; i < len; i++)   /* Последний символ строки - младший байт вектора */
+    h->vec[i / 4].aval |= (PLI_INT32)((uint32_t)(uint8_t)s[len - 1 - i] << (8 * (i % 4)));
+
+  return h;
+}
+
+
+void stub_name(vpiHandle obj, const char *full_name)
+{
+  obj->full_name  = full_name;
+  obj->next_named = named;
+  named = obj;
+}
+
+
+vpiHandle stub_scope(const char *full_name)
+{
+  vpiHandle   h = (vpiHandle)calloc(1, sizeof(struct vpi_obj_s));
+  const char *dot = strrchr(full_name, '.');
+
+  if(h == NULL)
+    return NULL;
+
+  h->type      = vpiModule;
+  h->full_name = full_name;
+  h->name      = (dot != NULL) ? dot + 1 : full_name;
+  return h;
+}
+
+
+vpiHandle stub_call(const char *tfname, vpiHandle scope, int argc, const vpiHandle *argv)
+{
+  vpiHandle h;
+  int       i;
+
+  for(i = 0; i < tf_count; i++)
+  {
+    if(strcmp(tf_tab[i].tfname, tfname) == 0)
+      break;
+  }
+
+  if(i == tf_count)
+  {
+    fprintf(stderr, "vpi_stub: '%s' is not registered\n", tfname);
+    return NULL;
+  }
+
+  h = (vpiHandle)calloc(1, sizeof(struct vpi_obj_s));
+  if(h == NULL)
+    return NULL;
+
+  h->type  = vpiSysTfCall;
+  h->name  = tf_tab[i].tfname;
+  h->tf    = &tf_tab[i];
+  h->scope = scope;
+  h->argc  = argc;
+  h->argv  = (vpiHandle *)calloc((argc > 0) ? argc : 1, sizeof(vpiHandle));
+
+  if(h->argv == NULL)
+  {
+    free(h);
+    return NULL;
+  }
+
+  memcpy(h->argv, argv, sizeof(vpiHandle) * argc);
+
+  if(h->tf->compiletf != NULL)
+  {
+    cur_call = h;
+    h->tf->compiletf(h->tf->user_data);
+    cur_call = NULL;
+  }
+
+  return sim_finish ? NULL : h;
+}
+
+
+void stub_calltf(vpiHandle call)
+{
+  cur_call = call;
+  call->tf->calltf(call->tf->user_data);
+  cur_call = NULL;
+}
+
+
+void stub_step(uint64_t ticks)
+{
+  cb_fire(cbReadWriteSynch, NULL);
+  cb_fire(cbReadOnlySynch, NULL);
+
+  sim_now += ticks;
+
+  cb_fire(cbNextSimTime, NULL);
+  cb_fire(cbAfterDelay, NULL);
+}
+
+
+int32_t stub_get_int(vpiHandle reg)
+{
+  return reg->vec[0].aval;
+}
+
+
+void stub_put_int(vpiHandle reg, int32_t v)
+{
+  s_vpi_value value_s;
+
+  value_s.format = vpiIntVal;
+  value_s.value.integer = v;
+  vpi_put_value(reg, &value_s, NULL, vpiNoDelay);
+}
+
+
+uint64_t stub_time(void)
+{
+  return sim_now;
+}
+
+
+int stub_finished(void)
+{
+  return sim_finish;
+}
+
+
+/*****************************************************************************
+ * VPI
+ *****************************************************************************/
+
+vpiHandle vpi_register_systf(p_vpi_systf_data systf_data_p)
+{
+  if(tf_count == STUB_TF_MAX)
+    return NULL;
+
+  tf_tab[tf_count] = *systf_data_p;
+  tf_obj[tf_count].type = vpiSysTask;
+  tf_obj[tf_count].name = systf_data_p->tfname;
+  return &tf_obj[tf_count++];
+}
+
+
+vpiHandle vpi_register_cb(p_cb_data cb_data_p)
+{
+  vpiHandle *tab;
+  vpiHandle  h;
+
+  if(cb_count == cb_size)
+  {
+    tab = (vpiHandle *)realloc(cb_tab, sizeof(vpiHandle) * (cb_size ? cb_size * 2 : 16));
+    if(tab == NULL)
+      return NULL;
+
+    cb_tab = tab;
+    cb_size = cb_size ? cb_size * 2 : 16;
+  }
+
+  h = pool_get(vpiCallback);
+  if(h == NULL)
+    return NULL;
+
+  h->cb     = *cb_data_p;
+  h->active = 1;
+
+  if(cb_data_p->time != NULL)   /* Время и формат значения копируются: структуры вызывающего могут быть на стеке */
+  {
+    h->cb_time = *cb_data_p->time;
+    h->cb.time = &h->cb_time;
+  }
+
+  if(cb_data_p->value != NULL)
+  {
+    h->cb_value = *cb_data_p->value;
+    h->cb.value = &h->cb_value;
+  }
+
+  if(cb_data_p->reason == cbAfterDelay)
+    h->due = sim_now + time_ticks(cb_data_p->time);
+
+  if(cb_data_p->reason == cbValueChange)
+  {
+    if(cb_data_p->obj == NULL)
+    {
+      pool_put(h);
+      return NULL;
+    }
+
+    cb_data_p->obj->watched++;
+  }
+
+  cb_tab[cb_count++] = h;
+  return h;
+}
+
+
+PLI_INT32 vpi_remove_cb(vpiHandle cb_obj)
+{
+  if( (cb_obj == NULL) || (cb_obj->type != vpiCallback) || (! cb_obj->active) )
+    return 0;
+
+  cb_obj->active = 0;
+
+  if(cb_obj->cb.reason == cbValueChange)
+    cb_obj->cb.obj->watched--;
+
+  cb_compact();
+  return 1;
+}
+
+
+vpiHandle vpi_handle(PLI_INT32 type, vpiHandle ref)
+{
+  if( (type == vpiSysTfCall) && (ref == NULL) )
+    return cur_call;
+
+  if( (type == vpiScope) && (ref != NULL) && (ref->type == vpiSysTfCall) )
+    return ref->scope;
+
+  return NULL;
+}
+
+
+vpiHandle vpi_handle_by_name(PLI_BYTE8 *name, vpiHandle scope)
+{
+  vpiHandle h;
+
+  for(h = named; (h != NULL) && (strcmp(h->full_name, name) != 0); h = h->next_named)
+    ;
+
+  return h;
+}
+
+
+vpiHandle vpi_iterate(PLI_INT32 type, vpiHandle ref)
+{
+  vpiHandle h;
+
+  if( (type != vpiArgument) || (ref == NULL) || (ref->type != vpiSysTfCall) || (ref->argc == 0) )
+    return NULL;
+
+  h = pool_get(vpiIterator);
+  if(h == NULL)
+    return NULL;
+
+  h->argc = ref->argc;
+  h->argv = ref->argv;
+  return h;
+}
+
+
+vpiHandle vpi_scan(vpiHandle iterator)
+{
+  if( (iterator == NULL) || (iterator->type != vpiIterator) )
+    return NULL;
+
+  if(iterator->pos < iterator->argc)
+    return iterator->argv[iterator->pos++];
+
+  pool_put(iterator);   /* Как в симуляторе: итератор освобождается после последнего элемента */
+  return NULL;
+}
+
+
+PLI_INT32 vpi_get(PLI_INT32 property, vpiHandle object)
+{
+  switch(property)
+  {
+    case vpiType:
+      return (object != NULL) ? object->type : 0;
+
+    case vpiSize:
+      return (object != NULL) ? object->width : 0;
+
+    case vpiConstType:   /* Константы заглушки - только строки (stub_str) */
+      return ( (object != NULL) && (object->type == vpiConstant) ) ? vpiStringConst : 0;
+
+    case vpiTimePrecision:
+      return STUB_TIME_PRECISION;
+  }
+
+  return 0;
+}
+
+
+PLI_BYTE8 *vpi_get_str(PLI_INT32 property, vpiHandle object)
+{
+  if(object == NULL)
+    return NULL;
+
+  if( (property == vpiFullName) && (object->full_name != NULL) )
+    return (PLI_BYTE8 *)object->full_name;
+
+  if( (property == vpiName) || (property == vpiFullName) )
+    return (PLI_BYTE8 *)object->name;
+
+  return NULL;
+}
+
+
+void vpi_get_value(vpiHandle expr, p_vpi_value value_p)
+{
+  int i;
+  int n;
+
+  switch(value_p->format)
+  {
+    case vpiIntVal:
+      value_p->value.integer = expr->vec[0].aval & ~expr->vec[0].bval;
+      break;
+
+    case vpiScalarVal:
+      if(expr->vec[0].bval & 1)
+        value_p->value.scalar = (expr->vec[0].aval & 1) ? vpiX : vpiZ;
+      else
+        value_p->value.scalar = (expr->vec[0].aval & 1) ? vpi1 : vpi0;
+      break;
+
+    case vpiVectorVal:
+      value_p->value.vector = expr->vec;
+      break;
+
+    case vpiStringVal:
+      if(expr->type == vpiReg)   /* Старший байт вектора - первый символ, ведущие нули пропускаются */
+      {
+        for(i = expr->width / 8 - 1, n = 0; i >= 0; i--)
+        {
+          char c = (char)(expr->vec[i / 4].aval >> (8 * (i % 4)));
+          if( (c != '\0') || (n != 0) )
+            expr->str[n++] = c;
+        }
+        expr->str[n] = '\0';
+      }
+      value_p->value.str = expr->str;
+      break;
+
+    default:
+      value_p->format = 0;
+      break;
+  }
+}
+
+
+vpiHandle vpi_put_value(vpiHandle object, p_vpi_value value_p, p_vpi_time time_p, PLI_INT32 flags)
+{
+  s_vpi_vecval w;
+  int          changed;
+
+  if( (object == NULL) || (object->vec == NULL) )
+    return NULL;
+
+  switch(value_p->format)
+  {
+    case vpiIntVal:
+      w.aval = value_p->value.integer;
+      w.bval = 0;
+      changed = vec_store(object, &w, 1);
+      break;
+
+    case vpiScalarVal:
+      w.aval = ( (value_p->value.scalar == vpi1) || (value_p->value.scalar == vpiX) ) ? 1 : 0;
+      w.bval = ( (value_p->value.scalar == vpiZ) || (value_p->value.scalar == vpiX) ) ? 1 : 0;
+      changed = vec_store(object, &w, 1);
+      break;
+
+    case vpiVectorVal:
+      changed = vec_store(object, value_p->value.vector, VEC_WORDS(object->width));
+      break;
+
+    default:
+      return NULL;
+  }
+
+  if(changed && object->watched)
+    cb_fire(cbValueChange, object);
+
+  return NULL;
+}
+
+
+void vpi_get_time(vpiHandle object, p_vpi_time time_p)
+{
+  if(time_p->type == vpiScaledRealTime)
+  {
+    time_p->real = (double)sim_now / 1000.0;
+    return;
+  }
+
+  time_p->high = (PLI_UINT32)(sim_now >> 32);
+  time_p->low  = (PLI_UINT32)sim_now;
+}
+
+
+PLI_INT32 vpi_free_object(vpiHandle object)
+{
+  if( (object != NULL) && (object->type == vpiIterator) )
+    pool_put(object);
+
+  /* Хэндл обратного вызова освобождается, сам вызов остаётся зарегистрированным (как в IEEE 1364) */
+  return 1;
+}
+
+
+PLI_INT32 vpi_get_vlog_info(p_vpi_vlog_info vlog_info_p)
+{
+  vlog_info_p->argc    = vlog_argc;
+  vlog_info_p->argv    = vlog_argv;
+  vlog_info_p->product = (PLI_BYTE8 *)"vpi_stub";
+  vlog_info_p->version = (PLI_BYTE8 *)"1.0";
+  return 1;
+}
+
+
+PLI_INT32 vpi_put_userdata(vpiHandle obj, void *userdata)
+{
+  if( (obj == NULL) || (obj->type != vpiSysTfCall) )
+    return 0;
+
+  obj->userdata = userdata;
+  return 1;
+}
+
+
+void *vpi_get_userdata(vpiHandle obj)
+{
+  return (obj != NULL) ? obj->userdata : NULL;
+}
+
+
+PLI_INT32 vpi_control(PLI_INT32 operation, ...)
+{
+  if( (operation == vpiFinish) || (operation == vpiStop) )
+    sim_finish = 1;
+
+  return 1;
+}
+
+
+PLI_INT32 vpi_printf(PLI_BYTE8 *format, ...)
+{
+  va_list ap;
+  int     n;
+
+  va_start(ap, format);
+  n = vprintf(format, ap);
+  va_end(ap);
+  return n;
+}
@@ -0,0 +1,96 @@
+/* encoding UTF-8 */
+
+/*
+ * This file is part of the "Verilog Lua" distribution (https://github.com/yrasik/Verilog_Lua).
+ * Copyright (c) 2022 Yuri Stepanenko.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+  ******************************************************************************
+  * @file    vpi_stub.h
+  * @brief   Симулятор - заглушка для стенда производительности: переменные, места вызова системных задач,
+  *          шаги времени и обратные вызовы. Всё выполняется в вызывающем потоке, без очереди событий:
+  *          vpi_put_value с задержкой применяется сразу.
+  ******************************************************************************
+  */
+
+#ifndef _VPI_STUB_H_
+#define _VPI_STUB_H_
+
+#include <stdint.h>
+#include "vpi_user.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+
+#define STUB_TIME_PRECISION  (-12)   /* Единица времени симулятора - 1 пс */
+
+
+/**
+  * @brief Запуск: plusargs для vpi_get_vlog_info() и вызов vlog_startup_routines.
+  */
+void      stub_start(int argc, char **argv);
+
+/**
+  * @brief Конец симуляции: cbEndOfSimulation.
+  */
+void      stub_finish(void);
+
+/**
+  * @brief Переменная reg [width-1:0] (значение 0) и строковая константа.
+  */
+vpiHandle stub_reg(const char *name, int width);
+vpiHandle stub_str(const char *s);
+
+/**
+  * @brief Полное имя переменной для vpi_handle_by_name().
+  */
+void      stub_name(vpiHandle obj, const char *full_name);
+
+/**
+  * @brief Область (модуль) для vpiScope места вызова.
+  */
+vpiHandle stub_scope(const char *full_name);
+
+/**
+  * @brief Место вызова системной задачи tfname с аргументами argv. compiletf вызывается сразу.
+  * @retval vpiHandle NULL, если задача не зарегистрирована или был vpi_control(vpiFinish).
+  */
+vpiHandle stub_call(const char *tfname, vpiHandle scope, int argc, const vpiHandle *argv);
+
+/**
+  * @brief Выполнение места вызова (calltf).
+  */
+void      stub_calltf(vpiHandle call);
+
+/**
+  * @brief Конец текущего шага времени (cbReadWriteSynch, cbReadOnlySynch) и переход на ticks вперёд
+  *        (cbNextSimTime, наступившие cbAfterDelay).
+  */
+void      stub_step(uint64_t ticks);
+
+int32_t   stub_get_int(vpiHandle reg);
+void      stub_put_int(vpiHandle reg, int32_t v);   /* С cbValueChange, как присваивание из Verilog */
+uint64_t  stub_time(void);
+int       stub_finished(void);                       /* Был vpi_control(vpiFinish) */
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _VPI_STUB_H_ */
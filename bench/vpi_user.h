@@ -0,0 +1,197 @@
+/* encoding UTF-8 */
+
+/*
+ * This file is part of the "Verilog Lua" distribution (https://github.com/yrasik/Verilog_Lua).
+ * Copyright (c) 2022 Yuri Stepanenko.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+  ******************************************************************************
+  * @file    vpi_user.h
+  * @brief   Минимальная замена vpi_user.h (IEEE 1364) для стенда производительности:
+  *          только то, что использует PLI2Lua.c. Значения констант совпадают со стандартными.
+  ******************************************************************************
+  */
+
+#ifndef _BENCH_VPI_USER_H_
+#define _BENCH_VPI_USER_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+
+typedef int32_t   PLI_INT32;
+typedef uint32_t  PLI_UINT32;
+typedef int16_t   PLI_INT16;
+typedef char      PLI_BYTE8;
+typedef uint8_t   PLI_UBYTE8;
+
+typedef struct vpi_obj_s *vpiHandle;
+
+
+/* Типы объектов */
+#define vpiConstant          7
+#define vpiIntegerVar       25
+#define vpiIterator         27
+#define vpiMemory           29
+#define vpiMemoryWord       30
+#define vpiModule           32
+#define vpiRealVar          47
+#define vpiReg              48
+#define vpiScope            84
+#define vpiSysTfCall        85
+#define vpiArgument         89
+#define vpiCallback        107
+#define vpiRegArray        116
+
+/* Свойства */
+#define vpiType              1
+#define vpiName              2
+#define vpiFullName          3
+#define vpiSize              4
+#define vpiTimePrecision    12
+#define vpiConstType        40
+#define vpiSigned           65
+
+/* Типы констант */
+#define vpiRealConst         2
+#define vpiStringConst       6
+
+/* Системные задачи и функции */
+#define vpiSysTask           1
+#define vpiSysFunc           2
+#define vpiSysFuncSized      4
+
+/* Форматы значений */
+#define vpiBinStrVal         1
+#define vpiScalarVal         5
+#define vpiIntVal            6
+#define vpiRealVal           7
+#define vpiStringVal         8
+#define vpiVectorVal         9
+
+#define vpi0                 0
+#define vpi1                 1
+#define vpiZ                 2
+#define vpiX                 3
+
+/* Время */
+#define vpiScaledRealTime    1
+#define vpiSimTime           2
+#define vpiSuppressTime      3
+
+/* Задержка vpi_put_value */
+#define vpiNoDelay           1
+#define vpiInertialDelay     2
+
+/* Причины обратных вызовов */
+#define cbValueChange        1
+#define cbReadWriteSynch     6
+#define cbReadOnlySynch      7
+#define cbNextSimTime        8
+#define cbAfterDelay         9
+#define cbEndOfSimulation   12
+
+/* vpi_control */
+#define vpiStop             66
+#define vpiFinish           67
+
+
+struct t_vpi_time {
+  PLI_INT32  type;
+  PLI_UINT32 high;
+  PLI_UINT32 low;
+  double     real;
+} typedef s_vpi_time, *p_vpi_time;
+
+
+struct t_vpi_vecval {
+  PLI_INT32 aval;
+  PLI_INT32 bval;
+} typedef s_vpi_vecval, *p_vpi_vecval;
+
+
+struct t_vpi_value {
+  PLI_INT32 format;
+  union {
+    PLI_BYTE8                *str;
+    PLI_INT32                 scalar;
+    PLI_INT32                 integer;
+    double                    real;
+    struct t_vpi_time        *time;
+    struct t_vpi_vecval      *vector;
+    PLI_BYTE8                *misc;
+  } value;
+} typedef s_vpi_value, *p_vpi_value;
+
+
+struct t_cb_data {
+  PLI_INT32           reason;
+  PLI_INT32         (*cb_rtn)(struct t_cb_data *);
+  vpiHandle           obj;
+  p_vpi_time          time;
+  p_vpi_value         value;
+  PLI_INT32           index;
+  PLI_BYTE8          *user_data;
+} typedef s_cb_data, *p_cb_data;
+
+
+struct t_vpi_systf_data {
+  PLI_INT32   type;
+  PLI_INT32   sysfunctype;
+  const char *tfname;
+  PLI_INT32 (*calltf)(PLI_BYTE8 *);
+  PLI_INT32 (*compiletf)(PLI_BYTE8 *);
+  PLI_INT32 (*sizetf)(PLI_BYTE8 *);
+  PLI_BYTE8  *user_data;
+} typedef s_vpi_systf_data, *p_vpi_systf_data;
+
+
+struct t_vpi_vlog_info {
+  PLI_INT32   argc;
+  PLI_BYTE8 **argv;
+  PLI_BYTE8  *product;
+  PLI_BYTE8  *version;
+} typedef s_vpi_vlog_info, *p_vpi_vlog_info;
+
+
+vpiHandle  vpi_register_systf(p_vpi_systf_data systf_data_p);
+vpiHandle  vpi_register_cb(p_cb_data cb_data_p);
+PLI_INT32  vpi_remove_cb(vpiHandle cb_obj);
+vpiHandle  vpi_handle(PLI_INT32 type, vpiHandle ref);
+vpiHandle  vpi_handle_by_name(PLI_BYTE8 *name, vpiHandle scope);
+vpiHandle  vpi_iterate(PLI_INT32 type, vpiHandle ref);
+vpiHandle  vpi_scan(vpiHandle iterator);
+PLI_INT32  vpi_get(PLI_INT32 property, vpiHandle object);
+PLI_BYTE8 *vpi_get_str(PLI_INT32 property, vpiHandle object);
+void       vpi_get_value(vpiHandle expr, p_vpi_value value_p);
+vpiHandle  vpi_put_value(vpiHandle object, p_vpi_value value_p, p_vpi_time time_p, PLI_INT32 flags);
+void       vpi_get_time(vpiHandle object, p_vpi_time time_p);
+PLI_INT32  vpi_free_object(vpiHandle object);
+PLI_INT32  vpi_get_vlog_info(p_vpi_vlog_info vlog_info_p);
+PLI_INT32  vpi_put_userdata(vpiHandle obj, void *userdata);
+void      *vpi_get_userdata(vpiHandle obj);
+PLI_INT32  vpi_control(PLI_INT32 operation, ...);
+PLI_INT32  vpi_printf(PLI_BYTE8 *format, ...);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BENCH_VPI_USER_H_ */
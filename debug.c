@@ -13,66 +13,393 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "debug.h"
 
 
+#define DEBUG_LOG_SLOT_SIZE   248                  /* Полезная нагрузка одной ячейки кольцевого буфера */
+#define DEBUG_LOG_SLOTS       4096                 /* Количество ячеек, степень двойки */
+#define DEBUG_LOG_BATCH       (64 * 1024)          /* Размер пачки, выводимой фоновым потоком за один fwrite() */
+#define DEBUG_LOG_IDLE_NS     1000000              /* Пауза фонового потока при пустом буфере */
+#define DEBUG_LINE_MAX        1024                 /* Максимальная длина одного сообщения DebugMessage() */
+#define DEBUG_LOG_GROUP_MAX   (DEBUG_LOG_SLOTS / 4) /* Ячеек, занимаемых одним сообщением за раз */
+
+
 /**
- * \brief The main debug message output function
+ * Ячейка кольцевого буфера (очередь Вьюкова: много писателей, один читатель).
+ * seq == pos       - ячейка свободна для записи с номером pos,
+ * seq == pos + 1   - ячейка заполнена и готова к выводу.
  */
-void DebugMessage(FILE *fd, int level, const char *prefix,
-                    const char *suffix, const char *function, int line, const char *errFmt, ...)
+struct {
+  atomic_size_t seq;
+  uint32_t      len;
+  char          data[DEBUG_LOG_SLOT_SIZE];
+} typedef debug_log_slot_t;
+
+
+volatile int DebugLogLevel = MSG_LEVEL;
+
+static debug_log_slot_t *log_slots   = NULL;
+static atomic_size_t     log_head;           /* Следующая позиция записи (писатели) */
+static atomic_size_t     log_done;           /* Позиция, до которой всё выведено (читатель) */
+static atomic_int        log_running;
+static atomic_flag       log_reader  = ATOMIC_FLAG_INIT; /* Ячейки выводит тот, кто его захватил */
+static char             *log_batch   = NULL;
+static FILE             *log_fd      = NULL;
+static pthread_t         log_thread;
+static pthread_t         log_owner;          /* Поток, вызвавший DebugLogStart() */
+static void            (*log_notify)(void) = NULL;
+
+
+static void log_sleep(long ns)
 {
-  va_list arg;
-  int print = 0;
+  struct timespec ts;
+
+  ts.tv_sec  = 0;
+  ts.tv_nsec = ns;
+  nanosleep(&ts, NULL);
+}
+
+
+/**
+ * \brief Вывод всех готовых ячеек пачками, каждая - одним fwrite(). Вызывается под log_reader.
+ * \return Число выведенных байт
+ */
+static size_t log_drain(void)
+{
+  size_t            total = 0;
+  size_t            batch_len;
+  size_t            tail;
+  size_t            seq;
+  debug_log_slot_t *slot;
 
-  if (MSG_LEVEL < MSG_ERROR)
+  tail = atomic_load_explicit(&log_done, memory_order_relaxed);
+
+  for (;;)
   {
-    return;
+    batch_len = 0;
+
+    while (batch_len + DEBUG_LOG_SLOT_SIZE <= DEBUG_LOG_BATCH)
+    {
+      slot = &log_slots[tail & (DEBUG_LOG_SLOTS - 1)];
+      seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+      if (seq != tail + 1)
+        break;
+
+      memcpy(log_batch + batch_len, slot->data, slot->len);
+      batch_len += slot->len;
+
+      atomic_store_explicit(&slot->seq, tail + DEBUG_LOG_SLOTS, memory_order_release);
+      tail++;
+    }
+
+    if (batch_len == 0)
+      break;
+
+    fwrite(log_batch, 1, batch_len, log_fd);
+    atomic_store_explicit(&log_done, tail, memory_order_release);
+    total += batch_len;
+  }
+
+  return total;
+}
+
+
+/**
+ * \brief Фоновый поток: выводит готовые ячейки, если их в этот момент не выводит DebugLogDrain()
+ */
+static void *log_writer(void *arg)
+{
+  size_t n;
+
+  for (;;)
+  {
+    if (! atomic_flag_test_and_set_explicit(&log_reader, memory_order_acquire))
+    {
+      n = log_drain();
+      if (n > 0)
+        fflush(log_fd);
+      atomic_flag_clear_explicit(&log_reader, memory_order_release);
+
+      if (n > 0)
+        continue;
+    }
+
+    if (! atomic_load_explicit(&log_running, memory_order_acquire))
+      break;
+
+    log_sleep(DEBUG_LOG_IDLE_NS);
+  }
+
+  return NULL;
+}
+
+
+/**
+ * \brief Помещение фрагмента (не длиннее DEBUG_LOG_GROUP_MAX ячеек) в кольцевой буфер.
+ *        Все ячейки фрагмента занимаются одним CAS подряд, поэтому строки разных потоков не перемешиваются.
+ *        Ячейки освобождаются читателем по порядку: если свободна последняя, свободны и остальные.
+ *        Без блокировок; при переполнении писатель уступает процессор фоновому потоку.
+ */
+static void log_push(const char *buf, size_t len)
+{
+  size_t            pos;
+  size_t            seq;
+  size_t            n;
+  size_t            i;
+  size_t            chunk;
+  intptr_t          diff;
+  debug_log_slot_t *slot;
+
+  n = (len + DEBUG_LOG_SLOT_SIZE - 1) / DEBUG_LOG_SLOT_SIZE;
+  pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+
+  for (;;)
+  {
+    slot = &log_slots[(pos + n - 1) & (DEBUG_LOG_SLOTS - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)(pos + n - 1);
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + n,
+            memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      sched_yield();
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+    else
+    {
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    chunk = (len > DEBUG_LOG_SLOT_SIZE) ? DEBUG_LOG_SLOT_SIZE : len;
+    slot = &log_slots[(pos + i) & (DEBUG_LOG_SLOTS - 1)];
+
+    memcpy(slot->data, buf, chunk);
+    slot->len = (uint32_t)chunk;
+    atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+
+/**
+ * \brief Запуск фонового вывода для fd. Возвращает 0 в случае успеха.
+ */
+int DebugLogStart(FILE *fd)
+{
+  size_t i;
+
+  if (atomic_load(&log_running))
+    return 0;
+
+  if (log_slots == NULL)
+  {
+    log_slots = (debug_log_slot_t *)malloc(sizeof(debug_log_slot_t) * DEBUG_LOG_SLOTS);
+    if (log_slots == NULL)
+      return -1;
+  }
+
+  if (log_batch == NULL)
+  {
+    log_batch = (char *)malloc(DEBUG_LOG_BATCH);
+    if (log_batch == NULL)
+      return -1;
+  }
+
+  for (i = 0; i < DEBUG_LOG_SLOTS; i++)
+    atomic_init(&log_slots[i].seq, i);
+
+  atomic_init(&log_head, 0);
+  atomic_init(&log_done, 0);
+  log_fd = fd;
+  log_owner = pthread_self();
+
+  atomic_store(&log_running, 1);
+
+  if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0)
+  {
+    atomic_store(&log_running, 0);
+    return -2;
   }
 
-  if ( (level == MSG_INFO) && (MSG_LEVEL >= MSG_INFO) )
+  return 0;
+}
+
+
+/**
+ * \brief Функция, вызываемая после каждого сообщения потока, запустившего вывод (NULL - не вызывать).
+ *        Через неё вызывающий планирует DebugLogDrain() в точке синхронизации со своим выводом.
+ */
+void DebugLogSetNotify(void (*notify)(void))
+{
+  log_notify = notify;
+}
+
+
+/**
+ * \brief Есть ли в буфере невыведенные сообщения.
+ */
+int DebugLogPending(void)
+{
+  return atomic_load_explicit(&log_running, memory_order_relaxed) &&
+         (atomic_load_explicit(&log_head, memory_order_relaxed) != atomic_load_explicit(&log_done, memory_order_acquire));
+}
+
+
+/**
+ * \brief Вывод готовых сообщений в вызывающем потоке; пачку, которую выводит фоновый поток, дожидается.
+ *        После возврата всё, что было полностью помещено в буфер до вызова, передано в fd (без fflush:
+ *        вывод, идущий в тот же FILE, остаётся упорядоченным без системного вызова на каждый вызов).
+ */
+void DebugLogDrain(void)
+{
+  if (! DebugLogPending())
+    return;
+
+  while (atomic_flag_test_and_set_explicit(&log_reader, memory_order_acquire))
+    sched_yield();
+
+  log_drain();
+  atomic_flag_clear_explicit(&log_reader, memory_order_release);
+}
+
+
+/**
+ * \brief Ожидание вывода всего, что было помещено в буфер до вызова.
+ */
+void DebugLogFlush(void)
+{
+  size_t head;
+
+  if (! atomic_load(&log_running))
   {
-    fprintf(fd, "INFO: ");
-    print = 1;
+    if (log_fd != NULL)
+      fflush(log_fd);
+    return;
   }
 
-  if ( (level == MSG_WARNING) && (MSG_LEVEL >= MSG_WARNING) )
+  head = atomic_load(&log_head);
+
+  while (atomic_load_explicit(&log_done, memory_order_acquire) < head)
+    log_sleep(DEBUG_LOG_IDLE_NS / 10);
+}
+
+
+/**
+ * \brief Остановка фонового вывода; всё накопленное выводится до возврата.
+ */
+void DebugLogStop(void)
+{
+  if (! atomic_load(&log_running))
+    return;
+
+  DebugLogFlush();
+  atomic_store(&log_running, 0);
+  pthread_join(log_thread, NULL);
+  fflush(log_fd);
+}
+
+
+/**
+ * \brief Вывод готовой строки: через кольцевой буфер, если он обслуживает fd, иначе одним fwrite().
+ *        Строка до DEBUG_LOG_GROUP_MAX ячеек выводится целиком, без вставок из других потоков.
+ */
+void DebugLogWrite(FILE *fd, const char *buf, size_t len)
+{
+  size_t chunk;
+
+  if ((! atomic_load_explicit(&log_running, memory_order_relaxed)) || (fd != log_fd))
   {
-    fprintf(fd, "WARNING: ");
-    print = 1;
+    fwrite(buf, 1, len, fd);
+    return;
   }
 
-  if ( (level == MSG_ERROR) && (MSG_LEVEL >= MSG_ERROR) )
+  while (len > 0)
   {
-    fprintf(fd, "ERROR: ");
-    print = 1;
+    chunk = (len > DEBUG_LOG_GROUP_MAX * DEBUG_LOG_SLOT_SIZE) ? DEBUG_LOG_GROUP_MAX * DEBUG_LOG_SLOT_SIZE : len;
+    log_push(buf, chunk);
+    buf += chunk;
+    len -= chunk;
   }
 
-  if(print == 0)
+  if ((log_notify != NULL) && pthread_equal(pthread_self(), log_owner))
+    log_notify();
+}
+
+
+/**
+ * \brief The main debug message output function
+ */
+void DebugMessage(FILE *fd, int level, const char *prefix,
+                    const char *suffix, const char *function, int line, const char *errFmt, ...)
+{
+  va_list arg;
+  char    msg[DEBUG_LINE_MAX];
+  int     len;
+  int     n;
+
+  if ( (level < MSG_ERROR) || (level > DebugLogLevel) )
   {
     return;
   }
 
+  switch (level)
+  {
+    case MSG_ERROR:   len = snprintf(msg, sizeof(msg), "ERROR: ");   break;
+    case MSG_WARNING: len = snprintf(msg, sizeof(msg), "WARNING: "); break;
+    case MSG_INFO:    len = snprintf(msg, sizeof(msg), "INFO: ");    break;
+    default:          len = snprintf(msg, sizeof(msg), "DEBUG: ");   break;
+  }
+
   if (prefix)
-    fprintf(fd, "%s: ", prefix);
+    len += snprintf(msg + len, sizeof(msg) - len, "%s: ", prefix);
 
 #ifdef CONFIG_DBG_SHOW_FUNCTION
-  if (line > 0)
-    fprintf(fd, "%s: ", function);
+  if ((line > 0) && ((size_t)len < sizeof(msg)))
+    len += snprintf(msg + len, sizeof(msg) - len, "%s: ", function);
 #endif
 
 #ifdef CONFIG_DBG_SHOW_LINE_NUM
-  if (line > 0)
-    fprintf(fd, "@%d - ", line);
+  if ((line > 0) && ((size_t)len < sizeof(msg)))
+    len += snprintf(msg + len, sizeof(msg) - len, "@%d - ", line);
 #endif
 
-  va_start(arg, errFmt);
-  vfprintf(fd, errFmt, arg);
-  va_end(arg);
+  if ((size_t)len < sizeof(msg))
+  {
+    va_start(arg, errFmt);
+    n = vsnprintf(msg + len, sizeof(msg) - len, errFmt, arg);
+    va_end(arg);
+    if (n > 0)
+      len += n;
+  }
+
+  if (suffix && ((size_t)len < sizeof(msg)))
+    len += snprintf(msg + len, sizeof(msg) - len, "%s", suffix);
 
-  if (suffix)
-    fprintf(fd, "%s", suffix);
+  if ((size_t)len >= sizeof(msg))
+  {
+    len = sizeof(msg) - 1;
+    msg[len - 1] = '\n';
+  }
+
+  DebugLogWrite(fd, msg, len);
 
   return;
 }
-
@@ -29,9 +29,11 @@
 //#define PFX  __FILE__": "
 //#define  _FD_  fd /* FILE *fd   or  stderr */
 
+#define MSG_NONE        0
 #define MSG_ERROR       1
 #define MSG_WARNING     2
 #define MSG_INFO        3
+#define MSG_DEBUG       4
 
 
 #ifndef TENDSTR
@@ -47,14 +49,37 @@
 #define CONFIG_DBG_SHOW_LINE_NUM
 
 
+/* Текущий уровень сообщений, задаётся во время выполнения (по умолчанию MSG_LEVEL) */
+extern volatile int DebugLogLevel;
+
 void DebugMessage(FILE *fd, int level, const char *prefix, const char *suffix, const char *function, int line, const char *errFmt, ...);
 
+/* Асинхронный вывод: сообщения для fd складываются в кольцевой буфер и выводятся фоновым потоком
+   или DebugLogDrain() в точке синхронизации вызывающего */
+int  DebugLogStart(FILE *fd);
+void DebugLogStop(void);
+void DebugLogFlush(void);
+void DebugLogWrite(FILE *fd, const char *buf, size_t len);
+void DebugLogSetNotify(void (*notify)(void));
+int  DebugLogPending(void);
+void DebugLogDrain(void);
+
 
 #ifndef DEBUG
   #define REPORT(level, fmt, ...)
+  #define REPORT_PFX(prefix, level, fmt, ...)
 #else
   #define REPORT(level, fmt, ... ) \
-    DebugMessage(_FD_, level, PFX, TENDSTR, __func__, __LINE__, fmt, ## __VA_ARGS__)
+    do { \
+      if ((level) <= DebugLogLevel) \
+        DebugMessage(_FD_, level, PFX, TENDSTR, __func__, __LINE__, fmt, ## __VA_ARGS__); \
+    } while (0)
+
+  #define REPORT_PFX(prefix, level, fmt, ... ) \
+    do { \
+      if ((level) <= DebugLogLevel) \
+        DebugMessage(_FD_, level, prefix, TENDSTR, __func__, __LINE__, fmt, ## __VA_ARGS__); \
+    } while (0)
 #endif
 
 
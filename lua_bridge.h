@@ -0,0 +1,454 @@
+/* encoding UTF-8 */
+
+/*
+ * This file is part of the "Verilog Lua" distribution (https://github.com/yrasik/Verilog_Lua).
+ * Copyright (c) 2022 Yuri Stepanenko.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+  ******************************************************************************
+  * @file    lua_bridge.h
+  * @brief   Мост в разделяемой памяти между PLI2Lua.c и внешним эмулятором (QEMU и т.п.):
+  *          раскладка сегмента POSIX shm, кольца запросов и ответов, пробуждение через futex
+  *          и функции стороны эмулятора. Только Linux (futex), C11 (stdatomic).
+  ******************************************************************************
+  *
+  * Сегмент создаёт симулятор (bridge_open() в скрипте экземпляра), эмулятор подключается lb_attach().
+  * Кольца (один писатель - один читатель, ёмкость depth - степень двойки):
+  *
+  *   LB__M_REQ - эмулятор -> симулятор: транзакции, которые $lua_exchange_M выдаёт на шину Verilog,
+  *   LB__M_RSP - симулятор -> эмулятор: DAT_I и STATUS_I чтений LB__M_REQ (записи ответа не получают),
+  *   LB__S_REQ - симулятор -> эмулятор: обращения Verilog, пришедшие в $lua_exchange_S,
+  *   LB__S_RSP - эмулятор -> симулятор: DAT_O и STATUS_O на каждый LB__S_REQ.
+  *
+  * Время: запрос LB__M_REQ выдаётся на шину не раньше своего time_ns. LB_CMD_SYNC с time_ns = T означает
+  * "до T запросов больше не будет": симулятор идёт до T без ожидания эмулятора и публикует своё время в sim_ns
+  * на границах кванта. Эмулятор после lb_sync(T) ждёт, пока sim_ns не станет >= T - quantum_ns, то есть опережает
+  * симулятор не больше чем на квант. Синхронизация - одна на квант, а не на каждое обращение.
+  */
+
+#ifndef _LUA_BRIDGE_H_
+#define _LUA_BRIDGE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+
+#define LB_MAGIC       "PLIBRG1"
+#define LB_VERSION     1
+#define LB_DEPTH_MAX   65536
+#define LB_SPIN        2000    /* Холостых проверок перед засыпанием на futex */
+#define LB_WAIT_MS     100     /* Наибольшее время одного сна на futex */
+
+#define LB_CMD_SYNC    (-1)    /* LB__M_REQ: до time_ns запросов не будет */
+
+#define LB_CLOSED_SIM  1u      /* Симулятор закрыл мост ($lua_deinit) */
+#define LB_CLOSED_EMU  2u      /* Эмулятор отключился (lb_detach) */
+
+
+enum
+{
+  LB__M_REQ = 0,
+  LB__M_RSP = 1,
+  LB__S_REQ = 2,
+  LB__S_RSP = 3,
+  LB__RINGS = 4
+} typedef lb_ring_id_t;
+
+
+/**
+  * @brief Сообщение кольца. CMD и ADR - как у $lua_exchange_M/$lua_exchange_S (ACTION__READ = 1, ACTION__WRITE = 2).
+  *        Запрос: time_ns, CMD, ADR, DAT.  Ответ: time_ns симулятора, CMD запроса, DAT, STATUS.
+  */
+struct {
+  int64_t time_ns;
+  int32_t CMD;
+  int32_t ADR;
+  int32_t DAT;
+  int32_t STATUS;
+} typedef lb_msg_t;
+
+
+/**
+  * @brief Индексы кольца - монотонные счётчики, каждый пишет только одна сторона.
+  */
+struct {
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+} typedef lb_ring_t;
+
+
+/**
+  * @brief Звонок стороны: seq увеличивается, если сторона спит на futex (waiting != 0).
+  */
+struct {
+  _Alignas(64) _Atomic uint32_t seq;
+  _Atomic uint32_t waiting;
+} typedef lb_doorbell_t;
+
+
+/**
+  * @brief Заголовок сегмента. За ним - LB__RINGS массивов по depth сообщений.
+  */
+struct {
+  char              magic[8];     /* LB_MAGIC, записывается последним */
+  uint32_t          version;
+  uint32_t          depth;
+  int64_t           quantum_ns;
+
+  _Alignas(64) _Atomic int64_t  sim_ns;   /* Время симуляции на последней границе кванта */
+  _Atomic int32_t   status;       /* Последний STATUS_I $lua_exchange_M (сброс, прерывания) */
+  _Atomic uint32_t  closed;       /* LB_CLOSED_SIM | LB_CLOSED_EMU */
+  _Atomic uint32_t  attached;     /* Эмулятор подключён */
+
+  lb_doorbell_t     sim;          /* Звонит эмулятор */
+  lb_doorbell_t     emu;          /* Звонит симулятор */
+  lb_ring_t         ring[LB__RINGS];
+} typedef lb_shm_t;
+
+
+static inline size_t lb_shm_size(uint32_t depth)
+{
+  return sizeof(lb_shm_t) + (size_t)LB__RINGS * depth * sizeof(lb_msg_t);
+}
+
+
+static inline lb_msg_t *lb_msgs(lb_shm_t *shm, int ring)
+{
+  return (lb_msg_t *)(shm + 1) + (size_t)ring * shm->depth;
+}
+
+
+static inline int lb_push(lb_shm_t *shm, int ring, const lb_msg_t *msg)
+{
+  lb_ring_t *r = &shm->ring[ring];
+  uint32_t   head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+  if( (head - atomic_load_explicit(&r->tail, memory_order_acquire)) >= shm->depth )
+    return -1;
+
+  lb_msgs(shm, ring)[head & (shm->depth - 1)] = *msg;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return 0;
+}
+
+
+static inline int lb_pop(lb_shm_t *shm, int ring, lb_msg_t *msg)
+{
+  lb_ring_t *r = &shm->ring[ring];
+  uint32_t   tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  if( atomic_load_explicit(&r->head, memory_order_acquire) == tail )
+    return -1;
+
+  *msg = lb_msgs(shm, ring)[tail & (shm->depth - 1)];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+
+static inline int lb_empty(lb_shm_t *shm, int ring)
+{
+  return atomic_load_explicit(&shm->ring[ring].head, memory_order_acquire) ==
+         atomic_load_explicit(&shm->ring[ring].tail, memory_order_acquire);
+}
+
+
+static inline int lb_full(lb_shm_t *shm, int ring)
+{
+  return (atomic_load_explicit(&shm->ring[ring].head, memory_order_acquire) -
+          atomic_load_explicit(&shm->ring[ring].tail, memory_order_acquire)) >= shm->depth;
+}
+
+
+/**
+  * @brief Пробуждение стороны db. Если она не спит, стоит одну атомарную загрузку.
+  */
+static inline void lb_ring(lb_doorbell_t *db)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if( atomic_load(&db->waiting) )
+  {
+    atomic_fetch_add(&db->seq, 1);
+    syscall(SYS_futex, &db->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+
+/**
+  * @brief Ожидание ready(arg) на своём звонке db: сначала активное, затем на futex не дольше LB_WAIT_MS.
+  * @retval int Значение ready(arg) после ожидания (0 - истёк срок, вызывающий проверяет closed и повторяет).
+  */
+static inline int lb_wait(lb_doorbell_t *db, int (*ready)(void *arg), void *arg)
+{
+  struct timespec ts = { 0, LB_WAIT_MS * 1000000L };
+  uint32_t        seq;
+  int             i;
+
+  for(i = 0; i < LB_SPIN; i++)
+  {
+    if( ready(arg) )
+      return 1;
+  }
+
+  atomic_store(&db->waiting, 1);
+  seq = atomic_load(&db->seq);
+
+  if( ! ready(arg) )
+    syscall(SYS_futex, &db->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+
+  atomic_store(&db->waiting, 0);
+  return ready(arg);
+}
+
+
+/*****************************************************************************
+ * Сторона эмулятора. Все функции вызываются из одного потока эмулятора.
+ *****************************************************************************/
+
+/**
+  * @brief Обработчик обращения Verilog к эмулятору (LB__S_REQ): заполняет DAT и STATUS в rsp.
+  */
+typedef void (*lb_serve_fn)(void *ud, const lb_msg_t *req, lb_msg_t *rsp);
+
+
+struct {
+  lb_shm_t    *shm;
+  size_t       size;
+  lb_serve_fn  serve;   /* NULL - обращения $lua_exchange_S получают STATUS = 1 */
+  void        *ud;
+  int64_t      wait_ns; /* Условие lb_sync(): sim_ns >= wait_ns */
+} typedef lb_client_t;
+
+
+/**
+  * @brief Подключение к мосту name (имя shm_open, например "/cpu0").
+  * @retval int 0 - подключено, -1 - сегмента ещё нет или он не готов, -2 - другая версия.
+  */
+static inline int lb_attach(lb_client_t *c, const char *name, lb_serve_fn serve, void *ud)
+{
+  struct stat st;
+  lb_shm_t   *shm;
+  int         fd;
+
+  fd = shm_open(name, O_RDWR, 0);
+  if(fd < 0)
+    return -1;
+
+  if( (fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(lb_shm_t)) )
+  {
+    close(fd);
+    return -1;
+  }
+
+  shm = (lb_shm_t *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(shm == MAP_FAILED)
+    return -1;
+
+  atomic_thread_fence(memory_order_acquire);
+
+  if( (memcmp(shm->magic, LB_MAGIC, sizeof(LB_MAGIC)) != 0) || (lb_shm_size(shm->depth) > (size_t)st.st_size) )
+  {
+    munmap(shm, (size_t)st.st_size);
+    return -1;
+  }
+
+  if(shm->version != LB_VERSION)
+  {
+    munmap(shm, (size_t)st.st_size);
+    return -2;
+  }
+
+  c->shm     = shm;
+  c->size    = (size_t)st.st_size;
+  c->serve   = serve;
+  c->ud      = ud;
+  c->wait_ns = 0;
+
+  atomic_store(&shm->attached, 1);
+  lb_ring(&shm->sim);
+  return 0;
+}
+
+
+static inline void lb_detach(lb_client_t *c)
+{
+  if(c->shm == NULL)
+    return;
+
+  atomic_fetch_or(&c->shm->closed, LB_CLOSED_EMU);
+  lb_ring(&c->shm->sim);
+  munmap(c->shm, c->size);
+  c->shm = NULL;
+}
+
+
+static inline int lb_closed(lb_client_t *c)
+{
+  return (atomic_load(&c->shm->closed) & LB_CLOSED_SIM) != 0;
+}
+
+
+/**
+  * @brief Обслуживание накопившихся обращений Verilog (LB__S_REQ). Вызывается и из всех ожиданий ниже.
+  */
+static inline void lb_poll(lb_client_t *c)
+{
+  lb_msg_t req;
+  lb_msg_t rsp;
+  int      served = 0;
+
+  while( ! lb_full(c->shm, LB__S_RSP) && (lb_pop(c->shm, LB__S_REQ, &req) == 0) )
+  {
+    rsp = req;
+    rsp.DAT = 0;
+    rsp.STATUS = 1;
+
+    if(c->serve != NULL)
+      c->serve(c->ud, &req, &rsp);
+
+    lb_push(c->shm, LB__S_RSP, &rsp);
+    served = 1;
+  }
+
+  if(served)
+    lb_ring(&c->shm->sim);
+}
+
+
+static inline int lb_ready_push(void *arg)
+{
+  lb_client_t *c = (lb_client_t *)arg;
+
+  lb_poll(c);
+  return (! lb_full(c->shm, LB__M_REQ)) || lb_closed(c);
+}
+
+
+static inline int lb_ready_rsp(void *arg)
+{
+  lb_client_t *c = (lb_client_t *)arg;
+
+  lb_poll(c);
+  return (! lb_empty(c->shm, LB__M_RSP)) || lb_closed(c);
+}
+
+
+static inline int lb_ready_time(void *arg)
+{
+  lb_client_t *c = (lb_client_t *)arg;
+
+  lb_poll(c);
+  return (atomic_load(&c->shm->sim_ns) >= c->wait_ns) || lb_closed(c);
+}
+
+
+/**
+  * @brief Постановка запроса в LB__M_REQ (с ожиданием места).
+  * @retval int 0 - в очереди, -1 - симулятор закрыл мост.
+  */
+static inline int lb_post(lb_client_t *c, int64_t time_ns, int32_t CMD, int32_t ADR, int32_t DAT)
+{
+  lb_msg_t req = { time_ns, CMD, ADR, DAT, 0 };
+
+  while( lb_push(c->shm, LB__M_REQ, &req) != 0 )
+  {
+    if( lb_closed(c) )
+      return -1;
+    lb_wait(&c->shm->emu, lb_ready_push, c);
+  }
+
+  lb_ring(&c->shm->sim);
+  return 0;
+}
+
+
+/**
+  * @brief Запись на шину Verilog в момент time_ns (нс). Не ждёт выполнения.
+  */
+static inline int lb_write(lb_client_t *c, int64_t time_ns, int32_t ADR, int32_t DAT)
+{
+  return lb_post(c, time_ns, 2, ADR, DAT);
+}
+
+
+/**
+  * @brief Чтение с шины Verilog в момент time_ns (нс). Ждёт ответа; все предыдущие записи к этому времени выполнены.
+  * @retval int 0 - DAT и STATUS (STATUS_I $lua_exchange_M) получены, -1 - симулятор закрыл мост.
+  */
+static inline int lb_read(lb_client_t *c, int64_t time_ns, int32_t ADR, int32_t *DAT, int32_t *STATUS)
+{
+  lb_msg_t rsp;
+
+  if( lb_post(c, time_ns, 1, ADR, 0) != 0 )
+    return -1;
+
+  while( lb_pop(c->shm, LB__M_RSP, &rsp) != 0 )
+  {
+    if( lb_closed(c) )
+      return -1;
+    lb_wait(&c->shm->emu, lb_ready_rsp, c);
+  }
+
+  *DAT = rsp.DAT;
+  if(STATUS != NULL)
+    *STATUS = rsp.STATUS;
+  return 0;
+}
+
+
+/**
+  * @brief Точка синхронизации: запросов до time_ns больше не будет. Возвращается, когда симулятор
+  *        дошёл до time_ns - quantum_ns.
+  */
+static inline int lb_sync(lb_client_t *c, int64_t time_ns)
+{
+  if( lb_post(c, time_ns, LB_CMD_SYNC, 0, 0) != 0 )
+    return -1;
+
+  c->wait_ns = time_ns - c->shm->quantum_ns;
+
+  while( ! lb_ready_time(c) )
+  {
+    if( lb_closed(c) )
+      return -1;
+    lb_wait(&c->shm->emu, lb_ready_time, c);
+  }
+
+  return lb_closed(c) ? -1 : 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LUA_BRIDGE_H_ */